@@ -8,9 +8,113 @@
 
 typedef struct matrix_t matrix_t;
 
+/* how the elements are ordered in memory, see MatSetLayout */
+typedef enum mat_layout_t
+{
+    MAT_ROW_MAJOR,  /* data[row * n_cols + col], the default */
+    MAT_COL_MAJOR   /* data[col * n_rows + row] */
+} mat_layout_t;
+
+
+/* releases a buffer handed to MatAdopt, ctx is the pointer given with it */
+typedef void (*mat_free_fn)(float* data, void* ctx);
+
 
 matrix_t* MatCreate(size_t n_rows, size_t n_cols, const float* data);
 
+/** 
+*   MatWrap
+*   -------
+*   Creates a matrix that borrows a row-major buffer without copying it
+*   (see MatSetLayout for column-major buffers).
+*   The caller keeps ownership and the buffer must outlive the matrix
+*   and all of its clones.
+*
+*   Return
+*   ------
+*   A pointer to the matrix. NULL on failure.
+*/
+matrix_t* MatWrap(size_t n_rows, size_t n_cols, float* data);
+
+/** 
+*   MatAdopt
+*   --------
+*   Creates a matrix that takes ownership of a row-major buffer without
+*   copying it. free_fn(data, free_ctx) is called once the matrix and all
+*   of its clones are destroyed. A NULL free_fn means free().
+*   On failure the buffer is not taken and stays with the caller.
+*
+*   Return
+*   ------
+*   A pointer to the matrix. NULL on failure.
+*/
+matrix_t* MatAdopt(size_t n_rows, size_t n_cols, float* data, mat_free_fn free_fn, void* free_ctx);
+
+/** 
+*   MatClone
+*   --------
+*   Creates a copy-on-write clone that shares mat's elements. The data is
+*   only copied when one of the sharing matrices asks for write access
+*   through MatData.
+*
+*   Return
+*   ------
+*   A pointer to the clone. NULL on failure.
+*/
+matrix_t* MatClone(const matrix_t* mat);
+
+/** 
+*   MatData
+*   -------
+*   Return
+*   ------
+*   A writable pointer to the elements of mat, in its layout, copying
+*   them first if they are shared with a clone. NULL on failure.
+*/
+float* MatData(matrix_t* mat);
+
+/** 
+*   MatConstData
+*   ------------
+*   Return
+*   ------
+*   A read-only pointer to the elements of mat, in its layout. Never
+*   copies.
+*/
+const float* MatConstData(const matrix_t* mat);
+
+/** 
+*   MatSetLayout
+*   ------------
+*   Declares how mat's existing elements are ordered: nothing is moved,
+*   the same memory is read the other way. Wrapping a column-major
+*   buffer is MatWrap followed by MatSetLayout(mat, MAT_COL_MAJOR).
+*   The layout belongs to this matrix only, not to its clones.
+*   Every operation accepts either layout. Element-wise results keep
+*   the input's layout, MatMult of two column-major matrices and
+*   MatInvert of one give column-major results, everything else is
+*   row-major.
+*
+*   Return
+*   ------
+*   0 on success, 1 for an unknown layout.
+*/
+int MatSetLayout(matrix_t* mat, mat_layout_t layout);
+
+mat_layout_t MatGetLayout(const matrix_t* mat);
+
+/** 
+*   MatConvertLayout
+*   ----------------
+*   Copies mat with its elements reordered into layout, for handing data
+*   to code that expects it. A clone if mat already is in layout.
+*
+*   Return
+*   ------
+*   The converted matrix. NULL on failure.
+*/
+matrix_t* MatConvertLayout(const matrix_t* mat, mat_layout_t layout);
+
 
 void MatDestroy(matrix_t* mat);
 
@@ -151,6 +255,1195 @@ void MatShape(const matrix_t* mat, size_t dims[2]);
 */
 float MatGetElem(const matrix_t* mat, size_t row, size_t col);
 
+/** 
+*   Reduced-precision storage
+*   -------------------------
+*   A mat_quant_t holds the same values as a matrix_t in 16 or 8 bits per
+*   element. fp16 and bf16 store each element on its own, int8 stores each
+*   row scaled by its own factor (scale = max |x| in the row / 127).
+*   The products below widen back to float on the fly and accumulate in
+*   float, so no full-size float copy of the quantized operand is made.
+*/
+typedef enum
+{
+    MAT_STORE_FP16,
+    MAT_STORE_BF16,
+    MAT_STORE_INT8
+} mat_storage_t;
+
+typedef struct mat_quant_t mat_quant_t;
+
+/** 
+*   MatQuantize
+*   -----------
+*   Converts a matrix into reduced-precision storage.
+*
+*   Params
+*   ------
+*   mat - a pointer to the matrix.
+*   storage - the element format to store.
+*
+*   Return
+*   ------
+*   A pointer to the quantized matrix. NULL on failure.
+*/
+mat_quant_t* MatQuantize(const matrix_t* mat, mat_storage_t storage);
+
+void MatQuantDestroy(mat_quant_t* qmat);
+
+/** 
+*   MatDequantize
+*   -------------
+*   Return
+*   ------
+*   A new float matrix widened from qmat. NULL on failure.
+*/
+matrix_t* MatDequantize(const mat_quant_t* qmat);
+
+/** 
+*   MatQuantShape
+*   -------------
+*   Same as MatShape for a quantized matrix.
+*/
+void MatQuantShape(const mat_quant_t* qmat, size_t dims[2]);
+
+/** 
+*   MatQuantGetElem
+*   ---------------
+*   Return
+*   ------
+*   The value at qmat[row][col] widened to float, 0 if out of range.
+*/
+float MatQuantGetElem(const mat_quant_t* qmat, size_t row, size_t col);
+
+/** 
+*   MatQuantMult
+*   ------------
+*   Multiplies a float matrix by a quantized one (mat * qmat).
+*
+*   Return
+*   ------
+*   A pointer to the result matrix. NULL on failure or shape mismatch.
+*/
+matrix_t* MatQuantMult(const matrix_t* mat, const mat_quant_t* qmat);
+
+/** 
+*   MatQuantMatvec
+*   --------------
+*   Computes y = qmat * x.
+*
+*   Params
+*   ------
+*   qmat - a pointer to the quantized matrix.
+*   x - input vector of n_cols elements.
+*   y - output vector of n_rows elements.
+*
+*   Return
+*   ------
+*   0 on success, nonzero on failure.
+*/
+int MatQuantMatvec(const mat_quant_t* qmat, const float* x, float* y);
+
+
+/** 
+*   Disk-backed matrices
+*   --------------------
+*   A mat_disk_t is a row-major matrix kept in a file instead of memory.
+*   Tiles of it are read and written with MatDiskRead/MatDiskWrite, and
+*   MatDiskMult multiplies two of them without ever holding a whole
+*   operand in memory.
+*/
+typedef struct mat_disk_t mat_disk_t;
+
+/** 
+*   MatDiskCreate
+*   -------------
+*   Creates (or truncates) the file at path as an n_rows * n_cols matrix
+*   of zeros.
+*
+*   Return
+*   ------
+*   A handle to the disk matrix. NULL on failure.
+*/
+mat_disk_t* MatDiskCreate(const char* path, size_t n_rows, size_t n_cols);
+
+/** 
+*   MatDiskOpen
+*   -----------
+*   Return
+*   ------
+*   A handle to a disk matrix previously created at path. NULL on failure.
+*/
+mat_disk_t* MatDiskOpen(const char* path);
+
+void MatDiskClose(mat_disk_t* disk);
+
+void MatDiskShape(const mat_disk_t* disk, size_t dims[2]);
+
+/** 
+*   MatDiskRead
+*   -----------
+*   Return
+*   ------
+*   A new in-memory matrix holding the n_rows * n_cols tile whose top left
+*   element is disk[row][col]. NULL on failure or if it is out of range.
+*/
+matrix_t* MatDiskRead(const mat_disk_t* disk, size_t row, size_t col, size_t n_rows, size_t n_cols);
+
+/** 
+*   MatDiskWrite
+*   ------------
+*   Writes tile into disk with its top left element at disk[row][col].
+*
+*   Return
+*   ------
+*   0 on success, nonzero on failure or if it is out of range.
+*/
+int MatDiskWrite(mat_disk_t* disk, size_t row, size_t col, const matrix_t* tile);
+
+/** 
+*   MatDiskMult
+*   -----------
+*   Out-of-core a * b. Square tiles are streamed from both operands, the
+*   next pair is read on a second thread while the current one is
+*   multiplied, and every result tile is written to out_path as soon as
+*   it is complete.
+*
+*   Params
+*   ------
+*   a, b - the operands. out_path must not be the file of either.
+*   mem_budget - bytes of tile buffers the product may hold at once.
+*
+*   Return
+*   ------
+*   A handle to the result at out_path. NULL on failure, on a shape
+*   mismatch, or if mem_budget cannot hold a single tile.
+*/
+mat_disk_t* MatDiskMult(const mat_disk_t* a, const mat_disk_t* b, const char* out_path, size_t mem_budget);
+
+/** 
+*   MatSetNumThreads
+*   ----------------
+*   Sets how many threads the parallel kernels may use. 0 (the default)
+*   means one per online CPU. Small inputs always run on one thread.
+*/
+void MatSetNumThreads(size_t n_threads);
+
+/** 
+*   MatGetNumThreads
+*   ----------------
+*   Return
+*   ------
+*   The number of threads the parallel kernels use.
+*/
+size_t MatGetNumThreads(void);
+
+/** 
+*   NUMA placement
+*   --------------
+*   By default matrix buffers come from malloc and land on whichever node
+*   first touches them. Under MAT_NUMA_INTERLEAVE the pages of large
+*   buffers (1 MiB and up) made by MatCreate are spread round robin over
+*   all nodes. Under MAT_NUMA_FIRST_TOUCH they are initialized in row
+*   ranges by worker threads pinned to the nodes, and the parallel row
+*   kernels (MatMult, reductions, MatApplyRows) split rows the same way,
+*   so each worker mostly reads and writes memory of its own node.
+*   On a single node machine every policy falls back to the default path
+*   (workers are not pinned), so results never depend on the policy.
+*/
+typedef enum
+{
+    MAT_NUMA_DEFAULT,
+    MAT_NUMA_INTERLEAVE,
+    MAT_NUMA_FIRST_TOUCH
+} mat_numa_policy_t;
+
+/* sets the policy for matrices created from now on */
+void MatSetNumaPolicy(mat_numa_policy_t policy);
+
+mat_numa_policy_t MatGetNumaPolicy(void);
+
+/** 
+*   MatNumaNodes
+*   ------------
+*   Return
+*   ------
+*   The number of NUMA nodes with CPUs, 1 when it cannot be determined.
+*/
+size_t MatNumaNodes(void);
+
+typedef enum
+{
+    MAT_REDUCE_SUM,
+    MAT_REDUCE_MIN,
+    MAT_REDUCE_MAX,
+    MAT_REDUCE_MEAN
+} mat_reduce_t;
+
+/** 
+*   MatRowReduce
+*   ------------
+*   Reduces every row of mat to one value.
+*
+*   Return
+*   ------
+*   A new n_rows * 1 matrix of results. NULL on failure.
+*   Rows of an n_rows * 0 matrix reduce to 0.
+*/
+matrix_t* MatRowReduce(const matrix_t* mat, mat_reduce_t op);
+
+/** 
+*   MatColReduce
+*   ------------
+*   Reduces every column of mat to one value.
+*
+*   Return
+*   ------
+*   A new 1 * n_cols matrix of results. NULL on failure.
+*   Columns of a 0 * n_cols matrix reduce to 0.
+*/
+matrix_t* MatColReduce(const matrix_t* mat, mat_reduce_t op);
+
+/** 
+*   MatRowArgReduce
+*   ---------------
+*   Finds the column of the minimum (MAT_REDUCE_MIN) or maximum
+*   (MAT_REDUCE_MAX) of every row. Ties resolve to the first column.
+*
+*   Params
+*   ------
+*   indices - output of n_rows elements.
+*
+*   Return
+*   ------
+*   0 on success, nonzero on failure or for any other op.
+*/
+int MatRowArgReduce(const matrix_t* mat, mat_reduce_t op, size_t* indices);
+
+/** 
+*   MatColArgReduce
+*   ---------------
+*   Same as MatRowArgReduce for the row of every column's min or max.
+*
+*   Params
+*   ------
+*   indices - output of n_cols elements.
+*/
+int MatColArgReduce(const matrix_t* mat, mat_reduce_t op, size_t* indices);
+
+typedef enum
+{
+    MAT_FN_EXP,
+    MAT_FN_LOG,
+    MAT_FN_TANH,
+    MAT_FN_SIGMOID,
+    MAT_FN_RELU,
+    MAT_FN_ABS,
+    MAT_FN_CLAMP
+} mat_func_t;
+
+/* maps count elements of in to out, in and out never overlap */
+typedef void (*mat_row_fn)(const float* in, float* out, size_t count, void* ctx);
+
+/** 
+*   MatApply
+*   --------
+*   Applies a built-in function to every element. exp, log, tanh and
+*   sigmoid use polynomial approximations accurate to a few float ulps.
+*   Use MatClamp for MAT_FN_CLAMP.
+*
+*   Return
+*   ------
+*   A new matrix holding the results. NULL on failure.
+*/
+matrix_t* MatApply(const matrix_t* mat, mat_func_t fn);
+
+/** 
+*   MatClamp
+*   --------
+*   Return
+*   ------
+*   A new matrix with every element limited to [lo, hi].
+*   NULL on failure or if lo > hi.
+*/
+matrix_t* MatClamp(const matrix_t* mat, float lo, float hi);
+
+/** 
+*   MatApplyRows
+*   ------------
+*   Calls fn once per row with the row's elements and the matching row of
+*   the result. Rows of large matrices are split across threads, so fn
+*   may run concurrently and must not write shared state unguarded.
+*
+*   Return
+*   ------
+*   A new matrix holding the results. NULL on failure.
+*/
+matrix_t* MatApplyRows(const matrix_t* mat, mat_row_fn fn, void* ctx);
+
+/** 
+*   Householder QR
+*   --------------
+*   A mat_qr_t holds A = QR for an n_rows * n_cols matrix A. Q is kept as
+*   min(n_rows, n_cols) Householder reflectors, and blocks of them are
+*   applied together as matrix products (compact WY form).
+*/
+typedef struct mat_qr_t mat_qr_t;
+
+/** 
+*   MatQR
+*   -----
+*   Return
+*   ------
+*   A pointer to the factorization of mat. NULL on failure.
+*/
+mat_qr_t* MatQR(const matrix_t* mat);
+
+void MatQRDestroy(mat_qr_t* qr);
+
+/** 
+*   MatQRGetR
+*   ---------
+*   Return
+*   ------
+*   The min(n_rows, n_cols) * n_cols upper triangular R. NULL on failure.
+*/
+matrix_t* MatQRGetR(const mat_qr_t* qr);
+
+/** 
+*   MatQRGetQ
+*   ---------
+*   Return
+*   ------
+*   The n_rows * min(n_rows, n_cols) Q with orthonormal columns.
+*   NULL on failure.
+*/
+matrix_t* MatQRGetQ(const mat_qr_t* qr);
+
+/** 
+*   MatQRSolve
+*   ----------
+*   Solves min ||A x - b|| for every column of b using A = QR.
+*
+*   Params
+*   ------
+*   qr - factorization of an n_rows * n_cols A with n_rows >= n_cols.
+*   b - n_rows * k right hand sides.
+*
+*   Return
+*   ------
+*   The n_cols * k solution. NULL on failure, on a shape mismatch or if
+*   A is rank deficient.
+*/
+matrix_t* MatQRSolve(const mat_qr_t* qr, const matrix_t* b);
+
+/** 
+*   MatLeastSquares
+*   ---------------
+*   Solves min ||a x - b|| through a QR factorization of a, without
+*   forming a^T a.
+*
+*   Return
+*   ------
+*   The a->n_cols * b->n_cols solution. NULL on failure, on a shape
+*   mismatch or if a is rank deficient.
+*/
+matrix_t* MatLeastSquares(const matrix_t* a, const matrix_t* b);
+
+/** 
+*   Iterative eigen / singular value solvers
+*   ----------------------------------------
+*   These only touch the matrix through products with vectors, so any
+*   operator works: a dense matrix_t through MatDenseMatvec, or a sparse
+*   or implicit one through a callback of the user's own. The cost is a
+*   few products per wanted value instead of O(n^3).
+*   Results are deterministic: start vectors come from a fixed seed.
+*/
+
+/* y = A x for the operator behind ctx */
+typedef void (*mat_matvec_fn)(const float* x, float* y, void* ctx);
+
+/* mat_matvec_fn for y = mat * x, ctx is the matrix_t* */
+void MatDenseMatvec(const float* x, float* y, void* mat);
+
+/* mat_matvec_fn for y = mat^T * x, ctx is the matrix_t* */
+void MatDenseMatvecT(const float* x, float* y, void* mat);
+
+/** 
+*   MatEigsLanczos
+*   --------------
+*   Finds the k eigenvalues of largest magnitude of a symmetric n * n
+*   operator with the Lanczos method (full reorthogonalization, at most
+*   2k + 64 steps).
+*
+*   Params
+*   ------
+*   op, ctx - the operator.
+*   values - output of k eigenvalues, largest magnitude first.
+*   vectors - if not NULL, receives a new n * k matrix whose columns are
+*             the matching unit eigenvectors.
+*
+*   Return
+*   ------
+*   0 on success, 1 on failure, 2 if the step limit was reached before
+*   convergence (the outputs then hold the best approximations).
+*/
+int MatEigsLanczos(mat_matvec_fn op, void* ctx, size_t n, size_t k, float* values, matrix_t** vectors);
+
+/** 
+*   MatEigsPower
+*   ------------
+*   Same as MatEigsLanczos using block power (subspace) iteration. Slower
+*   to converge when eigenvalues are close, but only keeps k vectors.
+*/
+int MatEigsPower(mat_matvec_fn op, void* ctx, size_t n, size_t k, float* values, matrix_t** vectors);
+
+/** 
+*   MatRandSVD
+*   ----------
+*   Randomized SVD A ~ U S V^T of rank k of an n_rows * n_cols operator,
+*   using k + 10 random probes and two power iterations.
+*
+*   Params
+*   ------
+*   op, op_t, ctx - products with A and with A^T.
+*   s - output of k singular values, largest first.
+*   u, v - if not NULL, receive new n_rows * k and n_cols * k matrices
+*          of singular vectors.
+*
+*   Return
+*   ------
+*   0 on success, nonzero on failure.
+*/
+int MatRandSVD(mat_matvec_fn op, mat_matvec_fn op_t, void* ctx, size_t n_rows, size_t n_cols,
+               size_t k, float* s, matrix_t** u, matrix_t** v);
+
+/** 
+*   Incremental inverse
+*   -------------------
+*   A mat_inverse_t keeps A^-1 and det(A) of a square matrix current while
+*   A changes by low-rank updates, at O(n^2 k) per rank-k update instead
+*   of O(n^3) for a fresh MatInvert. Rounding errors accumulate over many
+*   updates, MatInverseRefresh recomputes both from the current A.
+*/
+typedef struct mat_inverse_t mat_inverse_t;
+
+/** 
+*   MatInverseCreate
+*   ----------------
+*   Return
+*   ------
+*   A handle holding a copy of mat, its inverse and determinant.
+*   NULL on failure or if mat is not square or is singular.
+*/
+mat_inverse_t* MatInverseCreate(const matrix_t* mat);
+
+void MatInverseDestroy(mat_inverse_t* inv);
+
+/** 
+*   MatInverseUpdate
+*   ----------------
+*   Applies the rank-1 change A += u v^T (Sherman-Morrison).
+*
+*   Params
+*   ------
+*   u, v - vectors of n elements.
+*
+*   Return
+*   ------
+*   0 on success. Nonzero on failure or if the result would be singular,
+*   in which case the handle is unchanged.
+*/
+int MatInverseUpdate(mat_inverse_t* inv, const float* u, const float* v);
+
+/** 
+*   MatInverseUpdateRow
+*   -------------------
+*   Replaces row of A with the n elements of new_row. Same return as
+*   MatInverseUpdate.
+*/
+int MatInverseUpdateRow(mat_inverse_t* inv, size_t row, const float* new_row);
+
+/** 
+*   MatInverseUpdateCol
+*   -------------------
+*   Replaces col of A with the n elements of new_col. Same return as
+*   MatInverseUpdate.
+*/
+int MatInverseUpdateCol(mat_inverse_t* inv, size_t col, const float* new_col);
+
+/** 
+*   MatInverseUpdateRankK
+*   ---------------------
+*   Applies A += u v^T for n * k matrices u and v (Woodbury). Same return
+*   as MatInverseUpdate.
+*/
+int MatInverseUpdateRankK(mat_inverse_t* inv, const matrix_t* u, const matrix_t* v);
+
+/** 
+*   MatInverseRefresh
+*   -----------------
+*   Recomputes the inverse and determinant of the current A from scratch.
+*
+*   Return
+*   ------
+*   0 on success, nonzero on failure or if A is singular.
+*/
+int MatInverseRefresh(mat_inverse_t* inv);
+
+/** 
+*   MatInverseGet
+*   -------------
+*   Return
+*   ------
+*   A copy-on-write clone of the current A^-1, which later updates do not
+*   change. NULL on failure.
+*/
+matrix_t* MatInverseGet(const mat_inverse_t* inv);
+
+/** 
+*   MatInverseDet
+*   -------------
+*   Return
+*   ------
+*   det(A) of the current A.
+*/
+float MatInverseDet(const mat_inverse_t* inv);
+
+/** 
+*   Conjugate gradient
+*   ------------------
+*   Iterative solver for symmetric positive definite A x = b that touches
+*   A only through a mat_matvec_fn, so dense and sparse operators work
+*   alike. A mat_cg_t holds the work vectors and is reused across solves
+*   of the same size.
+*/
+
+/* z = M^-1 r for the preconditioner M behind ctx */
+typedef void (*mat_precond_fn)(const float* r, float* z, void* ctx);
+
+typedef struct mat_precond_t mat_precond_t;
+typedef struct mat_cg_t mat_cg_t;
+
+/** 
+*   MatPrecondJacobi
+*   ----------------
+*   Return
+*   ------
+*   A diagonal (Jacobi) preconditioner for mat. NULL on failure or if a
+*   diagonal element is zero.
+*/
+mat_precond_t* MatPrecondJacobi(const matrix_t* mat);
+
+/** 
+*   MatPrecondJacobiDiag
+*   --------------------
+*   Same as MatPrecondJacobi from the n diagonal elements of an operator.
+*/
+mat_precond_t* MatPrecondJacobiDiag(const float* diag, size_t n);
+
+/** 
+*   MatPrecondIC
+*   ------------
+*   Incomplete Cholesky IC(0): L L^T ~ mat with L kept to the nonzero
+*   pattern of mat's lower triangle and stored sparsely. mat is dense;
+*   use MatPrecondICSparse for operators that are not.
+*
+*   Return
+*   ------
+*   The preconditioner. NULL on failure, or if the factorization breaks
+*   down (mat not positive definite enough for IC(0)).
+*/
+mat_precond_t* MatPrecondIC(const matrix_t* mat);
+
+/** 
+*   MatPrecondICSparse
+*   ------------------
+*   MatPrecondIC for an operator known only by its sparse lower triangle,
+*   in O(nnz) memory: row i of A (diagonal included, entries j <= i) is
+*   cols[row_ptr[i]] .. cols[row_ptr[i + 1] - 1] with values in vals,
+*   columns ascending. Stored zeros count as part of the pattern.
+*
+*   Return
+*   ------
+*   The preconditioner. NULL on failure, on entries above the diagonal
+*   or unsorted columns, or if the factorization breaks down.
+*/
+mat_precond_t* MatPrecondICSparse(size_t n, const size_t* row_ptr, const size_t* cols, const float* vals);
+
+void MatPrecondDestroy(mat_precond_t* pre);
+
+/* mat_precond_fn for a mat_precond_t, ctx is the mat_precond_t* */
+void MatPrecondApply(const float* r, float* z, void* precond);
+
+/** 
+*   MatCGCreate
+*   -----------
+*   Return
+*   ------
+*   A workspace for solves with n unknowns. NULL on failure.
+*/
+mat_cg_t* MatCGCreate(size_t n);
+
+void MatCGDestroy(mat_cg_t* cg);
+
+/** 
+*   MatCGSolve
+*   ----------
+*   Preconditioned conjugate gradient for A x = b.
+*
+*   Params
+*   ------
+*   cg - the workspace, sized for the system.
+*   op, op_ctx - the operator A.
+*   precond, precond_ctx - the preconditioner, NULL for none.
+*   b - right hand side.
+*   x - initial guess on entry, the solution on return.
+*   tol - stop once ||b - A x|| <= tol * ||b||.
+*   max_iter - iteration limit.
+*   iters - if not NULL, receives the number of iterations run.
+*
+*   Return
+*   ------
+*   0 once converged, 1 if A is found not to be positive definite,
+*   2 if max_iter was reached first.
+*/
+int MatCGSolve(mat_cg_t* cg, mat_matvec_fn op, void* op_ctx, mat_precond_fn precond, void* precond_ctx,
+               const float* b, float* x, float tol, size_t max_iter, size_t* iters);
+
+/** 
+*   MatReadCSV
+*   ----------
+*   Reads a comma separated file, one row per line. A first line that
+*   does not start with a number is taken as a header and skipped, blank
+*   lines are ignored. Large files are parsed by several threads.
+*
+*   Return
+*   ------
+*   The matrix. NULL on failure, on a parse error or if rows differ in
+*   length.
+*/
+matrix_t* MatReadCSV(const char* path);
+
+/** 
+*   MatWriteCSV
+*   -----------
+*   Writes mat as comma separated rows, every value in the fewest digits
+*   that read back as exactly the same float.
+*
+*   Return
+*   ------
+*   0 on success, nonzero on failure.
+*/
+int MatWriteCSV(const matrix_t* mat, const char* path);
+
+/** 
+*   MatReadMatrixMarket
+*   -------------------
+*   Reads a Matrix Market file: array (general) or coordinate format,
+*   real, integer or pattern entries, general, symmetric or
+*   skew-symmetric. Coordinate entries not listed are zero.
+*
+*   Return
+*   ------
+*   The matrix. NULL on failure or for an unsupported file.
+*/
+matrix_t* MatReadMatrixMarket(const char* path);
+
+/** 
+*   MatWriteMatrixMarket
+*   --------------------
+*   Writes mat as a Matrix Market array file with shortest round-trip
+*   values.
+*
+*   Return
+*   ------
+*   0 on success, nonzero on failure.
+*/
+int MatWriteMatrixMarket(const matrix_t* mat, const char* path);
+
+/** 
+*   MatKron
+*   -------
+*   The Kronecker product of a and b: every a[i][j] * b as one block of
+*   an (a_rows * b_rows) x (a_cols * b_cols) matrix.
+*
+*   Return
+*   ------
+*   The product. NULL on failure.
+*/
+matrix_t* MatKron(const matrix_t* a, const matrix_t* b);
+
+/** 
+*   MatBlock
+*   --------
+*   Assembles a block matrix from block_rows * block_cols blocks given
+*   row by row, e.g. {A, B, C, D} with 2, 2 for [[A, B], [C, D]]. A NULL
+*   block is zero and takes its shape from the other blocks in its block
+*   row and column.
+*
+*   Return
+*   ------
+*   The assembled matrix. NULL on failure, if the block shapes do not
+*   line up or if a block row or column is all NULL.
+*/
+matrix_t* MatBlock(const matrix_t* const* blocks, size_t block_rows, size_t block_cols);
+
+/** 
+*   Implicit Kronecker operator
+*   ---------------------------
+*   Applies a kron b to a vector x as a * X * b^T, X being x read row by
+*   row as an a_cols x b_cols matrix: two small products instead of
+*   materializing the full one. The handle keeps its own reference to a and a
+*   transposed copy of b, and a scratch buffer: do not share one handle
+*   between threads.
+*/
+typedef struct mat_kron_t mat_kron_t;
+
+mat_kron_t* MatKronCreate(const matrix_t* a, const matrix_t* b);
+void MatKronDestroy(mat_kron_t* kron);
+
+/* mat_matvec_fn for y = (a kron b) x, ctx is the mat_kron_t*. x has
+ * a_cols * b_cols entries, y a_rows * b_rows */
+void MatKronMatvec(const float* x, float* y, void* kron);
+
+/** 
+*   MatConv2D
+*   ---------
+*   Slides every filter over image, zero padded by padding on each side,
+*   in steps of stride. Like neural network layers this is a correlation:
+*   filters are not flipped. All filters must have the same shape kh x kw.
+*   3x3 filters at stride 1 use Winograd F(2x2, 3x3), which rounds a
+*   little differently; everything else goes through im2col and GEMM.
+*
+*   Return
+*   ------
+*   The n_filters output maps stacked vertically: a
+*   (n_filters * out_h) x out_w matrix with
+*   out_h = (n_rows + 2 * padding - kh) / stride + 1 and out_w likewise.
+*   NULL on failure, if stride is 0 or the filters do not fit.
+*/
+matrix_t* MatConv2D(const matrix_t* image, const matrix_t* const* filters, size_t n_filters,
+                    size_t stride, size_t padding);
+
+/** 
+*   MatMultChain
+*   ------------
+*   mats[0] * mats[1] * ... * mats[count - 1], multiplied in the order
+*   that needs the fewest flops (found by dynamic programming over the
+*   shapes) rather than left to right. Intermediate products reuse each
+*   other's buffers.
+*
+*   Return
+*   ------
+*   The product. NULL on failure, if count is 0 or on a shape mismatch.
+*/
+matrix_t* MatMultChain(const matrix_t* const* mats, size_t count);
+
+/** 
+*   Result cache
+*   ------------
+*   An optional LRU cache in front of MatDet, MatInvert and MatQR, for
+*   programs that keep asking about the same matrices. Entries are keyed
+*   by shape and exact contents (bit for bit), so a hit costs one hash
+*   and one compare pass over the input instead of O(n^3). Results come
+*   back as copy-on-write clones (MatInvert) or copies (MatQR) and may be
+*   freed and modified as usual. Inputs are held as clones too, so a
+*   cached input costs no memory until the caller writes to it; inputs
+*   over MatWrap buffers are copied. Thread safe.
+*/
+typedef struct mat_cache_stats_t
+{
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;       /* inputs plus results, as charged against the cap */
+} mat_cache_stats_t;
+
+/* starts caching, evicting down to max_bytes if already on; 0 disables */
+void MatCacheEnable(size_t max_bytes);
+
+/* stops caching and frees every entry */
+void MatCacheDisable(void);
+
+/* frees every entry and zeroes the statistics, the cap stays */
+void MatCacheClear(void);
+
+void MatCacheStats(mat_cache_stats_t* stats);
+
+/** 
+*   Banded matrices
+*   ---------------
+*   n x n matrices whose nonzeros lie within lower subdiagonals and upper
+*   superdiagonals, stored in n * (lower + upper + 1) floats. Solving
+*   and multiplying cost O(n * bandwidth) instead of O(n^2) or O(n^3).
+*/
+typedef struct mat_band_t mat_band_t;
+typedef struct mat_band_lu_t mat_band_lu_t;
+
+/* an all-zero band matrix, NULL on failure */
+mat_band_t* MatBandCreate(size_t n, size_t lower, size_t upper);
+
+/* the band of a square mat; entries outside it are dropped */
+mat_band_t* MatBandFromDense(const matrix_t* mat, size_t lower, size_t upper);
+
+void MatBandDestroy(mat_band_t* band);
+
+/* 0 on success, 1 if row, col is outside the matrix or the band */
+int MatBandSet(mat_band_t* band, size_t row, size_t col, float value);
+
+/* 0 outside the band, like MatGetElem outside the matrix */
+float MatBandGet(const mat_band_t* band, size_t row, size_t col);
+
+matrix_t* MatBandToDense(const mat_band_t* band);
+
+/* mat_matvec_fn for y = band * x, ctx is the mat_band_t* */
+void MatBandMatvec(const float* x, float* y, void* band);
+
+/** 
+*   MatBandLU
+*   ---------
+*   Factors band with partial pivoting. Pivoting widens the upper band to
+*   lower + upper, so the factors take about 1.5x to 2x the band's memory.
+*   Factor once, then MatBandLUSolve for each right-hand side.
+*
+*   Return
+*   ------
+*   The factors. NULL on failure or if band is singular.
+*/
+mat_band_lu_t* MatBandLU(const mat_band_t* band);
+
+void MatBandLUDestroy(mat_band_lu_t* lu);
+
+/* solves A x = b from the factors of A, x may be b; always 0 */
+int MatBandLUSolve(const mat_band_lu_t* lu, const float* b, float* x);
+
+/* MatBandLU and MatBandLUSolve in one: 0 on success, 1 on failure or
+ * if band is singular */
+int MatBandSolve(const mat_band_t* band, const float* b, float* x);
+
+/** 
+*   MatTridiagSolve
+*   ---------------
+*   Solves a tridiagonal system with the Thomas algorithm: one forward
+*   and one backward sweep, no pivoting. lower and upper hold the n - 1
+*   sub- and superdiagonal entries, diag the n diagonal ones. Stable for
+*   diagonally dominant or symmetric positive definite systems, the usual
+*   case for PDE discretizations; use MatBandSolve otherwise. x may be b.
+*
+*   Return
+*   ------
+*   0 on success, 1 on failure or on a zero pivot.
+*/
+int MatTridiagSolve(size_t n, const float* lower, const float* diag, const float* upper, const float* b, float* x);
+
+
+/* double-precision complex element of matrix_z_t */
+typedef struct mat_complex_t
+{
+    double re;
+    double im;
+} mat_complex_t;
+
+/** 
+*   MAT_TYPED_API
+*   -------------
+*   Declares a dense row-major matrix type MAT with elements of type T and
+*   its functions Mat<P>Create, Mat<P>Mult, ... which follow their float
+*   counterparts above. Instantiated for:
+*
+*       matrix_d_t     double           MatDCreate, MatDMult, ...
+*       matrix_i32_t   int (32 bits)    MatI32Create, MatI32Mult, ...
+*       matrix_z_t     mat_complex_t    MatZCreate, MatZMult, ...
+*
+*   Mat<P>Compare is exact for integers and within TOLERANCE otherwise.
+*   Mat<P>Norm is the Frobenius norm. Mat<P>FromFloat rounds to the
+*   nearest integer for matrix_i32_t, saturating at INT_MIN and INT_MAX
+*   and giving 0 for NaN; Mat<P>ToFloat keeps only the real part of
+*   complex elements. matrix_i32_t arithmetic (Add, ScalarMult, Mult,
+*   Trace) wraps around modulo 2^32 on overflow. Element access out of range returns zero
+*   from GetElem and 1 from SetElem.
+*/
+#define MAT_TYPED_API(T, MAT, P) \
+    typedef struct MAT MAT; \
+    MAT* Mat##P##Create(size_t n_rows, size_t n_cols, const T* data); \
+    void Mat##P##Destroy(MAT* mat); \
+    T Mat##P##GetElem(const MAT* mat, size_t row, size_t col); \
+    int Mat##P##SetElem(MAT* mat, size_t row, size_t col, T value); \
+    void Mat##P##Shape(const MAT* mat, size_t dims[2]); \
+    T* Mat##P##Data(MAT* mat); \
+    MAT* Mat##P##FromFloat(const matrix_t* mat); \
+    matrix_t* Mat##P##ToFloat(const MAT* mat); \
+    MAT* Mat##P##I(size_t n); \
+    MAT* Mat##P##Add(const MAT* mat1, const MAT* mat2); \
+    MAT* Mat##P##ScalarMult(const MAT* mat, T scalar); \
+    int Mat##P##Compare(const MAT* mat1, const MAT* mat2); \
+    MAT* Mat##P##Transpose(const MAT* mat); \
+    MAT* Mat##P##Mult(const MAT* mat1, const MAT* mat2); \
+    T Mat##P##Trace(const MAT* mat); \
+    double Mat##P##Norm(const MAT* mat)
+
+/** 
+*   MAT_TYPED_FIELD_API
+*   -------------------
+*   The LU based functions, for element types with division (double and
+*   complex). Mat<P>Det is zero for a singular matrix; Mat<P>Solve(a, b)
+*   returns X with a X = b and, like Mat<P>Invert, NULL if a is singular.
+*/
+#define MAT_TYPED_FIELD_API(T, MAT, P) \
+    T Mat##P##Det(const MAT* mat); \
+    MAT* Mat##P##Solve(const MAT* a, const MAT* b); \
+    MAT* Mat##P##Invert(const MAT* mat)
+
+MAT_TYPED_API(double, matrix_d_t, D);
+MAT_TYPED_FIELD_API(double, matrix_d_t, D);
+MAT_TYPED_API(int, matrix_i32_t, I32);
+MAT_TYPED_API(mat_complex_t, matrix_z_t, Z);
+MAT_TYPED_FIELD_API(mat_complex_t, matrix_z_t, Z);
+
+
+/** 
+*   MatProfileEnable
+*   ----------------
+*   Starts recording the main operations (MatMult, MatAdd, MatDet,
+*   MatQR, MatConv2D, ...): calls and wall time, plus user-space CPU
+*   cycles, instructions, L1 data cache read misses and last level cache
+*   misses through Linux perf_event_open where the kernel allows it.
+*   Each operation is aggregated per shape bucket, the power of two ranges
+*   holding the rows and the columns of its first matrix argument. The
+*   figures are inclusive of nested operations and of the worker threads.
+*   Counters follow the thread that enabled profiling; calls made from
+*   other threads are only timed. Enabling again reopens the counters and
+*   keeps what was recorded.
+*
+*   Return
+*   ------
+*   0 with hardware counters, 1 if only time can be recorded.
+*/
+int MatProfileEnable(void);
+
+/* stops recording and closes the counters, the figures are kept */
+void MatProfileDisable(void);
+
+/* forgets everything recorded so far */
+void MatProfileReset(void);
+
+/** 
+*   MatProfileReport
+*   ----------------
+*   Writes one line per operation and shape bucket, slowest first, to the
+*   file at path or to stdout if path is NULL. Besides the raw counts it
+*   lists instructions per cycle and last level cache misses per thousand
+*   instructions: a low IPC with a high miss rate marks a memory-bound
+*   kernel. Counters that could not be read are shown as "-".
+*
+*   Return
+*   ------
+*   0 on success, 1 if the file cannot be written.
+*/
+int MatProfileReport(const char* path);
+
+
+/* the cache blocking of the float GEMM kernel behind MatMult */
+typedef struct mat_tune_t
+{
+    size_t block_inner;  /* rows of b in a panel, 8 to 4096 */
+    size_t block_cols;   /* columns of b in a panel, 8 to 8192 */
+    size_t unroll_rows;  /* rows of the result updated together: 1, 2 or 4 */
+} mat_tune_t;
+
+void MatGetTune(mat_tune_t* tune);
+
+/* applies tune to every later product; 1 if a value is out of range */
+int MatSetTune(const mat_tune_t* tune);
+
+/** 
+*   MatAutotune
+*   -----------
+*   Times every candidate blocking of the GEMM kernel on this CPU and
+*   keeps the fastest, writing it to the profile file at path unless
+*   path is NULL. Takes about a second. The candidates differ in speed
+*   only, products stay bit for bit the same. Products running in
+*   other threads meanwhile keep the previous blocking.
+*   If the environment variable MAT_TUNE_PROFILE names a profile, the
+*   first MatMult loads it, or tunes and creates it when it is missing
+*   or was made on another CPU model, so each machine picks its own
+*   blocking without a rebuild.
+*
+*   Return
+*   ------
+*   0 on success, 1 on failure or if the profile cannot be written.
+*/
+int MatAutotune(const char* path);
+
+/* applies a profile written by MatAutotune; 1 if it is missing, invalid
+ * or was tuned on another CPU model */
+int MatLoadTuneProfile(const char* path);
+
+
+typedef struct mat_shard_t mat_shard_t;
+
+/** 
+*   MatShardCreate
+*   --------------
+*   Forks n_workers worker processes, at most 64, for MatShardMult and
+*   MatShardLU. Each has its own address space and allocator, so a pool
+*   can scale past what the threads of one process manage. The
+*   coordinator sends commands over a socket and the workers exchange
+*   tiles through a POSIX shared memory segment, which is unlinked as
+*   soon as all of them have mapped it. Create the pool before the
+*   program starts threads of its own, as with any fork. Linux only.
+*
+*   Return
+*   ------
+*   A pointer to the pool. NULL on failure.
+*/
+mat_shard_t* MatShardCreate(size_t n_workers);
+
+/* stops and reaps the worker processes */
+void MatShardDestroy(mat_shard_t* shard);
+
+/* MatMult with the rows of the product split over the worker processes;
+ * NULL on failure or if a worker has died */
+matrix_t* MatShardMult(mat_shard_t* shard, const matrix_t* mat1, const matrix_t* mat2);
+
+/** 
+*   MatShardLU
+*   ----------
+*   Blocked LU with partial pivoting, P mat = L U, the trailing updates
+*   spread over the worker processes. *lu holds L below the diagonal
+*   (unit diagonal implied) and U on and above it. pivots gets n entries:
+*   row i was swapped with row pivots[i], in order i = 0 .. n - 1.
+*
+*   Return
+*   ------
+*   0 on success, 1 on failure or if mat is singular (*lu is then NULL).
+*/
+int MatShardLU(mat_shard_t* shard, const matrix_t* mat, matrix_t** lu, size_t* pivots);
+
+
+/* sum of the element-wise products of two matrices of the same shape,
+ * x^T y for vectors; 0 if the shapes differ */
+float MatDot(const matrix_t* mat1, const matrix_t* mat2);
+
+/** 
+*   MatSetReproducible
+*   ------------------
+*   In reproducible mode MatNorm, MatDot and the sums and means of
+*   MatColReduce give bit-identical results whatever the thread count
+*   or CPU: they add fixed blocks of elements (exact products in double
+*   for MatNorm and MatDot), spread over the threads, and combine the
+*   blocks with a pairwise tree whose shape depends on the size only.
+*   Still parallel, at some cost in speed. By default each thread
+*   combines its own share, so the rounding follows the thread count.
+*   Results do depend on the storage layout. MatTrace, MatRowReduce and
+*   the min/max reductions are reproducible in either mode.
+*/
+void MatSetReproducible(int enabled);
+
+int MatGetReproducible(void);
+
+
+/** 
+*   MatRandUniform
+*   --------------
+*   Creates a matrix of random elements uniform in [low, high), filled in
+*   parallel by the counter-based Philox4x32-10 generator. Element i (in
+*   row-major order) depends on seed and i only, so a seed gives the same
+*   matrix whatever the thread count, and the first rows of a larger
+*   matrix with the same number of columns are the same.
+*   MatRandNormal draws from N(mean, stddev^2) through Box-Muller.
+*   MatRandSparse keeps each element with probability density (0 to 1),
+*   uniform in [-1, 1), and sets the others to zero.
+*
+*   Return
+*   ------
+*   A pointer to the matrix. NULL on failure or for a density outside
+*   [0, 1].
+*/
+matrix_t* MatRandUniform(size_t n_rows, size_t n_cols, float low, float high, unsigned long seed);
+
+matrix_t* MatRandNormal(size_t n_rows, size_t n_cols, float mean, float stddev, unsigned long seed);
+
+matrix_t* MatRandSparse(size_t n_rows, size_t n_cols, float density, unsigned long seed);
+
+
+/* Low-rank approximation A ~ U V^T of a dense matrix, built by a randomized
+ * range finder. Products and sums work on the factors: O((n+m)k) memory
+ * and O((n+m)k) per matvec instead of O(nm). */
+typedef struct mat_lowrank_t mat_lowrank_t;
+
+/**
+*   MatLowRank
+*   ----------
+*   Compresses mat to the smallest rank, grown in blocks of 16, whose
+*   relative Frobenius error ||A - U V^T|| / ||A|| is at most tol, but to
+*   no more than max_rank (0 for min(n_rows, n_cols)). The error is
+*   measured on the explicit residual, which takes an n_rows * n_cols
+*   buffer while the rank grows.
+*   Deterministic: the random probes use fixed seeds.
+*
+*   Return
+*   ------
+*   The approximation, NULL for a negative tol or on allocation failure.
+*/
+mat_lowrank_t* MatLowRank(const matrix_t* mat, float tol, size_t max_rank);
+
+void MatLowRankDestroy(mat_lowrank_t* lr);
+
+/* dims receives n_rows, n_cols and the rank */
+void MatLowRankShape(const mat_lowrank_t* lr, size_t dims[3]);
+
+/* relative error measured by MatLowRank; -1 for products and sums, which
+ * are exact on the factors and carry no estimate */
+float MatLowRankError(const mat_lowrank_t* lr);
+
+matrix_t* MatLowRankToDense(const mat_lowrank_t* lr);
+
+/* y = U (V^T x), a mat_matvec_fn taking the mat_lowrank_t as ctx.
+ * Uses scratch inside lr: one call at a time per lr. */
+void MatLowRankMatvec(const float* x, float* y, void* lr);
+
+/* U (V^T mat), the dense product in O((n + m) k p) for p columns */
+matrix_t* MatLowRankMult(const mat_lowrank_t* lr, const matrix_t* mat);
+
+/* lr1 lr2 with rank of lr2, lr1 + lr2 with the ranks summed; NULL on
+ * mismatched shapes or allocation failure */
+mat_lowrank_t* MatLowRankProduct(const mat_lowrank_t* lr1, const mat_lowrank_t* lr2);
+mat_lowrank_t* MatLowRankAdd(const mat_lowrank_t* lr1, const mat_lowrank_t* lr2);
+
+
+typedef enum
+{
+    MAT_CMP_ABS,    /* |a - b| <= tol */
+    MAT_CMP_REL,    /* |a - b| <= tol * max(|a|, |b|) */
+    MAT_CMP_ULP     /* at most tol representable floats apart, +0 == -0 */
+} mat_cmp_mode_t;
+
+typedef struct
+{
+    size_t mismatches;  /* elements beyond tol, only the first unless scan_all */
+    size_t row;         /* first mismatch in storage order, if any */
+    size_t col;
+    double max_error;   /* largest error seen in the mode's unit, HUGE_VAL for NaN */
+} mat_cmp_report_t;
+
+/**
+*   MatCompareEx
+*   ------------
+*   Compares mat1 and mat2 element by element in blocks, stopping at the
+*   first mismatch unless scan_all is set. NaN never compares equal.
+*   MatCompare is MatCompareEx with MAT_CMP_ABS and its fixed tolerance.
+*   report may be NULL; it is left empty for mismatched shapes. Without
+*   scan_all, max_error covers only the blocks scanned.
+*
+*   Return
+*   ------
+*   1 if the matrices have the same shape and agree within tol, else 0.
+*/
+int MatCompareEx(const matrix_t* mat1, const matrix_t* mat2, mat_cmp_mode_t mode, float tol,
+                 int scan_all, mat_cmp_report_t* report);
 
 
 #endif
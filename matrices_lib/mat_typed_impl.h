@@ -0,0 +1,494 @@
+/* Template for the typed matrices declared by MAT_TYPED_API in mat.h,
+ * included by matrix.c once per element type. The includer defines:
+ *
+ *   MT_T                element type
+ *   MT_MAT              matrix struct name
+ *   MT_PREFIX           name infix, Mat<prefix>Create
+ *   MT_FIELD            1 if division exists: det, invert and solve
+ *   MT_ZERO, MT_ONE     constants of MT_T
+ *   MT_ADD, MT_SUB, MT_MUL, MT_DIV, MT_NEG
+ *   MT_MAG2(a)          |a|^2 as a double
+ *   MT_NEAR(a, b)       equal within TOLERANCE, or exactly for integers
+ *   MT_FROM_FLOAT(f), MT_TO_FLOAT(a)
+ *
+ * and everything is #undef'd again at the end. */
+
+#define MT_PASTE_(a, b) a##b
+#define MT_PASTE(a, b) MT_PASTE_(a, b)
+#define MT_PUB(name) MT_PASTE(MT_PASTE(Mat, MT_PREFIX), name)
+#define MT_ID(name) MT_PASTE(MT_PREFIX, name)
+
+#define MT_TRANSPOSE_TILE 32
+
+struct MT_MAT
+{
+    size_t n_rows;
+    size_t n_cols;
+    MT_T* data;
+};
+
+typedef struct MT_ID(MultJob)
+{
+    const MT_MAT* a;
+    const MT_MAT* b;
+    MT_MAT* c;
+} MT_ID(MultJob);
+
+MT_MAT* MT_PUB(Create)(size_t n_rows, size_t n_cols, const MT_T* data)
+{
+    MT_MAT* mat = (MT_MAT*)malloc(sizeof(MT_MAT));
+
+    if (!mat)
+    {
+        return NULL;
+    }
+    mat->n_rows = n_rows;
+    mat->n_cols = n_cols;
+    mat->data = (MT_T*)calloc(n_rows * n_cols + 1, sizeof(MT_T));
+    if (!mat->data)
+    {
+        free(mat);
+        return NULL;
+    }
+    if (data)
+    {
+        memcpy(mat->data, data, n_rows * n_cols * sizeof(MT_T));
+    }
+    return mat;
+}
+
+void MT_PUB(Destroy)(MT_MAT* mat)
+{
+    if (!mat)
+    {
+        return;
+    }
+    free(mat->data);
+    free(mat);
+}
+
+MT_T MT_PUB(GetElem)(const MT_MAT* mat, size_t row, size_t col)
+{
+    if (row >= mat->n_rows || col >= mat->n_cols)
+    {
+        return MT_ZERO;
+    }
+    return mat->data[row * mat->n_cols + col];
+}
+
+int MT_PUB(SetElem)(MT_MAT* mat, size_t row, size_t col, MT_T value)
+{
+    if (row >= mat->n_rows || col >= mat->n_cols)
+    {
+        return 1;
+    }
+    mat->data[row * mat->n_cols + col] = value;
+    return 0;
+}
+
+void MT_PUB(Shape)(const MT_MAT* mat, size_t dims[2])
+{
+    dims[0] = mat->n_rows;
+    dims[1] = mat->n_cols;
+}
+
+MT_T* MT_PUB(Data)(MT_MAT* mat)
+{
+    return mat->data;
+}
+
+MT_MAT* MT_PUB(FromFloat)(const matrix_t* mat)
+{
+    MT_MAT* result = MT_PUB(Create)(mat->n_rows, mat->n_cols, NULL);
+    size_t i, j = 0;
+
+    for (i = 0; result && i < mat->n_rows; i++)
+    {
+        for (j = 0; j < mat->n_cols; j++)
+        {
+            result->data[i * mat->n_cols + j] = MT_FROM_FLOAT(MatGetElem(mat, i, j));
+        }
+    }
+    return result;
+}
+
+matrix_t* MT_PUB(ToFloat)(const MT_MAT* mat)
+{
+    matrix_t* result = MatCreate(mat->n_rows, mat->n_cols, NULL);
+    size_t i = 0;
+
+    for (i = 0; result && i < mat->n_rows * mat->n_cols; i++)
+    {
+        result->data[i] = MT_TO_FLOAT(mat->data[i]);
+    }
+    return result;
+}
+
+MT_MAT* MT_PUB(I)(size_t n)
+{
+    MT_MAT* mat = MT_PUB(Create)(n, n, NULL);
+    size_t i = 0;
+
+    for (i = 0; mat && i < n; i++)
+    {
+        mat->data[i * n + i] = MT_ONE;
+    }
+    return mat;
+}
+
+MT_MAT* MT_PUB(Add)(const MT_MAT* mat1, const MT_MAT* mat2)
+{
+    MT_MAT* result = NULL;
+    size_t i = 0;
+
+    if (mat1->n_rows != mat2->n_rows || mat1->n_cols != mat2->n_cols)
+    {
+        return NULL;
+    }
+    result = MT_PUB(Create)(mat1->n_rows, mat1->n_cols, NULL);
+    for (i = 0; result && i < mat1->n_rows * mat1->n_cols; i++)
+    {
+        result->data[i] = MT_ADD(mat1->data[i], mat2->data[i]);
+    }
+    return result;
+}
+
+MT_MAT* MT_PUB(ScalarMult)(const MT_MAT* mat, MT_T scalar)
+{
+    MT_MAT* result = MT_PUB(Create)(mat->n_rows, mat->n_cols, NULL);
+    size_t i = 0;
+
+    for (i = 0; result && i < mat->n_rows * mat->n_cols; i++)
+    {
+        result->data[i] = MT_MUL(scalar, mat->data[i]);
+    }
+    return result;
+}
+
+int MT_PUB(Compare)(const MT_MAT* mat1, const MT_MAT* mat2)
+{
+    size_t i = 0;
+
+    if (mat1->n_rows != mat2->n_rows || mat1->n_cols != mat2->n_cols)
+    {
+        return 0;
+    }
+    for (i = 0; i < mat1->n_rows * mat1->n_cols; i++)
+    {
+        if (!MT_NEAR(mat1->data[i], mat2->data[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* tile by tile, so both the reads and the writes stay in cache */
+MT_MAT* MT_PUB(Transpose)(const MT_MAT* mat)
+{
+    MT_MAT* result = MT_PUB(Create)(mat->n_cols, mat->n_rows, NULL);
+    size_t i0, j0, i, j = 0;
+
+    for (i0 = 0; result && i0 < mat->n_rows; i0 += MT_TRANSPOSE_TILE)
+    {
+        size_t i1 = i0 + MT_TRANSPOSE_TILE < mat->n_rows ? i0 + MT_TRANSPOSE_TILE : mat->n_rows;
+
+        for (j0 = 0; j0 < mat->n_cols; j0 += MT_TRANSPOSE_TILE)
+        {
+            size_t j1 = j0 + MT_TRANSPOSE_TILE < mat->n_cols ? j0 + MT_TRANSPOSE_TILE : mat->n_cols;
+
+            for (i = i0; i < i1; i++)
+            {
+                for (j = j0; j < j1; j++)
+                {
+                    result->data[j * mat->n_rows + i] = mat->data[i * mat->n_cols + j];
+                }
+            }
+        }
+    }
+    return result;
+}
+
+/* rows [begin, end) of c += a * b, blocked like GemmAccumulate */
+static void MT_ID(MultRange)(void* arg, size_t begin, size_t end, size_t worker)
+{
+    MT_ID(MultJob)* job = (MT_ID(MultJob)*)arg;
+    size_t k = job->a->n_cols;
+    size_t m = job->b->n_cols;
+    size_t k0, j0, i, p, j = 0;
+
+    (void)worker;
+    for (k0 = 0; k0 < k; k0 += GEMM_BLOCK_INNER)
+    {
+        size_t k1 = k0 + GEMM_BLOCK_INNER < k ? k0 + GEMM_BLOCK_INNER : k;
+
+        for (j0 = 0; j0 < m; j0 += GEMM_BLOCK_COLS)
+        {
+            size_t j1 = j0 + GEMM_BLOCK_COLS < m ? j0 + GEMM_BLOCK_COLS : m;
+
+            for (i = begin; i < end; i++)
+            {
+                MT_T* c_row = job->c->data + i * m;
+
+                for (p = k0; p < k1; p++)
+                {
+                    MT_T a_ip = job->a->data[i * k + p];
+                    const MT_T* b_row = job->b->data + p * m;
+
+                    for (j = j0; j < j1; j++)
+                    {
+                        c_row[j] = MT_ADD(c_row[j], MT_MUL(a_ip, b_row[j]));
+                    }
+                }
+            }
+        }
+    }
+}
+
+MT_MAT* MT_PUB(Mult)(const MT_MAT* mat1, const MT_MAT* mat2)
+{
+    MT_ID(MultJob) job;
+    MT_MAT* result = NULL;
+
+    if (mat1->n_cols != mat2->n_rows)
+    {
+        return NULL;
+    }
+    result = MT_PUB(Create)(mat1->n_rows, mat2->n_cols, NULL);
+    if (!result)
+    {
+        return NULL;
+    }
+    job.a = mat1;
+    job.b = mat2;
+    job.c = result;
+    ParallelFor(result->n_rows, RowsPerWorker(result->n_cols), MT_ID(MultRange), &job);
+    return result;
+}
+
+MT_T MT_PUB(Trace)(const MT_MAT* mat)
+{
+    MT_T trace = MT_ZERO;
+    size_t i = 0;
+
+    if (mat->n_rows != mat->n_cols)
+    {
+        return MT_ZERO;
+    }
+    for (i = 0; i < mat->n_rows; i++)
+    {
+        trace = MT_ADD(trace, mat->data[i * mat->n_cols + i]);
+    }
+    return trace;
+}
+
+double MT_PUB(Norm)(const MT_MAT* mat)
+{
+    double sum = 0;
+    size_t i = 0;
+
+    for (i = 0; i < mat->n_rows * mat->n_cols; i++)
+    {
+        sum += MT_MAG2(mat->data[i]);
+    }
+    return sqrt(sum);
+}
+
+#if MT_FIELD
+
+/* In-place LU with partial pivoting, L's multipliers below the
+ * diagonal. pivots[i] is the row swapped into row i. Returns the sign
+ * of the permutation, 0 if singular. */
+static int MT_ID(LUFactor)(MT_MAT* lu, size_t* pivots)
+{
+    size_t n = lu->n_rows;
+    size_t i, j, k = 0;
+    int sign = 1;
+
+    for (k = 0; k < n; k++)
+    {
+        size_t pivot_row = k;
+        double best = MT_MAG2(lu->data[k * n + k]);
+        MT_T* row_k = lu->data + k * n;
+
+        for (i = k + 1; i < n; i++)
+        {
+            if (MT_MAG2(lu->data[i * n + k]) > best)
+            {
+                best = MT_MAG2(lu->data[i * n + k]);
+                pivot_row = i;
+            }
+        }
+        if (best == 0)
+        {
+            return 0;
+        }
+        pivots[k] = pivot_row;
+        if (pivot_row != k)
+        {
+            MT_T* row_p = lu->data + pivot_row * n;
+
+            for (j = 0; j < n; j++)
+            {
+                MT_T tmp = row_k[j];
+
+                row_k[j] = row_p[j];
+                row_p[j] = tmp;
+            }
+            sign = -sign;
+        }
+
+        for (i = k + 1; i < n; i++)
+        {
+            MT_T* row_i = lu->data + i * n;
+            MT_T factor = MT_DIV(row_i[k], row_k[k]);
+
+            row_i[k] = factor;
+            for (j = k + 1; j < n; j++)
+            {
+                row_i[j] = MT_SUB(row_i[j], MT_MUL(factor, row_k[j]));
+            }
+        }
+    }
+    return sign;
+}
+
+MT_T MT_PUB(Det)(const MT_MAT* mat)
+{
+    MT_MAT* lu = NULL;
+    size_t* pivots = NULL;
+    MT_T det = MT_ZERO;
+    size_t i = 0;
+    int sign = 0;
+
+    if (mat->n_rows != mat->n_cols)
+    {
+        return MT_ZERO;
+    }
+    lu = MT_PUB(Create)(mat->n_rows, mat->n_cols, mat->data);
+    pivots = (size_t*)malloc(mat->n_rows * sizeof(size_t) + 1);
+    sign = lu && pivots ? MT_ID(LUFactor)(lu, pivots) : 0;
+    if (sign != 0)
+    {
+        det = sign > 0 ? MT_ONE : MT_NEG(MT_ONE);
+        for (i = 0; i < mat->n_rows; i++)
+        {
+            det = MT_MUL(det, lu->data[i * mat->n_cols + i]);
+        }
+    }
+    MT_PUB(Destroy)(lu);
+    free(pivots);
+    return det;
+}
+
+/* A X = B through LU: the row swaps, then forward and back substitution
+ * on whole rows of X, so every inner loop runs along a row */
+MT_MAT* MT_PUB(Solve)(const MT_MAT* a, const MT_MAT* b)
+{
+    MT_MAT* lu = NULL;
+    MT_MAT* x = NULL;
+    size_t* pivots = NULL;
+    size_t n = a->n_rows;
+    size_t m = b->n_cols;
+    size_t i, j, k = 0;
+
+    if (a->n_rows != a->n_cols || b->n_rows != n)
+    {
+        return NULL;
+    }
+    lu = MT_PUB(Create)(n, n, a->data);
+    x = MT_PUB(Create)(n, m, b->data);
+    pivots = (size_t*)malloc(n * sizeof(size_t) + 1);
+    if (!lu || !x || !pivots || MT_ID(LUFactor)(lu, pivots) == 0)
+    {
+        MT_PUB(Destroy)(lu);
+        MT_PUB(Destroy)(x);
+        free(pivots);
+        return NULL;
+    }
+
+    for (k = 0; k < n; k++)
+    {
+        MT_T* row_k = x->data + k * m;
+
+        if (pivots[k] != k)
+        {
+            MT_T* row_p = x->data + pivots[k] * m;
+
+            for (j = 0; j < m; j++)
+            {
+                MT_T tmp = row_k[j];
+
+                row_k[j] = row_p[j];
+                row_p[j] = tmp;
+            }
+        }
+    }
+    for (i = 1; i < n; i++)
+    {
+        for (k = 0; k < i; k++)
+        {
+            MT_T l_ik = lu->data[i * n + k];
+
+            for (j = 0; j < m; j++)
+            {
+                x->data[i * m + j] = MT_SUB(x->data[i * m + j], MT_MUL(l_ik, x->data[k * m + j]));
+            }
+        }
+    }
+    for (i = n; i > 0; i--)
+    {
+        MT_T* row_i = x->data + (i - 1) * m;
+        MT_T diag = lu->data[(i - 1) * n + i - 1];
+
+        for (k = i; k < n; k++)
+        {
+            MT_T u_ik = lu->data[(i - 1) * n + k];
+
+            for (j = 0; j < m; j++)
+            {
+                row_i[j] = MT_SUB(row_i[j], MT_MUL(u_ik, x->data[k * m + j]));
+            }
+        }
+        for (j = 0; j < m; j++)
+        {
+            row_i[j] = MT_DIV(row_i[j], diag);
+        }
+    }
+
+    MT_PUB(Destroy)(lu);
+    free(pivots);
+    return x;
+}
+
+MT_MAT* MT_PUB(Invert)(const MT_MAT* mat)
+{
+    MT_MAT* identity = MT_PUB(I)(mat->n_rows);
+    MT_MAT* inverse = identity ? MT_PUB(Solve)(mat, identity) : NULL;
+
+    MT_PUB(Destroy)(identity);
+    return inverse;
+}
+
+#endif /* MT_FIELD */
+
+#undef MT_PASTE_
+#undef MT_PASTE
+#undef MT_PUB
+#undef MT_ID
+#undef MT_TRANSPOSE_TILE
+#undef MT_T
+#undef MT_MAT
+#undef MT_PREFIX
+#undef MT_FIELD
+#undef MT_ZERO
+#undef MT_ONE
+#undef MT_ADD
+#undef MT_SUB
+#undef MT_MUL
+#undef MT_DIV
+#undef MT_NEG
+#undef MT_MAG2
+#undef MT_NEAR
+#undef MT_FROM_FLOAT
+#undef MT_TO_FLOAT
@@ -1,447 +1,9062 @@
+#define _GNU_SOURCE /* CPU affinity, mmap and mbind for NUMA placement */
+#define _FILE_OFFSET_BITS 64 /* 64-bit off_t for disk matrices past 2 GB */
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#endif
 #include "mat.h"
 
+#define GEMM_BLOCK_INNER 128
+#define GEMM_BLOCK_COLS 256
+
+/* GCC/Clang atomics keep clones safe to hand between threads */
+#if defined(__GNUC__)
+#define REF_INC(count) __sync_add_and_fetch(&(count), 1)
+#define REF_DEC(count) __sync_sub_and_fetch(&(count), 1)
+#else
+#define REF_INC(count) (++(count))
+#define REF_DEC(count) (--(count))
+#endif
+
+/* no-alias promise for kernels that must vectorize without runtime checks */
+#if defined(__GNUC__)
+#define MAT_RESTRICT __restrict__
+#else
+#define MAT_RESTRICT
+#endif
+
+/* the element storage, possibly shared by several copy-on-write clones */
+typedef struct mat_buffer_t
+{
+    float* data;
+    size_t ref_count;
+    mat_free_fn free_fn;  /* NULL for borrowed buffers */
+    void* free_ctx;
+} mat_buffer_t;
+
 struct matrix_t
 {
     size_t n_rows;
     size_t n_cols;
-    float* data;
+    float* data;          /* always buffer->data */
+    mat_buffer_t* buffer;
+    mat_layout_t layout;  /* a property of this view, clones may differ */
 };
 
-
-
-float MatGetElem(const matrix_t* mat, size_t row, size_t col) 
+static void FreeDefault(float* data, void* ctx)
 {
-    if (row >= mat->n_rows || col >= mat->n_cols) 
-    {
-        return 0.0;
-    }
-    return mat->data[row * mat->n_cols + col];
+    (void)ctx;
+    free(data);
 }
 
-matrix_t* MatCreate(size_t n_rows, size_t n_cols, const float* data) 
+static matrix_t* MatFromBuffer(size_t n_rows, size_t n_cols, float* data, mat_free_fn free_fn, void* free_ctx)
 {
     matrix_t* mat = (matrix_t*)malloc(sizeof(matrix_t));
-    
-    if (!mat) 
+
+    if (!mat)
     {
         return NULL;
     }
-    mat->n_rows = n_rows;
-    mat->n_cols = n_cols;
-    mat->data = (float*)malloc(n_rows * n_cols * sizeof(float));
-    
-    if (!mat->data) 
+    mat->buffer = (mat_buffer_t*)malloc(sizeof(mat_buffer_t));
+    if (!mat->buffer)
     {
         free(mat);
         return NULL;
     }
+    mat->n_rows = n_rows;
+    mat->n_cols = n_cols;
+    mat->data = data;
+    mat->layout = MAT_ROW_MAJOR;
+    mat->buffer->data = data;
+    mat->buffer->ref_count = 1;
+    mat->buffer->free_fn = free_fn;
+    mat->buffer->free_ctx = free_ctx;
+
+    return mat;
+}
+
+static void ReleaseBuffer(mat_buffer_t* buffer)
+{
+    if (REF_DEC(buffer->ref_count) == 0)
+    {
+        if (buffer->free_fn)
+        {
+            buffer->free_fn(buffer->data, buffer->free_ctx);
+        }
+        free(buffer);
+    }
+}
+
+/* gives mat a private copy of its elements if a clone still shares them */
+static int MatDetach(matrix_t* mat)
+{
+    size_t bytes = mat->n_rows * mat->n_cols * sizeof(float);
+    mat_buffer_t* buffer = NULL;
+    float* data = NULL;
 
-    if (data) 
+    if (mat->buffer->ref_count == 1)
     {
-        memcpy(mat->data, data, n_rows * n_cols * sizeof(float));
-    } 
-    else 
+        return 0;
+    }
+
+    buffer = (mat_buffer_t*)malloc(sizeof(mat_buffer_t));
+    data = (float*)malloc(bytes);
+    if (!buffer || !data)
     {
-        memset(mat->data, 0, n_rows * n_cols * sizeof(float));
+        free(buffer);
+        free(data);
+        return 1;
     }
+    memcpy(data, mat->data, bytes);
+    buffer->data = data;
+    buffer->ref_count = 1;
+    buffer->free_fn = FreeDefault;
+    buffer->free_ctx = NULL;
 
-    return mat;
+    ReleaseBuffer(mat->buffer);
+    mat->buffer = buffer;
+    mat->data = data;
+
+    return 0;
 }
 
-void MatDestroy(matrix_t* mat) 
+
+
+/* ----------------------------- NUMA topology ----------------------------- */
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MIN_BYTES (1 << 20) /* smaller buffers stay on the plain heap */
+#define NUMA_CPULIST_SIZE 4096
+#define MPOL_INTERLEAVE_MODE 3   /* from linux/mempolicy.h */
+
+static mat_numa_policy_t g_numa_policy = MAT_NUMA_DEFAULT;
+static pthread_once_t g_numa_once = PTHREAD_ONCE_INIT;
+static size_t g_numa_nodes = 1;
+static size_t g_numa_ids[NUMA_MAX_NODES];
+#ifdef __linux__
+static cpu_set_t g_numa_cpus[NUMA_MAX_NODES];
+#endif
+
+#ifdef __linux__
+/* parses a sysfs cpulist such as "0-3,8-11" */
+static int NumaParseCpus(const char* list, cpu_set_t* cpus)
 {
-    free(mat->data);
-    free(mat);
+    char* end = NULL;
+    int any = 0;
+
+    CPU_ZERO(cpus);
+    while (*list >= '0' && *list <= '9')
+    {
+        unsigned long first = strtoul(list, &end, 10);
+        unsigned long last = first;
+
+        if (*end == '-')
+        {
+            last = strtoul(end + 1, &end, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++)
+        {
+            CPU_SET(first, cpus);
+            any = 1;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return any;
 }
+#endif
 
-static void MatSetElem(matrix_t* mat, size_t row, size_t col, float value) 
+/* one node, and no pinning, unless sysfs shows several nodes with CPUs */
+static void NumaDiscover(void)
 {
-    if (row < mat->n_rows && col < mat->n_cols) 
+#ifdef __linux__
+    char path[64];
+    char list[NUMA_CPULIST_SIZE];
+    size_t id, found = 0;
+
+    for (id = 0; id < NUMA_MAX_NODES; id++)
     {
-        mat->data[row * mat->n_cols + col] = value;
+        FILE* file = NULL;
+
+        sprintf(path, "/sys/devices/system/node/node%lu/cpulist", (unsigned long)id);
+        file = fopen(path, "r");
+        if (!file)
+        {
+            continue;
+        }
+        if (fgets(list, sizeof(list), file) && NumaParseCpus(list, &g_numa_cpus[found]))
+        {
+            g_numa_ids[found++] = id;
+        }
+        fclose(file);
     }
+    g_numa_nodes = found > 0 ? found : 1;
+#endif
 }
 
+size_t MatNumaNodes(void)
+{
+    pthread_once(&g_numa_once, NumaDiscover);
+    return g_numa_nodes;
+}
 
-static void SwapRows(matrix_t* mat, size_t row1, size_t row2) 
+void MatSetNumaPolicy(mat_numa_policy_t policy)
 {
-    size_t j;
-    for (j = 0; j < mat->n_cols; j++) 
-    {
-        float tmp = MatGetElem(mat, row1, j);
-        MatSetElem(mat, row1, j, MatGetElem(mat, row2, j));
-        MatSetElem(mat, row2, j, tmp);
-    }
+    g_numa_policy = policy;
 }
 
+mat_numa_policy_t MatGetNumaPolicy(void)
+{
+    return g_numa_policy;
+}
 
-static void ScaleRow(matrix_t* mat, size_t row, float factor) 
+/* workers are pinned only when a policy is set and there is a choice */
+static int NumaPinning(void)
 {
-    size_t j;
-    for (j = 0; j < mat->n_cols; j++) 
+    return g_numa_policy != MAT_NUMA_DEFAULT && MatNumaNodes() > 1;
+}
+
+/* the node of worker out of workers: consecutive workers share a node so
+ * consecutive row ranges land together */
+static size_t NumaNodeOf(size_t worker, size_t workers)
+{
+    return worker * MatNumaNodes() / workers;
+}
+
+static void NumaPinThread(size_t node)
+{
+#ifdef __linux__
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &g_numa_cpus[node]);
+#else
+    (void)node;
+#endif
+}
+
+
+
+/* ------------------------------- threads ------------------------------- */
+
+#define MAX_THREADS 256
+#define PARALLEL_MIN_ELEMS 65536 /* below this a thread costs more than it saves */
+
+/* processes [begin, end) of a parallel loop on behalf of worker */
+typedef void (*range_fn)(void* ctx, size_t begin, size_t end, size_t worker);
+
+typedef struct parallel_job_t
+{
+    range_fn fn;
+    void* ctx;
+    size_t begin;
+    size_t end;
+    size_t worker;
+    int pin;
+    size_t node;
+} parallel_job_t;
+
+static size_t g_num_threads = 0; /* 0 means one per online CPU */
+
+void MatSetNumThreads(size_t n_threads)
+{
+    g_num_threads = n_threads > MAX_THREADS ? MAX_THREADS : n_threads;
+}
+
+size_t MatGetNumThreads(void)
+{
+    long online = 0;
+
+    if (g_num_threads > 0)
     {
-        MatSetElem(mat, row, j, MatGetElem(mat, row, j) * factor);
+        return g_num_threads;
+    }
+    online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online < 1)
+    {
+        return 1;
     }
+    return online > MAX_THREADS ? MAX_THREADS : (size_t)online;
 }
 
-
-static void SubtractRows(matrix_t* mat, size_t target_row, size_t source_row, float factor) 
+static void* ParallelRun(void* arg)
 {
-    size_t j;
-    for (j = 0; j < mat->n_cols; j++) 
+    parallel_job_t* job = (parallel_job_t*)arg;
+
+    if (job->pin)
     {
-        MatSetElem(mat, target_row, j, MatGetElem(mat, target_row, j) - factor * MatGetElem(mat, source_row, j));
+        NumaPinThread(job->node);
     }
+    job->fn(job->ctx, job->begin, job->end, job->worker);
+    return NULL;
 }
 
+/* how many workers ParallelFor will split count items over */
+static size_t ParallelWorkers(size_t count, size_t min_per_worker)
+{
+    size_t workers = MatGetNumThreads();
 
+    if (min_per_worker == 0)
+    {
+        min_per_worker = 1;
+    }
+    if (count / min_per_worker < workers)
+    {
+        workers = count / min_per_worker;
+    }
+    return workers > 0 ? workers : 1;
+}
 
-matrix_t* MatAdd(const matrix_t* mat1, const matrix_t* mat2) 
+/* Splits [0, count) into one contiguous range per worker, worker w always
+ * getting [count * w / workers, count * (w + 1) / workers). Worker 0 runs
+ * on the calling thread, and a worker whose thread cannot be started runs
+ * there too, so the loop always completes. Under a NUMA policy the
+ * workers are pinned to nodes, the calling thread only for the loop.
+ * Callers with per-worker buffers pass the workers they sized them for,
+ * from one ParallelWorkers call, since the thread count may change in
+ * between. */
+static void ParallelForWorkers(size_t count, size_t workers, range_fn fn, void* ctx)
 {
-    matrix_t* result;
-    size_t i = 0;
-    size_t j = 0;
-    if (mat1->n_rows != mat2->n_rows || mat1->n_cols != mat2->n_cols) 
+    parallel_job_t jobs[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+#ifdef __linux__
+    cpu_set_t caller_cpus;
+#endif
+    size_t w = 0;
+
+    if (workers <= 1)
     {
-        return NULL;
+        fn(ctx, 0, count, 0);
+        return;
     }
 
-    result = MatCreate(mat1->n_rows, mat1->n_cols, NULL);
-    if (!result) 
+    for (w = 0; w < workers; w++)
     {
-        return NULL;
+        jobs[w].fn = fn;
+        jobs[w].ctx = ctx;
+        jobs[w].begin = count / workers * w + count % workers * w / workers;
+        jobs[w].end = count / workers * (w + 1) + count % workers * (w + 1) / workers;
+        jobs[w].worker = w;
+        jobs[w].pin = 0;
+        jobs[w].node = NumaNodeOf(w, workers);
+        started[w] = 0;
     }
 
-    for (i = 0; i < mat1->n_rows; i++) 
+#ifdef __linux__
+    if (NumaPinning())
     {
-        for (j = 0; j < mat1->n_cols; j++) 
+        pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &caller_cpus);
+        for (w = 0; w < workers; w++)
         {
-            MatSetElem(result, i, j, MatGetElem(mat1, i, j) + MatGetElem(mat2, i, j));
+            jobs[w].pin = 1;
         }
     }
+#endif
 
-    return result;
-}
-
-matrix_t* MatScalarMult(matrix_t* mat, float scalar)
-{
-    matrix_t* result = MatCreate(mat->n_rows, mat->n_cols, NULL);
-    size_t i = 0;
-    size_t j = 0;
-    if (!result) 
+    for (w = 1; w < workers; w++)
     {
-        return NULL;
+        started[w] = pthread_create(&threads[w], NULL, ParallelRun, &jobs[w]) == 0;
     }
-    
-    for (i = 0; i < mat->n_rows; i++) 
+    for (w = 0; w < workers; w++)
     {
-        for (j = 0; j < mat->n_cols; j++) 
+        if (!started[w])
         {
-            MatSetElem(result, i, j, scalar * MatGetElem(mat, i, j));
+            ParallelRun(&jobs[w]);
         }
     }
-
-    return result;
-}
-
-int MatCompare(const matrix_t* mat1, const matrix_t* mat2)
-{
-	size_t i = 0;
-	size_t j = 0;
-    if (mat1->n_rows != mat2->n_rows || mat1->n_cols != mat2->n_cols) 
+#ifdef __linux__
+    if (jobs[0].pin)
     {
-        return 0;
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &caller_cpus);
     }
-    
-    for (i = 0; i < mat1->n_rows; i++) 
+#endif
+    for (w = 1; w < workers; w++)
     {
-        for (j = 0; j < mat1->n_cols; j++) 
+        if (started[w])
         {
-            if(fabs(MatGetElem(mat1, i, j) - MatGetElem(mat2, i, j)) > TOLERANCE)
-            {
-                return 0;
-            }
+            pthread_join(threads[w], NULL);
         }
     }
-    
-    return 1;  
 }
 
+static void ParallelFor(size_t count, size_t min_per_worker, range_fn fn, void* ctx)
+{
+    ParallelForWorkers(count, ParallelWorkers(count, min_per_worker), fn, ctx);
+}
 
-matrix_t* MatI(size_t n) 
+
+
+/* ------------------------------ profiling ------------------------------ */
+
+#define PROFILE_COUNTERS 4
+#define PROFILE_MAX_ENTRIES 256
+
+/* calls of one operation within one shape bucket */
+typedef struct profile_entry_t
 {
-	size_t i = 0;
-    matrix_t* mat = MatCreate(n, n, NULL);
+    const char* op;
+    unsigned int row_bucket;  /* floor(log2(n_rows)), 0 for 0 and 1 */
+    unsigned int col_bucket;
+    double calls;
+    double seconds;
+    double counts[PROFILE_COUNTERS];
+    unsigned int have;        /* bit c set once counts[c] got a sample */
+} profile_entry_t;
 
-    for (i = 0; i < n; i++) 
-    {
-        MatSetElem(mat, i, i, 1.0);
-    }
+/* state captured by ProfileBegin for the matching ProfileEnd */
+typedef struct profile_mark_t
+{
+    int active;
+    int counted;
+    unsigned long generation;
+    double start;
+    double counts[PROFILE_COUNTERS];
+} profile_mark_t;
 
-    return mat;
+static const char* const g_profile_counter_names[PROFILE_COUNTERS] = {"cycles", "instr", "L1D miss", "LLC miss"};
+
+static pthread_mutex_t g_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_profile_enabled = 0;  /* written under the lock, see ProfileEnabled */
+static unsigned long g_profile_generation = 0;
+static pthread_t g_profile_owner;
+static int g_profile_fds[PROFILE_COUNTERS] = {-1, -1, -1, -1};
+static profile_entry_t g_profile_entries[PROFILE_MAX_ENTRIES];
+static size_t g_profile_n_entries = 0;
+static size_t g_profile_dropped = 0;
+
+static double ProfileNow(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
 }
 
-void MatShape(const matrix_t* mat, size_t dims[2]) 
-{ 
-    dims[0] = mat->n_rows;
-    dims[1] = mat->n_cols;
+#ifdef __linux__
+/* A user-space counter of the calling thread. inherit also counts the
+ * threads it starts afterwards, ParallelFor's workers, which are folded
+ * in as they exit. */
+static int ProfileOpen(unsigned int type, unsigned long config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0UL);
 }
+#endif
 
-matrix_t* MatTranspose(const matrix_t* mat) 
+/* current counter values, called with g_profile_lock held */
+static int ProfileRead(double* counts)
 {
-    matrix_t* result = MatCreate(mat->n_cols, mat->n_rows, NULL);
-    size_t i = 0;
-    size_t j = 0;
-    if (!result) 
-    {
-        return NULL;
-    }
+    int any = 0;
+    size_t c = 0;
 
-    for (i = 0; i < mat->n_rows; i++) 
+    for (c = 0; c < PROFILE_COUNTERS; c++)
     {
-        for (j = 0; j < mat->n_cols; j++) 
+#ifdef __linux__
+        __u64 value = 0;
+
+        if (g_profile_fds[c] >= 0 && read(g_profile_fds[c], &value, sizeof(value)) == (ssize_t)sizeof(value))
         {
-            MatSetElem(result, j, i, MatGetElem(mat, i, j));
+            counts[c] = (double)value;
+            any = 1;
+            continue;
         }
+#endif
+        counts[c] = -1;
     }
-
-    return result;
+    return any;
 }
 
-matrix_t* MatMult(const matrix_t* mat1, const matrix_t* mat2) 
+static void ProfileCloseCounters(void)
 {
-    matrix_t* result = NULL;
-    size_t i = 0;
-    size_t j = 0;
-    size_t k = 0;
-    
-    if (mat1->n_cols != mat2->n_rows) 
-    {
-        return NULL;
-    }
-
-    result = MatCreate(mat1->n_rows, mat2->n_cols, NULL);
-    if (!result) 
-    {
-        return NULL;
-    }
+    size_t c = 0;
 
-    for (i = 0; i < mat1->n_rows; i++) 
+    for (c = 0; c < PROFILE_COUNTERS; c++)
     {
-        for (j = 0; j < mat2->n_cols; j++) 
+        if (g_profile_fds[c] >= 0)
         {
-            float sum = 0.0;
-            
-            for (k = 0; k < mat1->n_cols; k++) 
-            {
-                sum += MatGetElem(mat1, i, k) * MatGetElem(mat2, k, j);
-            }
-            
-            MatSetElem(result, i, j, sum);
+            close(g_profile_fds[c]);
         }
+        g_profile_fds[c] = -1;
     }
-
-    return result;
 }
 
-float MatTrace(const matrix_t* mat) 
+static unsigned int ProfileBucket(size_t n)
 {
-    float trace = 0.0;
-    size_t i = 0;
-    if (mat->n_rows != mat->n_cols) 
-    {
-        return 0.0;
-    }
+    unsigned int bucket = 0;
 
-    for (i = 0; i < mat->n_rows; i++) 
+    while (n > 1)
     {
-        trace += MatGetElem(mat, i, i);
+        n >>= 1;
+        ++bucket;
     }
+    return bucket;
+}
 
-    return trace;
+/* The flag is read on every instrumented call, so without the lock: a
+ * relaxed atomic load under GCC/Clang (stores are atomic too), elsewhere
+ * under the lock. A stale value only records or skips one call, as
+ * ProfileEnd checks the flag again under the lock. */
+#if defined(__GNUC__)
+#define PROFILE_SET_ENABLED(value) __atomic_store_n(&g_profile_enabled, (value), __ATOMIC_RELAXED)
+
+static int ProfileEnabled(void)
+{
+    return __atomic_load_n(&g_profile_enabled, __ATOMIC_RELAXED);
 }
+#else
+#define PROFILE_SET_ENABLED(value) (g_profile_enabled = (value))
 
-matrix_t* MatSubmatrix(const matrix_t* mat, size_t row, size_t col) 
+static int ProfileEnabled(void)
 {
-    matrix_t* submat = NULL;
-    size_t i, j, sub_i, sub_j = 0;
+    int enabled = 0;
 
-    if (row >= mat->n_rows || col >= mat->n_cols) 
+    pthread_mutex_lock(&g_profile_lock);
+    enabled = g_profile_enabled;
+    pthread_mutex_unlock(&g_profile_lock);
+    return enabled;
+}
+#endif
+
+/* Cheap when profiling is off: one flag test. Error returns between
+ * ProfileBegin and ProfileEnd just leave the call unrecorded. */
+static void ProfileBegin(profile_mark_t* mark)
+{
+    mark->active = ProfileEnabled();
+    if (!mark->active)
     {
-        return NULL;
+        return;
     }
+    pthread_mutex_lock(&g_profile_lock);
+    mark->generation = g_profile_generation;
+    mark->counted = pthread_equal(pthread_self(), g_profile_owner) && ProfileRead(mark->counts);
+    pthread_mutex_unlock(&g_profile_lock);
+    mark->start = ProfileNow();
+}
 
-    submat = MatCreate(mat->n_rows - 1, mat->n_cols - 1, NULL);
-    if (!submat) 
+static void ProfileEnd(const profile_mark_t* mark, const char* op, size_t n_rows, size_t n_cols)
+{
+    double counts[PROFILE_COUNTERS];
+    double elapsed = 0;
+    unsigned int row_bucket = ProfileBucket(n_rows);
+    unsigned int col_bucket = ProfileBucket(n_cols);
+    int counted = 0;
+    profile_entry_t* entry = NULL;
+    size_t e, c = 0;
+
+    if (!mark->active)
     {
-        return NULL;
+        return;
     }
-
-    for (i = 0, sub_i = 0; i < mat->n_rows; i++) 
+    elapsed = ProfileNow() - mark->start;
+    pthread_mutex_lock(&g_profile_lock);
+    if (g_profile_enabled && mark->generation == g_profile_generation)
     {
-        if (i == row) 
+        counted = mark->counted && ProfileRead(counts);
+        for (e = 0; e < g_profile_n_entries && !entry; e++)
         {
-            continue;
+            if (g_profile_entries[e].op == op && g_profile_entries[e].row_bucket == row_bucket &&
+                g_profile_entries[e].col_bucket == col_bucket)
+            {
+                entry = &g_profile_entries[e];
+            }
         }
-        
-        for (j = 0, sub_j = 0; j < mat->n_cols; j++) 
+        if (!entry && g_profile_n_entries < PROFILE_MAX_ENTRIES)
         {
-            if (j == col) 
+            entry = &g_profile_entries[g_profile_n_entries++];
+            memset(entry, 0, sizeof(*entry));
+            entry->op = op;
+            entry->row_bucket = row_bucket;
+            entry->col_bucket = col_bucket;
+        }
+        if (entry)
+        {
+            entry->calls += 1;
+            entry->seconds += elapsed;
+            for (c = 0; counted && c < PROFILE_COUNTERS; c++)
             {
-                continue;
+                if (counts[c] >= 0 && mark->counts[c] >= 0)
+                {
+                    entry->counts[c] += counts[c] - mark->counts[c];
+                    entry->have |= 1U << c;
+                }
             }
-            
-            MatSetElem(submat, sub_i, sub_j, MatGetElem(mat, i, j));
-            sub_j++;
         }
-        sub_i++;
+        else
+        {
+            ++g_profile_dropped;
+        }
     }
-
-    return submat;
+    pthread_mutex_unlock(&g_profile_lock);
 }
 
-float MatDet(const matrix_t* mat) 
+int MatProfileEnable(void)
 {
-    size_t i, k = 0;
-    float det = 1.0;
-    size_t n = mat->n_rows;
-    matrix_t* temp = NULL;
-	
-    if (mat->n_rows != mat->n_cols) 
+    int counters = 0;
+    size_t c = 0;
+
+    pthread_mutex_lock(&g_profile_lock);
+    ProfileCloseCounters();
+#ifdef __linux__
+    g_profile_fds[0] = ProfileOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    g_profile_fds[1] = ProfileOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    g_profile_fds[2] = ProfileOpen(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                   (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    g_profile_fds[3] = ProfileOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+    for (c = 0; c < PROFILE_COUNTERS; c++)
     {
-        return 0.0;
+        counters |= g_profile_fds[c] >= 0;
     }
+    g_profile_owner = pthread_self();
+    ++g_profile_generation;
+    PROFILE_SET_ENABLED(1);
+    pthread_mutex_unlock(&g_profile_lock);
+    return counters ? 0 : 1;
+}
 
-    temp = MatCreate(n, n, mat->data);
+void MatProfileDisable(void)
+{
+    pthread_mutex_lock(&g_profile_lock);
+    PROFILE_SET_ENABLED(0);
+    ProfileCloseCounters();
+    pthread_mutex_unlock(&g_profile_lock);
+}
 
-    if (!temp) 
+void MatProfileReset(void)
+{
+    pthread_mutex_lock(&g_profile_lock);
+    g_profile_n_entries = 0;
+    g_profile_dropped = 0;
+    pthread_mutex_unlock(&g_profile_lock);
+}
+
+/* slowest first */
+static int ProfileCompare(const void* a, const void* b)
+{
+    double sa = ((const profile_entry_t*)a)->seconds;
+    double sb = ((const profile_entry_t*)b)->seconds;
+
+    return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+static void ProfileBucketText(char* text, unsigned int bucket)
+{
+    unsigned long low = bucket == 0 ? 0 : 1UL << bucket;
+
+    sprintf(text, "%lu-%lu", low, (1UL << (bucket + 1)) - 1);
+}
+
+int MatProfileReport(const char* path)
+{
+    profile_entry_t entries[PROFILE_MAX_ENTRIES];
+    char rows[48], cols[48];
+    FILE* out = stdout;
+    size_t n_entries, dropped, e, c = 0;
+
+    pthread_mutex_lock(&g_profile_lock);
+    n_entries = g_profile_n_entries;
+    dropped = g_profile_dropped;
+    memcpy(entries, g_profile_entries, n_entries * sizeof(profile_entry_t));
+    pthread_mutex_unlock(&g_profile_lock);
+
+    if (path && !(out = fopen(path, "w")))
     {
-        return 0.0;
+        return 1;
     }
-	
-    /*bring the matrix to upper diagnoal form so det  = (-1)^(number of row swaps + 1)*(main diagnoal elements multiplication) */
-    for (i = 0; i < n; i++) 
+    qsort(entries, n_entries, sizeof(profile_entry_t), ProfileCompare);
+
+    fprintf(out, "%-20s %-12s %-12s %8s %12s", "op", "rows", "cols", "calls", "seconds");
+    for (c = 0; c < PROFILE_COUNTERS; c++)
     {
-        /* find zero value on the diagnoal */
-        if (fabs(MatGetElem(temp, i, i)) < TOLERANCE) 
+        fprintf(out, " %14s", g_profile_counter_names[c]);
+    }
+    fprintf(out, " %6s %9s\n", "IPC", "LLC/kinst");
+    for (e = 0; e < n_entries; e++)
+    {
+        ProfileBucketText(rows, entries[e].row_bucket);
+        ProfileBucketText(cols, entries[e].col_bucket);
+        fprintf(out, "%-20s %-12s %-12s %8.0f %12.6f", entries[e].op, rows, cols, entries[e].calls,
+                entries[e].seconds);
+        for (c = 0; c < PROFILE_COUNTERS; c++)
         {
-            for (k = i + 1; k < n; k++) 
+            if (entries[e].have & (1U << c))
             {
-                if (fabs(MatGetElem(temp, k, i)) > TOLERANCE) 
-                {
-                    SwapRows(temp, i, k); /*switch it with the first non-zero elment in his col*/
-                    det = -det; 
-                    break; 
-                }
+                fprintf(out, " %14.0f", entries[e].counts[c]);
             }
-
-            
-            if (k == n) /* we go in here only if there is a 0 in diagonal in the upper triangular form*/
+            else
             {
-                MatDestroy(temp); 
-                return 0.0; 
+                fprintf(out, " %14s", "-");
             }
         }
-
-        det *= MatGetElem(temp, i, i); /*update det as multipication of main diagnoal elements*/
-
-        for (k = i + 1; k < n; k++) /* make sure that it is all 0 below the non-zero element in the diagnoal */
+        /* low IPC with many LLC misses per instruction: memory-bound */
+        if ((entries[e].have & 0xB) == 0xB && entries[e].counts[0] > 0 && entries[e].counts[1] > 0)
         {
-            float factor = MatGetElem(temp, k, i) / MatGetElem(temp, i, i);
-            SubtractRows(temp, k, i, factor);
+            fprintf(out, " %6.2f %9.2f\n", entries[e].counts[1] / entries[e].counts[0],
+                    1000 * entries[e].counts[3] / entries[e].counts[1]);
+        }
+        else
+        {
+            fprintf(out, " %6s %9s\n", "-", "-");
         }
     }
+    if (dropped > 0)
+    {
+        fprintf(out, "%lu calls not recorded, more than %d op and shape pairs\n", (unsigned long)dropped,
+                PROFILE_MAX_ENTRIES);
+    }
 
-    MatDestroy(temp);
-    return det;
+    if (out != stdout)
+    {
+        return fclose(out) != 0;
+    }
+    return fflush(out) != 0;
 }
 
-matrix_t* MatInvert(const matrix_t* mat) 
+
+
+/* ---------------------------- NUMA allocation ---------------------------- */
+
+typedef struct numa_init_t
 {
-    size_t i, k = 0;
-    size_t n = 0 ;
-    matrix_t* inverse = NULL;
-    matrix_t* temp;
+    float* dst;
+    const float* src;
+    size_t n_cols;
+} numa_init_t;
 
-    if (mat->n_rows != mat->n_cols) 
-    {
-        return NULL;  
-    }
+/* rows of a matrix each worker gets, the same split for every row kernel */
+static size_t RowsPerWorker(size_t n_cols)
+{
+    return PARALLEL_MIN_ELEMS / (n_cols + 1) + 1;
+}
 
-    n = mat->n_rows;
-    inverse = MatI(n);  
-    temp = MatCreate(n, n, mat->data);  
+#ifdef __linux__
+static void NumaFree(float* data, void* ctx)
+{
+    munmap(data, *(size_t*)ctx);
+    free(ctx);
+}
+#endif
 
-    if (!temp || !inverse) 
+static void NumaInitRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    numa_init_t* init = (numa_init_t*)arg;
+    size_t bytes = (end - begin) * init->n_cols * sizeof(float);
+    float* dst = init->dst + begin * init->n_cols;
+
+    (void)worker;
+    if (init->src)
     {
-        MatDestroy(temp);
-        MatDestroy(inverse);
-        return NULL; 
+        memcpy(dst, init->src + begin * init->n_cols, bytes);
+    }
+    else
+    {
+        memset(dst, 0, bytes);
     }
+}
 
-    for (i = 0; i < n; i++) 
+/* Buffer for an n_rows * n_cols matrix, filled from data (zeros if NULL).
+ * Under a NUMA policy large buffers are mapped untouched, then either
+ * interleaved across nodes or first touched row range by row range by
+ * the pinned workers that will process those rows. Without a policy, on
+ * one node or if mapping fails, it is plain malloc. */
+static float* MatAllocData(size_t n_rows, size_t n_cols, const float* data, mat_free_fn* free_fn, void** free_ctx)
+{
+    size_t bytes = n_rows * n_cols * sizeof(float);
+    float* buffer = NULL;
+    numa_init_t init;
+
+    *free_fn = FreeDefault;
+    *free_ctx = NULL;
+
+#ifdef __linux__
+    if (g_numa_policy != MAT_NUMA_DEFAULT && bytes >= NUMA_MIN_BYTES)
     {
-    	float pivot = MatGetElem(temp, i, i); 
-        /* find zero value on the diagnoal */
-        if (fabs(MatGetElem(temp, i, i)) < TOLERANCE) 
+        size_t* length = (size_t*)malloc(sizeof(size_t));
+        void* map = length ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+
+        if (map != MAP_FAILED)
         {
-            
-            for (k = i + 1; k < n; k++) /*switch it with the first non-zero elment in his col*/
+            *length = bytes;
+            *free_fn = NumaFree;
+            *free_ctx = length;
+            buffer = (float*)map;
+
+            if (g_numa_policy == MAT_NUMA_INTERLEAVE && MatNumaNodes() > 1)
             {
-                if (fabs(MatGetElem(temp, k, i)) > TOLERANCE) 
+                unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long)) + 1];
+                size_t node = 0;
+
+                memset(mask, 0, sizeof(mask));
+                for (node = 0; node < MatNumaNodes(); node++)
                 {
-                    SwapRows(temp, i, k);  
-                    SwapRows(inverse, i, k);  
-                    break;
+                    mask[g_numa_ids[node] / (8 * sizeof(unsigned long))] |= 1UL << (g_numa_ids[node] % (8 * sizeof(unsigned long)));
                 }
-            }
-            if (k == n) /* we go in here only if there is a 0 in diagonal in the upper triangular form*/
-            {
-                MatDestroy(temp);
-                MatDestroy(inverse);
-                return NULL;  
+                /* on failure the pages simply take the default placement */
+                syscall(SYS_mbind, map, bytes, MPOL_INTERLEAVE_MODE, mask, (unsigned long)NUMA_MAX_NODES + 1, 0UL);
             }
         }
+        else
+        {
+            free(length);
+        }
+    }
+#endif
 
-        
-        ScaleRow(temp, i, 1.0f / pivot); /*make the pivot be 1 */
-        ScaleRow(inverse, i, 1.0f / pivot);
-
-        /*make everything (above and below) in the current pivot col to be 0*/
-        for (k = 0; k < n; k++) 
+    if (!buffer)
+    {
+        buffer = (float*)malloc(bytes);
+        if (!buffer)
         {
-            if (k != i) 
-            {
-                float factor = MatGetElem(temp, k, i);
-                SubtractRows(temp, k, i, factor);
-                SubtractRows(inverse, k, i, factor);
-            }
+            return NULL;
         }
     }
 
-    MatDestroy(temp);
-    return inverse;
+    init.dst = buffer;
+    init.src = data;
+    init.n_cols = n_cols;
+    if (*free_fn != FreeDefault && g_numa_policy == MAT_NUMA_FIRST_TOUCH)
+    {
+        ParallelFor(n_rows, RowsPerWorker(n_cols), NumaInitRange, &init);
+    }
+    else if (data || *free_fn == FreeDefault)
+    {
+        NumaInitRange(&init, 0, n_rows, 0); /* fresh mappings are already zero */
+    }
+
+    return buffer;
 }
 
 
 
+/* offset of element row, col in mat->data for either layout */
+static size_t ElemIndex(const matrix_t* mat, size_t row, size_t col)
+{
+    return mat->layout == MAT_ROW_MAJOR ? row * mat->n_cols + col : col * mat->n_rows + row;
+}
 
-float MatNorm(const matrix_t* mat) 
+float MatGetElem(const matrix_t* mat, size_t row, size_t col) 
+{
+    if (row >= mat->n_rows || col >= mat->n_cols) 
+    {
+        return 0.0;
+    }
+    return mat->data[ElemIndex(mat, row, col)];
+}
+
+matrix_t* MatCreate(size_t n_rows, size_t n_cols, const float* data) 
 {
-    float sum = 0.0;
-    size_t i,j = 0; 
+    matrix_t* mat = NULL;
+    mat_free_fn free_fn = NULL;
+    void* free_ctx = NULL;
+    float* buffer = MatAllocData(n_rows, n_cols, data, &free_fn, &free_ctx);
     
-    for (i = 0; i < mat->n_rows; i++) 
+    if (!buffer) 
     {
-        for (j = 0; j < mat->n_cols; j++) 
+        return NULL;
+    }
+
+    mat = MatFromBuffer(n_rows, n_cols, buffer, free_fn, free_ctx);
+    if (!mat) 
+    {
+        free_fn(buffer, free_ctx);
+        return NULL;
+    }
+
+    return mat;
+}
+
+matrix_t* MatWrap(size_t n_rows, size_t n_cols, float* data)
+{
+    if (!data)
+    {
+        return NULL;
+    }
+    return MatFromBuffer(n_rows, n_cols, data, NULL, NULL);
+}
+
+matrix_t* MatAdopt(size_t n_rows, size_t n_cols, float* data, mat_free_fn free_fn, void* free_ctx)
+{
+    if (!data)
+    {
+        return NULL;
+    }
+    return MatFromBuffer(n_rows, n_cols, data, free_fn ? free_fn : FreeDefault, free_ctx);
+}
+
+matrix_t* MatClone(const matrix_t* mat)
+{
+    matrix_t* clone = (matrix_t*)malloc(sizeof(matrix_t));
+
+    if (!clone)
+    {
+        return NULL;
+    }
+    clone->n_rows = mat->n_rows;
+    clone->n_cols = mat->n_cols;
+    clone->data = mat->data;
+    clone->buffer = mat->buffer;
+    clone->layout = mat->layout;
+    REF_INC(mat->buffer->ref_count);
+
+    return clone;
+}
+
+const float* MatConstData(const matrix_t* mat)
+{
+    return mat->data;
+}
+
+float* MatData(matrix_t* mat)
+{
+    if (MatDetach(mat))
+    {
+        return NULL;
+    }
+    return mat->data;
+}
+
+void MatDestroy(matrix_t* mat) 
+{
+    if (!mat)
+    {
+        return;
+    }
+    ReleaseBuffer(mat->buffer);
+    free(mat);
+}
+
+static void MatSetElem(matrix_t* mat, size_t row, size_t col, float value) 
+{
+    if (row < mat->n_rows && col < mat->n_cols) 
+    {
+        mat->data[ElemIndex(mat, row, col)] = value;
+    }
+}
+
+/* mat's elements as the row-major matrix they literally are: mat itself,
+ * or its transpose for column-major data. Borrows mat's buffer. */
+static matrix_t StorageView(const matrix_t* mat)
+{
+    matrix_t view = *mat;
+
+    if (mat->layout == MAT_COL_MAJOR)
+    {
+        view.n_rows = mat->n_cols;
+        view.n_cols = mat->n_rows;
+        view.layout = MAT_ROW_MAJOR;
+    }
+    return view;
+}
+
+/* For kernels that need contiguous rows: a clone of a row-major mat,
+ * else a row-major copy. */
+static matrix_t* RowMajor(const matrix_t* mat)
+{
+    matrix_t view = StorageView(mat);
+
+    return mat->layout == MAT_ROW_MAJOR ? MatClone(mat) : MatTranspose(&view);
+}
+
+/* mat's elements into dst in row-major order, whatever mat's layout */
+static void CopyRows(const matrix_t* mat, float* dst)
+{
+    size_t i, j = 0;
+
+    if (mat->layout == MAT_ROW_MAJOR)
+    {
+        memcpy(dst, mat->data, mat->n_rows * mat->n_cols * sizeof(float));
+        return;
+    }
+    for (j = 0; j < mat->n_cols; j++)
+    {
+        for (i = 0; i < mat->n_rows; i++)
         {
-            float elem = MatGetElem(mat, i, j);
-            sum += elem * elem;
+            dst[i * mat->n_cols + j] = mat->data[j * mat->n_rows + i];
         }
     }
-    
-    return sqrt(sum);
+}
+
+int MatSetLayout(matrix_t* mat, mat_layout_t layout)
+{
+    if (layout != MAT_ROW_MAJOR && layout != MAT_COL_MAJOR)
+    {
+        return 1;
+    }
+    mat->layout = layout;
+    return 0;
+}
+
+mat_layout_t MatGetLayout(const matrix_t* mat)
+{
+    return mat->layout;
+}
+
+matrix_t* MatConvertLayout(const matrix_t* mat, mat_layout_t layout)
+{
+    matrix_t* result = NULL;
+
+    if (layout != MAT_ROW_MAJOR && layout != MAT_COL_MAJOR)
+    {
+        return NULL;
+    }
+    if (layout == mat->layout)
+    {
+        return MatClone(mat);
+    }
+    if (layout == MAT_ROW_MAJOR)
+    {
+        return RowMajor(mat);
+    }
+
+    /* the column-major elements of mat are the row-major ones of mat^T */
+    result = MatTranspose(mat);
+    if (result)
+    {
+        result->n_rows = mat->n_rows;
+        result->n_cols = mat->n_cols;
+        result->layout = MAT_COL_MAJOR;
+    }
+    return result;
+}
+
+
+static void SwapRows(matrix_t* mat, size_t row1, size_t row2) 
+{
+    size_t j;
+    for (j = 0; j < mat->n_cols; j++) 
+    {
+        float tmp = MatGetElem(mat, row1, j);
+        MatSetElem(mat, row1, j, MatGetElem(mat, row2, j));
+        MatSetElem(mat, row2, j, tmp);
+    }
+}
+
+
+static void ScaleRow(matrix_t* mat, size_t row, float factor) 
+{
+    size_t j;
+    for (j = 0; j < mat->n_cols; j++) 
+    {
+        MatSetElem(mat, row, j, MatGetElem(mat, row, j) * factor);
+    }
+}
+
+
+static void SubtractRows(matrix_t* mat, size_t target_row, size_t source_row, float factor) 
+{
+    size_t j;
+    for (j = 0; j < mat->n_cols; j++) 
+    {
+        MatSetElem(mat, target_row, j, MatGetElem(mat, target_row, j) - factor * MatGetElem(mat, source_row, j));
+    }
+}
+
+
+
+matrix_t* MatAdd(const matrix_t* mat1, const matrix_t* mat2) 
+{
+    profile_mark_t mark;
+    matrix_t* result;
+    size_t i = 0;
+    size_t j = 0;
+    if (mat1->n_rows != mat2->n_rows || mat1->n_cols != mat2->n_cols) 
+    {
+        return NULL;
+    }
+
+    result = MatCreate(mat1->n_rows, mat1->n_cols, NULL);
+    if (!result) 
+    {
+        return NULL;
+    }
+
+    ProfileBegin(&mark);
+    /* same layouts add flat and keep it */
+    if (mat1->layout == mat2->layout)
+    {
+        result->layout = mat1->layout;
+        for (i = 0; i < mat1->n_rows * mat1->n_cols; i++)
+        {
+            result->data[i] = mat1->data[i] + mat2->data[i];
+        }
+        ProfileEnd(&mark, "MatAdd", mat1->n_rows, mat1->n_cols);
+        return result;
+    }
+
+    for (i = 0; i < mat1->n_rows; i++) 
+    {
+        for (j = 0; j < mat1->n_cols; j++) 
+        {
+            MatSetElem(result, i, j, MatGetElem(mat1, i, j) + MatGetElem(mat2, i, j));
+        }
+    }
+
+    ProfileEnd(&mark, "MatAdd", mat1->n_rows, mat1->n_cols);
+    return result;
+}
+
+matrix_t* MatScalarMult(matrix_t* mat, float scalar)
+{
+    profile_mark_t mark;
+    matrix_t* result = MatCreate(mat->n_rows, mat->n_cols, NULL);
+    size_t i = 0;
+    if (!result) 
+    {
+        return NULL;
+    }
+    
+    ProfileBegin(&mark);
+    result->layout = mat->layout;
+    for (i = 0; i < mat->n_rows * mat->n_cols; i++) 
+    {
+        result->data[i] = scalar * mat->data[i];
+    }
+
+    ProfileEnd(&mark, "MatScalarMult", mat->n_rows, mat->n_cols);
+    return result;
+}
+
+int MatCompare(const matrix_t* mat1, const matrix_t* mat2)
+{
+    return MatCompareEx(mat1, mat2, MAT_CMP_ABS, TOLERANCE, 0, NULL);
+}
+
+
+matrix_t* MatI(size_t n) 
+{
+	size_t i = 0;
+    matrix_t* mat = MatCreate(n, n, NULL);
+
+    for (i = 0; i < n; i++) 
+    {
+        MatSetElem(mat, i, i, 1.0);
+    }
+
+    return mat;
+}
+
+void MatShape(const matrix_t* mat, size_t dims[2]) 
+{ 
+    dims[0] = mat->n_rows;
+    dims[1] = mat->n_cols;
+}
+
+matrix_t* MatTranspose(const matrix_t* mat) 
+{
+    profile_mark_t mark;
+    matrix_t* result = NULL;
+    size_t i = 0;
+    size_t j = 0;
+
+    /* column-major data already is the row-major transpose */
+    if (mat->layout == MAT_COL_MAJOR)
+    {
+        result = MatClone(mat);
+        if (result)
+        {
+            result->n_rows = mat->n_cols;
+            result->n_cols = mat->n_rows;
+            result->layout = MAT_ROW_MAJOR;
+        }
+        return result;
+    }
+
+    ProfileBegin(&mark);
+    result = MatCreate(mat->n_cols, mat->n_rows, NULL);
+    if (!result) 
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < mat->n_rows; i++) 
+    {
+        for (j = 0; j < mat->n_cols; j++) 
+        {
+            MatSetElem(result, j, i, MatGetElem(mat, i, j));
+        }
+    }
+
+    ProfileEnd(&mark, "MatTranspose", mat->n_rows, mat->n_cols);
+    return result;
+}
+
+static float DotF(const float* x, const float* y, size_t n)
+{
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        s0 += x[i] * y[i];
+        s1 += x[i + 1] * y[i + 1];
+        s2 += x[i + 2] * y[i + 2];
+        s3 += x[i + 3] * y[i + 3];
+    }
+    for (; i < n; i++)
+    {
+        s0 += x[i] * y[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+/* the blocking of GemmAccumulate and GemmDotAccumulate, see MatSetTune;
+ * only ever read or replaced whole under g_tune_lock */
+static mat_tune_t g_gemm_tune = {GEMM_BLOCK_INNER, GEMM_BLOCK_COLS, 1};
+static pthread_mutex_t g_tune_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static mat_tune_t TuneSnapshot(void)
+{
+    mat_tune_t tune;
+
+    pthread_mutex_lock(&g_tune_lock);
+    tune = g_gemm_tune;
+    pthread_mutex_unlock(&g_tune_lock);
+    return tune;
+}
+
+/* c += a * b on row-major operands with leading dimensions lda/ldb/ldc.
+ * b is walked in panels small enough to stay in cache while every row of
+ * a streams over them, and the inner loop is a contiguous axpy, run for
+ * unroll_rows rows of c at once so each load of b serves all of them. */
+static void GemmAccumulateTuned(const mat_tune_t* blocking, size_t n, size_t k, size_t m,
+                                const float* a, size_t lda,
+                                const float* b, size_t ldb,
+                                float* c, size_t ldc)
+{
+    mat_tune_t tune = *blocking;
+    size_t k0, j0, i, p, j = 0;
+
+    for (k0 = 0; k0 < k; k0 += tune.block_inner)
+    {
+        size_t k1 = k0 + tune.block_inner < k ? k0 + tune.block_inner : k;
+
+        for (j0 = 0; j0 < m; j0 += tune.block_cols)
+        {
+            size_t width = j0 + tune.block_cols < m ? tune.block_cols : m - j0;
+
+            for (i = 0; i + 4 <= n && tune.unroll_rows == 4; i += 4)
+            {
+                float* c0 = c + i * ldc + j0;
+                float* c1 = c0 + ldc;
+                float* c2 = c1 + ldc;
+                float* c3 = c2 + ldc;
+
+                for (p = k0; p < k1; p++)
+                {
+                    const float* a_p = a + i * lda + p;
+                    float a0 = a_p[0], a1 = a_p[lda], a2 = a_p[2 * lda], a3 = a_p[3 * lda];
+                    const float* b_row = b + p * ldb + j0;
+
+                    for (j = 0; j < width; j++)
+                    {
+                        float b_pj = b_row[j];
+
+                        c0[j] += a0 * b_pj;
+                        c1[j] += a1 * b_pj;
+                        c2[j] += a2 * b_pj;
+                        c3[j] += a3 * b_pj;
+                    }
+                }
+            }
+            for (; i + 2 <= n && tune.unroll_rows >= 2; i += 2)
+            {
+                float* c0 = c + i * ldc + j0;
+                float* c1 = c0 + ldc;
+
+                for (p = k0; p < k1; p++)
+                {
+                    float a0 = a[i * lda + p], a1 = a[(i + 1) * lda + p];
+                    const float* b_row = b + p * ldb + j0;
+
+                    for (j = 0; j < width; j++)
+                    {
+                        float b_pj = b_row[j];
+
+                        c0[j] += a0 * b_pj;
+                        c1[j] += a1 * b_pj;
+                    }
+                }
+            }
+            for (; i < n; i++)
+            {
+                float* c_row = c + i * ldc + j0;
+
+                for (p = k0; p < k1; p++)
+                {
+                    float a_ip = a[i * lda + p];
+                    const float* b_row = b + p * ldb + j0;
+
+                    for (j = 0; j < width; j++)
+                    {
+                        c_row[j] += a_ip * b_row[j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* GemmAccumulate under the current tuning */
+static void GemmAccumulate(size_t n, size_t k, size_t m,
+                           const float* a, size_t lda,
+                           const float* b, size_t ldb,
+                           float* c, size_t ldc)
+{
+    mat_tune_t tune = TuneSnapshot();
+
+    GemmAccumulateTuned(&tune, n, k, m, a, lda, b, ldb, c, ldc);
+}
+
+typedef struct mult_job_t
+{
+    const matrix_t* a;
+    const matrix_t* b;
+    matrix_t* c;
+} mult_job_t;
+
+/* c[i][j] += row i of a . row j of b_t, over column panels of c so the
+ * rows of b_t stay in cache while the rows of a pass over them */
+static void GemmDotAccumulate(size_t n, size_t k, size_t m, const float* a, const float* b_t, float* c, size_t ldc)
+{
+    size_t block_cols = TuneSnapshot().block_cols;
+    size_t j0, i, j = 0;
+
+    for (j0 = 0; j0 < m; j0 += block_cols)
+    {
+        size_t j1 = j0 + block_cols < m ? j0 + block_cols : m;
+
+        for (i = 0; i < n; i++)
+        {
+            for (j = j0; j < j1; j++)
+            {
+                c[i * ldc + j] += DotF(a + i * k, b_t + j * k, k);
+            }
+        }
+    }
+}
+
+/* Rows [begin, end) of the row-major product c, split the way MatCreate
+ * first touched them. Column-major rows of a are packed contiguously
+ * first; a column-major b is b^T row by row, which suits dot products. */
+static void MultRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    mult_job_t* job = (mult_job_t*)arg;
+    size_t n = job->a->n_rows;
+    size_t k = job->a->n_cols;
+    size_t m = job->b->n_cols;
+    const float* a = job->a->data + begin * k;
+    float* packed = NULL;
+    size_t i, j, p = 0;
+
+    (void)worker;
+    if (job->a->layout == MAT_COL_MAJOR)
+    {
+        packed = (float*)malloc((end - begin) * k * sizeof(float) + 1);
+        if (!packed)
+        {
+            /* no room to pack: element by element, slow but right */
+            for (i = begin; i < end; i++)
+            {
+                for (j = 0; j < m; j++)
+                {
+                    for (p = 0; p < k; p++)
+                    {
+                        job->c->data[i * m + j] += MatGetElem(job->a, i, p) * MatGetElem(job->b, p, j);
+                    }
+                }
+            }
+            return;
+        }
+        for (p = 0; p < k; p++)
+        {
+            for (i = begin; i < end; i++)
+            {
+                packed[(i - begin) * k + p] = job->a->data[p * n + i];
+            }
+        }
+        a = packed;
+    }
+
+    if (job->b->layout == MAT_COL_MAJOR)
+    {
+        GemmDotAccumulate(end - begin, k, m, a, job->b->data, job->c->data + begin * m, m);
+    }
+    else
+    {
+        GemmAccumulate(end - begin, k, m, a, k, job->b->data, m, job->c->data + begin * m, m);
+    }
+    free(packed);
+}
+
+/* ----------------------------- GEMM tuning ----------------------------- */
+
+#define TUNE_ENV "MAT_TUNE_PROFILE"
+#define TUNE_ROWS 64    /* benchmark shape: a worker's strip of a mid-sized product */
+#define TUNE_INNER 384
+#define TUNE_COLS 512
+#define TUNE_REPEATS 3
+
+static pthread_once_t g_tune_once = PTHREAD_ONCE_INIT;
+
+static int TuneValid(const mat_tune_t* tune)
+{
+    return tune->block_inner >= 8 && tune->block_inner <= 4096 && tune->block_cols >= 8 &&
+           tune->block_cols <= 8192 && (tune->unroll_rows == 1 || tune->unroll_rows == 2 || tune->unroll_rows == 4);
+}
+
+void MatGetTune(mat_tune_t* tune)
+{
+    *tune = TuneSnapshot();
+}
+
+int MatSetTune(const mat_tune_t* tune)
+{
+    if (!TuneValid(tune))
+    {
+        return 1;
+    }
+    pthread_mutex_lock(&g_tune_lock);
+    g_gemm_tune = *tune;
+    pthread_mutex_unlock(&g_tune_lock);
+    return 0;
+}
+
+/* the CPU a profile was tuned on, "model name" of /proc/cpuinfo */
+static void TuneCpuName(char* name, size_t size)
+{
+    char line[256];
+    FILE* info = fopen("/proc/cpuinfo", "r");
+    char* value = NULL;
+
+    strcpy(name, "unknown");
+    while (info && fgets(line, sizeof(line), info))
+    {
+        if (strncmp(line, "model name", 10) == 0 && (value = strchr(line, ':')) != NULL)
+        {
+            value += strspn(value, ": \t");
+            value[strcspn(value, "\r\n")] = '\0';
+            strncpy(name, value, size - 1);
+            name[size - 1] = '\0';
+            break;
+        }
+    }
+    if (info)
+    {
+        fclose(info);
+    }
+}
+
+int MatLoadTuneProfile(const char* path)
+{
+    char line[256];
+    char cpu[128];
+    char profile_cpu[128];
+    mat_tune_t tune;
+    FILE* file = fopen(path, "r");
+
+    if (!file)
+    {
+        return 1;
+    }
+    TuneCpuName(cpu, sizeof(cpu));
+    profile_cpu[0] = '\0';
+    memset(&tune, 0, sizeof(tune));
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "cpu=", 4) == 0)
+        {
+            strncpy(profile_cpu, line + 4, sizeof(profile_cpu) - 1);
+            profile_cpu[sizeof(profile_cpu) - 1] = '\0';
+        }
+        else if (strncmp(line, "block_inner=", 12) == 0)
+        {
+            tune.block_inner = strtoul(line + 12, NULL, 10);
+        }
+        else if (strncmp(line, "block_cols=", 11) == 0)
+        {
+            tune.block_cols = strtoul(line + 11, NULL, 10);
+        }
+        else if (strncmp(line, "unroll_rows=", 12) == 0)
+        {
+            tune.unroll_rows = strtoul(line + 12, NULL, 10);
+        }
+    }
+    fclose(file);
+
+    /* a profile from another CPU model is no better than the defaults */
+    if (strcmp(cpu, profile_cpu) != 0)
+    {
+        return 1;
+    }
+    return MatSetTune(&tune);
+}
+
+static int TuneWrite(const char* path, const mat_tune_t* tune)
+{
+    char cpu[128];
+    FILE* file = fopen(path, "w");
+
+    if (!file)
+    {
+        return 1;
+    }
+    TuneCpuName(cpu, sizeof(cpu));
+    fprintf(file, "# GEMM tuning profile, see MatAutotune\n");
+    fprintf(file, "cpu=%s\n", cpu);
+    fprintf(file, "block_inner=%lu\n", (unsigned long)tune->block_inner);
+    fprintf(file, "block_cols=%lu\n", (unsigned long)tune->block_cols);
+    fprintf(file, "unroll_rows=%lu\n", (unsigned long)tune->unroll_rows);
+    return fclose(file) != 0;
+}
+
+/* best of TUNE_REPEATS runs of the benchmark product under tune */
+static double TuneTime(const mat_tune_t* tune, const float* a, const float* b, float* c)
+{
+    double best = 0;
+    size_t r = 0;
+
+    for (r = 0; r < TUNE_REPEATS; r++)
+    {
+        double start = ProfileNow();
+        double elapsed = 0;
+
+        GemmAccumulateTuned(tune, TUNE_ROWS, TUNE_INNER, TUNE_COLS, a, TUNE_INNER, b, TUNE_COLS, c, TUNE_COLS);
+        elapsed = ProfileNow() - start;
+        if (r == 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+/* Every candidate computes bit-identical products: the blocking only
+ * reorders independent elements, never the sum for one element. The
+ * candidates run on a private blocking; products elsewhere keep the
+ * current one until the winner is published. */
+int MatAutotune(const char* path)
+{
+    static const size_t inners[] = {64, 128, 256, 512};
+    static const size_t cols[] = {128, 256, 512, 1024};
+    static const size_t unrolls[] = {1, 2, 4};
+    mat_tune_t best = TuneSnapshot();
+    mat_tune_t candidate;
+    double best_time = 0;
+    float* a = (float*)malloc(TUNE_ROWS * TUNE_INNER * sizeof(float));
+    float* b = (float*)malloc(TUNE_INNER * TUNE_COLS * sizeof(float));
+    float* c = (float*)calloc(TUNE_ROWS * TUNE_COLS, sizeof(float));
+    size_t i, j, u = 0;
+
+    if (!a || !b || !c)
+    {
+        free(a);
+        free(b);
+        free(c);
+        return 1;
+    }
+    for (i = 0; i < TUNE_ROWS * TUNE_INNER; i++)
+    {
+        a[i] = (float)(i % 17) * 0.125F;
+    }
+    for (i = 0; i < TUNE_INNER * TUNE_COLS; i++)
+    {
+        b[i] = (float)(i % 13) * 0.25F;
+    }
+
+    best_time = TuneTime(&best, a, b, c);
+    for (i = 0; i < sizeof(inners) / sizeof(inners[0]); i++)
+    {
+        for (j = 0; j < sizeof(cols) / sizeof(cols[0]); j++)
+        {
+            for (u = 0; u < sizeof(unrolls) / sizeof(unrolls[0]); u++)
+            {
+                double elapsed = 0;
+
+                candidate.block_inner = inners[i];
+                candidate.block_cols = cols[j];
+                candidate.unroll_rows = unrolls[u];
+                elapsed = TuneTime(&candidate, a, b, c);
+                if (elapsed < best_time)
+                {
+                    best_time = elapsed;
+                    best = candidate;
+                }
+            }
+        }
+    }
+    MatSetTune(&best);
+
+    free(a);
+    free(b);
+    free(c);
+    return path ? TuneWrite(path, &best) : 0;
+}
+
+/* first MatMult: load $MAT_TUNE_PROFILE, or tune and create it */
+static void TuneFromEnv(void)
+{
+    const char* path = getenv(TUNE_ENV);
+
+    if (path && *path && MatLoadTuneProfile(path) != 0)
+    {
+        MatAutotune(path);
+    }
+}
+
+matrix_t* MatMult(const matrix_t* mat1, const matrix_t* mat2) 
+{
+    profile_mark_t mark;
+    matrix_t* result = NULL;
+    mult_job_t job;
+    
+    if (mat1->n_cols != mat2->n_rows) 
+    {
+        return NULL;
+    }
+    pthread_once(&g_tune_once, TuneFromEnv);
+
+    /* both column-major: C^T = B^T A^T on the stored data gives C
+     * column-major without touching a single element twice */
+    if (mat1->layout == MAT_COL_MAJOR && mat2->layout == MAT_COL_MAJOR)
+    {
+        matrix_t left = StorageView(mat2);
+        matrix_t right = StorageView(mat1);
+
+        result = MatMult(&left, &right);
+        if (result)
+        {
+            result->n_rows = mat1->n_rows;
+            result->n_cols = mat2->n_cols;
+            result->layout = MAT_COL_MAJOR;
+        }
+        return result;
+    }
+
+    ProfileBegin(&mark);
+    result = MatCreate(mat1->n_rows, mat2->n_cols, NULL);
+    if (!result) 
+    {
+        return NULL;
+    }
+
+    job.a = mat1;
+    job.b = mat2;
+    job.c = result;
+    ParallelFor(result->n_rows, RowsPerWorker(result->n_cols), MultRange, &job);
+
+    ProfileEnd(&mark, "MatMult", mat1->n_rows, mat1->n_cols);
+    return result;
+}
+
+float MatTrace(const matrix_t* mat) 
+{
+    float trace = 0.0;
+    size_t i = 0;
+    if (mat->n_rows != mat->n_cols) 
+    {
+        return 0.0;
+    }
+
+    for (i = 0; i < mat->n_rows; i++) 
+    {
+        trace += MatGetElem(mat, i, i);
+    }
+
+    return trace;
+}
+
+matrix_t* MatSubmatrix(const matrix_t* mat, size_t row, size_t col) 
+{
+    matrix_t* submat = NULL;
+    size_t i, j, sub_i, sub_j = 0;
+
+    if (row >= mat->n_rows || col >= mat->n_cols) 
+    {
+        return NULL;
+    }
+
+    submat = MatCreate(mat->n_rows - 1, mat->n_cols - 1, NULL);
+    if (!submat) 
+    {
+        return NULL;
+    }
+
+    for (i = 0, sub_i = 0; i < mat->n_rows; i++) 
+    {
+        if (i == row) 
+        {
+            continue;
+        }
+        
+        for (j = 0, sub_j = 0; j < mat->n_cols; j++) 
+        {
+            if (j == col) 
+            {
+                continue;
+            }
+            
+            MatSetElem(submat, sub_i, sub_j, MatGetElem(mat, i, j));
+            sub_j++;
+        }
+        sub_i++;
+    }
+
+    return submat;
+}
+
+/* the uncached computations behind MatDet, MatInvert and MatQR */
+static float Determinant(const matrix_t* mat) 
+{
+    size_t i, k = 0;
+    float det = 1.0;
+    size_t n = mat->n_rows;
+    matrix_t* temp = NULL;
+	
+    if (mat->n_rows != mat->n_cols) 
+    {
+        return 0.0;
+    }
+
+    /* column-major data read row-major is mat^T, which has the same det */
+    temp = MatCreate(n, n, mat->data);
+
+    if (!temp) 
+    {
+        return 0.0;
+    }
+	
+    /*bring the matrix to upper diagnoal form so det  = (-1)^(number of row swaps + 1)*(main diagnoal elements multiplication) */
+    for (i = 0; i < n; i++) 
+    {
+        /* find zero value on the diagnoal */
+        if (fabs(MatGetElem(temp, i, i)) < TOLERANCE) 
+        {
+            for (k = i + 1; k < n; k++) 
+            {
+                if (fabs(MatGetElem(temp, k, i)) > TOLERANCE) 
+                {
+                    SwapRows(temp, i, k); /*switch it with the first non-zero elment in his col*/
+                    det = -det; 
+                    break; 
+                }
+            }
+
+            
+            if (k == n) /* we go in here only if there is a 0 in diagonal in the upper triangular form*/
+            {
+                MatDestroy(temp); 
+                return 0.0; 
+            }
+        }
+
+        det *= MatGetElem(temp, i, i); /*update det as multipication of main diagnoal elements*/
+
+        for (k = i + 1; k < n; k++) /* make sure that it is all 0 below the non-zero element in the diagnoal */
+        {
+            float factor = MatGetElem(temp, k, i) / MatGetElem(temp, i, i);
+            SubtractRows(temp, k, i, factor);
+        }
+    }
+
+    MatDestroy(temp);
+    return det;
+}
+
+static matrix_t* Invert(const matrix_t* mat) 
+{
+    size_t i, k = 0;
+    size_t n = 0 ;
+    matrix_t* inverse = NULL;
+    matrix_t* temp;
+
+    if (mat->n_rows != mat->n_cols) 
+    {
+        return NULL;  
+    }
+
+    n = mat->n_rows;
+    inverse = MatI(n);  
+    temp = MatCreate(n, n, mat->data);  
+
+    if (!temp || !inverse) 
+    {
+        MatDestroy(temp);
+        MatDestroy(inverse);
+        return NULL; 
+    }
+
+    for (i = 0; i < n; i++) 
+    {
+        float pivot = 0;
+
+        /* find zero value on the diagnoal */
+        if (fabs(MatGetElem(temp, i, i)) < TOLERANCE) 
+        {
+            
+            for (k = i + 1; k < n; k++) /*switch it with the first non-zero elment in his col*/
+            {
+                if (fabs(MatGetElem(temp, k, i)) > TOLERANCE) 
+                {
+                    SwapRows(temp, i, k);  
+                    SwapRows(inverse, i, k);  
+                    break;
+                }
+            }
+            if (k == n) /* we go in here only if there is a 0 in diagonal in the upper triangular form*/
+            {
+                MatDestroy(temp);
+                MatDestroy(inverse);
+                return NULL;  
+            }
+        }
+
+        pivot = MatGetElem(temp, i, i); /* read after any swap */
+        ScaleRow(temp, i, 1.0f / pivot); /*make the pivot be 1 */
+        ScaleRow(inverse, i, 1.0f / pivot);
+
+        /*make everything (above and below) in the current pivot col to be 0*/
+        for (k = 0; k < n; k++) 
+        {
+            if (k != i) 
+            {
+                float factor = MatGetElem(temp, k, i);
+                SubtractRows(temp, k, i, factor);
+                SubtractRows(inverse, k, i, factor);
+            }
+        }
+    }
+
+    /* column-major data was inverted as mat^T, and inv(mat^T) read
+     * column-major is inv(mat) */
+    inverse->layout = mat->layout;
+    MatDestroy(temp);
+    return inverse;
+}
+
+
+
+/* ------------------------ reduced-precision storage ------------------------ */
+
+#define QUANT_TILE_ROWS 64
+#define QUANT_TILE_COLS 256
+#define INT8_MAX_LEVEL 127.0F
+
+struct mat_quant_t
+{
+    size_t n_rows;
+    size_t n_cols;
+    mat_storage_t storage;
+    void* data;     /* unsigned short for fp16/bf16, signed char for int8 */
+    float* scales;  /* one per row, int8 only */
+};
+
+static unsigned int FloatBits(float value)
+{
+    unsigned int bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static float BitsFloat(unsigned int bits)
+{
+    float value = 0;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/* round to nearest even, overflow goes to inf, small values to subnormals */
+static unsigned short FloatToHalf(float value)
+{
+    unsigned int bits = FloatBits(value);
+    unsigned int sign = (bits >> 16) & 0x8000;
+    unsigned int mant = bits & 0x7fffff;
+    int exp = (int)((bits >> 23) & 0xff);
+    unsigned int half = 0;
+    unsigned int rem = 0;
+
+    if (exp == 0xff)
+    {
+        return (unsigned short)(sign | 0x7c00 | (mant ? 0x200 : 0));
+    }
+
+    exp = exp - 127 + 15;
+    if (exp >= 31)
+    {
+        return (unsigned short)(sign | 0x7c00);
+    }
+
+    if (exp <= 0)
+    {
+        unsigned int shift = (unsigned int)(14 - exp);
+        unsigned int halfway = 0;
+
+        if (exp < -10)
+        {
+            return (unsigned short)sign;
+        }
+        mant |= 0x800000;
+        half = mant >> shift;
+        rem = mant & ((1U << shift) - 1);
+        halfway = 1U << (shift - 1);
+        if (rem > halfway || (rem == halfway && (half & 1)))
+        {
+            ++half;
+        }
+        return (unsigned short)(sign | half);
+    }
+
+    half = sign | ((unsigned int)exp << 10) | (mant >> 13);
+    rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1)))
+    {
+        ++half; /* a carry into the exponent correctly rounds up to inf */
+    }
+    return (unsigned short)half;
+}
+
+static float HalfToFloat(unsigned short half)
+{
+    unsigned int sign = ((unsigned int)half & 0x8000) << 16;
+    unsigned int mant = half & 0x3ff;
+    int exp = (half >> 10) & 0x1f;
+
+    if (exp == 0x1f)
+    {
+        return BitsFloat(sign | 0x7f800000 | (mant << 13));
+    }
+    if (exp == 0)
+    {
+        if (mant == 0)
+        {
+            return BitsFloat(sign);
+        }
+        /* subnormal half, normalize it into a float */
+        exp = 1;
+        while (!(mant & 0x400))
+        {
+            mant <<= 1;
+            --exp;
+        }
+        mant &= 0x3ff;
+    }
+    return BitsFloat(sign | ((unsigned int)(exp + 127 - 15) << 23) | (mant << 13));
+}
+
+static unsigned short FloatToBf16(float value)
+{
+    unsigned int bits = FloatBits(value);
+
+    if ((bits & 0x7fffffff) > 0x7f800000)
+    {
+        return (unsigned short)((bits >> 16) | 0x40); /* keep NaN a NaN */
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return (unsigned short)(bits >> 16);
+}
+
+static float Bf16ToFloat(unsigned short bf)
+{
+    return BitsFloat((unsigned int)bf << 16);
+}
+
+/* widen count elements of a row starting at col into out */
+static void QuantWiden(const mat_quant_t* qmat, size_t row, size_t col, size_t count, float* out)
+{
+    size_t offset = row * qmat->n_cols + col;
+    size_t j = 0;
+
+    if (qmat->storage == MAT_STORE_INT8)
+    {
+        const signed char* src = (const signed char*)qmat->data + offset;
+        float scale = qmat->scales[row];
+
+        for (j = 0; j < count; j++)
+        {
+            out[j] = scale * (float)src[j];
+        }
+    }
+    else if (qmat->storage == MAT_STORE_FP16)
+    {
+        const unsigned short* src = (const unsigned short*)qmat->data + offset;
+
+        for (j = 0; j < count; j++)
+        {
+            out[j] = HalfToFloat(src[j]);
+        }
+    }
+    else
+    {
+        const unsigned short* src = (const unsigned short*)qmat->data + offset;
+
+        for (j = 0; j < count; j++)
+        {
+            out[j] = Bf16ToFloat(src[j]);
+        }
+    }
+}
+
+mat_quant_t* MatQuantize(const matrix_t* mat, mat_storage_t storage)
+{
+    mat_quant_t* qmat = NULL;
+    size_t count = mat->n_rows * mat->n_cols;
+    size_t i = 0;
+    size_t j = 0;
+
+    if (mat->layout != MAT_ROW_MAJOR)
+    {
+        matrix_t* rows = RowMajor(mat);
+
+        qmat = rows ? MatQuantize(rows, storage) : NULL;
+        MatDestroy(rows);
+        return qmat;
+    }
+
+    if (storage != MAT_STORE_FP16 && storage != MAT_STORE_BF16 && storage != MAT_STORE_INT8)
+    {
+        return NULL;
+    }
+
+    qmat = (mat_quant_t*)malloc(sizeof(mat_quant_t));
+    if (!qmat)
+    {
+        return NULL;
+    }
+    qmat->n_rows = mat->n_rows;
+    qmat->n_cols = mat->n_cols;
+    qmat->storage = storage;
+    qmat->scales = NULL;
+    qmat->data = malloc(count * (storage == MAT_STORE_INT8 ? sizeof(signed char) : sizeof(unsigned short)) + 1);
+    if (storage == MAT_STORE_INT8)
+    {
+        qmat->scales = (float*)malloc(mat->n_rows * sizeof(float) + 1);
+    }
+    if (!qmat->data || (storage == MAT_STORE_INT8 && !qmat->scales))
+    {
+        MatQuantDestroy(qmat);
+        return NULL;
+    }
+
+    if (storage == MAT_STORE_INT8)
+    {
+        signed char* dst = (signed char*)qmat->data;
+
+        for (i = 0; i < mat->n_rows; i++)
+        {
+            const float* row = mat->data + i * mat->n_cols;
+            float max_abs = 0;
+            float inv = 0;
+
+            for (j = 0; j < mat->n_cols; j++)
+            {
+                float a = (float)fabs(row[j]);
+                max_abs = a > max_abs ? a : max_abs;
+            }
+            qmat->scales[i] = max_abs / INT8_MAX_LEVEL;
+            inv = max_abs > 0 ? INT8_MAX_LEVEL / max_abs : 0;
+
+            for (j = 0; j < mat->n_cols; j++)
+            {
+                float level = row[j] * inv;
+                level = level >= 0 ? (float)floor(level + 0.5) : -(float)floor(-level + 0.5);
+                dst[i * mat->n_cols + j] = (signed char)level;
+            }
+        }
+    }
+    else
+    {
+        unsigned short* dst = (unsigned short*)qmat->data;
+
+        for (i = 0; i < count; i++)
+        {
+            dst[i] = storage == MAT_STORE_FP16 ? FloatToHalf(mat->data[i]) : FloatToBf16(mat->data[i]);
+        }
+    }
+
+    return qmat;
+}
+
+void MatQuantDestroy(mat_quant_t* qmat)
+{
+    if (!qmat)
+    {
+        return;
+    }
+    free(qmat->data);
+    free(qmat->scales);
+    free(qmat);
+}
+
+matrix_t* MatDequantize(const mat_quant_t* qmat)
+{
+    matrix_t* result = MatCreate(qmat->n_rows, qmat->n_cols, NULL);
+    size_t i = 0;
+
+    if (!result)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < qmat->n_rows; i++)
+    {
+        QuantWiden(qmat, i, 0, qmat->n_cols, result->data + i * qmat->n_cols);
+    }
+
+    return result;
+}
+
+void MatQuantShape(const mat_quant_t* qmat, size_t dims[2])
+{
+    dims[0] = qmat->n_rows;
+    dims[1] = qmat->n_cols;
+}
+
+float MatQuantGetElem(const mat_quant_t* qmat, size_t row, size_t col)
+{
+    float value = 0;
+
+    if (row >= qmat->n_rows || col >= qmat->n_cols)
+    {
+        return 0.0;
+    }
+    QuantWiden(qmat, row, col, 1, &value);
+    return value;
+}
+
+matrix_t* MatQuantMult(const matrix_t* mat, const mat_quant_t* qmat)
+{
+    profile_mark_t mark;
+    matrix_t* result = NULL;
+    float wide[QUANT_TILE_COLS];
+    size_t n = mat->n_rows;
+    size_t k = mat->n_cols;
+    size_t m = qmat->n_cols;
+    size_t i0, j0, i, j, p = 0;
+
+    if (mat->layout != MAT_ROW_MAJOR)
+    {
+        matrix_t* rows = RowMajor(mat);
+
+        result = rows ? MatQuantMult(rows, qmat) : NULL;
+        MatDestroy(rows);
+        return result;
+    }
+    if (k != qmat->n_rows)
+    {
+        return NULL;
+    }
+
+    ProfileBegin(&mark);
+    result = MatCreate(n, m, NULL);
+    if (!result)
+    {
+        return NULL;
+    }
+
+    /* each quantized row segment is widened once per tile of result rows */
+    for (i0 = 0; i0 < n; i0 += QUANT_TILE_ROWS)
+    {
+        size_t i1 = i0 + QUANT_TILE_ROWS < n ? i0 + QUANT_TILE_ROWS : n;
+
+        for (j0 = 0; j0 < m; j0 += QUANT_TILE_COLS)
+        {
+            size_t width = j0 + QUANT_TILE_COLS < m ? QUANT_TILE_COLS : m - j0;
+
+            for (p = 0; p < k; p++)
+            {
+                QuantWiden(qmat, p, j0, width, wide);
+
+                for (i = i0; i < i1; i++)
+                {
+                    float a = mat->data[i * k + p];
+                    float* c = result->data + i * m + j0;
+
+                    for (j = 0; j < width; j++)
+                    {
+                        c[j] += a * wide[j];
+                    }
+                }
+            }
+        }
+    }
+
+    ProfileEnd(&mark, "MatQuantMult", n, k);
+    return result;
+}
+
+int MatQuantMatvec(const mat_quant_t* qmat, const float* x, float* y)
+{
+    float wide[QUANT_TILE_COLS];
+    size_t i, j, j0 = 0;
+
+    if (!qmat || !x || !y)
+    {
+        return 1;
+    }
+
+    for (i = 0; i < qmat->n_rows; i++)
+    {
+        float sum = 0;
+
+        if (qmat->storage == MAT_STORE_INT8)
+        {
+            const signed char* row = (const signed char*)qmat->data + i * qmat->n_cols;
+
+            for (j = 0; j < qmat->n_cols; j++)
+            {
+                sum += (float)row[j] * x[j];
+            }
+            y[i] = sum * qmat->scales[i];
+            continue;
+        }
+
+        for (j0 = 0; j0 < qmat->n_cols; j0 += QUANT_TILE_COLS)
+        {
+            size_t width = j0 + QUANT_TILE_COLS < qmat->n_cols ? QUANT_TILE_COLS : qmat->n_cols - j0;
+
+            QuantWiden(qmat, i, j0, width, wide);
+            sum += DotF(wide, x + j0, width);
+        }
+        y[i] = sum;
+    }
+
+    return 0;
+}
+
+
+
+/* ----------------------------- out-of-core ----------------------------- */
+
+#define DISK_MAGIC "MATD"
+#define DISK_MAGIC_SIZE 4
+#define DISK_DIM_BYTES 8
+#define DISK_HEADER_SIZE (DISK_MAGIC_SIZE + 2 * DISK_DIM_BYTES)
+#define DISK_TILES_IN_BUDGET 5 /* one result tile and two double-buffered operand tiles */
+
+struct mat_disk_t
+{
+    size_t n_rows;
+    size_t n_cols;
+    FILE* file;
+};
+
+/* the tiles of one k step of the product, loaded ahead of their use */
+typedef struct disk_prefetch_t
+{
+    const mat_disk_t* a;
+    const mat_disk_t* b;
+    size_t row;
+    size_t col;
+    size_t inner;
+    size_t n_rows;
+    size_t n_cols;
+    size_t n_inner;
+    float* a_tile;
+    float* b_tile;
+    int status;
+} disk_prefetch_t;
+
+static int DiskWriteDim(FILE* file, size_t dim)
+{
+    unsigned char bytes[DISK_DIM_BYTES];
+    size_t i = 0;
+
+    for (i = 0; i < DISK_DIM_BYTES; i++)
+    {
+        bytes[i] = (unsigned char)(dim & 0xff);
+        dim = (dim >> 4) >> 4; /* two shifts stay defined for a 32-bit size_t */
+    }
+    return fwrite(bytes, 1, DISK_DIM_BYTES, file) != DISK_DIM_BYTES;
+}
+
+static int DiskReadDim(FILE* file, size_t* dim)
+{
+    unsigned char bytes[DISK_DIM_BYTES];
+    size_t i = DISK_DIM_BYTES;
+
+    if (fread(bytes, 1, DISK_DIM_BYTES, file) != DISK_DIM_BYTES)
+    {
+        return 1;
+    }
+    *dim = 0;
+    while (i-- > 0)
+    {
+        *dim = ((*dim << 4) << 4) | bytes[i];
+    }
+    return 0;
+}
+
+/* largest off_t, whatever its width */
+#define DISK_OFF_MAX ((((off_t)1 << (sizeof(off_t) * CHAR_BIT - 2)) - 1) * 2 + 1)
+
+static int DiskSeek(const mat_disk_t* disk, size_t row, size_t col)
+{
+    off_t limit = (DISK_OFF_MAX - DISK_HEADER_SIZE) / (off_t)sizeof(float);
+    off_t n_cols = (off_t)disk->n_cols;
+
+    /* row * n_cols + col elements must fit in off_t after the header */
+    if ((off_t)row < 0 || (off_t)col < 0 || n_cols < 0 || (off_t)col > limit ||
+        (n_cols > 0 && (off_t)row > (limit - (off_t)col) / n_cols))
+    {
+        return 1;
+    }
+    return fseeko(disk->file, DISK_HEADER_SIZE + ((off_t)row * n_cols + (off_t)col) * (off_t)sizeof(float),
+                  SEEK_SET);
+}
+
+static int DiskReadTile(const mat_disk_t* disk, size_t row, size_t col, size_t n_rows, size_t n_cols, float* dst)
+{
+    size_t i = 0;
+
+    for (i = 0; i < n_rows; i++)
+    {
+        if (DiskSeek(disk, row + i, col) ||
+            fread(dst + i * n_cols, sizeof(float), n_cols, disk->file) != n_cols)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int DiskWriteTile(mat_disk_t* disk, size_t row, size_t col, size_t n_rows, size_t n_cols, const float* src)
+{
+    size_t i = 0;
+
+    for (i = 0; i < n_rows; i++)
+    {
+        if (DiskSeek(disk, row + i, col) ||
+            fwrite(src + i * n_cols, sizeof(float), n_cols, disk->file) != n_cols)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void* DiskPrefetch(void* arg)
+{
+    disk_prefetch_t* job = (disk_prefetch_t*)arg;
+
+    job->status = DiskReadTile(job->a, job->row, job->inner, job->n_rows, job->n_inner, job->a_tile) ||
+                  DiskReadTile(job->b, job->inner, job->col, job->n_inner, job->n_cols, job->b_tile);
+    return NULL;
+}
+
+mat_disk_t* MatDiskCreate(const char* path, size_t n_rows, size_t n_cols)
+{
+    mat_disk_t* disk = (mat_disk_t*)malloc(sizeof(mat_disk_t));
+    float zero = 0;
+
+    if (!disk)
+    {
+        return NULL;
+    }
+    disk->n_rows = n_rows;
+    disk->n_cols = n_cols;
+    disk->file = fopen(path, "w+b");
+    if (!disk->file)
+    {
+        free(disk);
+        return NULL;
+    }
+
+    /* writing the last element sizes the file, the gap reads back as zeros */
+    if (fwrite(DISK_MAGIC, 1, DISK_MAGIC_SIZE, disk->file) != DISK_MAGIC_SIZE ||
+        DiskWriteDim(disk->file, n_rows) || DiskWriteDim(disk->file, n_cols) ||
+        (n_rows * n_cols > 0 &&
+         (DiskSeek(disk, n_rows - 1, n_cols - 1) || fwrite(&zero, sizeof(float), 1, disk->file) != 1)))
+    {
+        MatDiskClose(disk);
+        return NULL;
+    }
+
+    return disk;
+}
+
+mat_disk_t* MatDiskOpen(const char* path)
+{
+    mat_disk_t* disk = (mat_disk_t*)malloc(sizeof(mat_disk_t));
+    char magic[DISK_MAGIC_SIZE];
+
+    if (!disk)
+    {
+        return NULL;
+    }
+    disk->file = fopen(path, "r+b");
+    if (!disk->file)
+    {
+        free(disk);
+        return NULL;
+    }
+
+    if (fread(magic, 1, DISK_MAGIC_SIZE, disk->file) != DISK_MAGIC_SIZE ||
+        memcmp(magic, DISK_MAGIC, DISK_MAGIC_SIZE) != 0 ||
+        DiskReadDim(disk->file, &disk->n_rows) || DiskReadDim(disk->file, &disk->n_cols))
+    {
+        MatDiskClose(disk);
+        return NULL;
+    }
+
+    return disk;
+}
+
+void MatDiskClose(mat_disk_t* disk)
+{
+    if (!disk)
+    {
+        return;
+    }
+    fclose(disk->file);
+    free(disk);
+}
+
+void MatDiskShape(const mat_disk_t* disk, size_t dims[2])
+{
+    dims[0] = disk->n_rows;
+    dims[1] = disk->n_cols;
+}
+
+matrix_t* MatDiskRead(const mat_disk_t* disk, size_t row, size_t col, size_t n_rows, size_t n_cols)
+{
+    matrix_t* tile = NULL;
+
+    if (row + n_rows > disk->n_rows || col + n_cols > disk->n_cols)
+    {
+        return NULL;
+    }
+
+    tile = MatCreate(n_rows, n_cols, NULL);
+    if (!tile)
+    {
+        return NULL;
+    }
+    if (DiskReadTile(disk, row, col, n_rows, n_cols, tile->data))
+    {
+        MatDestroy(tile);
+        return NULL;
+    }
+
+    return tile;
+}
+
+int MatDiskWrite(mat_disk_t* disk, size_t row, size_t col, const matrix_t* tile)
+{
+    if (tile->layout != MAT_ROW_MAJOR)
+    {
+        matrix_t* rows = RowMajor(tile);
+        int status = rows ? MatDiskWrite(disk, row, col, rows) : 1;
+
+        MatDestroy(rows);
+        return status;
+    }
+    if (row + tile->n_rows > disk->n_rows || col + tile->n_cols > disk->n_cols)
+    {
+        return 1;
+    }
+    if (DiskWriteTile(disk, row, col, tile->n_rows, tile->n_cols, tile->data))
+    {
+        return 1;
+    }
+    return fflush(disk->file) != 0;
+}
+
+mat_disk_t* MatDiskMult(const mat_disk_t* a, const mat_disk_t* b, const char* out_path, size_t mem_budget)
+{
+    mat_disk_t* c = NULL;
+    disk_prefetch_t jobs[2];
+    pthread_t thread;
+    float* c_tile = NULL;
+    size_t n = a->n_rows;
+    size_t k = a->n_cols;
+    size_t m = b->n_cols;
+    size_t tile = (size_t)sqrt((double)(mem_budget / sizeof(float) / DISK_TILES_IN_BUDGET));
+    size_t tiles_n, tiles_m, tiles_k, steps, step = 0;
+    int status = 0;
+
+    if (k != b->n_rows || tile == 0)
+    {
+        return NULL;
+    }
+
+    c = MatDiskCreate(out_path, n, m);
+    if (!c)
+    {
+        return NULL;
+    }
+    if (n == 0 || m == 0 || k == 0)
+    {
+        return c; /* already all zeros */
+    }
+
+    tiles_n = (n + tile - 1) / tile;
+    tiles_m = (m + tile - 1) / tile;
+    tiles_k = (k + tile - 1) / tile;
+    steps = tiles_n * tiles_m * tiles_k;
+
+    c_tile = (float*)malloc(tile * tile * sizeof(float));
+    jobs[0].a_tile = (float*)malloc(tile * tile * sizeof(float));
+    jobs[0].b_tile = (float*)malloc(tile * tile * sizeof(float));
+    jobs[1].a_tile = (float*)malloc(tile * tile * sizeof(float));
+    jobs[1].b_tile = (float*)malloc(tile * tile * sizeof(float));
+    status = !c_tile || !jobs[0].a_tile || !jobs[0].b_tile || !jobs[1].a_tile || !jobs[1].b_tile;
+
+    /* step s covers result tile (s / tiles_k) and inner tile (s % tiles_k);
+     * the operands of step s + 1 load on a second thread while s computes */
+    for (step = 0; !status && step <= steps; step++)
+    {
+        disk_prefetch_t* next = &jobs[step % 2];
+        disk_prefetch_t* current = &jobs[(step + 1) % 2];
+        int threaded = 0;
+
+        if (step < steps)
+        {
+            size_t out_tile = step / tiles_k;
+
+            next->a = a;
+            next->b = b;
+            next->row = (out_tile / tiles_m) * tile;
+            next->col = (out_tile % tiles_m) * tile;
+            next->inner = (step % tiles_k) * tile;
+            next->n_rows = next->row + tile < n ? tile : n - next->row;
+            next->n_cols = next->col + tile < m ? tile : m - next->col;
+            next->n_inner = next->inner + tile < k ? tile : k - next->inner;
+            threaded = step > 0 && pthread_create(&thread, NULL, DiskPrefetch, next) == 0;
+            if (!threaded)
+            {
+                DiskPrefetch(next);
+            }
+        }
+
+        if (step > 0)
+        {
+            if (current->inner == 0)
+            {
+                memset(c_tile, 0, current->n_rows * current->n_cols * sizeof(float));
+            }
+            GemmAccumulate(current->n_rows, current->n_inner, current->n_cols,
+                           current->a_tile, current->n_inner,
+                           current->b_tile, current->n_cols,
+                           c_tile, current->n_cols);
+            if (current->inner + current->n_inner == k)
+            {
+                status = DiskWriteTile(c, current->row, current->col, current->n_rows, current->n_cols, c_tile);
+            }
+        }
+
+        if (threaded)
+        {
+            pthread_join(thread, NULL);
+        }
+        if (step < steps)
+        {
+            status = status || next->status;
+        }
+    }
+
+    free(c_tile);
+    free(jobs[0].a_tile);
+    free(jobs[0].b_tile);
+    free(jobs[1].a_tile);
+    free(jobs[1].b_tile);
+
+    if (status || fflush(c->file) != 0)
+    {
+        MatDiskClose(c);
+        remove(out_path);
+        return NULL;
+    }
+
+    return c;
+}
+
+
+
+/* ------------------------------ reductions ------------------------------ */
+
+#define REPRO_BLOCK 4096 /* elements per partial sum, whatever the thread count */
+#define REPRO_ROWS 256   /* rows per partial column sum */
+#define TREE_DEPTH 64
+
+static int g_reproducible = 0;
+
+void MatSetReproducible(int enabled)
+{
+    g_reproducible = enabled != 0;
+}
+
+int MatGetReproducible(void)
+{
+    return g_reproducible;
+}
+
+/* Pairwise sum of a stream of values, combined like a binary counter:
+ * the shape of the tree depends on the number of values only. */
+typedef struct tree_sum_t
+{
+    double sums[TREE_DEPTH];
+    size_t sizes[TREE_DEPTH];
+    size_t depth;
+} tree_sum_t;
+
+static void TreePush(tree_sum_t* tree, double value)
+{
+    size_t size = 1;
+
+    while (tree->depth > 0 && tree->sizes[tree->depth - 1] == size)
+    {
+        --tree->depth;
+        value = tree->sums[tree->depth] + value;
+        size *= 2;
+    }
+    tree->sums[tree->depth] = value;
+    tree->sizes[tree->depth] = size;
+    ++tree->depth;
+}
+
+static double TreeFinish(tree_sum_t* tree)
+{
+    double value = 0;
+
+    if (tree->depth == 0)
+    {
+        return 0;
+    }
+    value = tree->sums[--tree->depth];
+    while (tree->depth > 0)
+    {
+        value = tree->sums[--tree->depth] + value;
+    }
+    return value;
+}
+
+/* Products of two floats are exact in double, so a fused multiply-add
+ * cannot change them and the fixed lane order fixes the sum. */
+static double DotExact(const float* x, const float* y, size_t n)
+{
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        s0 += (double)x[i] * (double)y[i];
+        s1 += (double)x[i + 1] * (double)y[i + 1];
+        s2 += (double)x[i + 2] * (double)y[i + 2];
+        s3 += (double)x[i + 3] * (double)y[i + 3];
+    }
+    for (; i < n; i++)
+    {
+        s0 += (double)x[i] * (double)y[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+typedef struct dot_job_t
+{
+    const float* x;
+    const float* y;
+    size_t n;
+    double* partials; /* one per REPRO_BLOCK block, or per worker */
+} dot_job_t;
+
+static void DotBlocksRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    dot_job_t* job = (dot_job_t*)arg;
+    size_t b = 0;
+
+    (void)worker;
+    for (b = begin; b < end; b++)
+    {
+        size_t first = b * REPRO_BLOCK;
+        size_t count = job->n - first < REPRO_BLOCK ? job->n - first : REPRO_BLOCK;
+
+        job->partials[b] = DotExact(job->x + first, job->y + first, count);
+    }
+}
+
+static void DotWorkerRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    dot_job_t* job = (dot_job_t*)arg;
+
+    job->partials[worker] = DotF(job->x + begin, job->y + begin, end - begin);
+}
+
+/* x . y per fixed block in double, combined by the fixed tree */
+static double SumProductsExact(const float* x, const float* y, size_t n)
+{
+    tree_sum_t tree;
+    dot_job_t job;
+    size_t n_blocks = (n + REPRO_BLOCK - 1) / REPRO_BLOCK;
+    size_t b = 0;
+
+    job.x = x;
+    job.y = y;
+    job.n = n;
+    tree.depth = 0;
+    job.partials = (double*)malloc(n_blocks * sizeof(double) + 1);
+    if (job.partials)
+    {
+        ParallelFor(n_blocks, PARALLEL_MIN_ELEMS / REPRO_BLOCK, DotBlocksRange, &job);
+        for (b = 0; b < n_blocks; b++)
+        {
+            TreePush(&tree, job.partials[b]);
+        }
+        free(job.partials);
+    }
+    else
+    {
+        /* the same blocks one at a time */
+        for (b = 0; b < n_blocks; b++)
+        {
+            size_t count = n - b * REPRO_BLOCK < REPRO_BLOCK ? n - b * REPRO_BLOCK : REPRO_BLOCK;
+
+            TreePush(&tree, DotExact(x + b * REPRO_BLOCK, y + b * REPRO_BLOCK, count));
+        }
+    }
+    return TreeFinish(&tree);
+}
+
+/* x . y: per worker in float by default, SumProductsExact in
+ * reproducible mode */
+static double SumProducts(const float* x, const float* y, size_t n)
+{
+    double partials[MAX_THREADS];
+    dot_job_t job;
+    size_t workers, w = 0;
+    float sum = 0;
+
+    if (g_reproducible)
+    {
+        return SumProductsExact(x, y, n);
+    }
+    job.x = x;
+    job.y = y;
+    job.n = n;
+    job.partials = partials;
+    workers = ParallelWorkers(n, PARALLEL_MIN_ELEMS);
+    ParallelForWorkers(n, workers, DotWorkerRange, &job);
+    for (w = 0; w < workers; w++)
+    {
+        sum += (float)partials[w];
+    }
+    return sum;
+}
+
+float MatNorm(const matrix_t* mat) 
+{
+    profile_mark_t mark;
+    double sum = 0;
+
+    ProfileBegin(&mark);
+    /* the sum of squares does not care about the order of the elements */
+    sum = SumProducts(mat->data, mat->data, mat->n_rows * mat->n_cols);
+    ProfileEnd(&mark, "MatNorm", mat->n_rows, mat->n_cols);
+    return (float)sqrt(sum);
+}
+
+float MatDot(const matrix_t* mat1, const matrix_t* mat2)
+{
+    profile_mark_t mark;
+    matrix_t* converted = NULL;
+    const float* data2 = mat2->data;
+    double sum = 0;
+
+    if (mat1->n_rows != mat2->n_rows || mat1->n_cols != mat2->n_cols)
+    {
+        return 0;
+    }
+    ProfileBegin(&mark);
+    if (mat1->layout != mat2->layout)
+    {
+        converted = MatConvertLayout(mat2, mat1->layout);
+        if (!converted)
+        {
+            return 0;
+        }
+        data2 = converted->data;
+    }
+    sum = SumProducts(mat1->data, data2, mat1->n_rows * mat1->n_cols);
+    MatDestroy(converted);
+    ProfileEnd(&mark, "MatDot", mat1->n_rows, mat1->n_cols);
+    return (float)sum;
+}
+
+#define REDUCE_LANES 8
+
+typedef struct reduce_ctx_t
+{
+    const matrix_t* mat;
+    mat_reduce_t op;
+    int is_arg;
+    float* values;   /* rows: one per row, cols: one n_cols strip per worker */
+    size_t* indices; /* same shape as values, arg reductions only */
+} reduce_ctx_t;
+
+/* sum, min or max of x[0..n) over independent lanes so it vectorizes */
+static float ReduceSpan(const float* x, size_t n, mat_reduce_t op)
+{
+    float lanes[REDUCE_LANES];
+    float result = 0;
+    size_t i, l = 0;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+    for (l = 0; l < REDUCE_LANES; l++)
+    {
+        lanes[l] = (op == MAT_REDUCE_SUM || op == MAT_REDUCE_MEAN) ? 0 : x[0];
+    }
+
+    i = 0;
+    if (op == MAT_REDUCE_MIN)
+    {
+        for (; i + REDUCE_LANES <= n; i += REDUCE_LANES)
+        {
+            for (l = 0; l < REDUCE_LANES; l++)
+            {
+                lanes[l] = x[i + l] < lanes[l] ? x[i + l] : lanes[l];
+            }
+        }
+        for (; i < n; i++)
+        {
+            lanes[0] = x[i] < lanes[0] ? x[i] : lanes[0];
+        }
+        for (result = lanes[0], l = 1; l < REDUCE_LANES; l++)
+        {
+            result = lanes[l] < result ? lanes[l] : result;
+        }
+    }
+    else if (op == MAT_REDUCE_MAX)
+    {
+        for (; i + REDUCE_LANES <= n; i += REDUCE_LANES)
+        {
+            for (l = 0; l < REDUCE_LANES; l++)
+            {
+                lanes[l] = x[i + l] > lanes[l] ? x[i + l] : lanes[l];
+            }
+        }
+        for (; i < n; i++)
+        {
+            lanes[0] = x[i] > lanes[0] ? x[i] : lanes[0];
+        }
+        for (result = lanes[0], l = 1; l < REDUCE_LANES; l++)
+        {
+            result = lanes[l] > result ? lanes[l] : result;
+        }
+    }
+    else
+    {
+        for (; i + REDUCE_LANES <= n; i += REDUCE_LANES)
+        {
+            for (l = 0; l < REDUCE_LANES; l++)
+            {
+                lanes[l] += x[i + l];
+            }
+        }
+        for (; i < n; i++)
+        {
+            lanes[0] += x[i];
+        }
+        result = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+                 ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+        if (op == MAT_REDUCE_MEAN)
+        {
+            result /= (float)n;
+        }
+    }
+
+    return result;
+}
+
+/* first index of the min or max of x: a vectorized reduce then a scan */
+static size_t ArgSpan(const float* x, size_t n, mat_reduce_t op)
+{
+    float best = ReduceSpan(x, n, op);
+    size_t i = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (x[i] == best)
+        {
+            return i;
+        }
+    }
+    return 0; /* only reached when x holds NaNs */
+}
+
+static void RowReduceRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    reduce_ctx_t* ctx = (reduce_ctx_t*)arg;
+    size_t n_cols = ctx->mat->n_cols;
+    size_t i = 0;
+
+    (void)worker;
+    for (i = begin; i < end; i++)
+    {
+        const float* row = ctx->mat->data + i * n_cols;
+
+        if (ctx->is_arg)
+        {
+            ctx->indices[i] = ArgSpan(row, n_cols, ctx->op);
+        }
+        else
+        {
+            ctx->values[i] = ReduceSpan(row, n_cols, ctx->op);
+        }
+    }
+}
+
+/* each worker folds its rows into its own strip of per-column results,
+ * walking every row contiguously so the accumulation vectorizes */
+static void ColReduceRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    reduce_ctx_t* ctx = (reduce_ctx_t*)arg;
+    size_t n_cols = ctx->mat->n_cols;
+    float* acc = ctx->values + worker * n_cols;
+    size_t* idx = ctx->indices ? ctx->indices + worker * n_cols : NULL;
+    size_t i, j = 0;
+
+    memcpy(acc, ctx->mat->data + begin * n_cols, n_cols * sizeof(float));
+    if (ctx->op == MAT_REDUCE_SUM || ctx->op == MAT_REDUCE_MEAN)
+    {
+        for (i = begin + 1; i < end; i++)
+        {
+            const float* row = ctx->mat->data + i * n_cols;
+
+            for (j = 0; j < n_cols; j++)
+            {
+                acc[j] += row[j];
+            }
+        }
+        return;
+    }
+
+    if (idx)
+    {
+        for (j = 0; j < n_cols; j++)
+        {
+            idx[j] = begin;
+        }
+    }
+    for (i = begin + 1; i < end; i++)
+    {
+        const float* row = ctx->mat->data + i * n_cols;
+
+        if (idx)
+        {
+            for (j = 0; j < n_cols; j++)
+            {
+                int better = ctx->op == MAT_REDUCE_MIN ? row[j] < acc[j] : row[j] > acc[j];
+
+                acc[j] = better ? row[j] : acc[j];
+                idx[j] = better ? i : idx[j];
+            }
+        }
+        else if (ctx->op == MAT_REDUCE_MIN)
+        {
+            for (j = 0; j < n_cols; j++)
+            {
+                acc[j] = row[j] < acc[j] ? row[j] : acc[j];
+            }
+        }
+        else
+        {
+            for (j = 0; j < n_cols; j++)
+            {
+                acc[j] = row[j] > acc[j] ? row[j] : acc[j];
+            }
+        }
+    }
+}
+
+typedef struct col_sum_job_t
+{
+    const matrix_t* mat;
+    float* partials; /* n_cols sums per block of REPRO_ROWS rows */
+} col_sum_job_t;
+
+static void ColBlocksRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    col_sum_job_t* job = (col_sum_job_t*)arg;
+    size_t n_rows = job->mat->n_rows;
+    size_t n_cols = job->mat->n_cols;
+    size_t b, i, j = 0;
+
+    (void)worker;
+    for (b = begin; b < end; b++)
+    {
+        size_t first = b * REPRO_ROWS;
+        size_t last = n_rows - first < REPRO_ROWS ? n_rows : first + REPRO_ROWS;
+        float* acc = job->partials + b * n_cols;
+
+        memcpy(acc, job->mat->data + first * n_cols, n_cols * sizeof(float));
+        for (i = first + 1; i < last; i++)
+        {
+            const float* row = job->mat->data + i * n_cols;
+
+            for (j = 0; j < n_cols; j++)
+            {
+                acc[j] += row[j];
+            }
+        }
+    }
+}
+
+/* column sums of the reproducible mode: fixed blocks of rows, then a
+ * pairwise tree over the blocks, level by level */
+static int ColSumsReproducible(const matrix_t* mat, float* sums)
+{
+    col_sum_job_t job;
+    size_t n_cols = mat->n_cols;
+    size_t n_blocks = (mat->n_rows + REPRO_ROWS - 1) / REPRO_ROWS;
+    size_t width, b, j = 0;
+
+    job.mat = mat;
+    job.partials = (float*)malloc(n_blocks * n_cols * sizeof(float) + 1);
+    if (!job.partials)
+    {
+        return 1;
+    }
+    ParallelFor(n_blocks, RowsPerWorker(n_cols) / REPRO_ROWS + 1, ColBlocksRange, &job);
+    for (width = 1; width < n_blocks; width *= 2)
+    {
+        for (b = 0; b + width < n_blocks; b += 2 * width)
+        {
+            float* left = job.partials + b * n_cols;
+            const float* right = job.partials + (b + width) * n_cols;
+
+            for (j = 0; j < n_cols; j++)
+            {
+                left[j] += right[j];
+            }
+        }
+    }
+    memcpy(sums, job.partials, n_cols * sizeof(float));
+    free(job.partials);
+    return 0;
+}
+
+static int ColReduce(const matrix_t* mat, mat_reduce_t op, float* values, size_t* indices)
+{
+    reduce_ctx_t ctx;
+    size_t n_cols = mat->n_cols;
+    size_t min_rows = RowsPerWorker(n_cols);
+    size_t workers = ParallelWorkers(mat->n_rows, min_rows);
+    size_t w, j = 0;
+
+    if (g_reproducible && values && !indices && (op == MAT_REDUCE_SUM || op == MAT_REDUCE_MEAN))
+    {
+        if (ColSumsReproducible(mat, values))
+        {
+            return 1;
+        }
+        for (j = 0; op == MAT_REDUCE_MEAN && j < n_cols; j++)
+        {
+            values[j] /= (float)mat->n_rows;
+        }
+        return 0;
+    }
+
+    ctx.mat = mat;
+    ctx.op = op;
+    ctx.is_arg = indices != NULL;
+    ctx.values = (float*)malloc(workers * n_cols * sizeof(float) + 1);
+    ctx.indices = indices ? (size_t*)malloc(workers * n_cols * sizeof(size_t) + 1) : NULL;
+    if (!ctx.values || (indices && !ctx.indices))
+    {
+        free(ctx.values);
+        free(ctx.indices);
+        return 1;
+    }
+
+    ParallelForWorkers(mat->n_rows, workers, ColReduceRange, &ctx);
+
+    /* workers hold consecutive row ranges, so on ties the earlier one wins */
+    for (w = 1; w < workers; w++)
+    {
+        const float* part = ctx.values + w * n_cols;
+        const size_t* part_idx = ctx.indices ? ctx.indices + w * n_cols : NULL;
+
+        for (j = 0; j < n_cols; j++)
+        {
+            int better = 0;
+
+            if (op == MAT_REDUCE_SUM || op == MAT_REDUCE_MEAN)
+            {
+                ctx.values[j] += part[j];
+                continue;
+            }
+            better = op == MAT_REDUCE_MIN ? part[j] < ctx.values[j] : part[j] > ctx.values[j];
+            if (better)
+            {
+                ctx.values[j] = part[j];
+                if (part_idx)
+                {
+                    ctx.indices[j] = part_idx[j];
+                }
+            }
+        }
+    }
+
+    for (j = 0; j < n_cols; j++)
+    {
+        if (values)
+        {
+            values[j] = op == MAT_REDUCE_MEAN ? ctx.values[j] / (float)mat->n_rows : ctx.values[j];
+        }
+        if (indices)
+        {
+            indices[j] = ctx.indices[j];
+        }
+    }
+
+    free(ctx.values);
+    free(ctx.indices);
+    return 0;
+}
+
+static int IsReduceOp(mat_reduce_t op)
+{
+    return op == MAT_REDUCE_SUM || op == MAT_REDUCE_MIN || op == MAT_REDUCE_MAX || op == MAT_REDUCE_MEAN;
+}
+
+matrix_t* MatRowReduce(const matrix_t* mat, mat_reduce_t op)
+{
+    profile_mark_t mark;
+    matrix_t* result = NULL;
+    reduce_ctx_t ctx;
+
+    if (!IsReduceOp(op))
+    {
+        return NULL;
+    }
+
+    /* the rows of column-major data are the columns of what is stored,
+     * and a vector is laid out the same either way */
+    if (mat->layout == MAT_COL_MAJOR)
+    {
+        matrix_t view = StorageView(mat);
+
+        result = MatColReduce(&view, op);
+        if (result)
+        {
+            result->n_rows = mat->n_rows;
+            result->n_cols = 1;
+        }
+        return result;
+    }
+    ProfileBegin(&mark);
+    result = MatCreate(mat->n_rows, 1, NULL);
+    if (!result)
+    {
+        return NULL;
+    }
+
+    ctx.mat = mat;
+    ctx.op = op;
+    ctx.is_arg = 0;
+    ctx.values = result->data;
+    ctx.indices = NULL;
+    ParallelFor(mat->n_rows, RowsPerWorker(mat->n_cols), RowReduceRange, &ctx);
+
+    ProfileEnd(&mark, "MatRowReduce", mat->n_rows, mat->n_cols);
+    return result;
+}
+
+matrix_t* MatColReduce(const matrix_t* mat, mat_reduce_t op)
+{
+    profile_mark_t mark;
+    matrix_t* result = NULL;
+
+    if (!IsReduceOp(op))
+    {
+        return NULL;
+    }
+    if (mat->layout == MAT_COL_MAJOR)
+    {
+        matrix_t view = StorageView(mat);
+
+        result = MatRowReduce(&view, op);
+        if (result)
+        {
+            result->n_rows = 1;
+            result->n_cols = mat->n_cols;
+        }
+        return result;
+    }
+    ProfileBegin(&mark);
+    result = MatCreate(1, mat->n_cols, NULL);
+    if (!result)
+    {
+        return NULL;
+    }
+
+    if (mat->n_rows > 0 && ColReduce(mat, op, result->data, NULL))
+    {
+        MatDestroy(result);
+        return NULL;
+    }
+
+    ProfileEnd(&mark, "MatColReduce", mat->n_rows, mat->n_cols);
+    return result;
+}
+
+int MatRowArgReduce(const matrix_t* mat, mat_reduce_t op, size_t* indices)
+{
+    reduce_ctx_t ctx;
+
+    if (op != MAT_REDUCE_MIN && op != MAT_REDUCE_MAX)
+    {
+        return 1;
+    }
+    if (mat->layout == MAT_COL_MAJOR)
+    {
+        matrix_t view = StorageView(mat);
+
+        return MatColArgReduce(&view, op, indices);
+    }
+
+    ctx.mat = mat;
+    ctx.op = op;
+    ctx.is_arg = 1;
+    ctx.values = NULL;
+    ctx.indices = indices;
+    ParallelFor(mat->n_rows, RowsPerWorker(mat->n_cols), RowReduceRange, &ctx);
+
+    return 0;
+}
+
+int MatColArgReduce(const matrix_t* mat, mat_reduce_t op, size_t* indices)
+{
+    if (op != MAT_REDUCE_MIN && op != MAT_REDUCE_MAX)
+    {
+        return 1;
+    }
+    if (mat->layout == MAT_COL_MAJOR)
+    {
+        matrix_t view = StorageView(mat);
+
+        return MatRowArgReduce(&view, op, indices);
+    }
+    if (mat->n_rows == 0)
+    {
+        memset(indices, 0, mat->n_cols * sizeof(size_t));
+        return 0;
+    }
+    return ColReduce(mat, op, NULL, indices);
+}
+
+
+
+/* --------------------------- element-wise map --------------------------- */
+
+#define EXP_MAX_ARG 88.72F
+#define EXP_MIN_ARG -87.33F
+#define TANH_SMALL_ARG 0.25F
+#define TANH_SATURATE_ARG 9.0F
+#define ROUND_MAGIC 12582912.0F /* 1.5 * 2^23, adding it rounds to an integer */
+#define LOG2_E 1.44269504F
+#define LN2_HI 0.693145752F
+#define LN2_LO 1.42860677e-6F
+#define LN2 0.693147181F
+#define SQRT2 1.41421356F
+#define APPLY_BLOCK 256
+
+typedef struct apply_ctx_t
+{
+    const float* src;
+    float* dst;
+    size_t n_cols;
+    mat_func_t fn;
+    float lo;
+    float hi;
+    mat_row_fn row_fn;
+    void* user_ctx;
+} apply_ctx_t;
+
+/* all ones where cond holds; SelectBits(mask, a, b) is a where mask is
+ * set, else b. Selecting on bits keeps gcc from turning a float ?: back
+ * into a branch around the arithmetic of one arm. */
+static unsigned int CondMask(int cond)
+{
+    return 0U - (unsigned int)cond;
+}
+
+static unsigned int SelectBits(unsigned int mask, unsigned int a, unsigned int b)
+{
+    return (a & mask) | (b & ~mask);
+}
+
+/* e^x as 2^n * e^r with |r| <= ln2 / 2 and a degree 6 polynomial for e^r.
+ * The kernels below have no branches and a fixed trip count: special
+ * inputs are patched with masks so each loop vectorizes. */
+static void ExpBlock(const float* MAT_RESTRICT x, float* MAT_RESTRICT y)
+{
+    size_t i = 0;
+
+    for (i = 0; i < APPLY_BLOCK; i++)
+    {
+        unsigned int bits = FloatBits(x[i]);
+        unsigned int nan = CondMask(x[i] != x[i]);
+        unsigned int over = CondMask(x[i] > EXP_MAX_ARG);
+        unsigned int under = CondMask(x[i] < EXP_MIN_ARG);
+        /* clamped into range, NaN as 0 so the conversion to int is defined */
+        float v = BitsFloat(SelectBits(over, FloatBits(EXP_MAX_ARG),
+                                       SelectBits(under, FloatBits(EXP_MIN_ARG), bits & ~nan)));
+        float n = (v * LOG2_E + ROUND_MAGIC) - ROUND_MAGIC;
+        float r = (v - n * LN2_HI) - n * LN2_LO;
+        float p = 1.0F / 720;
+        int half = (int)n / 2;
+        int rest = (int)n - half;
+
+        p = p * r + 1.0F / 120;
+        p = p * r + 1.0F / 24;
+        p = p * r + 1.0F / 6;
+        p = p * r + 0.5F;
+        p = p * r + 1.0F;
+        p = p * r + 1.0F;
+
+        /* 2^n in two factors, as 2^128 and 2^-127 are no normal floats */
+        p = p * BitsFloat((unsigned int)(half + 127) << 23) * BitsFloat((unsigned int)(rest + 127) << 23);
+
+        y[i] = BitsFloat(SelectBits(nan, bits, SelectBits(over, 0x7f800000U, FloatBits(p) & ~under)));
+    }
+}
+
+/* ln x as e * ln2 + ln m with m in [sqrt(2) / 2, sqrt(2)) via an atanh series */
+static void LogBlock(const float* MAT_RESTRICT x, float* MAT_RESTRICT y)
+{
+    size_t i = 0;
+
+    for (i = 0; i < APPLY_BLOCK; i++)
+    {
+        unsigned int input = FloatBits(x[i]);
+        unsigned int subnormal = CondMask(input < 0x00800000U);
+        /* 2^23 lifts a subnormal into the normal range */
+        unsigned int bits = SelectBits(subnormal, FloatBits(x[i] * 8388608.0F), input);
+        unsigned int high = CondMask((bits & 0x7fffffU) > (FloatBits(SQRT2) & 0x7fffffU));
+        int e = (int)((bits >> 23) & 0xff) - 127 + (int)(high & 1) - (int)(subnormal & 23);
+        float m = BitsFloat((bits & 0x7fffffU) | SelectBits(high, 0x3f000000U, 0x3f800000U));
+        float s = (m - 1.0F) / (m + 1.0F);
+        float s2 = s * s;
+        float p = 1.0F / 9;
+        unsigned int result = 0;
+
+        p = p * s2 + 1.0F / 7;
+        p = p * s2 + 1.0F / 5;
+        p = p * s2 + 1.0F / 3;
+        p = p * s2 + 1.0F;
+        result = FloatBits((float)e * LN2 + 2.0F * s * p);
+
+        /* NaN and negatives give NaN, inf stays inf, zeros give -inf */
+        result = SelectBits(CondMask(input > 0x7f800000U), 0x7fc00000U, result);
+        result = SelectBits(CondMask(input == 0x7f800000U), input, result);
+        result = SelectBits(CondMask((input & 0x7fffffffU) == 0), 0xff800000U, result);
+        y[i] = BitsFloat(result);
+    }
+}
+
+/* tanh |x| as 1 - 2 / (e^2|x| + 1), a series near 0; |x| > 9 saturates */
+static void TanhBlock(const float* MAT_RESTRICT x, float* MAT_RESTRICT y)
+{
+    float args[APPLY_BLOCK];
+    float exps[APPLY_BLOCK];
+    size_t i = 0;
+
+    for (i = 0; i < APPLY_BLOCK; i++)
+    {
+        unsigned int a = FloatBits(x[i]) & 0x7fffffffU;
+        unsigned int saturated = CondMask(BitsFloat(a) > TANH_SATURATE_ARG);
+
+        args[i] = 2.0F * BitsFloat(SelectBits(saturated, FloatBits(TANH_SATURATE_ARG), a));
+    }
+    ExpBlock(args, exps);
+    for (i = 0; i < APPLY_BLOCK; i++)
+    {
+        unsigned int sign = FloatBits(x[i]) & 0x80000000U;
+        float a = BitsFloat(FloatBits(x[i]) & 0x7fffffffU);
+        float a2 = a * a;
+        float p = 62.0F / 2835;
+        unsigned int t = FloatBits(1.0F - 2.0F / (exps[i] + 1.0F));
+
+        p = p * a2 - 17.0F / 315;
+        p = p * a2 + 2.0F / 15;
+        p = p * a2 - 1.0F / 3;
+        t = SelectBits(CondMask(a < TANH_SMALL_ARG), FloatBits(a + a * a2 * p), t);
+        t = SelectBits(CondMask(a > TANH_SATURATE_ARG), FloatBits(1.0F), t);
+        y[i] = BitsFloat(t | sign);
+    }
+}
+
+static void SigmoidBlock(const float* MAT_RESTRICT x, float* MAT_RESTRICT y)
+{
+    float args[APPLY_BLOCK];
+    float exps[APPLY_BLOCK];
+    size_t i = 0;
+
+    for (i = 0; i < APPLY_BLOCK; i++)
+    {
+        args[i] = -x[i];
+    }
+    ExpBlock(args, exps);
+    for (i = 0; i < APPLY_BLOCK; i++)
+    {
+        y[i] = 1.0F / (1.0F + exps[i]);
+    }
+}
+
+/* exp, log, tanh and sigmoid through their block kernels, the last block
+ * zero padded; the kernels write to a local buffer so no aliasing check
+ * stands in the way of vectorizing */
+static void ApplyBlocks(const float* src, float* dst, size_t n, void (*kernel)(const float*, float*))
+{
+    float in[APPLY_BLOCK];
+    float out[APPLY_BLOCK];
+    size_t start = 0;
+
+    for (start = 0; start < n; start += APPLY_BLOCK)
+    {
+        size_t len = n - start < APPLY_BLOCK ? n - start : APPLY_BLOCK;
+
+        if (len == APPLY_BLOCK)
+        {
+            kernel(src + start, out);
+        }
+        else
+        {
+            memset(in, 0, sizeof(in));
+            memcpy(in, src + start, len * sizeof(float));
+            kernel(in, out);
+        }
+        memcpy(dst + start, out, len * sizeof(float));
+    }
+}
+
+static void ApplySpan(const float* src, float* dst, size_t n, mat_func_t fn, float lo, float hi)
+{
+    size_t i = 0;
+
+    switch (fn)
+    {
+        case MAT_FN_EXP:
+            ApplyBlocks(src, dst, n, ExpBlock);
+            break;
+        case MAT_FN_LOG:
+            ApplyBlocks(src, dst, n, LogBlock);
+            break;
+        case MAT_FN_TANH:
+            ApplyBlocks(src, dst, n, TanhBlock);
+            break;
+        case MAT_FN_SIGMOID:
+            ApplyBlocks(src, dst, n, SigmoidBlock);
+            break;
+        case MAT_FN_RELU:
+            for (i = 0; i < n; i++)
+            {
+                dst[i] = src[i] > 0 ? src[i] : 0;
+            }
+            break;
+        case MAT_FN_ABS:
+            for (i = 0; i < n; i++)
+            {
+                dst[i] = src[i] < 0 ? -src[i] : src[i];
+            }
+            break;
+        case MAT_FN_CLAMP:
+            for (i = 0; i < n; i++)
+            {
+                float v = src[i] < lo ? lo : src[i];
+                dst[i] = v > hi ? hi : v;
+            }
+            break;
+    }
+}
+
+static void ApplyRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    apply_ctx_t* ctx = (apply_ctx_t*)arg;
+
+    (void)worker;
+    ApplySpan(ctx->src + begin, ctx->dst + begin, end - begin, ctx->fn, ctx->lo, ctx->hi);
+}
+
+static void ApplyRowsRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    apply_ctx_t* ctx = (apply_ctx_t*)arg;
+    size_t i = 0;
+
+    (void)worker;
+    for (i = begin; i < end; i++)
+    {
+        ctx->row_fn(ctx->src + i * ctx->n_cols, ctx->dst + i * ctx->n_cols, ctx->n_cols, ctx->user_ctx);
+    }
+}
+
+static matrix_t* MatApplyBounded(const matrix_t* mat, mat_func_t fn, float lo, float hi)
+{
+    matrix_t* result = NULL;
+    apply_ctx_t ctx;
+
+    if (fn < MAT_FN_EXP || fn > MAT_FN_CLAMP)
+    {
+        return NULL;
+    }
+    result = MatCreate(mat->n_rows, mat->n_cols, NULL);
+    if (!result)
+    {
+        return NULL;
+    }
+
+    result->layout = mat->layout;
+    ctx.src = mat->data;
+    ctx.dst = result->data;
+    ctx.fn = fn;
+    ctx.lo = lo;
+    ctx.hi = hi;
+    ParallelFor(mat->n_rows * mat->n_cols, PARALLEL_MIN_ELEMS, ApplyRange, &ctx);
+
+    return result;
+}
+
+matrix_t* MatApply(const matrix_t* mat, mat_func_t fn)
+{
+    if (fn == MAT_FN_CLAMP)
+    {
+        return NULL;
+    }
+    return MatApplyBounded(mat, fn, 0, 0);
+}
+
+matrix_t* MatClamp(const matrix_t* mat, float lo, float hi)
+{
+    if (lo > hi)
+    {
+        return NULL;
+    }
+    return MatApplyBounded(mat, MAT_FN_CLAMP, lo, hi);
+}
+
+matrix_t* MatApplyRows(const matrix_t* mat, mat_row_fn fn, void* ctx)
+{
+    matrix_t* result = NULL;
+    apply_ctx_t apply;
+
+    if (mat->layout != MAT_ROW_MAJOR)
+    {
+        matrix_t* rows = RowMajor(mat);
+
+        result = rows ? MatApplyRows(rows, fn, ctx) : NULL;
+        MatDestroy(rows);
+        return result;
+    }
+
+    result = MatCreate(mat->n_rows, mat->n_cols, NULL);
+    if (!result)
+    {
+        return NULL;
+    }
+
+    apply.src = mat->data;
+    apply.dst = result->data;
+    apply.n_cols = mat->n_cols;
+    apply.row_fn = fn;
+    apply.user_ctx = ctx;
+    ParallelFor(mat->n_rows, RowsPerWorker(mat->n_cols), ApplyRowsRange, &apply);
+
+    return result;
+}
+
+
+
+/* ------------------------------ QR / least squares ------------------------------ */
+
+#define QR_BLOCK 32
+
+/* Householder QR in LAPACK's blocked form: every QR_BLOCK reflectors
+ * H_j = I - tau_j v_j v_j^T are aggregated as I - V T V^T (compact WY)
+ * so the trailing matrix is updated with matrix-matrix products. */
+struct mat_qr_t
+{
+    size_t n_rows;
+    size_t n_cols;
+    size_t n_reflectors; /* min(n_rows, n_cols) */
+    float* fact;         /* R on and above the diagonal, v_j below it */
+    float* tau;
+    float* t;            /* one QR_BLOCK * QR_BLOCK T per block of reflectors */
+};
+
+/* turns the column below a[0] (stride lda, m elements) into v with an
+ * implicit leading 1 and leaves beta in a[0] */
+static float HouseholderColumn(float* a, size_t lda, size_t m)
+{
+    double norm2 = 0;
+    double alpha = a[0];
+    double beta = 0;
+    float scale = 0;
+    size_t i = 0;
+
+    for (i = 1; i < m; i++)
+    {
+        norm2 += (double)a[i * lda] * a[i * lda];
+    }
+    if (norm2 == 0)
+    {
+        return 0;
+    }
+
+    beta = sqrt(alpha * alpha + norm2);
+    beta = alpha >= 0 ? -beta : beta;
+    scale = (float)(1.0 / (alpha - beta));
+    for (i = 1; i < m; i++)
+    {
+        a[i * lda] *= scale;
+    }
+    a[0] = (float)beta;
+
+    return (float)((beta - alpha) / beta);
+}
+
+/* copies reflectors [j0, j0 + jb) as an explicit (n_rows - j0) * jb V */
+static void QRExtractV(const mat_qr_t* qr, size_t j0, size_t jb, float* v)
+{
+    size_t rows = qr->n_rows - j0;
+    size_t r, i = 0;
+
+    for (r = 0; r < rows; r++)
+    {
+        for (i = 0; i < jb; i++)
+        {
+            float value = r == i ? 1.0F : 0.0F;
+
+            if (r > i)
+            {
+                value = qr->fact[(j0 + r) * qr->n_cols + j0 + i];
+            }
+            v[r * jb + i] = value;
+        }
+    }
+}
+
+/* C = (I - V T V^T) C, or its transpose, for the rows * nc block c;
+ * w is jb * nc scratch */
+static void QRApplyBlock(const float* v, const float* t, size_t rows, size_t jb,
+                         float* c, size_t ldc, size_t nc, float* w, int transpose)
+{
+    size_t r, i, l, j = 0;
+
+    memset(w, 0, jb * nc * sizeof(float));
+    for (r = 0; r < rows; r++)
+    {
+        const float* c_row = c + r * ldc;
+
+        for (i = 0; i < jb; i++)
+        {
+            float v_ri = v[r * jb + i];
+            float* w_row = w + i * nc;
+
+            if (v_ri == 0)
+            {
+                continue;
+            }
+            for (j = 0; j < nc; j++)
+            {
+                w_row[j] += v_ri * c_row[j];
+            }
+        }
+    }
+
+    /* w = T w or T^T w in place, T is upper triangular */
+    if (transpose)
+    {
+        for (i = jb; i-- > 0;)
+        {
+            float* w_row = w + i * nc;
+
+            for (j = 0; j < nc; j++)
+            {
+                w_row[j] *= t[i * QR_BLOCK + i];
+            }
+            for (l = 0; l < i; l++)
+            {
+                float t_li = t[l * QR_BLOCK + i];
+                const float* w_l = w + l * nc;
+
+                for (j = 0; j < nc; j++)
+                {
+                    w_row[j] += t_li * w_l[j];
+                }
+            }
+        }
+    }
+    else
+    {
+        for (i = 0; i < jb; i++)
+        {
+            float* w_row = w + i * nc;
+
+            for (j = 0; j < nc; j++)
+            {
+                w_row[j] *= t[i * QR_BLOCK + i];
+            }
+            for (l = i + 1; l < jb; l++)
+            {
+                float t_il = t[i * QR_BLOCK + l];
+                const float* w_l = w + l * nc;
+
+                for (j = 0; j < nc; j++)
+                {
+                    w_row[j] += t_il * w_l[j];
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < jb * nc; i++)
+    {
+        w[i] = -w[i];
+    }
+    GemmAccumulate(rows, jb, nc, v, jb, w, nc, c, ldc);
+}
+
+/* T of the block starting at reflector j0 (LAPACK larft, forward columnwise) */
+static void QRFormT(const mat_qr_t* qr, const float* v, size_t j0, size_t jb, float* t)
+{
+    size_t rows = qr->n_rows - j0;
+    float gram[QR_BLOCK * QR_BLOCK];
+    float z[QR_BLOCK];
+    size_t r, i, l, p = 0;
+
+    memset(gram, 0, sizeof(gram));
+    for (r = 0; r < rows; r++)
+    {
+        const float* v_row = v + r * jb;
+
+        for (l = 0; l < jb; l++)
+        {
+            for (i = l + 1; i < jb; i++)
+            {
+                gram[l * QR_BLOCK + i] += v_row[l] * v_row[i];
+            }
+        }
+    }
+
+    memset(t, 0, QR_BLOCK * QR_BLOCK * sizeof(float));
+    for (i = 0; i < jb; i++)
+    {
+        float tau = qr->tau[j0 + i];
+
+        t[i * QR_BLOCK + i] = tau;
+        for (l = 0; l < i; l++)
+        {
+            z[l] = -tau * gram[l * QR_BLOCK + i];
+        }
+        for (l = 0; l < i; l++)
+        {
+            float sum = 0;
+
+            for (p = l; p < i; p++)
+            {
+                sum += t[l * QR_BLOCK + p] * z[p];
+            }
+            t[l * QR_BLOCK + i] = sum;
+        }
+    }
+}
+
+static size_t QRBlocks(const mat_qr_t* qr)
+{
+    return (qr->n_reflectors + QR_BLOCK - 1) / QR_BLOCK;
+}
+
+/* c = Q^T c (transpose) or Q c for an n_rows * nc row-major c */
+static int QRApply(const mat_qr_t* qr, float* c, size_t nc, int transpose)
+{
+    size_t blocks = QRBlocks(qr);
+    float* v = (float*)malloc(qr->n_rows * QR_BLOCK * sizeof(float) + 1);
+    float* w = (float*)malloc(QR_BLOCK * nc * sizeof(float) + 1);
+    size_t b = 0;
+
+    if (!v || !w)
+    {
+        free(v);
+        free(w);
+        return 1;
+    }
+
+    for (b = 0; b < blocks; b++)
+    {
+        size_t block = transpose ? b : blocks - 1 - b;
+        size_t j0 = block * QR_BLOCK;
+        size_t jb = j0 + QR_BLOCK < qr->n_reflectors ? QR_BLOCK : qr->n_reflectors - j0;
+
+        QRExtractV(qr, j0, jb, v);
+        QRApplyBlock(v, qr->t + block * QR_BLOCK * QR_BLOCK, qr->n_rows - j0, jb,
+                     c + j0 * nc, nc, nc, w, transpose);
+    }
+
+    free(v);
+    free(w);
+    return 0;
+}
+
+static mat_qr_t* QRFactor(const matrix_t* mat)
+{
+    mat_qr_t* qr = (mat_qr_t*)malloc(sizeof(mat_qr_t));
+    size_t m = mat->n_rows;
+    size_t n = mat->n_cols;
+    size_t blocks = 0;
+    float* v = NULL;
+    float* w = NULL;
+    size_t j0, j, i, c = 0;
+
+    if (!qr)
+    {
+        return NULL;
+    }
+    qr->n_rows = m;
+    qr->n_cols = n;
+    qr->n_reflectors = m < n ? m : n;
+    blocks = QRBlocks(qr);
+    qr->fact = (float*)malloc(m * n * sizeof(float) + 1);
+    qr->tau = (float*)malloc(qr->n_reflectors * sizeof(float) + 1);
+    qr->t = (float*)malloc(blocks * QR_BLOCK * QR_BLOCK * sizeof(float) + 1);
+    v = (float*)malloc(m * QR_BLOCK * sizeof(float) + 1);
+    w = (float*)malloc(QR_BLOCK * n * sizeof(float) + 1);
+    if (!qr->fact || !qr->tau || !qr->t || !v || !w)
+    {
+        free(v);
+        free(w);
+        MatQRDestroy(qr);
+        return NULL;
+    }
+    CopyRows(mat, qr->fact);
+
+    for (j0 = 0; j0 < qr->n_reflectors; j0 += QR_BLOCK)
+    {
+        size_t jb = j0 + QR_BLOCK < qr->n_reflectors ? QR_BLOCK : qr->n_reflectors - j0;
+        size_t panel_end = j0 + jb;
+        float* t = qr->t + (j0 / QR_BLOCK) * QR_BLOCK * QR_BLOCK;
+
+        /* unblocked factorization of the panel, updated row by row */
+        for (j = j0; j < panel_end; j++)
+        {
+            float* a_jj = qr->fact + j * n + j;
+            float tau = HouseholderColumn(a_jj, n, m - j);
+            size_t width = panel_end - j - 1;
+
+            qr->tau[j] = tau;
+            if (tau == 0 || width == 0)
+            {
+                continue;
+            }
+
+            memcpy(w, a_jj + 1, width * sizeof(float));
+            for (i = j + 1; i < m; i++)
+            {
+                float v_i = qr->fact[i * n + j];
+                const float* a_row = qr->fact + i * n + j + 1;
+
+                for (c = 0; c < width; c++)
+                {
+                    w[c] += v_i * a_row[c];
+                }
+            }
+            for (c = 0; c < width; c++)
+            {
+                a_jj[1 + c] -= tau * w[c];
+            }
+            for (i = j + 1; i < m; i++)
+            {
+                float scaled = tau * qr->fact[i * n + j];
+                float* a_row = qr->fact + i * n + j + 1;
+
+                for (c = 0; c < width; c++)
+                {
+                    a_row[c] -= scaled * w[c];
+                }
+            }
+        }
+
+        QRExtractV(qr, j0, jb, v);
+        QRFormT(qr, v, j0, jb, t);
+
+        /* level-3 update of everything right of the panel */
+        if (panel_end < n)
+        {
+            QRApplyBlock(v, t, m - j0, jb, qr->fact + j0 * n + panel_end, n, n - panel_end, w, 1);
+        }
+    }
+
+    free(v);
+    free(w);
+    return qr;
+}
+
+void MatQRDestroy(mat_qr_t* qr)
+{
+    if (!qr)
+    {
+        return;
+    }
+    free(qr->fact);
+    free(qr->tau);
+    free(qr->t);
+    free(qr);
+}
+
+matrix_t* MatQRGetR(const mat_qr_t* qr)
+{
+    matrix_t* r = MatCreate(qr->n_reflectors, qr->n_cols, NULL);
+    size_t i = 0;
+
+    if (!r)
+    {
+        return NULL;
+    }
+    for (i = 0; i < qr->n_reflectors; i++)
+    {
+        memcpy(r->data + i * qr->n_cols + i, qr->fact + i * qr->n_cols + i, (qr->n_cols - i) * sizeof(float));
+    }
+    return r;
+}
+
+matrix_t* MatQRGetQ(const mat_qr_t* qr)
+{
+    matrix_t* q = MatCreate(qr->n_rows, qr->n_reflectors, NULL);
+    size_t i = 0;
+
+    if (!q)
+    {
+        return NULL;
+    }
+    for (i = 0; i < qr->n_reflectors; i++)
+    {
+        q->data[i * qr->n_reflectors + i] = 1.0F;
+    }
+    if (QRApply(qr, q->data, qr->n_reflectors, 0))
+    {
+        MatDestroy(q);
+        return NULL;
+    }
+    return q;
+}
+
+matrix_t* MatQRSolve(const mat_qr_t* qr, const matrix_t* b)
+{
+    size_t n = qr->n_cols;
+    size_t p = b->n_cols;
+    float* qtb = NULL;
+    matrix_t* x = NULL;
+    float max_diag = 0;
+    size_t i, l, j = 0;
+
+    if (b->layout != MAT_ROW_MAJOR)
+    {
+        matrix_t* rows = RowMajor(b);
+
+        x = rows ? MatQRSolve(qr, rows) : NULL;
+        MatDestroy(rows);
+        return x;
+    }
+    if (b->n_rows != qr->n_rows || qr->n_rows < n)
+    {
+        return NULL;
+    }
+
+    /* a zero pivot relative to the largest one means A is rank deficient */
+    for (i = 0; i < n; i++)
+    {
+        float d = (float)fabs(qr->fact[i * n + i]);
+        max_diag = d > max_diag ? d : max_diag;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (fabs(qr->fact[i * n + i]) <= max_diag * FLT_EPSILON * (float)qr->n_rows)
+        {
+            return NULL;
+        }
+    }
+
+    qtb = (float*)malloc(b->n_rows * p * sizeof(float) + 1);
+    x = MatCreate(n, p, NULL);
+    if (!qtb || !x)
+    {
+        free(qtb);
+        MatDestroy(x);
+        return NULL;
+    }
+    memcpy(qtb, b->data, b->n_rows * p * sizeof(float));
+    if (QRApply(qr, qtb, p, 1))
+    {
+        free(qtb);
+        MatDestroy(x);
+        return NULL;
+    }
+
+    /* back substitution R x = (Q^T b)[0:n], all right hand sides at once */
+    for (i = n; i-- > 0;)
+    {
+        float* x_row = x->data + i * p;
+        float inv = 1.0F / qr->fact[i * n + i];
+
+        memcpy(x_row, qtb + i * p, p * sizeof(float));
+        for (l = i + 1; l < n; l++)
+        {
+            float r_il = qr->fact[i * n + l];
+            const float* x_l = x->data + l * p;
+
+            for (j = 0; j < p; j++)
+            {
+                x_row[j] -= r_il * x_l[j];
+            }
+        }
+        for (j = 0; j < p; j++)
+        {
+            x_row[j] *= inv;
+        }
+    }
+
+    free(qtb);
+    return x;
+}
+
+matrix_t* MatLeastSquares(const matrix_t* a, const matrix_t* b)
+{
+    profile_mark_t mark;
+    mat_qr_t* qr = NULL;
+    matrix_t* x = NULL;
+
+    if (a->n_rows < a->n_cols || b->n_rows != a->n_rows)
+    {
+        return NULL;
+    }
+
+    ProfileBegin(&mark);
+    qr = MatQR(a);
+    if (!qr)
+    {
+        return NULL;
+    }
+    x = MatQRSolve(qr, b);
+    MatQRDestroy(qr);
+
+    ProfileEnd(&mark, "MatLeastSquares", a->n_rows, a->n_cols);
+    return x;
+}
+
+
+
+/* ----------------------- iterative eigen / SVD solvers ----------------------- */
+
+#define EIG_TOLERANCE 1e-5
+#define EIG_BREAKDOWN 1e-10
+#define JACOBI_MAX_SWEEPS 64
+#define LANCZOS_EXTRA_STEPS 64
+#define LANCZOS_CHECK_EVERY 8
+#define POWER_MAX_ITER 1000
+#define RSVD_OVERSAMPLE 10
+#define RSVD_POWER_ITERS 2
+#define RANDOM_START_SEED 0x2545f491UL
+
+void MatDenseMatvec(const float* x, float* y, void* mat)
+{
+    const matrix_t* dense = (const matrix_t*)mat;
+    size_t i = 0;
+
+    /* column-major A x is (the stored A^T)^T x */
+    if (dense->layout == MAT_COL_MAJOR)
+    {
+        matrix_t view = StorageView(dense);
+
+        MatDenseMatvecT(x, y, &view);
+        return;
+    }
+
+    for (i = 0; i < dense->n_rows; i++)
+    {
+        y[i] = DotF(dense->data + i * dense->n_cols, x, dense->n_cols);
+    }
+}
+
+void MatDenseMatvecT(const float* x, float* y, void* mat)
+{
+    const matrix_t* dense = (const matrix_t*)mat;
+    size_t i, j = 0;
+
+    if (dense->layout == MAT_COL_MAJOR)
+    {
+        matrix_t view = StorageView(dense);
+
+        MatDenseMatvec(x, y, &view);
+        return;
+    }
+
+    memset(y, 0, dense->n_cols * sizeof(float));
+    for (i = 0; i < dense->n_rows; i++)
+    {
+        const float* row = dense->data + i * dense->n_cols;
+
+        for (j = 0; j < dense->n_cols; j++)
+        {
+            y[j] += x[i] * row[j];
+        }
+    }
+}
+
+/* xorshift32 in [-1, 1), only used for start vectors */
+static float RandomSigned(unsigned long* state)
+{
+    unsigned long x = *state & 0xffffffffUL;
+
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    *state = x;
+    return (float)((double)x / 2147483648.0 - 1.0);
+}
+
+static double DotD(const float* x, const float* y, size_t n)
+{
+    double sum = 0;
+    size_t i = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        sum += (double)x[i] * y[i];
+    }
+    return sum;
+}
+
+/* makes v orthogonal to the count unit rows of basis (Gram-Schmidt run
+ * twice, which is enough in floating point) and normalizes it;
+ * returns the norm v had before normalization */
+static double Orthonormalize(const float* basis, size_t count, float* v, size_t n)
+{
+    double norm = 0;
+    size_t pass, i, j = 0;
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (i = 0; i < count; i++)
+        {
+            const float* b = basis + i * n;
+            float d = (float)DotD(b, v, n);
+
+            for (j = 0; j < n; j++)
+            {
+                v[j] -= d * b[j];
+            }
+        }
+    }
+
+    norm = sqrt(DotD(v, v, n));
+    if (norm > 0)
+    {
+        for (j = 0; j < n; j++)
+        {
+            v[j] = (float)(v[j] / norm);
+        }
+    }
+    return norm;
+}
+
+/* a random unit vector orthogonal to basis, nonzero if basis spans everything */
+static int RandomOrthonormal(const float* basis, size_t count, float* v, size_t n, unsigned long* state)
+{
+    size_t attempt, j = 0;
+
+    for (attempt = 0; attempt < 4; attempt++)
+    {
+        for (j = 0; j < n; j++)
+        {
+            v[j] = RandomSigned(state);
+        }
+        if (Orthonormalize(basis, count, v, n) > EIG_BREAKDOWN)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* cyclic Jacobi for a symmetric n * n a; on return the diagonal of a holds
+ * the eigenvalues and column i of vecs the i'th eigenvector */
+static void JacobiEig(double* a, size_t n, double* vecs)
+{
+    size_t sweep, p, q, r = 0;
+
+    for (p = 0; p < n * n; p++)
+    {
+        vecs[p] = 0;
+    }
+    for (p = 0; p < n; p++)
+    {
+        vecs[p * n + p] = 1;
+    }
+
+    for (sweep = 0; sweep < JACOBI_MAX_SWEEPS; sweep++)
+    {
+        double off = 0;
+        double diag = 0;
+
+        for (p = 0; p < n; p++)
+        {
+            diag += a[p * n + p] * a[p * n + p];
+            for (q = p + 1; q < n; q++)
+            {
+                off += a[p * n + q] * a[p * n + q];
+            }
+        }
+        if (off <= 1e-30 * diag || off == 0)
+        {
+            break;
+        }
+
+        for (p = 0; p < n; p++)
+        {
+            for (q = p + 1; q < n; q++)
+            {
+                double a_pq = a[p * n + q];
+                double theta, t, c, s = 0;
+
+                if (a_pq == 0)
+                {
+                    continue;
+                }
+                theta = (a[q * n + q] - a[p * n + p]) / (2 * a_pq);
+                t = 1 / (fabs(theta) + sqrt(theta * theta + 1));
+                t = theta < 0 ? -t : t;
+                c = 1 / sqrt(t * t + 1);
+                s = t * c;
+
+                for (r = 0; r < n; r++)
+                {
+                    double a_rp = a[r * n + p];
+                    double a_rq = a[r * n + q];
+                    double v_rp = vecs[r * n + p];
+                    double v_rq = vecs[r * n + q];
+
+                    a[r * n + p] = c * a_rp - s * a_rq;
+                    a[r * n + q] = s * a_rp + c * a_rq;
+                    vecs[r * n + p] = c * v_rp - s * v_rq;
+                    vecs[r * n + q] = s * v_rp + c * v_rq;
+                }
+                for (r = 0; r < n; r++)
+                {
+                    double a_pr = a[p * n + r];
+                    double a_qr = a[q * n + r];
+
+                    a[p * n + r] = c * a_pr - s * a_qr;
+                    a[q * n + r] = s * a_pr + c * a_qr;
+                }
+            }
+        }
+    }
+}
+
+/* indices of the k largest |values[i]|, largest first */
+static void TopByMagnitude(const double* values, size_t n, size_t k, size_t* order)
+{
+    size_t i, j = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        order[i] = i;
+    }
+    for (i = 0; i < k && i < n; i++)
+    {
+        size_t best = i;
+
+        for (j = i + 1; j < n; j++)
+        {
+            if (fabs(values[order[j]]) > fabs(values[order[best]]))
+            {
+                best = j;
+            }
+        }
+        j = order[i];
+        order[i] = order[best];
+        order[best] = j;
+    }
+}
+
+/* rows [0, count) of out = combinations of the rows of basis given by the
+ * columns order[] of the dim * dim coefficient matrix coef */
+static void CombineRows(const float* basis, size_t dim, size_t n, const double* coef,
+                        const size_t* order, size_t count, float* out)
+{
+    size_t i, l, j = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        float* row = out + i * n;
+
+        memset(row, 0, n * sizeof(float));
+        for (l = 0; l < dim; l++)
+        {
+            float c = (float)coef[l * dim + order[i]];
+            const float* b = basis + l * n;
+
+            for (j = 0; j < n; j++)
+            {
+                row[j] += c * b[j];
+            }
+        }
+    }
+}
+
+/* n * k matrix whose columns are the k rows of vecs */
+static matrix_t* ColumnsFromRows(const float* vecs, size_t k, size_t n)
+{
+    matrix_t* mat = MatCreate(n, k, NULL);
+    size_t i, j = 0;
+
+    if (!mat)
+    {
+        return NULL;
+    }
+    for (i = 0; i < k; i++)
+    {
+        for (j = 0; j < n; j++)
+        {
+            mat->data[j * k + i] = vecs[i * n + j];
+        }
+    }
+    return mat;
+}
+
+/* Lanczos with full reorthogonalization, T = tridiag(beta, alpha, beta) */
+typedef struct lanczos_t
+{
+    size_t n;
+    size_t k;
+    size_t max_steps;
+    float* basis; /* max_steps + 1 unit rows of n */
+    float* w;
+    double* alpha;
+    double* beta;
+    double* t;    /* Ritz values on the diagonal after LanczosRitz */
+    double* s;    /* eigenvectors of T */
+    double* ritz;
+    size_t* order;
+} lanczos_t;
+
+/* eigen-decomposes T_steps, orders the Ritz values by magnitude and
+ * returns nonzero once the top k have converged */
+static int LanczosRitz(lanczos_t* lz, size_t steps, float* values)
+{
+    double residual = lz->beta[steps - 1];
+    double scale = 0;
+    int converged = 1;
+    size_t i = 0;
+
+    for (i = 0; i < steps * steps; i++)
+    {
+        lz->t[i] = 0;
+    }
+    for (i = 0; i < steps; i++)
+    {
+        lz->t[i * steps + i] = lz->alpha[i];
+        if (i + 1 < steps)
+        {
+            lz->t[i * steps + i + 1] = lz->beta[i];
+            lz->t[(i + 1) * steps + i] = lz->beta[i];
+        }
+    }
+    JacobiEig(lz->t, steps, lz->s);
+    for (i = 0; i < steps; i++)
+    {
+        lz->ritz[i] = lz->t[i * steps + i];
+    }
+    TopByMagnitude(lz->ritz, steps, lz->k, lz->order);
+
+    scale = fabs(lz->ritz[lz->order[0]]);
+    for (i = 0; i < lz->k; i++)
+    {
+        /* beta times the last component of a Ritz vector is its residual */
+        if (residual * fabs(lz->s[(steps - 1) * steps + lz->order[i]]) > EIG_TOLERANCE * scale)
+        {
+            converged = 0;
+        }
+        values[i] = (float)lz->ritz[lz->order[i]];
+    }
+    return converged;
+}
+
+static int LanczosRun(lanczos_t* lz, mat_matvec_fn op, void* ctx, float* values, matrix_t** vectors)
+{
+    unsigned long state = RANDOM_START_SEED;
+    size_t n = lz->n;
+    size_t steps = 0;
+    int converged = 0;
+    float* ritz_vectors = NULL;
+
+    if (RandomOrthonormal(NULL, 0, lz->basis, n, &state))
+    {
+        return 1;
+    }
+
+    while (steps < lz->max_steps && !converged)
+    {
+        float* q = lz->basis + steps * n;
+
+        op(q, lz->w, ctx);
+        lz->alpha[steps] = DotD(q, lz->w, n);
+        lz->beta[steps] = Orthonormalize(lz->basis, steps + 1, lz->w, n);
+        ++steps;
+
+        if (steps >= lz->k && (steps % LANCZOS_CHECK_EVERY == 0 || steps == lz->max_steps ||
+                               lz->beta[steps - 1] < EIG_BREAKDOWN))
+        {
+            converged = LanczosRitz(lz, steps, values);
+        }
+        if (converged || steps == lz->max_steps)
+        {
+            break;
+        }
+
+        if (lz->beta[steps - 1] < EIG_BREAKDOWN)
+        {
+            /* invariant subspace found, carry on in a fresh direction */
+            lz->beta[steps - 1] = 0;
+            if (RandomOrthonormal(lz->basis, steps, lz->basis + steps * n, n, &state))
+            {
+                converged = LanczosRitz(lz, steps, values);
+                break;
+            }
+        }
+        else
+        {
+            memcpy(lz->basis + steps * n, lz->w, n * sizeof(float));
+        }
+    }
+
+    if (vectors)
+    {
+        ritz_vectors = (float*)malloc(lz->k * n * sizeof(float));
+        if (!ritz_vectors)
+        {
+            return 1;
+        }
+        CombineRows(lz->basis, steps, n, lz->s, lz->order, lz->k, ritz_vectors);
+        *vectors = ColumnsFromRows(ritz_vectors, lz->k, n);
+        free(ritz_vectors);
+        if (!*vectors)
+        {
+            return 1;
+        }
+    }
+
+    return converged ? 0 : 2;
+}
+
+int MatEigsLanczos(mat_matvec_fn op, void* ctx, size_t n, size_t k, float* values, matrix_t** vectors)
+{
+    lanczos_t lz;
+    size_t m = 0;
+    int status = 1;
+
+    if (k == 0 || k > n)
+    {
+        return 1;
+    }
+
+    m = n < 2 * k + LANCZOS_EXTRA_STEPS ? n : 2 * k + LANCZOS_EXTRA_STEPS;
+    lz.n = n;
+    lz.k = k;
+    lz.max_steps = m;
+    lz.basis = (float*)malloc((m + 1) * n * sizeof(float));
+    lz.w = (float*)malloc(n * sizeof(float));
+    lz.alpha = (double*)malloc(m * sizeof(double));
+    lz.beta = (double*)malloc(m * sizeof(double));
+    lz.t = (double*)malloc(m * m * sizeof(double));
+    lz.s = (double*)malloc(m * m * sizeof(double));
+    lz.ritz = (double*)malloc(m * sizeof(double));
+    lz.order = (size_t*)malloc(m * sizeof(size_t));
+
+    if (lz.basis && lz.w && lz.alpha && lz.beta && lz.t && lz.s && lz.ritz && lz.order)
+    {
+        status = LanczosRun(&lz, op, ctx, values, vectors);
+    }
+
+    free(lz.basis);
+    free(lz.w);
+    free(lz.alpha);
+    free(lz.beta);
+    free(lz.t);
+    free(lz.s);
+    free(lz.ritz);
+    free(lz.order);
+    return status;
+}
+
+/* subspace iteration with a Rayleigh-Ritz step on every pass; x and ax
+ * hold k rows of n, h and s are k * k */
+static int PowerRun(mat_matvec_fn op, void* ctx, size_t n, size_t k, float* x, float* ax, float* rotated,
+                    double* h, double* s, double* theta, size_t* order, float* values)
+{
+    unsigned long state = RANDOM_START_SEED;
+    size_t iter, i, l, j = 0;
+
+    for (i = 0; i < k; i++)
+    {
+        if (RandomOrthonormal(x, i, x + i * n, n, &state))
+        {
+            return 1;
+        }
+    }
+
+    for (iter = 0; iter < POWER_MAX_ITER; iter++)
+    {
+        double scale = 0;
+        int converged = 1;
+
+        for (i = 0; i < k; i++)
+        {
+            op(x + i * n, ax + i * n, ctx);
+        }
+        for (i = 0; i < k; i++)
+        {
+            for (l = 0; l < k; l++)
+            {
+                h[i * k + l] = 0.5 * (DotD(x + i * n, ax + l * n, n) + DotD(x + l * n, ax + i * n, n));
+            }
+        }
+        JacobiEig(h, k, s);
+        for (i = 0; i < k; i++)
+        {
+            theta[i] = h[i * k + i];
+        }
+        TopByMagnitude(theta, k, k, order);
+
+        CombineRows(x, k, n, s, order, k, rotated);
+        memcpy(x, rotated, k * n * sizeof(float));
+        CombineRows(ax, k, n, s, order, k, rotated);
+        memcpy(ax, rotated, k * n * sizeof(float));
+
+        scale = fabs(theta[order[0]]);
+        for (i = 0; i < k; i++)
+        {
+            double residual = 0;
+
+            values[i] = (float)theta[order[i]];
+            for (j = 0; j < n; j++)
+            {
+                double r = ax[i * n + j] - theta[order[i]] * x[i * n + j];
+                residual += r * r;
+            }
+            if (sqrt(residual) > EIG_TOLERANCE * scale)
+            {
+                converged = 0;
+            }
+        }
+        if (converged)
+        {
+            return 0;
+        }
+
+        /* the next subspace is orth(A X), refilled where A X lost rank */
+        for (i = 0; i < k; i++)
+        {
+            memcpy(x + i * n, ax + i * n, n * sizeof(float));
+            if (Orthonormalize(x, i, x + i * n, n) < EIG_BREAKDOWN &&
+                RandomOrthonormal(x, i, x + i * n, n, &state))
+            {
+                return 1;
+            }
+        }
+    }
+
+    return 2;
+}
+
+int MatEigsPower(mat_matvec_fn op, void* ctx, size_t n, size_t k, float* values, matrix_t** vectors)
+{
+    float* x = NULL;
+    float* ax = NULL;
+    float* rotated = NULL;
+    double* h = NULL;
+    double* s = NULL;
+    double* theta = NULL;
+    size_t* order = NULL;
+    int status = 1;
+
+    if (k == 0 || k > n)
+    {
+        return 1;
+    }
+
+    x = (float*)malloc(k * n * sizeof(float));
+    ax = (float*)malloc(k * n * sizeof(float));
+    rotated = (float*)malloc(k * n * sizeof(float));
+    h = (double*)malloc(k * k * sizeof(double));
+    s = (double*)malloc(k * k * sizeof(double));
+    theta = (double*)malloc(k * sizeof(double));
+    order = (size_t*)malloc(k * sizeof(size_t));
+    if (x && ax && rotated && h && s && theta && order)
+    {
+        status = PowerRun(op, ctx, n, k, x, ax, rotated, h, s, theta, order, values);
+    }
+
+    if (status != 1 && vectors)
+    {
+        *vectors = ColumnsFromRows(x, k, n);
+        status = *vectors ? status : 1;
+    }
+
+    free(x);
+    free(ax);
+    free(rotated);
+    free(h);
+    free(s);
+    free(theta);
+    free(order);
+    return status;
+}
+
+/* one-sided Jacobi SVD of the l columns of B^T, stored as l rows w of
+ * length n; on return w holds V * S by rows and u the l * l U of B */
+static void OneSidedJacobi(double* w, size_t l, size_t n, double* u)
+{
+    size_t sweep, p, q, j = 0;
+
+    for (p = 0; p < l * l; p++)
+    {
+        u[p] = 0;
+    }
+    for (p = 0; p < l; p++)
+    {
+        u[p * l + p] = 1;
+    }
+
+    for (sweep = 0; sweep < JACOBI_MAX_SWEEPS; sweep++)
+    {
+        int rotated = 0;
+
+        for (p = 0; p < l; p++)
+        {
+            for (q = p + 1; q < l; q++)
+            {
+                double* wp = w + p * n;
+                double* wq = w + q * n;
+                double alpha = 0, beta = 0, gamma = 0;
+                double zeta, t, c, s = 0;
+
+                for (j = 0; j < n; j++)
+                {
+                    alpha += wp[j] * wp[j];
+                    beta += wq[j] * wq[j];
+                    gamma += wp[j] * wq[j];
+                }
+                if (fabs(gamma) <= 1e-15 * sqrt(alpha * beta) || gamma == 0)
+                {
+                    continue;
+                }
+                rotated = 1;
+
+                zeta = (beta - alpha) / (2 * gamma);
+                t = 1 / (fabs(zeta) + sqrt(1 + zeta * zeta));
+                t = zeta < 0 ? -t : t;
+                c = 1 / sqrt(1 + t * t);
+                s = c * t;
+                for (j = 0; j < n; j++)
+                {
+                    double a = wp[j];
+                    double b = wq[j];
+
+                    wp[j] = c * a - s * b;
+                    wq[j] = s * a + c * b;
+                }
+                for (j = 0; j < l; j++)
+                {
+                    double a = u[j * l + p];
+                    double b = u[j * l + q];
+
+                    u[j * l + p] = c * a - s * b;
+                    u[j * l + q] = s * a + c * b;
+                }
+            }
+        }
+        if (!rotated)
+        {
+            break;
+        }
+    }
+}
+
+static int RandSVDRun(mat_matvec_fn op, mat_matvec_fn op_t, void* ctx, size_t n_rows, size_t n_cols,
+                      size_t k, size_t l, float* q, float* z, double* w, double* u, double* sigma,
+                      size_t* order, float* s, matrix_t** u_out, matrix_t** v_out)
+{
+    unsigned long state = RANDOM_START_SEED;
+    float* rows = NULL;
+    size_t pass, i, j = 0;
+
+    /* range finder: Q = orth(A Omega), sharpened by power iterations */
+    for (i = 0; i < l; i++)
+    {
+        for (j = 0; j < n_cols; j++)
+        {
+            z[i * n_cols + j] = RandomSigned(&state);
+        }
+    }
+    for (pass = 0; pass <= RSVD_POWER_ITERS; pass++)
+    {
+        for (i = 0; i < l; i++)
+        {
+            op(z + i * n_cols, q + i * n_rows, ctx);
+            if (Orthonormalize(q, i, q + i * n_rows, n_rows) < EIG_BREAKDOWN &&
+                RandomOrthonormal(q, i, q + i * n_rows, n_rows, &state))
+            {
+                return 1;
+            }
+        }
+        for (i = 0; i < l; i++)
+        {
+            op_t(q + i * n_rows, z + i * n_cols, ctx);
+            if (pass < RSVD_POWER_ITERS && Orthonormalize(z, i, z + i * n_cols, n_cols) < EIG_BREAKDOWN &&
+                RandomOrthonormal(z, i, z + i * n_cols, n_cols, &state))
+            {
+                return 1;
+            }
+        }
+    }
+
+    /* z now holds the rows of B^T = A^T Q, take its SVD */
+    for (i = 0; i < l * n_cols; i++)
+    {
+        w[i] = z[i];
+    }
+    OneSidedJacobi(w, l, n_cols, u);
+    for (i = 0; i < l; i++)
+    {
+        double norm2 = 0;
+
+        for (j = 0; j < n_cols; j++)
+        {
+            norm2 += w[i * n_cols + j] * w[i * n_cols + j];
+        }
+        sigma[i] = sqrt(norm2);
+    }
+    TopByMagnitude(sigma, l, k, order);
+
+    for (i = 0; i < k; i++)
+    {
+        s[i] = (float)sigma[order[i]];
+    }
+    if (u_out)
+    {
+        rows = (float*)malloc(k * n_rows * sizeof(float) + 1);
+        if (!rows)
+        {
+            return 1;
+        }
+        CombineRows(q, l, n_rows, u, order, k, rows);
+        *u_out = ColumnsFromRows(rows, k, n_rows);
+        free(rows);
+        if (!*u_out)
+        {
+            return 1;
+        }
+    }
+    if (v_out)
+    {
+        *v_out = MatCreate(n_cols, k, NULL);
+        if (!*v_out)
+        {
+            if (u_out)
+            {
+                MatDestroy(*u_out);
+                *u_out = NULL;
+            }
+            return 1;
+        }
+        for (i = 0; i < k; i++)
+        {
+            double inv = sigma[order[i]] > 0 ? 1 / sigma[order[i]] : 0;
+
+            for (j = 0; j < n_cols; j++)
+            {
+                (*v_out)->data[j * k + i] = (float)(w[order[i] * n_cols + j] * inv);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int MatRandSVD(mat_matvec_fn op, mat_matvec_fn op_t, void* ctx, size_t n_rows, size_t n_cols,
+               size_t k, float* s, matrix_t** u, matrix_t** v)
+{
+    size_t min_dim = n_rows < n_cols ? n_rows : n_cols;
+    size_t l = k + RSVD_OVERSAMPLE < min_dim ? k + RSVD_OVERSAMPLE : min_dim;
+    float* q = NULL;
+    float* z = NULL;
+    double* w = NULL;
+    double* rot = NULL;
+    double* sigma = NULL;
+    size_t* order = NULL;
+    int status = 1;
+
+    if (k == 0 || k > min_dim)
+    {
+        return 1;
+    }
+
+    q = (float*)malloc(l * n_rows * sizeof(float));
+    z = (float*)malloc(l * n_cols * sizeof(float));
+    w = (double*)malloc(l * n_cols * sizeof(double));
+    rot = (double*)malloc(l * l * sizeof(double));
+    sigma = (double*)calloc(l, sizeof(double));
+    order = (size_t*)malloc(l * sizeof(size_t));
+    if (q && z && w && rot && sigma && order)
+    {
+        status = RandSVDRun(op, op_t, ctx, n_rows, n_cols, k, l, q, z, w, rot, sigma, order, s, u, v);
+    }
+
+    free(q);
+    free(z);
+    free(w);
+    free(rot);
+    free(sigma);
+    free(order);
+    return status;
+}
+
+
+
+/* ------------------------- incremental inverse ------------------------- */
+
+/* A^-1 and det(A) kept current under low-rank changes of A through the
+ * Sherman-Morrison-Woodbury identity and the matrix determinant lemma */
+struct mat_inverse_t
+{
+    matrix_t* mat;     /* the current A, needed for row/column updates */
+    matrix_t* inverse;
+    float det;
+    float* z;          /* n scratch: A^-1 u */
+    float* w;          /* n scratch: v^T A^-1 */
+};
+
+static int InverseRecompute(mat_inverse_t* inv)
+{
+    matrix_t* inverse = MatInvert(inv->mat);
+
+    if (!inverse)
+    {
+        return 1;
+    }
+    MatDestroy(inv->inverse);
+    inv->inverse = inverse;
+    inv->det = MatDet(inv->mat);
+    return 0;
+}
+
+mat_inverse_t* MatInverseCreate(const matrix_t* mat)
+{
+    mat_inverse_t* inv = NULL;
+
+    if (mat->n_rows != mat->n_cols)
+    {
+        return NULL;
+    }
+
+    inv = (mat_inverse_t*)malloc(sizeof(mat_inverse_t));
+    if (!inv)
+    {
+        return NULL;
+    }
+    inv->inverse = NULL;
+    inv->mat = MatCreate(mat->n_rows, mat->n_cols, NULL);
+    if (inv->mat)
+    {
+        CopyRows(mat, inv->mat->data);
+    }
+    inv->z = (float*)malloc(mat->n_rows * sizeof(float) + 1);
+    inv->w = (float*)malloc(mat->n_rows * sizeof(float) + 1);
+    if (!inv->mat || !inv->z || !inv->w || InverseRecompute(inv))
+    {
+        MatInverseDestroy(inv);
+        return NULL;
+    }
+
+    return inv;
+}
+
+void MatInverseDestroy(mat_inverse_t* inv)
+{
+    if (!inv)
+    {
+        return;
+    }
+    MatDestroy(inv->mat);
+    MatDestroy(inv->inverse);
+    free(inv->z);
+    free(inv->w);
+    free(inv);
+}
+
+int MatInverseUpdate(mat_inverse_t* inv, const float* u, const float* v)
+{
+    size_t n = inv->mat->n_rows;
+    float* a_inv = NULL;
+    float* a = NULL;
+    float denom = 0;
+    size_t i, j = 0;
+
+    /* z = A^-1 u, w = v^T A^-1, both O(n^2) */
+    for (i = 0; i < n; i++)
+    {
+        inv->z[i] = DotF(inv->inverse->data + i * n, u, n);
+    }
+    memset(inv->w, 0, n * sizeof(float));
+    for (i = 0; i < n; i++)
+    {
+        const float* row = inv->inverse->data + i * n;
+
+        for (j = 0; j < n; j++)
+        {
+            inv->w[j] += v[i] * row[j];
+        }
+    }
+
+    denom = 1.0F + DotF(v, inv->z, n);
+    if (fabs(denom) <= FLT_EPSILON)
+    {
+        return 1; /* A + u v^T is singular */
+    }
+
+    a_inv = MatData(inv->inverse);
+    a = MatData(inv->mat);
+    if (!a_inv || !a)
+    {
+        return 1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        float scale = inv->z[i] / denom;
+        float* inv_row = a_inv + i * n;
+        float* a_row = a + i * n;
+
+        for (j = 0; j < n; j++)
+        {
+            inv_row[j] -= scale * inv->w[j];
+            a_row[j] += u[i] * v[j];
+        }
+    }
+    inv->det *= denom;
+
+    return 0;
+}
+
+int MatInverseUpdateRow(mat_inverse_t* inv, size_t row, const float* new_row)
+{
+    size_t n = inv->mat->n_rows;
+    float* u = NULL;
+    float* v = NULL;
+    size_t j = 0;
+    int status = 0;
+
+    if (row >= n)
+    {
+        return 1;
+    }
+    u = (float*)calloc(n, sizeof(float));
+    v = (float*)malloc(n * sizeof(float));
+    if (!u || !v)
+    {
+        free(u);
+        free(v);
+        return 1;
+    }
+
+    /* replacing row r is A + e_r (new_row - old_row)^T */
+    u[row] = 1.0F;
+    for (j = 0; j < n; j++)
+    {
+        v[j] = new_row[j] - inv->mat->data[row * n + j];
+    }
+    status = MatInverseUpdate(inv, u, v);
+
+    free(u);
+    free(v);
+    return status;
+}
+
+int MatInverseUpdateCol(mat_inverse_t* inv, size_t col, const float* new_col)
+{
+    size_t n = inv->mat->n_rows;
+    float* u = NULL;
+    float* v = NULL;
+    size_t i = 0;
+    int status = 0;
+
+    if (col >= n)
+    {
+        return 1;
+    }
+    u = (float*)malloc(n * sizeof(float));
+    v = (float*)calloc(n, sizeof(float));
+    if (!u || !v)
+    {
+        free(u);
+        free(v);
+        return 1;
+    }
+
+    /* replacing column c is A + (new_col - old_col) e_c^T */
+    for (i = 0; i < n; i++)
+    {
+        u[i] = new_col[i] - inv->mat->data[i * n + col];
+    }
+    v[col] = 1.0F;
+    status = MatInverseUpdate(inv, u, v);
+
+    free(u);
+    free(v);
+    return status;
+}
+
+int MatInverseUpdateRankK(mat_inverse_t* inv, const matrix_t* u, const matrix_t* v)
+{
+    size_t n = inv->mat->n_rows;
+    size_t k = u->n_cols;
+    matrix_t* z = NULL;       /* A^-1 U, n * k */
+    matrix_t* w = NULL;       /* V^T A^-1, k * n */
+    matrix_t* vt = NULL;
+    matrix_t* cap = NULL;     /* I + V^T A^-1 U, k * k */
+    matrix_t* cap_inv = NULL;
+    matrix_t* cap_inv_w = NULL;
+    float* a_inv = NULL;
+    float* a = NULL;
+    float cap_det = 0;
+    size_t i = 0;
+    int status = 1;
+
+    if (u->n_rows != n || v->n_rows != n || v->n_cols != k)
+    {
+        return 1;
+    }
+    if (u->layout != MAT_ROW_MAJOR)
+    {
+        matrix_t* rows = RowMajor(u);
+
+        status = rows ? MatInverseUpdateRankK(inv, rows, v) : 1;
+        MatDestroy(rows);
+        return status;
+    }
+
+    z = MatMult(inv->inverse, u);
+    vt = MatTranspose(v);
+    w = vt ? MatMult(vt, inv->inverse) : NULL;
+    cap = (vt && z) ? MatMult(vt, z) : NULL;
+    if (cap)
+    {
+        for (i = 0; i < k; i++)
+        {
+            cap->data[i * k + i] += 1.0F;
+        }
+        /* a singular capacitance matrix means A + U V^T is singular */
+        cap_det = MatDet(cap);
+        cap_inv = fabs(cap_det) > FLT_EPSILON ? MatInvert(cap) : NULL;
+    }
+    cap_inv_w = (cap_inv && w) ? MatMult(cap_inv, w) : NULL;
+    for (i = 0; cap_inv_w && i < k * n; i++)
+    {
+        if (!(fabs(cap_inv_w->data[i]) <= FLT_MAX))
+        {
+            MatDestroy(cap_inv_w);
+            cap_inv_w = NULL;
+        }
+    }
+    a_inv = cap_inv_w ? MatData(inv->inverse) : NULL;
+    a = a_inv ? MatData(inv->mat) : NULL;
+
+    if (a)
+    {
+        /* A^-1 -= Z (I + V^T Z)^-1 W, A += U V^T */
+        for (i = 0; i < k * n; i++)
+        {
+            cap_inv_w->data[i] = -cap_inv_w->data[i];
+        }
+        GemmAccumulate(n, k, n, z->data, k, cap_inv_w->data, n, a_inv, n);
+        GemmAccumulate(n, k, n, u->data, k, vt->data, n, a, n);
+        inv->det *= cap_det;
+        status = 0;
+    }
+
+    MatDestroy(z);
+    MatDestroy(w);
+    MatDestroy(vt);
+    MatDestroy(cap);
+    MatDestroy(cap_inv);
+    MatDestroy(cap_inv_w);
+    return status;
+}
+
+int MatInverseRefresh(mat_inverse_t* inv)
+{
+    return InverseRecompute(inv);
+}
+
+matrix_t* MatInverseGet(const mat_inverse_t* inv)
+{
+    return MatClone(inv->inverse);
+}
+
+float MatInverseDet(const mat_inverse_t* inv)
+{
+    return inv->det;
+}
+
+
+
+/* --------------------------- conjugate gradient --------------------------- */
+
+typedef enum
+{
+    PRECOND_JACOBI,
+    PRECOND_IC
+} precond_kind_t;
+
+struct mat_precond_t
+{
+    size_t n;
+    precond_kind_t kind;
+    float* inv_diag;  /* Jacobi */
+    size_t* row_ptr;  /* IC(0): L by rows, diagonal last in every row */
+    size_t* cols;
+    float* vals;
+};
+
+struct mat_cg_t
+{
+    size_t n;
+    float* r;
+    float* z;
+    float* p;
+    float* q;
+};
+
+static mat_precond_t* PrecondAlloc(size_t n, precond_kind_t kind)
+{
+    mat_precond_t* pre = (mat_precond_t*)malloc(sizeof(mat_precond_t));
+
+    if (!pre)
+    {
+        return NULL;
+    }
+    pre->n = n;
+    pre->kind = kind;
+    pre->inv_diag = NULL;
+    pre->row_ptr = NULL;
+    pre->cols = NULL;
+    pre->vals = NULL;
+    return pre;
+}
+
+mat_precond_t* MatPrecondJacobiDiag(const float* diag, size_t n)
+{
+    mat_precond_t* pre = PrecondAlloc(n, PRECOND_JACOBI);
+    size_t i = 0;
+
+    if (!pre)
+    {
+        return NULL;
+    }
+    pre->inv_diag = (float*)malloc(n * sizeof(float) + 1);
+    if (!pre->inv_diag)
+    {
+        MatPrecondDestroy(pre);
+        return NULL;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (diag[i] == 0)
+        {
+            MatPrecondDestroy(pre);
+            return NULL;
+        }
+        pre->inv_diag[i] = 1.0F / diag[i];
+    }
+    return pre;
+}
+
+mat_precond_t* MatPrecondJacobi(const matrix_t* mat)
+{
+    mat_precond_t* pre = NULL;
+    float* diag = NULL;
+    size_t i = 0;
+
+    if (mat->n_rows != mat->n_cols)
+    {
+        return NULL;
+    }
+    diag = (float*)malloc(mat->n_rows * sizeof(float) + 1);
+    if (!diag)
+    {
+        return NULL;
+    }
+    for (i = 0; i < mat->n_rows; i++)
+    {
+        diag[i] = mat->data[i * mat->n_cols + i];
+    }
+    pre = MatPrecondJacobiDiag(diag, mat->n_rows);
+    free(diag);
+    return pre;
+}
+
+/* sum of L[i][j] * L[k][j] over the columns j < k both rows hold */
+static float SparseRowDot(const mat_precond_t* pre, size_t i, size_t i_end, size_t k)
+{
+    size_t a = pre->row_ptr[i];
+    size_t b = pre->row_ptr[k];
+    size_t b_end = pre->row_ptr[k + 1] - 1; /* skip the diagonal of row k */
+    float sum = 0;
+
+    while (a < i_end && b < b_end)
+    {
+        if (pre->cols[a] == pre->cols[b])
+        {
+            sum += pre->vals[a++] * pre->vals[b++];
+        }
+        else if (pre->cols[a] < pre->cols[b])
+        {
+            ++a;
+        }
+        else
+        {
+            ++b;
+        }
+    }
+    return sum;
+}
+
+mat_precond_t* MatPrecondICSparse(size_t n, const size_t* row_ptr, const size_t* cols, const float* vals)
+{
+    mat_precond_t* pre = NULL;
+    size_t nnz = n;
+    size_t i, j, e = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        for (j = row_ptr[i]; j < row_ptr[i + 1]; j++)
+        {
+            if (cols[j] > i || (j > row_ptr[i] && cols[j] <= cols[j - 1]))
+            {
+                return NULL; /* not a lower triangle with sorted columns */
+            }
+            nnz += cols[j] < i;
+        }
+    }
+
+    pre = PrecondAlloc(n, PRECOND_IC);
+    if (!pre)
+    {
+        return NULL;
+    }
+    pre->row_ptr = (size_t*)malloc((n + 1) * sizeof(size_t));
+    pre->cols = (size_t*)malloc(nnz * sizeof(size_t) + 1);
+    pre->vals = (float*)malloc(nnz * sizeof(float) + 1);
+    if (!pre->row_ptr || !pre->cols || !pre->vals)
+    {
+        MatPrecondDestroy(pre);
+        return NULL;
+    }
+
+    /* IC(0): the Cholesky recurrence restricted to A's pattern */
+    for (i = 0, e = 0; i < n; i++)
+    {
+        size_t row_start = e;
+        float diag = 0;
+
+        pre->row_ptr[i] = e;
+        for (j = row_ptr[i]; j < row_ptr[i + 1]; j++)
+        {
+            if (cols[j] == i)
+            {
+                diag = vals[j];
+                continue;
+            }
+            pre->cols[e] = cols[j];
+            pre->vals[e] = (vals[j] - SparseRowDot(pre, i, e, cols[j])) / pre->vals[pre->row_ptr[cols[j] + 1] - 1];
+            ++e;
+        }
+        for (j = row_start; j < e; j++)
+        {
+            diag -= pre->vals[j] * pre->vals[j];
+        }
+        if (!(diag > 0))
+        {
+            MatPrecondDestroy(pre); /* no IC(0) factor without fill-in */
+            return NULL;
+        }
+        pre->cols[e] = i;
+        pre->vals[e] = (float)sqrt(diag);
+        ++e;
+        pre->row_ptr[i + 1] = e;
+    }
+
+    return pre;
+}
+
+mat_precond_t* MatPrecondIC(const matrix_t* mat)
+{
+    mat_precond_t* pre = NULL;
+    size_t n = mat->n_rows;
+    size_t* row_ptr = NULL;
+    size_t* cols = NULL;
+    float* vals = NULL;
+    size_t nnz = 0;
+    size_t i, j, e = 0;
+
+    if (mat->n_rows != mat->n_cols)
+    {
+        return NULL;
+    }
+    if (mat->layout != MAT_ROW_MAJOR)
+    {
+        matrix_t* rows = RowMajor(mat);
+
+        pre = rows ? MatPrecondIC(rows) : NULL;
+        MatDestroy(rows);
+        return pre;
+    }
+    for (i = 0; i < n; i++)
+    {
+        for (j = 0; j < i; j++)
+        {
+            nnz += mat->data[i * n + j] != 0;
+        }
+    }
+    nnz += n;
+
+    /* the nonzero lower triangle and the whole diagonal as CSR */
+    row_ptr = (size_t*)malloc((n + 1) * sizeof(size_t));
+    cols = (size_t*)malloc(nnz * sizeof(size_t) + 1);
+    vals = (float*)malloc(nnz * sizeof(float) + 1);
+    for (i = 0; row_ptr && cols && vals && i < n; i++)
+    {
+        row_ptr[i] = e;
+        for (j = 0; j <= i; j++)
+        {
+            if (j == i || mat->data[i * n + j] != 0)
+            {
+                cols[e] = j;
+                vals[e] = mat->data[i * n + j];
+                ++e;
+            }
+        }
+        row_ptr[i + 1] = e;
+    }
+    if (row_ptr && cols && vals)
+    {
+        pre = MatPrecondICSparse(n, row_ptr, cols, vals);
+    }
+
+    free(row_ptr);
+    free(cols);
+    free(vals);
+    return pre;
+}
+
+void MatPrecondDestroy(mat_precond_t* pre)
+{
+    if (!pre)
+    {
+        return;
+    }
+    free(pre->inv_diag);
+    free(pre->row_ptr);
+    free(pre->cols);
+    free(pre->vals);
+    free(pre);
+}
+
+void MatPrecondApply(const float* r, float* z, void* precond)
+{
+    const mat_precond_t* pre = (const mat_precond_t*)precond;
+    size_t n = pre->n;
+    size_t i, e = 0;
+
+    if (pre->kind == PRECOND_JACOBI)
+    {
+        for (i = 0; i < n; i++)
+        {
+            z[i] = pre->inv_diag[i] * r[i];
+        }
+        return;
+    }
+
+    /* z = L^-T L^-1 r, both triangular solves in place */
+    for (i = 0; i < n; i++)
+    {
+        size_t diag = pre->row_ptr[i + 1] - 1;
+        float sum = r[i];
+
+        for (e = pre->row_ptr[i]; e < diag; e++)
+        {
+            sum -= pre->vals[e] * z[pre->cols[e]];
+        }
+        z[i] = sum / pre->vals[diag];
+    }
+    for (i = n; i-- > 0;)
+    {
+        size_t diag = pre->row_ptr[i + 1] - 1;
+
+        z[i] /= pre->vals[diag];
+        for (e = pre->row_ptr[i]; e < diag; e++)
+        {
+            z[pre->cols[e]] -= pre->vals[e] * z[i];
+        }
+    }
+}
+
+mat_cg_t* MatCGCreate(size_t n)
+{
+    mat_cg_t* cg = (mat_cg_t*)malloc(sizeof(mat_cg_t));
+
+    if (!cg)
+    {
+        return NULL;
+    }
+    cg->n = n;
+    cg->r = (float*)malloc(n * sizeof(float) + 1);
+    cg->z = (float*)malloc(n * sizeof(float) + 1);
+    cg->p = (float*)malloc(n * sizeof(float) + 1);
+    cg->q = (float*)malloc(n * sizeof(float) + 1);
+    if (!cg->r || !cg->z || !cg->p || !cg->q)
+    {
+        MatCGDestroy(cg);
+        return NULL;
+    }
+    return cg;
+}
+
+void MatCGDestroy(mat_cg_t* cg)
+{
+    if (!cg)
+    {
+        return;
+    }
+    free(cg->r);
+    free(cg->z);
+    free(cg->p);
+    free(cg->q);
+    free(cg);
+}
+
+int MatCGSolve(mat_cg_t* cg, mat_matvec_fn op, void* op_ctx, mat_precond_fn precond, void* precond_ctx,
+               const float* b, float* x, float tol, size_t max_iter, size_t* iters)
+{
+    size_t n = cg->n;
+    double b_norm = sqrt(DotD(b, b, n));
+    double rz = 0;
+    size_t iter, i = 0;
+
+    if (iters)
+    {
+        *iters = 0;
+    }
+    if (b_norm == 0)
+    {
+        memset(x, 0, n * sizeof(float));
+        return 0;
+    }
+
+    op(x, cg->q, op_ctx);
+    for (i = 0; i < n; i++)
+    {
+        cg->r[i] = b[i] - cg->q[i];
+    }
+    if (sqrt(DotD(cg->r, cg->r, n)) <= tol * b_norm)
+    {
+        return 0;
+    }
+    if (precond)
+    {
+        precond(cg->r, cg->z, precond_ctx);
+    }
+    else
+    {
+        memcpy(cg->z, cg->r, n * sizeof(float));
+    }
+    memcpy(cg->p, cg->z, n * sizeof(float));
+    rz = DotD(cg->r, cg->z, n);
+
+    for (iter = 1; iter <= max_iter; iter++)
+    {
+        double pq = 0;
+        double rz_next = 0;
+        float alpha = 0;
+        float beta = 0;
+
+        op(cg->p, cg->q, op_ctx);
+        pq = DotD(cg->p, cg->q, n);
+        if (!(pq > 0))
+        {
+            return 1; /* A (or the preconditioner) is not positive definite */
+        }
+        alpha = (float)(rz / pq);
+        for (i = 0; i < n; i++)
+        {
+            x[i] += alpha * cg->p[i];
+            cg->r[i] -= alpha * cg->q[i];
+        }
+        if (iters)
+        {
+            *iters = iter;
+        }
+        if (sqrt(DotD(cg->r, cg->r, n)) <= tol * b_norm)
+        {
+            return 0;
+        }
+
+        if (precond)
+        {
+            precond(cg->r, cg->z, precond_ctx);
+        }
+        else
+        {
+            memcpy(cg->z, cg->r, n * sizeof(float));
+        }
+        rz_next = DotD(cg->r, cg->z, n);
+        beta = (float)(rz_next / rz);
+        rz = rz_next;
+        for (i = 0; i < n; i++)
+        {
+            cg->p[i] = cg->z[i] + beta * cg->p[i];
+        }
+    }
+
+    return 2;
+}
+
+
+
+/* ------------------------------- text I/O ------------------------------- */
+
+#define TEXT_EXACT_DIGITS 15    /* a double holds 15 decimal digits exactly */
+#define TEXT_EXACT_POW10 22     /* and 10^22 exactly */
+#define TEXT_FLOAT_CHARS 32     /* longest "%.9g" of a float plus separator */
+#define TEXT_MAX_PRECISION 9    /* 9 significant digits round-trip any float */
+#define TEXT_ROWS_PER_ROUND 4096
+#define TEXT_MIN_CHUNK (1 << 20)
+#define TEXT_MIN_VALUES 4096
+#define MM_BANNER "%%MatrixMarket"
+#define MM_LINE_SIZE 1024
+
+static const double g_pow10[TEXT_EXACT_POW10 + 1] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+typedef struct csv_job_t
+{
+    const char* text;
+    size_t size;
+    size_t n_cols;
+    size_t* line_counts; /* per worker, then turned into first row indices */
+    float* data;
+    int* errors;
+} csv_job_t;
+
+typedef struct csv_write_job_t
+{
+    const matrix_t* mat;
+    size_t first_row;
+    char** texts;        /* one buffer per worker */
+    size_t* lengths;
+    char separator;
+} csv_write_job_t;
+
+typedef struct mm_job_t
+{
+    csv_job_t lines;     /* the entry lines, counted as the CSV reader does */
+    size_t n_rows;
+    size_t n_cols;
+    int pattern;
+    size_t* rows;        /* coordinate entries, 0-based; NULL for arrays */
+    size_t* cols;
+    float* values;
+} mm_job_t;
+
+static int IsBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Parses one number starting at p. Up to 15 significant digits scaled by
+ * an exact power of ten cover nearly all input with one rounding; the
+ * rest (long mantissas, large exponents, inf, nan) goes to strtod, which
+ * relies on the text ending in a NUL somewhere after p.
+ * Returns the character after the number, NULL if there is none. */
+static const char* ParseFloat(const char* p, float* out)
+{
+    const char* start = NULL;
+    double mantissa = 0;
+    int digits = 0;
+    int exp10 = 0;
+    int negative = 0;
+    int any = 0;
+
+    while (IsBlank(*p))
+    {
+        ++p;
+    }
+    start = p;
+    if (*p == '-' || *p == '+')
+    {
+        negative = *p == '-';
+        ++p;
+    }
+
+    for (; *p >= '0' && *p <= '9'; p++, any = 1)
+    {
+        if (digits < TEXT_EXACT_DIGITS)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa > 0;
+        }
+        else
+        {
+            ++exp10;
+        }
+    }
+    if (*p == '.')
+    {
+        for (++p; *p >= '0' && *p <= '9'; p++, any = 1)
+        {
+            if (digits < TEXT_EXACT_DIGITS)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa > 0;
+                --exp10;
+            }
+        }
+    }
+    if (any && (*p == 'e' || *p == 'E'))
+    {
+        const char* q = p + 1;
+        int exp_negative = 0;
+        int exp = 0;
+
+        if (*q == '-' || *q == '+')
+        {
+            exp_negative = *q == '-';
+            ++q;
+        }
+        if (*q >= '0' && *q <= '9')
+        {
+            for (; *q >= '0' && *q <= '9'; q++)
+            {
+                exp = exp < 10000 ? exp * 10 + (*q - '0') : exp;
+            }
+            exp10 += exp_negative ? -exp : exp;
+            p = q;
+        }
+    }
+
+    if (!any || digits >= TEXT_EXACT_DIGITS || exp10 > TEXT_EXACT_POW10 || exp10 < -TEXT_EXACT_POW10)
+    {
+        char* end = NULL;
+        double value = strtod(start, &end);
+
+        if (end == start)
+        {
+            return NULL;
+        }
+        *out = (float)value;
+        return end;
+    }
+
+    mantissa = exp10 < 0 ? mantissa / g_pow10[-exp10] : mantissa * g_pow10[exp10];
+    *out = (float)(negative ? -mantissa : mantissa);
+    return p;
+}
+
+/* Parses an unsigned decimal integer starting at p, without sign,
+ * fraction or exponent. Returns the character after it, NULL if there is
+ * none or it does not fit a size_t. */
+static const char* ParseSize(const char* p, size_t* out)
+{
+    char* end = NULL;
+    unsigned long value = 0;
+
+    while (IsBlank(*p))
+    {
+        ++p;
+    }
+    if (*p < '0' || *p > '9')
+    {
+        return NULL;
+    }
+    errno = 0;
+    value = strtoul(p, &end, 10);
+    if (errno == ERANGE || value > (size_t)-1 || *end == '.' || *end == 'e' || *end == 'E')
+    {
+        return NULL;
+    }
+    *out = (size_t)value;
+    return end;
+}
+
+/* reads a whole file into a NUL terminated buffer */
+static char* ReadWholeFile(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    char* text = NULL;
+    long length = 0;
+
+    if (!file)
+    {
+        return NULL;
+    }
+    if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        text = (char*)malloc((size_t)length + 1);
+    }
+    if (text && fread(text, 1, (size_t)length, file) != (size_t)length)
+    {
+        free(text);
+        text = NULL;
+    }
+    fclose(file);
+
+    if (text)
+    {
+        text[length] = '\0';
+        *size = (size_t)length;
+    }
+    return text;
+}
+
+/* start of the first line beginning in [pos, size) */
+static size_t LineStartFrom(const char* text, size_t size, size_t pos)
+{
+    const char* newline = NULL;
+
+    if (pos == 0)
+    {
+        return 0;
+    }
+    newline = (const char*)memchr(text + pos - 1, '\n', size - pos + 1);
+    return newline ? (size_t)(newline - text) + 1 : size;
+}
+
+static size_t LineEnd(const char* text, size_t size, size_t pos)
+{
+    const char* newline = (const char*)memchr(text + pos, '\n', size - pos);
+
+    return newline ? (size_t)(newline - text) : size;
+}
+
+static int IsBlankLine(const char* text, size_t begin, size_t end)
+{
+    for (; begin < end; begin++)
+    {
+        if (!IsBlank(text[begin]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* pass 1: non-blank lines starting in the worker's byte range */
+static void CsvCountRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    csv_job_t* job = (csv_job_t*)arg;
+    size_t pos = LineStartFrom(job->text, job->size, begin);
+    size_t count = 0;
+
+    while (pos < end)
+    {
+        size_t line_end = LineEnd(job->text, job->size, pos);
+
+        count += !IsBlankLine(job->text, pos, line_end);
+        pos = line_end + 1;
+    }
+    job->line_counts[worker] = count;
+}
+
+/* pass 2: parse those lines into their rows */
+static void CsvParseRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    csv_job_t* job = (csv_job_t*)arg;
+    size_t pos = LineStartFrom(job->text, job->size, begin);
+    size_t row = job->line_counts[worker];
+
+    while (pos < end && !job->errors[worker])
+    {
+        size_t line_end = LineEnd(job->text, job->size, pos);
+        const char* p = job->text + pos;
+        float* out = job->data + row * job->n_cols;
+        size_t col = 0;
+
+        if (IsBlankLine(job->text, pos, line_end))
+        {
+            pos = line_end + 1;
+            continue;
+        }
+        for (col = 0; col < job->n_cols && p; col++)
+        {
+            p = ParseFloat(p, &out[col]);
+            while (p && IsBlank(*p))
+            {
+                ++p;
+            }
+            if (p && col + 1 < job->n_cols)
+            {
+                p = *p == ',' ? p + 1 : NULL;
+            }
+        }
+        if (!p || p != job->text + line_end)
+        {
+            job->errors[worker] = 1;
+        }
+        ++row;
+        pos = line_end + 1;
+    }
+}
+
+matrix_t* MatReadCSV(const char* path)
+{
+    csv_job_t job;
+    matrix_t* mat = NULL;
+    size_t size = 0;
+    size_t workers = 0;
+    size_t first_line_end = 0;
+    size_t n_rows = 0;
+    size_t w, pos = 0;
+    float probe = 0;
+    char* text = ReadWholeFile(path, &size);
+
+    if (!text)
+    {
+        return NULL;
+    }
+
+    /* the first non-blank line gives the column count, or is a header */
+    while (pos < size && IsBlankLine(text, pos, LineEnd(text, size, pos)))
+    {
+        pos = LineEnd(text, size, pos) + 1;
+    }
+    first_line_end = pos < size ? LineEnd(text, size, pos) : size;
+    job.n_cols = pos < size ? 1 : 0;
+    for (w = pos; w < first_line_end; w++)
+    {
+        job.n_cols += text[w] == ',';
+    }
+    if (pos < size && !ParseFloat(text + pos, &probe))
+    {
+        pos = first_line_end + 1;
+    }
+    pos = pos > size ? size : pos;
+
+    job.text = text + pos;
+    job.size = size - pos;
+    workers = ParallelWorkers(job.size, TEXT_MIN_CHUNK);
+    job.line_counts = (size_t*)malloc(workers * sizeof(size_t));
+    job.errors = (int*)calloc(workers, sizeof(int));
+    if (!job.line_counts || !job.errors)
+    {
+        free(job.line_counts);
+        free(job.errors);
+        free(text);
+        return NULL;
+    }
+
+    ParallelForWorkers(job.size, workers, CsvCountRange, &job);
+    for (w = 0; w < workers; w++)
+    {
+        size_t count = job.line_counts[w];
+
+        job.line_counts[w] = n_rows;
+        n_rows += count;
+    }
+
+    mat = MatCreate(n_rows, job.n_cols, NULL);
+    if (mat)
+    {
+        job.data = mat->data;
+        ParallelForWorkers(job.size, workers, CsvParseRange, &job);
+        for (w = 0; w < workers; w++)
+        {
+            if (job.errors[w])
+            {
+                MatDestroy(mat);
+                mat = NULL;
+                break;
+            }
+        }
+    }
+
+    free(job.line_counts);
+    free(job.errors);
+    free(text);
+    return mat;
+}
+
+/* shortest "%.*g" that reads back as the same float; precision p
+ * round-tripping implies p + 1 does, so the search is a bisection */
+static size_t FormatFloat(float value, char* out)
+{
+    int lo = 1;
+    int hi = TEXT_MAX_PRECISION;
+
+    if (value != value || value - value != 0)
+    {
+        return (size_t)sprintf(out, "%g", value); /* nan, inf, -inf */
+    }
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        sprintf(out, "%.*g", mid, value);
+        if ((float)strtod(out, NULL) == value)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+    return (size_t)sprintf(out, "%.*g", lo, value);
+}
+
+static void CsvFormatRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    csv_write_job_t* job = (csv_write_job_t*)arg;
+    size_t n_cols = job->mat->n_cols;
+    char* out = job->texts[worker];
+    size_t length = 0;
+    size_t i, j = 0;
+
+    for (i = job->first_row + begin; i < job->first_row + end; i++)
+    {
+        const float* row = job->mat->data + i * n_cols;
+
+        for (j = 0; j < n_cols; j++)
+        {
+            length += FormatFloat(row[j], out + length);
+            out[length++] = j + 1 < n_cols ? job->separator : '\n';
+        }
+        if (n_cols == 0)
+        {
+            out[length++] = '\n';
+        }
+    }
+    job->lengths[worker] = length;
+}
+
+/* rows are formatted in parallel, TEXT_ROWS_PER_ROUND at a time, each
+ * worker into its own buffer, and the buffers written out in order */
+static int WriteRowsText(const matrix_t* mat, FILE* file, char separator)
+{
+    csv_write_job_t job;
+    size_t min_rows = TEXT_MIN_VALUES / (mat->n_cols + 1) + 1;
+    size_t row_chars = (mat->n_cols + 1) * TEXT_FLOAT_CHARS;
+    size_t capacity[MAX_THREADS];
+    size_t w = 0;
+    int status = 0;
+
+    if (mat->layout != MAT_ROW_MAJOR)
+    {
+        matrix_t* rows = RowMajor(mat);
+
+        status = rows ? WriteRowsText(rows, file, separator) : 1;
+        MatDestroy(rows);
+        return status;
+    }
+
+    memset(capacity, 0, sizeof(capacity));
+    job.mat = mat;
+    job.separator = separator;
+    job.texts = (char**)calloc(MAX_THREADS, sizeof(char*));
+    job.lengths = (size_t*)calloc(MAX_THREADS, sizeof(size_t));
+    status = !job.texts || !job.lengths;
+
+    for (job.first_row = 0; !status && job.first_row < mat->n_rows; job.first_row += TEXT_ROWS_PER_ROUND)
+    {
+        size_t rows = mat->n_rows - job.first_row;
+        size_t workers = 0;
+        size_t needed = 0;
+
+        rows = rows < TEXT_ROWS_PER_ROUND ? rows : TEXT_ROWS_PER_ROUND;
+        workers = ParallelWorkers(rows, min_rows);
+        needed = (rows / workers + 1) * row_chars;
+        for (w = 0; w < workers && !status; w++)
+        {
+            if (needed > capacity[w])
+            {
+                free(job.texts[w]);
+                job.texts[w] = (char*)malloc(needed);
+                capacity[w] = job.texts[w] ? needed : 0;
+                status = !job.texts[w];
+            }
+        }
+        if (status)
+        {
+            break;
+        }
+
+        ParallelForWorkers(rows, workers, CsvFormatRange, &job);
+        for (w = 0; w < workers && !status; w++)
+        {
+            status = fwrite(job.texts[w], 1, job.lengths[w], file) != job.lengths[w];
+        }
+    }
+
+    for (w = 0; job.texts && w < MAX_THREADS; w++)
+    {
+        free(job.texts[w]);
+    }
+    free(job.texts);
+    free(job.lengths);
+    return status;
+}
+
+int MatWriteCSV(const matrix_t* mat, const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    int status = 0;
+
+    if (!file)
+    {
+        return 1;
+    }
+    status = WriteRowsText(mat, file, ',');
+    return fclose(file) != 0 || status;
+}
+
+int MatWriteMatrixMarket(const matrix_t* mat, const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    matrix_t* columns = NULL;
+    matrix_t* as_column = NULL;
+    int status = 1;
+
+    if (!file)
+    {
+        return 1;
+    }
+
+    /* array format lists the entries column by column, one per line */
+    columns = MatTranspose(mat);
+    as_column = columns ? MatWrap(mat->n_rows * mat->n_cols, 1, columns->data) : NULL;
+    if (as_column && fprintf(file, "%s matrix array real general\n%lu %lu\n", MM_BANNER,
+                             (unsigned long)mat->n_rows, (unsigned long)mat->n_cols) > 0)
+    {
+        status = WriteRowsText(as_column, file, ' ');
+    }
+
+    MatDestroy(as_column);
+    MatDestroy(columns);
+    return fclose(file) != 0 || status;
+}
+
+/* lower-cased copy of the next whitespace separated word of line */
+static const char* NextWord(const char* line, char* word, size_t size)
+{
+    size_t i = 0;
+
+    while (*line == ' ' || *line == '\t')
+    {
+        ++line;
+    }
+    for (; *line && *line != ' ' && *line != '\t' && *line != '\n' && *line != '\r'; line++)
+    {
+        if (i + 1 < size)
+        {
+            word[i++] = (char)(*line >= 'A' && *line <= 'Z' ? *line - 'A' + 'a' : *line);
+        }
+    }
+    word[i] = '\0';
+    return line;
+}
+
+/* one entry per non-blank line: "row col [value]" or "value" for arrays */
+static void MmParseRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    mm_job_t* job = (mm_job_t*)arg;
+    const char* text = job->lines.text;
+    size_t pos = LineStartFrom(text, job->lines.size, begin);
+    size_t k = job->lines.line_counts[worker];
+
+    while (pos < end && !job->lines.errors[worker])
+    {
+        size_t line_end = LineEnd(text, job->lines.size, pos);
+        const char* p = text + pos;
+        size_t row = 0;
+        size_t col = 0;
+        float value = 1;
+
+        if (IsBlankLine(text, pos, line_end))
+        {
+            pos = line_end + 1;
+            continue;
+        }
+        if (job->rows)
+        {
+            p = ParseSize(p, &row);
+            p = p ? ParseSize(p, &col) : NULL;
+            if (p && (row < 1 || col < 1 || row > job->n_rows || col > job->n_cols))
+            {
+                p = NULL;
+            }
+        }
+        if (p && !job->pattern)
+        {
+            p = ParseFloat(p, &value);
+        }
+        while (p && IsBlank(*p))
+        {
+            ++p;
+        }
+        if (!p || p != text + line_end)
+        {
+            job->lines.errors[worker] = 1;
+            break;
+        }
+        if (job->rows)
+        {
+            job->rows[k] = row - 1;
+            job->cols[k] = col - 1;
+        }
+        job->values[k++] = value;
+        pos = line_end + 1;
+    }
+}
+
+/* Matrix Market: array or coordinate, real/integer/pattern values,
+ * general/symmetric/skew-symmetric storage. The entry lines are parsed in
+ * parallel like CSV rows; coordinate entries are then stored in file
+ * order, so a repeated coordinate keeps its last value. */
+matrix_t* MatReadMatrixMarket(const char* path)
+{
+    char banner[MM_LINE_SIZE];
+    char object[MM_LINE_SIZE];
+    char format[MM_LINE_SIZE];
+    char field[MM_LINE_SIZE];
+    char symmetry[MM_LINE_SIZE];
+    const char* p = NULL;
+    matrix_t* mat = NULL;
+    matrix_t* columns = NULL;
+    mm_job_t job;
+    size_t size = 0;
+    char* text = ReadWholeFile(path, &size);
+    size_t dims[3] = {0, 0, 0};
+    int coordinate, symmetric, skew = 0;
+    size_t n_rows, n_cols, entries, workers, lines, w, e, d = 0;
+    int failed = 0;
+
+    if (!text)
+    {
+        return NULL;
+    }
+
+    p = NextWord(text, banner, sizeof(banner));
+    p = NextWord(p, object, sizeof(object));
+    p = NextWord(p, format, sizeof(format));
+    p = NextWord(p, field, sizeof(field));
+    p = NextWord(p, symmetry, sizeof(symmetry));
+    coordinate = strcmp(format, "coordinate") == 0;
+    job.pattern = strcmp(field, "pattern") == 0;
+    symmetric = strcmp(symmetry, "symmetric") == 0;
+    skew = strcmp(symmetry, "skew-symmetric") == 0;
+    if (strcmp(banner, "%%matrixmarket") != 0 || strcmp(object, "matrix") != 0 ||
+        (!coordinate && strcmp(format, "array") != 0) ||
+        (strcmp(field, "real") != 0 && strcmp(field, "integer") != 0 && !job.pattern) ||
+        (!symmetric && !skew && strcmp(symmetry, "general") != 0) ||
+        (job.pattern && !coordinate) ||
+        (!coordinate && (symmetric || skew))) /* packed symmetric arrays are rare enough not to support */
+    {
+        free(text);
+        return NULL;
+    }
+
+    /* skip the rest of the banner and the % comment lines */
+    do
+    {
+        p = strchr(p, '\n');
+        p = p ? p + 1 : text + size;
+    } while (*p == '%');
+
+    for (d = 0; d < (size_t)(coordinate ? 3 : 2) && p; d++)
+    {
+        p = ParseSize(p, &dims[d]);
+        while (p && (IsBlank(*p) || *p == '\n'))
+        {
+            ++p;
+        }
+    }
+    n_rows = dims[0];
+    n_cols = dims[1];
+    if (!p || (n_cols > 0 && n_rows > (size_t)-1 / n_cols))
+    {
+        free(text);
+        return NULL;
+    }
+    entries = coordinate ? dims[2] : n_rows * n_cols;
+
+    /* pass 1: the entry lines must be exactly as many as announced */
+    job.lines.text = p;
+    job.lines.size = size - (size_t)(p - text);
+    job.n_rows = n_rows;
+    job.n_cols = n_cols;
+    job.rows = NULL;
+    job.cols = NULL;
+    job.values = NULL;
+    workers = ParallelWorkers(job.lines.size, TEXT_MIN_CHUNK);
+    job.lines.line_counts = (size_t*)malloc(workers * sizeof(size_t) + 1);
+    job.lines.errors = (int*)calloc(workers + 1, sizeof(int));
+    failed = !job.lines.line_counts || !job.lines.errors;
+    if (!failed)
+    {
+        ParallelForWorkers(job.lines.size, workers, CsvCountRange, &job.lines);
+    }
+    for (w = 0, lines = 0; !failed && w < workers; w++)
+    {
+        size_t count = job.lines.line_counts[w];
+
+        job.lines.line_counts[w] = lines;
+        lines += count;
+    }
+    failed = failed || lines != entries;
+
+    /* pass 2: arrays list the entries column by column, a transposed
+     * row-major matrix; coordinates go to triplets first */
+    if (!failed && coordinate)
+    {
+        job.rows = (size_t*)malloc(entries * sizeof(size_t) + 1);
+        job.cols = (size_t*)malloc(entries * sizeof(size_t) + 1);
+        job.values = (float*)malloc(entries * sizeof(float) + 1);
+        mat = MatCreate(n_rows, n_cols, NULL);
+        failed = !job.rows || !job.cols || !job.values || !mat;
+    }
+    else if (!failed)
+    {
+        columns = MatCreate(n_cols, n_rows, NULL);
+        job.values = columns ? columns->data : NULL;
+        failed = !columns;
+    }
+    if (!failed)
+    {
+        ParallelForWorkers(job.lines.size, workers, MmParseRange, &job);
+    }
+    for (w = 0; !failed && w < workers; w++)
+    {
+        failed = job.lines.errors[w];
+    }
+
+    for (e = 0; !failed && coordinate && e < entries; e++)
+    {
+        size_t row = job.rows[e];
+        size_t col = job.cols[e];
+
+        mat->data[row * n_cols + col] = job.values[e];
+        if ((symmetric || skew) && row != col && col < n_rows && row < n_cols)
+        {
+            mat->data[col * n_cols + row] = skew ? -job.values[e] : job.values[e];
+        }
+    }
+    if (!failed && !coordinate)
+    {
+        mat = MatTranspose(columns);
+    }
+    if (failed)
+    {
+        MatDestroy(mat);
+        mat = NULL;
+    }
+
+    if (coordinate)
+    {
+        free(job.values);
+    }
+    free(job.rows);
+    free(job.cols);
+    free(job.lines.line_counts);
+    free(job.lines.errors);
+    MatDestroy(columns);
+    free(text);
+    return mat;
+}
+
+
+
+/* ------------------------- kronecker and blocks ------------------------- */
+
+struct mat_kron_t
+{
+    matrix_t* a;
+    matrix_t* b_t;       /* b transposed, the right-hand factor of X B^T */
+    float* scratch;
+    int a_first;         /* order of the two products, the cheaper one */
+};
+
+typedef struct kron_job_t
+{
+    const matrix_t* a;
+    const matrix_t* b;
+    float* out;
+} kron_job_t;
+
+/* row i * b_rows + k of the product is a[i][j] * b[k] for j in order */
+static void KronRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    kron_job_t* job = (kron_job_t*)arg;
+    size_t b_rows = job->b->n_rows;
+    size_t b_cols = job->b->n_cols;
+    size_t a_cols = job->a->n_cols;
+    size_t row, j, l = 0;
+
+    (void)worker;
+    for (row = begin; row < end; row++)
+    {
+        const float* a_row = job->a->data + row / b_rows * a_cols;
+        const float* b_row = job->b->data + row % b_rows * b_cols;
+        float* out = job->out + row * a_cols * b_cols;
+
+        for (j = 0; j < a_cols; j++, out += b_cols)
+        {
+            for (l = 0; l < b_cols; l++)
+            {
+                out[l] = a_row[j] * b_row[l];
+            }
+        }
+    }
+}
+
+matrix_t* MatKron(const matrix_t* a, const matrix_t* b)
+{
+    profile_mark_t mark;
+    kron_job_t job;
+    matrix_t* result = NULL;
+
+    if (a->layout != MAT_ROW_MAJOR || b->layout != MAT_ROW_MAJOR)
+    {
+        matrix_t* a_rows = RowMajor(a);
+        matrix_t* b_rows = RowMajor(b);
+
+        result = a_rows && b_rows ? MatKron(a_rows, b_rows) : NULL;
+        MatDestroy(a_rows);
+        MatDestroy(b_rows);
+        return result;
+    }
+
+    ProfileBegin(&mark);
+    result = MatCreate(a->n_rows * b->n_rows, a->n_cols * b->n_cols, NULL);
+    if (!result)
+    {
+        return NULL;
+    }
+    job.a = a;
+    job.b = b;
+    job.out = result->data;
+    ParallelFor(result->n_rows, RowsPerWorker(result->n_cols), KronRange, &job);
+    ProfileEnd(&mark, "MatKron", a->n_rows, a->n_cols);
+    return result;
+}
+
+/* the height of block row r or width of block column c: the first
+ * non-NULL block along it sets it and every other one must agree */
+static int BlockExtent(const matrix_t* const* blocks, size_t count, size_t stride, int rows, size_t* extent)
+{
+    size_t i = 0;
+    int found = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        const matrix_t* block = blocks[i * stride];
+        size_t size = 0;
+
+        if (!block)
+        {
+            continue;
+        }
+        size = rows ? block->n_rows : block->n_cols;
+        if (found && size != *extent)
+        {
+            return 1;
+        }
+        *extent = size;
+        found = 1;
+    }
+    return !found;
+}
+
+matrix_t* MatBlock(const matrix_t* const* blocks, size_t block_rows, size_t block_cols)
+{
+    matrix_t* result = NULL;
+    size_t* heights = (size_t*)malloc((block_rows + 1) * sizeof(size_t));
+    size_t* widths = (size_t*)malloc((block_cols + 1) * sizeof(size_t));
+    size_t n_rows = 0;
+    size_t n_cols = 0;
+    size_t r, c, i = 0;
+    int status = !heights || !widths || block_rows == 0 || block_cols == 0;
+
+    for (r = 0; !status && r < block_rows; r++)
+    {
+        status = BlockExtent(blocks + r * block_cols, block_cols, 1, 1, &heights[r]);
+        n_rows += heights[r];
+    }
+    for (c = 0; !status && c < block_cols; c++)
+    {
+        status = BlockExtent(blocks + c, block_rows, block_cols, 0, &widths[c]);
+        n_cols += widths[c];
+    }
+    result = status ? NULL : MatCreate(n_rows, n_cols, NULL);
+
+    /* MatCreate zeroed the NULL blocks, the rest is copied row by row */
+    for (r = 0, n_rows = 0; result && r < block_rows; n_rows += heights[r], r++)
+    {
+        for (c = 0, n_cols = 0; c < block_cols; n_cols += widths[c], c++)
+        {
+            const matrix_t* block = blocks[r * block_cols + c];
+
+            for (i = 0; block && i < heights[r]; i++)
+            {
+                float* out = result->data + (n_rows + i) * result->n_cols + n_cols;
+                size_t j = 0;
+
+                if (block->layout == MAT_ROW_MAJOR)
+                {
+                    memcpy(out, block->data + i * widths[c], widths[c] * sizeof(float));
+                    continue;
+                }
+                for (j = 0; j < widths[c]; j++)
+                {
+                    out[j] = block->data[j * heights[r] + i];
+                }
+            }
+        }
+    }
+
+    free(heights);
+    free(widths);
+    return result;
+}
+
+mat_kron_t* MatKronCreate(const matrix_t* a, const matrix_t* b)
+{
+    mat_kron_t* kron = (mat_kron_t*)calloc(1, sizeof(mat_kron_t));
+    size_t a_first_cost = a->n_rows * a->n_cols * b->n_cols + a->n_rows * b->n_cols * b->n_rows;
+    size_t b_first_cost = a->n_cols * b->n_cols * b->n_rows + a->n_rows * a->n_cols * b->n_rows;
+
+    if (!kron)
+    {
+        return NULL;
+    }
+    kron->a_first = a_first_cost < b_first_cost;
+    kron->a = RowMajor(a);
+    kron->b_t = MatTranspose(b);
+    kron->scratch = (float*)malloc((kron->a_first ? a->n_rows * b->n_cols : a->n_cols * b->n_rows) * sizeof(float) + 1);
+    if (!kron->a || !kron->b_t || !kron->scratch)
+    {
+        MatKronDestroy(kron);
+        return NULL;
+    }
+    return kron;
+}
+
+void MatKronDestroy(mat_kron_t* kron)
+{
+    if (!kron)
+    {
+        return;
+    }
+    MatDestroy(kron->a);
+    MatDestroy(kron->b_t);
+    free(kron->scratch);
+    free(kron);
+}
+
+/* With x read as the a_cols x b_cols matrix X, (A kron B) x is A X B^T
+ * read row by row, so two small products replace the big one. */
+void MatKronMatvec(const float* x, float* y, void* ctx)
+{
+    mat_kron_t* kron = (mat_kron_t*)ctx;
+    const matrix_t* a = kron->a;
+    size_t b_rows = kron->b_t->n_cols;
+    size_t b_cols = kron->b_t->n_rows;
+
+    memset(y, 0, a->n_rows * b_rows * sizeof(float));
+    if (kron->a_first)
+    {
+        memset(kron->scratch, 0, a->n_rows * b_cols * sizeof(float));
+        GemmAccumulate(a->n_rows, a->n_cols, b_cols, a->data, a->n_cols, x, b_cols, kron->scratch, b_cols);
+        GemmAccumulate(a->n_rows, b_cols, b_rows, kron->scratch, b_cols, kron->b_t->data, b_rows, y, b_rows);
+    }
+    else
+    {
+        memset(kron->scratch, 0, a->n_cols * b_rows * sizeof(float));
+        GemmAccumulate(a->n_cols, b_cols, b_rows, x, b_cols, kron->b_t->data, b_rows, kron->scratch, b_rows);
+        GemmAccumulate(a->n_rows, a->n_cols, b_rows, a->data, a->n_cols, kron->scratch, b_rows, y, b_rows);
+    }
+}
+
+
+
+/* ----------------------------- convolution ----------------------------- */
+
+#define CONV_COLUMN_FLOATS (1 << 16) /* im2col band, sized to stay in cache */
+#define WINOGRAD_TILE 4              /* F(2x2, 3x3): 4x4 inputs, 2x2 outputs */
+#define WINOGRAD_OUT 2
+
+typedef struct conv_job_t
+{
+    const matrix_t* image;
+    const float* kernels;   /* one filter per row: kh * kw taps, or 16 Winograd taps */
+    size_t n_filters;
+    size_t kh;
+    size_t kw;
+    size_t stride;
+    size_t padding;
+    size_t out_h;
+    size_t out_w;
+    float* out;
+    int* errors;
+} conv_job_t;
+
+/* image value at row, col of the zero padded image */
+static float PaddedAt(const conv_job_t* job, size_t row, size_t col)
+{
+    if (row < job->padding || col < job->padding ||
+        row - job->padding >= job->image->n_rows || col - job->padding >= job->image->n_cols)
+    {
+        return 0;
+    }
+    return job->image->data[(row - job->padding) * job->image->n_cols + col - job->padding];
+}
+
+/* Output rows [begin, end) band by band: the band's patches become the
+ * columns of a kh * kw x (band * out_w) matrix, and all filters at once
+ * are one GEMM against it. */
+static void Im2colRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    conv_job_t* job = (conv_job_t*)arg;
+    size_t taps = job->kh * job->kw;
+    size_t band = CONV_COLUMN_FLOATS / (taps * job->out_w) + 1;
+    float* columns = (float*)malloc(taps * band * job->out_w * sizeof(float));
+    size_t r0, r, c, ki, kj = 0;
+
+    if (!columns)
+    {
+        job->errors[worker] = 1;
+        return;
+    }
+
+    for (r0 = begin; r0 < end; r0 += band)
+    {
+        size_t rows = end - r0 < band ? end - r0 : band;
+        size_t width = rows * job->out_w;
+
+        for (ki = 0; ki < job->kh; ki++)
+        {
+            for (kj = 0; kj < job->kw; kj++)
+            {
+                float* column = columns + (ki * job->kw + kj) * width;
+
+                for (r = 0; r < rows; r++)
+                {
+                    for (c = 0; c < job->out_w; c++)
+                    {
+                        column[r * job->out_w + c] = PaddedAt(job, (r0 + r) * job->stride + ki, c * job->stride + kj);
+                    }
+                }
+            }
+        }
+        GemmAccumulate(job->n_filters, taps, width, job->kernels, taps, columns, width,
+                       job->out + r0 * job->out_w, job->out_h * job->out_w);
+    }
+    free(columns);
+}
+
+/* 1-D Winograd transforms, applied along rows and then columns */
+static void WinogradInput1D(const float* x, size_t stride, float* y, size_t y_stride)
+{
+    float x0 = x[0], x1 = x[stride], x2 = x[2 * stride], x3 = x[3 * stride];
+
+    y[0] = x0 - x2;
+    y[y_stride] = x1 + x2;
+    y[2 * y_stride] = x2 - x1;
+    y[3 * y_stride] = x1 - x3;
+}
+
+static void WinogradFilter1D(const float* g, size_t stride, float* y, size_t y_stride)
+{
+    float g0 = g[0], g1 = g[stride], g2 = g[2 * stride];
+
+    y[0] = g0;
+    y[y_stride] = (g0 + g1 + g2) * 0.5F;
+    y[2 * y_stride] = (g0 - g1 + g2) * 0.5F;
+    y[3 * y_stride] = g2;
+}
+
+static void WinogradOutput1D(const float* m, size_t stride, float* y, size_t y_stride)
+{
+    y[0] = m[0] + m[stride] + m[2 * stride];
+    y[y_stride] = m[stride] - m[2 * stride] - m[3 * stride];
+}
+
+/* U = G g G^T for every 3x3 filter, 16 floats each */
+static float* WinogradFilters(const matrix_t* const* filters, size_t n_filters)
+{
+    float* transformed = (float*)malloc(n_filters * WINOGRAD_TILE * WINOGRAD_TILE * sizeof(float));
+    float half[WINOGRAD_TILE * 3];
+    size_t f, i = 0;
+
+    for (f = 0; transformed && f < n_filters; f++)
+    {
+        float* u = transformed + f * WINOGRAD_TILE * WINOGRAD_TILE;
+
+        for (i = 0; i < 3; i++)
+        {
+            WinogradFilter1D(filters[f]->data + ElemIndex(filters[f], 0, i), ElemIndex(filters[f], 1, 0),
+                             half + i, 3);
+        }
+        for (i = 0; i < WINOGRAD_TILE; i++)
+        {
+            WinogradFilter1D(half + i * 3, 1, u + i * WINOGRAD_TILE, 1);
+        }
+    }
+    return transformed;
+}
+
+/* Tile rows [begin, end): each 4x4 input tile is transformed once, then
+ * 16 multiplies per filter give its 2x2 outputs instead of 36. */
+static void WinogradRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    conv_job_t* job = (conv_job_t*)arg;
+    float d[WINOGRAD_TILE * WINOGRAD_TILE];
+    float v[WINOGRAD_TILE * WINOGRAD_TILE];
+    float m[WINOGRAD_TILE * WINOGRAD_TILE];
+    float half[WINOGRAD_OUT * WINOGRAD_TILE];
+    float y[WINOGRAD_OUT * WINOGRAD_OUT];
+    size_t tiles_w = (job->out_w + 1) / WINOGRAD_OUT;
+    size_t ty, tx, f, i, j = 0;
+
+    (void)worker;
+    for (ty = begin; ty < end; ty++)
+    {
+        for (tx = 0; tx < tiles_w; tx++)
+        {
+            size_t row = ty * WINOGRAD_OUT;
+            size_t col = tx * WINOGRAD_OUT;
+
+            for (i = 0; i < WINOGRAD_TILE; i++)
+            {
+                for (j = 0; j < WINOGRAD_TILE; j++)
+                {
+                    d[i * WINOGRAD_TILE + j] = PaddedAt(job, row + i, col + j);
+                }
+            }
+            for (i = 0; i < WINOGRAD_TILE; i++)
+            {
+                WinogradInput1D(d + i, WINOGRAD_TILE, m + i, WINOGRAD_TILE);
+            }
+            for (i = 0; i < WINOGRAD_TILE; i++)
+            {
+                WinogradInput1D(m + i * WINOGRAD_TILE, 1, v + i * WINOGRAD_TILE, 1);
+            }
+
+            for (f = 0; f < job->n_filters; f++)
+            {
+                const float* u = job->kernels + f * WINOGRAD_TILE * WINOGRAD_TILE;
+                float* out = job->out + f * job->out_h * job->out_w;
+
+                for (i = 0; i < WINOGRAD_TILE * WINOGRAD_TILE; i++)
+                {
+                    m[i] = u[i] * v[i];
+                }
+                for (i = 0; i < WINOGRAD_TILE; i++)
+                {
+                    WinogradOutput1D(m + i, WINOGRAD_TILE, half + i, WINOGRAD_TILE);
+                }
+                for (i = 0; i < WINOGRAD_OUT; i++)
+                {
+                    WinogradOutput1D(half + i * WINOGRAD_TILE, 1, y + i * WINOGRAD_OUT, 1);
+                }
+
+                /* the last tile row or column may hang over the output */
+                for (i = 0; i < WINOGRAD_OUT && row + i < job->out_h; i++)
+                {
+                    for (j = 0; j < WINOGRAD_OUT && col + j < job->out_w; j++)
+                    {
+                        out[(row + i) * job->out_w + col + j] = y[i * WINOGRAD_OUT + j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+matrix_t* MatConv2D(const matrix_t* image, const matrix_t* const* filters, size_t n_filters,
+                    size_t stride, size_t padding)
+{
+    profile_mark_t mark;
+    conv_job_t job;
+    matrix_t* result = NULL;
+    matrix_t* rows = NULL;
+    float* kernels = NULL;
+    size_t workers, count, min_rows = 0;
+    size_t f, w = 0;
+    int winograd = 0;
+
+    if (n_filters == 0 || stride == 0 || filters[0]->n_rows > image->n_rows + 2 * padding ||
+        filters[0]->n_cols > image->n_cols + 2 * padding)
+    {
+        return NULL;
+    }
+    for (f = 1; f < n_filters; f++)
+    {
+        if (filters[f]->n_rows != filters[0]->n_rows || filters[f]->n_cols != filters[0]->n_cols)
+        {
+            return NULL;
+        }
+    }
+
+    ProfileBegin(&mark);
+    rows = RowMajor(image); /* PaddedAt indexes row-major data */
+    job.image = rows;
+    job.n_filters = n_filters;
+    job.kh = filters[0]->n_rows;
+    job.kw = filters[0]->n_cols;
+    job.stride = stride;
+    job.padding = padding;
+    job.out_h = (image->n_rows + 2 * padding - job.kh) / stride + 1;
+    job.out_w = (image->n_cols + 2 * padding - job.kw) / stride + 1;
+    winograd = job.kh == 3 && job.kw == 3 && stride == 1;
+    count = winograd ? (job.out_h + 1) / WINOGRAD_OUT : job.out_h;
+    min_rows = winograd ? RowsPerWorker(n_filters * job.out_w * 8)
+                        : RowsPerWorker(n_filters * job.out_w * job.kh * job.kw);
+    workers = ParallelWorkers(count, min_rows);
+    job.errors = (int*)calloc(workers, sizeof(int));
+
+    /* im2col wants the filters as the rows of one matrix */
+    if (winograd)
+    {
+        kernels = WinogradFilters(filters, n_filters);
+    }
+    else if ((kernels = (float*)malloc(n_filters * job.kh * job.kw * sizeof(float))) != NULL)
+    {
+        for (f = 0; f < n_filters; f++)
+        {
+            CopyRows(filters[f], kernels + f * job.kh * job.kw);
+        }
+    }
+    job.kernels = kernels;
+    result = kernels && job.errors && rows ? MatCreate(n_filters * job.out_h, job.out_w, NULL) : NULL;
+
+    if (result)
+    {
+        job.out = result->data;
+        ParallelForWorkers(count, workers, winograd ? WinogradRange : Im2colRange, &job);
+        for (w = 0; w < workers; w++)
+        {
+            if (job.errors[w])
+            {
+                MatDestroy(result);
+                result = NULL;
+                break;
+            }
+        }
+    }
+
+    MatDestroy(rows);
+    free(kernels);
+    free(job.errors);
+    ProfileEnd(&mark, "MatConv2D", image->n_rows, image->n_cols);
+    return result;
+}
+
+
+
+/* ---------------------------- product chains ---------------------------- */
+
+typedef struct chain_t
+{
+    const matrix_t* const* mats;
+    size_t count;
+    size_t* split;       /* count x count: where the best order splits i..j */
+    float** pool;        /* intermediate buffers no longer in use */
+    size_t* capacity;
+    size_t pooled;
+    int failed;
+} chain_t;
+
+/* best fitting pooled buffer, else the largest one grown, else a new one */
+static float* ChainTake(chain_t* chain, size_t size, size_t* capacity)
+{
+    size_t best = chain->pooled;
+    size_t largest = 0;
+    size_t p = 0;
+    float* data = NULL;
+
+    for (p = 0; p < chain->pooled; p++)
+    {
+        if (chain->capacity[p] >= size && (best == chain->pooled || chain->capacity[p] < chain->capacity[best]))
+        {
+            best = p;
+        }
+        largest = chain->capacity[p] > chain->capacity[largest] ? p : largest;
+    }
+    if (best == chain->pooled && chain->pooled > 0)
+    {
+        data = (float*)realloc(chain->pool[largest], size * sizeof(float));
+        if (data)
+        {
+            chain->pool[largest] = data;
+            chain->capacity[largest] = size;
+            best = largest;
+        }
+    }
+
+    if (best == chain->pooled)
+    {
+        data = (float*)malloc(size * sizeof(float) + 1);
+        *capacity = size;
+    }
+    else
+    {
+        data = chain->pool[best];
+        *capacity = chain->capacity[best];
+        --chain->pooled;
+        chain->pool[best] = chain->pool[chain->pooled];
+        chain->capacity[best] = chain->capacity[chain->pooled];
+    }
+    return data;
+}
+
+static void ChainGive(chain_t* chain, float* data, size_t capacity)
+{
+    chain->pool[chain->pooled] = data;
+    chain->capacity[chain->pooled] = capacity;
+    ++chain->pooled;
+}
+
+/* The product of mats[i..j] as a view: the matrix itself for i == j,
+ * else a pooled buffer owned by the caller (*capacity nonzero). */
+static void ChainOperand(chain_t* chain, size_t i, size_t j, matrix_t* view, size_t* capacity)
+{
+    matrix_t left;
+    matrix_t right;
+    size_t left_capacity = 0;
+    size_t right_capacity = 0;
+    mult_job_t job;
+    size_t k = chain->split[i * chain->count + j];
+
+    *capacity = 0;
+    if (i == j)
+    {
+        *view = *chain->mats[i];
+        return;
+    }
+
+    ChainOperand(chain, i, k, &left, &left_capacity);
+    ChainOperand(chain, k + 1, j, &right, &right_capacity);
+    view->n_rows = left.n_rows;
+    view->n_cols = right.n_cols;
+    view->buffer = NULL;
+    view->layout = MAT_ROW_MAJOR;
+    view->data = chain->failed ? NULL : ChainTake(chain, view->n_rows * view->n_cols, capacity);
+
+    if (view->data)
+    {
+        memset(view->data, 0, view->n_rows * view->n_cols * sizeof(float));
+        job.a = &left;
+        job.b = &right;
+        job.c = view;
+        ParallelFor(view->n_rows, RowsPerWorker(view->n_cols), MultRange, &job);
+    }
+    else
+    {
+        chain->failed = 1;
+    }
+    if (left_capacity)
+    {
+        ChainGive(chain, left.data, left_capacity);
+    }
+    if (right_capacity)
+    {
+        ChainGive(chain, right.data, right_capacity);
+    }
+}
+
+/* classic O(count^3) dynamic program over the shapes, costs in doubles
+ * since flop counts of long chains overflow size_t */
+static void ChainPlan(const matrix_t* const* mats, size_t count, double* cost, size_t* split)
+{
+    size_t length, i, k = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        cost[i * count + i] = 0;
+        split[i * count + i] = i;
+    }
+    for (length = 2; length <= count; length++)
+    {
+        for (i = 0; i + length <= count; i++)
+        {
+            size_t j = i + length - 1;
+
+            cost[i * count + j] = -1;
+            for (k = i; k < j; k++)
+            {
+                double total = cost[i * count + k] + cost[(k + 1) * count + j] +
+                               (double)mats[i]->n_rows * mats[k]->n_cols * mats[j]->n_cols;
+
+                if (cost[i * count + j] < 0 || total < cost[i * count + j])
+                {
+                    cost[i * count + j] = total;
+                    split[i * count + j] = k;
+                }
+            }
+        }
+    }
+}
+
+matrix_t* MatMultChain(const matrix_t* const* mats, size_t count)
+{
+    profile_mark_t mark;
+    chain_t chain;
+    matrix_t left;
+    matrix_t right;
+    size_t left_capacity = 0;
+    size_t right_capacity = 0;
+    matrix_t* result = NULL;
+    double* cost = NULL;
+    mult_job_t job;
+    size_t i = 0;
+
+    if (count == 0)
+    {
+        return NULL;
+    }
+    for (i = 0; i + 1 < count; i++)
+    {
+        if (mats[i]->n_cols != mats[i + 1]->n_rows)
+        {
+            return NULL;
+        }
+    }
+    if (count == 1)
+    {
+        return MatClone(mats[0]);
+    }
+
+    ProfileBegin(&mark);
+    chain.mats = mats;
+    chain.count = count;
+    chain.pooled = 0;
+    chain.failed = 0;
+    cost = (double*)malloc(count * count * sizeof(double));
+    chain.split = (size_t*)malloc(count * count * sizeof(size_t));
+    chain.pool = (float**)malloc(count * sizeof(float*));
+    chain.capacity = (size_t*)malloc(count * sizeof(size_t));
+
+    if (cost && chain.split && chain.pool && chain.capacity)
+    {
+        ChainPlan(mats, count, cost, chain.split);
+
+        /* the outermost product goes straight into the result */
+        i = chain.split[count - 1];
+        ChainOperand(&chain, 0, i, &left, &left_capacity);
+        ChainOperand(&chain, i + 1, count - 1, &right, &right_capacity);
+        result = chain.failed ? NULL : MatCreate(left.n_rows, right.n_cols, NULL);
+        if (result)
+        {
+            job.a = &left;
+            job.b = &right;
+            job.c = result;
+            ParallelFor(result->n_rows, RowsPerWorker(result->n_cols), MultRange, &job);
+        }
+        if (left_capacity)
+        {
+            ChainGive(&chain, left.data, left_capacity);
+        }
+        if (right_capacity)
+        {
+            ChainGive(&chain, right.data, right_capacity);
+        }
+    }
+
+    for (i = 0; chain.pool && i < chain.pooled; i++)
+    {
+        free(chain.pool[i]);
+    }
+    free(cost);
+    free(chain.split);
+    free(chain.pool);
+    free(chain.capacity);
+    ProfileEnd(&mark, "MatMultChain", mats[0]->n_rows, mats[count - 1]->n_cols);
+    return result;
+}
+
+
+
+/* -------------------------------- cache -------------------------------- */
+
+#define CACHE_BUCKETS 1024
+#define HASH_LANES 4
+#define HASH_PRIME 0x9E3779B1UL
+#define HASH_MASK 0xffffffffUL
+
+typedef enum cache_kind_t
+{
+    CACHE_DET,
+    CACHE_INVERT,
+    CACHE_QR
+} cache_kind_t;
+
+typedef struct cache_entry_t
+{
+    struct cache_entry_t* newer;  /* LRU order, g_cache_newest first */
+    struct cache_entry_t* older;
+    struct cache_entry_t* next;   /* bucket chain */
+    unsigned long hash;
+    cache_kind_t kind;
+    matrix_t* key;                /* copy-on-write clone of the input */
+    matrix_t* inverse;
+    mat_qr_t* qr;
+    float det;
+    size_t bytes;
+} cache_entry_t;
+
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry_t* g_cache_buckets[CACHE_BUCKETS];
+static cache_entry_t* g_cache_newest = NULL;
+static cache_entry_t* g_cache_oldest = NULL;
+static size_t g_cache_max_bytes = 0; /* 0 while disabled, written under the lock */
+static mat_cache_stats_t g_cache_stats;
+
+/* The cap is checked on every MatDet, MatInvert and MatQR before the
+ * lock is taken, so like ProfileEnabled: a relaxed atomic load under
+ * GCC/Clang, elsewhere under the lock. A stale nonzero value only costs
+ * a lookup, as CacheInsert checks the cap again under the lock. */
+#if defined(__GNUC__)
+#define CACHE_SET_MAX_BYTES(value) __atomic_store_n(&g_cache_max_bytes, (value), __ATOMIC_RELAXED)
+
+static size_t CacheMaxBytes(void)
+{
+    return __atomic_load_n(&g_cache_max_bytes, __ATOMIC_RELAXED);
+}
+#else
+#define CACHE_SET_MAX_BYTES(value) (g_cache_max_bytes = (value))
+
+static size_t CacheMaxBytes(void)
+{
+    size_t max_bytes = 0;
+
+    pthread_mutex_lock(&g_cache_lock);
+    max_bytes = g_cache_max_bytes;
+    pthread_mutex_unlock(&g_cache_lock);
+    return max_bytes;
+}
+#endif
+
+/* Multiply-xor over four independent 32-bit lanes, so the loop is not
+ * one long dependency chain, folded together with the shape at the end.
+ * Hits are confirmed with memcmp, the hash only has to spread keys. */
+static unsigned long HashMatrix(const matrix_t* mat, cache_kind_t kind)
+{
+    unsigned long lanes[HASH_LANES] = {0x811C9DC5UL, 0x01000193UL, 0x7FEB352DUL, 0x846CA68BUL};
+    size_t count = mat->n_rows * mat->n_cols;
+    unsigned long hash = (unsigned long)kind * 2 + (unsigned long)mat->layout;
+    size_t i, l = 0;
+
+    for (i = 0; i + HASH_LANES <= count; i += HASH_LANES)
+    {
+        for (l = 0; l < HASH_LANES; l++)
+        {
+            lanes[l] = ((lanes[l] ^ FloatBits(mat->data[i + l])) * HASH_PRIME) & HASH_MASK;
+        }
+    }
+    for (l = 0; i < count; i++, l++)
+    {
+        lanes[l] = ((lanes[l] ^ FloatBits(mat->data[i])) * HASH_PRIME) & HASH_MASK;
+    }
+
+    hash = ((hash ^ mat->n_rows) * HASH_PRIME) & HASH_MASK;
+    hash = ((hash ^ mat->n_cols) * HASH_PRIME) & HASH_MASK;
+    for (l = 0; l < HASH_LANES; l++)
+    {
+        hash = ((hash ^ lanes[l] ^ (lanes[l] >> 15)) * HASH_PRIME) & HASH_MASK;
+    }
+    return hash ^ (hash >> 16);
+}
+
+static void CacheUnlink(cache_entry_t* entry)
+{
+    cache_entry_t** link = &g_cache_buckets[entry->hash % CACHE_BUCKETS];
+
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    if (entry->newer)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        g_cache_newest = entry->older;
+    }
+    if (entry->older)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        g_cache_oldest = entry->newer;
+    }
+}
+
+static void CacheLinkNewest(cache_entry_t* entry)
+{
+    entry->newer = NULL;
+    entry->older = g_cache_newest;
+    if (g_cache_newest)
+    {
+        g_cache_newest->newer = entry;
+    }
+    g_cache_newest = entry;
+    if (!g_cache_oldest)
+    {
+        g_cache_oldest = entry;
+    }
+}
+
+static void CacheDrop(cache_entry_t* entry)
+{
+    CacheUnlink(entry);
+    g_cache_stats.bytes -= entry->bytes;
+    --g_cache_stats.entries;
+    MatDestroy(entry->key);
+    MatDestroy(entry->inverse);
+    MatQRDestroy(entry->qr);
+    free(entry);
+}
+
+/* evicts least recently used entries until the cache fits max_bytes */
+static void CacheTrim(size_t max_bytes)
+{
+    while (g_cache_oldest && g_cache_stats.bytes > max_bytes)
+    {
+        CacheDrop(g_cache_oldest);
+        ++g_cache_stats.evictions;
+    }
+}
+
+/* the entry for mat and kind, moved to the front, or NULL; under the lock */
+static cache_entry_t* CacheFind(const matrix_t* mat, cache_kind_t kind, unsigned long hash)
+{
+    cache_entry_t* entry = g_cache_buckets[hash % CACHE_BUCKETS];
+
+    for (; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->kind == kind && entry->key->layout == mat->layout &&
+            entry->key->n_rows == mat->n_rows &&
+            entry->key->n_cols == mat->n_cols &&
+            (entry->key->data == mat->data ||
+             memcmp(entry->key->data, mat->data, mat->n_rows * mat->n_cols * sizeof(float)) == 0))
+        {
+            CacheUnlink(entry);
+            entry->next = g_cache_buckets[hash % CACHE_BUCKETS];
+            g_cache_buckets[hash % CACHE_BUCKETS] = entry;
+            CacheLinkNewest(entry);
+            ++g_cache_stats.hits;
+            return entry;
+        }
+    }
+    ++g_cache_stats.misses;
+    return NULL;
+}
+
+/* Takes ownership of inverse and qr, NULL after a failed copy. Entries
+ * larger than the whole cache are not kept. */
+static void CacheInsert(const matrix_t* mat, cache_kind_t kind, unsigned long hash,
+                        float det, matrix_t* inverse, mat_qr_t* qr)
+{
+    cache_entry_t* entry = (cache_entry_t*)calloc(1, sizeof(cache_entry_t));
+    size_t elems = mat->n_rows * mat->n_cols;
+    size_t bytes = sizeof(cache_entry_t) + elems * sizeof(float);
+
+    bytes += inverse ? elems * sizeof(float) : 0;
+    bytes += qr ? (elems + qr->n_reflectors + QRBlocks(qr) * QR_BLOCK * QR_BLOCK) * sizeof(float) : 0;
+
+    pthread_mutex_lock(&g_cache_lock);
+    /* borrowed buffers can change under a clone, so those are copied */
+    if (entry && bytes <= g_cache_max_bytes)
+    {
+        entry->key = mat->buffer->free_fn ? MatClone(mat) : MatCreate(mat->n_rows, mat->n_cols, mat->data);
+        if (entry->key)
+        {
+            entry->key->layout = mat->layout;
+        }
+    }
+    if (!entry || !entry->key || (!inverse && !qr && kind != CACHE_DET))
+    {
+        pthread_mutex_unlock(&g_cache_lock);
+        if (entry)
+        {
+            MatDestroy(entry->key);
+        }
+        free(entry);
+        MatDestroy(inverse);
+        MatQRDestroy(qr);
+        return;
+    }
+    entry->hash = hash;
+    entry->kind = kind;
+    entry->det = det;
+    entry->inverse = inverse;
+    entry->qr = qr;
+    entry->bytes = bytes;
+    entry->next = g_cache_buckets[hash % CACHE_BUCKETS];
+    g_cache_buckets[hash % CACHE_BUCKETS] = entry;
+    CacheLinkNewest(entry);
+    g_cache_stats.bytes += bytes;
+    ++g_cache_stats.entries;
+    CacheTrim(g_cache_max_bytes);
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+static mat_qr_t* QRCopy(const mat_qr_t* qr)
+{
+    mat_qr_t* copy = (mat_qr_t*)malloc(sizeof(mat_qr_t));
+    size_t elems = qr->n_rows * qr->n_cols;
+    size_t t_size = QRBlocks(qr) * QR_BLOCK * QR_BLOCK;
+
+    if (!copy)
+    {
+        return NULL;
+    }
+    *copy = *qr;
+    copy->fact = (float*)malloc(elems * sizeof(float) + 1);
+    copy->tau = (float*)malloc(qr->n_reflectors * sizeof(float) + 1);
+    copy->t = (float*)malloc(t_size * sizeof(float) + 1);
+    if (!copy->fact || !copy->tau || !copy->t)
+    {
+        MatQRDestroy(copy);
+        return NULL;
+    }
+    memcpy(copy->fact, qr->fact, elems * sizeof(float));
+    memcpy(copy->tau, qr->tau, qr->n_reflectors * sizeof(float));
+    memcpy(copy->t, qr->t, t_size * sizeof(float));
+    return copy;
+}
+
+void MatCacheEnable(size_t max_bytes)
+{
+    pthread_mutex_lock(&g_cache_lock);
+    CACHE_SET_MAX_BYTES(max_bytes);
+    CacheTrim(max_bytes);
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+void MatCacheDisable(void)
+{
+    MatCacheEnable(0);
+}
+
+void MatCacheClear(void)
+{
+    pthread_mutex_lock(&g_cache_lock);
+    CacheTrim(0);
+    memset(&g_cache_stats, 0, sizeof(g_cache_stats));
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+void MatCacheStats(mat_cache_stats_t* stats)
+{
+    pthread_mutex_lock(&g_cache_lock);
+    *stats = g_cache_stats;
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+/* The public entry points: a hit costs a hash and a compare pass plus a
+ * clone; a miss computes outside the lock, so concurrent misses on one
+ * key may both compute and both try to insert, which is harmless. */
+float MatDet(const matrix_t* mat)
+{
+    profile_mark_t mark;
+    cache_entry_t* entry = NULL;
+    unsigned long hash = 0;
+    float det = 0;
+
+    ProfileBegin(&mark);
+    if (CacheMaxBytes() == 0 || mat->n_rows != mat->n_cols)
+    {
+        det = Determinant(mat);
+        ProfileEnd(&mark, "MatDet", mat->n_rows, mat->n_cols);
+        return det;
+    }
+    hash = HashMatrix(mat, CACHE_DET);
+    pthread_mutex_lock(&g_cache_lock);
+    entry = CacheFind(mat, CACHE_DET, hash);
+    det = entry ? entry->det : 0;
+    pthread_mutex_unlock(&g_cache_lock);
+
+    if (!entry)
+    {
+        det = Determinant(mat);
+        CacheInsert(mat, CACHE_DET, hash, det, NULL, NULL);
+    }
+    ProfileEnd(&mark, "MatDet", mat->n_rows, mat->n_cols);
+    return det;
+}
+
+matrix_t* MatInvert(const matrix_t* mat)
+{
+    profile_mark_t mark;
+    cache_entry_t* entry = NULL;
+    matrix_t* inverse = NULL;
+    unsigned long hash = 0;
+
+    ProfileBegin(&mark);
+    if (CacheMaxBytes() == 0 || mat->n_rows != mat->n_cols)
+    {
+        inverse = Invert(mat);
+        ProfileEnd(&mark, "MatInvert", mat->n_rows, mat->n_cols);
+        return inverse;
+    }
+    hash = HashMatrix(mat, CACHE_INVERT);
+    pthread_mutex_lock(&g_cache_lock);
+    entry = CacheFind(mat, CACHE_INVERT, hash);
+    inverse = entry ? MatClone(entry->inverse) : NULL;
+    pthread_mutex_unlock(&g_cache_lock);
+
+    if (!entry)
+    {
+        inverse = Invert(mat);
+        if (inverse)
+        {
+            CacheInsert(mat, CACHE_INVERT, hash, 0, MatClone(inverse), NULL);
+        }
+    }
+    ProfileEnd(&mark, "MatInvert", mat->n_rows, mat->n_cols);
+    return inverse;
+}
+
+mat_qr_t* MatQR(const matrix_t* mat)
+{
+    profile_mark_t mark;
+    cache_entry_t* entry = NULL;
+    mat_qr_t* qr = NULL;
+    unsigned long hash = 0;
+
+    ProfileBegin(&mark);
+    if (CacheMaxBytes() == 0)
+    {
+        qr = QRFactor(mat);
+        ProfileEnd(&mark, "MatQR", mat->n_rows, mat->n_cols);
+        return qr;
+    }
+    hash = HashMatrix(mat, CACHE_QR);
+    pthread_mutex_lock(&g_cache_lock);
+    entry = CacheFind(mat, CACHE_QR, hash);
+    qr = entry ? QRCopy(entry->qr) : NULL;
+    pthread_mutex_unlock(&g_cache_lock);
+
+    if (!entry)
+    {
+        qr = QRFactor(mat);
+        if (qr)
+        {
+            CacheInsert(mat, CACHE_QR, hash, 0, NULL, QRCopy(qr));
+        }
+    }
+    ProfileEnd(&mark, "MatQR", mat->n_rows, mat->n_cols);
+    return qr;
+}
+
+
+
+/* --------------------------- banded matrices --------------------------- */
+
+/* Row i keeps columns i - lower .. i + upper, out-of-range ones unused.
+ * The LU factors keep lower + upper superdiagonals, the fill-in of
+ * partial pivoting, and the multipliers of L where A's subdiagonals were. */
+struct mat_band_t
+{
+    size_t n;
+    size_t lower;
+    size_t upper;
+    size_t width;    /* stored entries per row */
+    float* data;
+};
+
+struct mat_band_lu_t
+{
+    size_t n;
+    size_t lower;
+    size_t upper;    /* lower + upper of the original */
+    size_t width;
+    float* data;
+    size_t* pivots;
+};
+
+/* offset of row, col in row-wise band storage; col >= row - lower */
+static size_t BandIndex(size_t width, size_t lower, size_t row, size_t col)
+{
+    return row * width + col + lower - row;
+}
+
+static int InBand(size_t lower, size_t upper, size_t row, size_t col)
+{
+    return col + lower >= row && col <= row + upper;
+}
+
+mat_band_t* MatBandCreate(size_t n, size_t lower, size_t upper)
+{
+    mat_band_t* band = (mat_band_t*)malloc(sizeof(mat_band_t));
+
+    if (!band)
+    {
+        return NULL;
+    }
+    band->n = n;
+    band->lower = lower;
+    band->upper = upper;
+    band->width = lower + upper + 1;
+    band->data = (float*)calloc(n * band->width + 1, sizeof(float));
+    if (!band->data)
+    {
+        free(band);
+        return NULL;
+    }
+    return band;
+}
+
+mat_band_t* MatBandFromDense(const matrix_t* mat, size_t lower, size_t upper)
+{
+    mat_band_t* band = NULL;
+    size_t i, j = 0;
+
+    if (mat->n_rows != mat->n_cols)
+    {
+        return NULL;
+    }
+    band = MatBandCreate(mat->n_rows, lower, upper);
+    for (i = 0; band && i < band->n; i++)
+    {
+        for (j = i > lower ? i - lower : 0; j < band->n && j <= i + upper; j++)
+        {
+            band->data[BandIndex(band->width, lower, i, j)] = MatGetElem(mat, i, j);
+        }
+    }
+    return band;
+}
+
+void MatBandDestroy(mat_band_t* band)
+{
+    if (!band)
+    {
+        return;
+    }
+    free(band->data);
+    free(band);
+}
+
+int MatBandSet(mat_band_t* band, size_t row, size_t col, float value)
+{
+    if (row >= band->n || col >= band->n || !InBand(band->lower, band->upper, row, col))
+    {
+        return 1;
+    }
+    band->data[BandIndex(band->width, band->lower, row, col)] = value;
+    return 0;
+}
+
+float MatBandGet(const mat_band_t* band, size_t row, size_t col)
+{
+    if (row >= band->n || col >= band->n || !InBand(band->lower, band->upper, row, col))
+    {
+        return 0.0;
+    }
+    return band->data[BandIndex(band->width, band->lower, row, col)];
+}
+
+matrix_t* MatBandToDense(const mat_band_t* band)
+{
+    matrix_t* mat = MatCreate(band->n, band->n, NULL);
+    size_t i, j = 0;
+
+    for (i = 0; mat && i < band->n; i++)
+    {
+        for (j = i > band->lower ? i - band->lower : 0; j < band->n && j <= i + band->upper; j++)
+        {
+            mat->data[i * band->n + j] = band->data[BandIndex(band->width, band->lower, i, j)];
+        }
+    }
+    return mat;
+}
+
+typedef struct band_matvec_job_t
+{
+    const mat_band_t* band;
+    const float* x;
+    float* y;
+} band_matvec_job_t;
+
+static void BandMatvecRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    band_matvec_job_t* job = (band_matvec_job_t*)arg;
+    const mat_band_t* band = job->band;
+    size_t i = 0;
+
+    (void)worker;
+    for (i = begin; i < end; i++)
+    {
+        size_t first = i > band->lower ? i - band->lower : 0;
+        size_t last = i + band->upper < band->n ? i + band->upper : band->n - 1;
+
+        job->y[i] = DotF(band->data + BandIndex(band->width, band->lower, i, first), job->x + first, last - first + 1);
+    }
+}
+
+void MatBandMatvec(const float* x, float* y, void* band)
+{
+    band_matvec_job_t job;
+
+    job.band = (const mat_band_t*)band;
+    job.x = x;
+    job.y = y;
+    ParallelFor(job.band->n, RowsPerWorker(job.band->width), BandMatvecRange, &job);
+}
+
+int MatTridiagSolve(size_t n, const float* lower, const float* diag, const float* upper, const float* b, float* x)
+{
+    float* scratch = NULL;
+    float pivot = 0;
+    size_t i = 0;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+    scratch = (float*)malloc(n * sizeof(float));
+    if (!scratch || diag[0] == 0)
+    {
+        free(scratch);
+        return 1;
+    }
+
+    /* forward sweep: scratch holds the eliminated superdiagonal */
+    pivot = diag[0];
+    x[0] = b[0] / pivot;
+    for (i = 1; i < n; i++)
+    {
+        scratch[i - 1] = upper[i - 1] / pivot;
+        pivot = diag[i] - lower[i - 1] * scratch[i - 1];
+        if (pivot == 0)
+        {
+            free(scratch);
+            return 1;
+        }
+        x[i] = (b[i] - lower[i - 1] * x[i - 1]) / pivot;
+    }
+    for (i = n - 1; i > 0; i--)
+    {
+        x[i - 1] -= scratch[i - 1] * x[i];
+    }
+
+    free(scratch);
+    return 0;
+}
+
+void MatBandLUDestroy(mat_band_lu_t* lu)
+{
+    if (!lu)
+    {
+        return;
+    }
+    free(lu->data);
+    free(lu->pivots);
+    free(lu);
+}
+
+/* Gaussian elimination with partial pivoting restricted to the band:
+ * O(n * lower * (lower + upper)) instead of O(n^3) */
+mat_band_lu_t* MatBandLU(const mat_band_t* band)
+{
+    mat_band_lu_t* lu = (mat_band_lu_t*)malloc(sizeof(mat_band_lu_t));
+    size_t n = band->n;
+    size_t i, j, k = 0;
+
+    if (!lu)
+    {
+        return NULL;
+    }
+    lu->n = n;
+    lu->lower = band->lower;
+    lu->upper = band->lower + band->upper;
+    lu->width = lu->lower + lu->upper + 1;
+    lu->data = (float*)calloc(n * lu->width + 1, sizeof(float));
+    lu->pivots = (size_t*)malloc(n * sizeof(size_t) + 1);
+    if (!lu->data || !lu->pivots)
+    {
+        MatBandLUDestroy(lu);
+        return NULL;
+    }
+    for (i = 0; i < n; i++)
+    {
+        size_t first = i > band->lower ? i - band->lower : 0;
+        size_t last = i + band->upper < n ? i + band->upper : n - 1;
+
+        memcpy(lu->data + BandIndex(lu->width, lu->lower, i, first),
+               band->data + BandIndex(band->width, band->lower, i, first), (last - first + 1) * sizeof(float));
+    }
+
+    for (k = 0; k < n; k++)
+    {
+        size_t last_row = k + lu->lower < n ? k + lu->lower : n - 1;
+        size_t last_col = k + lu->upper < n ? k + lu->upper : n - 1;
+        size_t pivot_row = k;
+        float* row_k = NULL;
+        float pivot = 0;
+
+        for (i = k + 1; i <= last_row; i++)
+        {
+            if (fabs(lu->data[BandIndex(lu->width, lu->lower, i, k)]) >
+                fabs(lu->data[BandIndex(lu->width, lu->lower, pivot_row, k)]))
+            {
+                pivot_row = i;
+            }
+        }
+        lu->pivots[k] = pivot_row;
+        pivot = lu->data[BandIndex(lu->width, lu->lower, pivot_row, k)];
+        if (pivot == 0)
+        {
+            MatBandLUDestroy(lu);
+            return NULL;
+        }
+
+        /* both rows hold columns k .. last_col: pivot_row <= k + lower */
+        row_k = lu->data + BandIndex(lu->width, lu->lower, k, k);
+        if (pivot_row != k)
+        {
+            float* row_p = lu->data + BandIndex(lu->width, lu->lower, pivot_row, k);
+
+            for (j = 0; j <= last_col - k; j++)
+            {
+                float tmp = row_k[j];
+
+                row_k[j] = row_p[j];
+                row_p[j] = tmp;
+            }
+        }
+
+        for (i = k + 1; i <= last_row; i++)
+        {
+            float* row_i = lu->data + BandIndex(lu->width, lu->lower, i, k);
+            float factor = row_i[0] / pivot;
+
+            row_i[0] = factor;
+            for (j = 1; j <= last_col - k; j++)
+            {
+                row_i[j] -= factor * row_k[j];
+            }
+        }
+    }
+    return lu;
+}
+
+int MatBandLUSolve(const mat_band_lu_t* lu, const float* b, float* x)
+{
+    size_t n = lu->n;
+    size_t i, k = 0;
+
+    if (x != b)
+    {
+        memcpy(x, b, n * sizeof(float));
+    }
+
+    /* replays the row swaps and eliminations on x, then back substitutes */
+    for (k = 0; k < n; k++)
+    {
+        size_t last_row = k + lu->lower < n ? k + lu->lower : n - 1;
+        float x_k = x[lu->pivots[k]];
+
+        x[lu->pivots[k]] = x[k];
+        x[k] = x_k;
+        for (i = k + 1; i <= last_row; i++)
+        {
+            x[i] -= lu->data[BandIndex(lu->width, lu->lower, i, k)] * x_k;
+        }
+    }
+    for (k = n; k > 0; k--)
+    {
+        size_t row = k - 1;
+        size_t last_col = row + lu->upper < n ? row + lu->upper : n - 1;
+        const float* u = lu->data + BandIndex(lu->width, lu->lower, row, row);
+
+        x[row] = (x[row] - DotF(u + 1, x + row + 1, last_col - row)) / u[0];
+    }
+    return 0;
+}
+
+int MatBandSolve(const mat_band_t* band, const float* b, float* x)
+{
+    profile_mark_t mark;
+    mat_band_lu_t* lu = NULL;
+
+    ProfileBegin(&mark);
+    lu = MatBandLU(band);
+    if (!lu)
+    {
+        return 1;
+    }
+    MatBandLUSolve(lu, b, x);
+    MatBandLUDestroy(lu);
+    ProfileEnd(&mark, "MatBandSolve", band->n, band->width);
+    return 0;
+}
+
+
+/* --------------------------- typed matrices --------------------------- */
+
+static const mat_complex_t g_complex_zero = {0, 0};
+static const mat_complex_t g_complex_one = {1, 0};
+
+static mat_complex_t ComplexMake(double re, double im)
+{
+    mat_complex_t z;
+
+    z.re = re;
+    z.im = im;
+    return z;
+}
+
+static mat_complex_t ComplexAdd(mat_complex_t a, mat_complex_t b)
+{
+    return ComplexMake(a.re + b.re, a.im + b.im);
+}
+
+static mat_complex_t ComplexSub(mat_complex_t a, mat_complex_t b)
+{
+    return ComplexMake(a.re - b.re, a.im - b.im);
+}
+
+static mat_complex_t ComplexMul(mat_complex_t a, mat_complex_t b)
+{
+    return ComplexMake(a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re);
+}
+
+/* Smith's division, no overflow in |b|^2 */
+static mat_complex_t ComplexDiv(mat_complex_t a, mat_complex_t b)
+{
+    double ratio, denom = 0;
+
+    if (fabs(b.re) >= fabs(b.im))
+    {
+        ratio = b.im / b.re;
+        denom = b.re + b.im * ratio;
+        return ComplexMake((a.re + a.im * ratio) / denom, (a.im - a.re * ratio) / denom);
+    }
+    ratio = b.re / b.im;
+    denom = b.re * ratio + b.im;
+    return ComplexMake((a.re * ratio + a.im) / denom, (a.im * ratio - a.re) / denom);
+}
+
+#define MT_T double
+#define MT_MAT matrix_d_t
+#define MT_PREFIX D
+#define MT_FIELD 1
+#define MT_ZERO 0.0
+#define MT_ONE 1.0
+#define MT_ADD(a, b) ((a) + (b))
+#define MT_SUB(a, b) ((a) - (b))
+#define MT_MUL(a, b) ((a) * (b))
+#define MT_DIV(a, b) ((a) / (b))
+#define MT_NEG(a) (-(a))
+#define MT_MAG2(a) ((a) * (a))
+#define MT_NEAR(a, b) (fabs((a) - (b)) <= TOLERANCE)
+#define MT_FROM_FLOAT(f) ((double)(f))
+#define MT_TO_FLOAT(a) ((float)(a))
+#include "mat_typed_impl.h"
+
+/* nearest int, saturating out of range and 0 for NaN: the cast of such
+ * a value is undefined */
+static int I32FromFloat(float value)
+{
+    double rounded = floor((double)value + 0.5);
+
+    if (value != value)
+    {
+        return 0;
+    }
+    if (rounded >= (double)INT_MAX)
+    {
+        return INT_MAX;
+    }
+    return rounded <= (double)INT_MIN ? INT_MIN : (int)rounded;
+}
+
+/* int arithmetic wraps through unsigned, signed overflow is undefined */
+#define MT_T int
+#define MT_MAT matrix_i32_t
+#define MT_PREFIX I32
+#define MT_FIELD 0
+#define MT_ZERO 0
+#define MT_ONE 1
+#define MT_ADD(a, b) ((int)((unsigned int)(a) + (unsigned int)(b)))
+#define MT_SUB(a, b) ((int)((unsigned int)(a) - (unsigned int)(b)))
+#define MT_MUL(a, b) ((int)((unsigned int)(a) * (unsigned int)(b)))
+#define MT_MAG2(a) ((double)(a) * (double)(a))
+#define MT_NEAR(a, b) ((a) == (b))
+#define MT_FROM_FLOAT(f) I32FromFloat(f)
+#define MT_TO_FLOAT(a) ((float)(a))
+#include "mat_typed_impl.h"
+
+#define MT_T mat_complex_t
+#define MT_MAT matrix_z_t
+#define MT_PREFIX Z
+#define MT_FIELD 1
+#define MT_ZERO g_complex_zero
+#define MT_ONE g_complex_one
+#define MT_ADD(a, b) ComplexAdd(a, b)
+#define MT_SUB(a, b) ComplexSub(a, b)
+#define MT_MUL(a, b) ComplexMul(a, b)
+#define MT_DIV(a, b) ComplexDiv(a, b)
+#define MT_NEG(a) ComplexMake(-(a).re, -(a).im)
+#define MT_MAG2(a) ((a).re * (a).re + (a).im * (a).im)
+#define MT_NEAR(a, b) (MT_MAG2(ComplexSub(a, b)) <= (double)TOLERANCE * TOLERANCE)
+#define MT_FROM_FLOAT(f) ComplexMake(f, 0)
+#define MT_TO_FLOAT(a) ((float)(a).re)
+#include "mat_typed_impl.h"
+
+
+/* --------------------------- process shards --------------------------- */
+
+/* The coordinator talks to each worker process over a stream socket with
+ * fixed-size messages, one reply per command. Operands and results live
+ * in a POSIX shared memory segment that every worker maps, so a command
+ * only names tiles by element offset. Over a network the same commands
+ * would carry the tiles in the message body instead. */
+
+#define SHARD_MAX_WORKERS 64
+#define SHARD_NAME_LEN 64
+#define SHARD_ARGS 9
+#define SHARD_LU_BLOCK 64
+
+typedef enum shard_op_t
+{
+    SHARD_QUIT,
+    SHARD_MAP,   /* map segment name of args[0] bytes, dropping the old one */
+    SHARD_GEMM   /* GemmAccumulate on offsets a, b, c: args a, lda, b, ldb, c, ldc, n, k, m */
+} shard_op_t;
+
+typedef struct shard_msg_t
+{
+    unsigned long op;
+    unsigned long args[SHARD_ARGS];
+    char name[SHARD_NAME_LEN];
+} shard_msg_t;
+
+struct mat_shard_t
+{
+    size_t n_workers;
+    pid_t pids[SHARD_MAX_WORKERS];
+    int fds[SHARD_MAX_WORKERS];
+    float* base;          /* the current segment */
+    size_t bytes;
+    unsigned long n_segments;
+    int broken;           /* a worker stopped answering */
+    pthread_mutex_t lock; /* one operation at a time */
+};
+
+#ifdef __linux__
+static int ShardWriteAll(int fd, const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+
+    while (size > 0)
+    {
+        ssize_t done = send(fd, bytes, size, MSG_NOSIGNAL);
+
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return 1;
+        }
+        bytes += done;
+        size -= (size_t)done;
+    }
+    return 0;
+}
+
+static int ShardReadAll(int fd, void* data, size_t size)
+{
+    char* bytes = (char*)data;
+
+    while (size > 0)
+    {
+        ssize_t done = recv(fd, bytes, size, 0);
+
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return 1;
+        }
+        bytes += done;
+        size -= (size_t)done;
+    }
+    return 0;
+}
+
+/* rows x cols at offset with leading dimension ld fits in elems */
+static int ShardFits(unsigned long offset, unsigned long rows, unsigned long cols, unsigned long ld, size_t elems)
+{
+    if (rows == 0 || cols == 0)
+    {
+        return 1;
+    }
+    return cols <= ld && offset <= elems && (rows - 1) <= (elems - offset) / ld &&
+           offset + (rows - 1) * ld + cols <= elems;
+}
+
+/* the loop of a worker process, ends with it */
+static void ShardWorker(int fd)
+{
+    shard_msg_t msg;
+    float* base = NULL;
+    size_t bytes = 0;
+    int status = 0;
+
+    while (ShardReadAll(fd, &msg, sizeof(msg)) == 0 && msg.op != SHARD_QUIT)
+    {
+        status = 1;
+        if (msg.op == SHARD_MAP)
+        {
+            int shm = -1;
+
+            if (base)
+            {
+                munmap(base, bytes);
+                base = NULL;
+            }
+            msg.name[SHARD_NAME_LEN - 1] = '\0';
+            bytes = msg.args[0];
+            shm = shm_open(msg.name, O_RDWR, 0);
+            if (shm >= 0)
+            {
+                void* map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+
+                base = map == MAP_FAILED ? NULL : (float*)map;
+                close(shm);
+            }
+            status = base ? 0 : 1;
+        }
+        else if (msg.op == SHARD_GEMM && base)
+        {
+            unsigned long* a = msg.args;
+            size_t elems = bytes / sizeof(float);
+
+            if (ShardFits(a[0], a[6], a[7], a[1], elems) && ShardFits(a[2], a[7], a[8], a[3], elems) &&
+                ShardFits(a[4], a[6], a[8], a[5], elems))
+            {
+                GemmAccumulate(a[6], a[7], a[8], base + a[0], a[1], base + a[2], a[3], base + a[4], a[5]);
+                status = 0;
+            }
+        }
+        if (ShardWriteAll(fd, &status, sizeof(status)))
+        {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+/* sends msgs[w] to the first count workers, then collects every reply */
+static int ShardDispatch(mat_shard_t* shard, const shard_msg_t* msgs, size_t count)
+{
+    int failed = 0;
+    int status = 0;
+    size_t w = 0;
+
+    for (w = 0; w < count; w++)
+    {
+        failed |= ShardWriteAll(shard->fds[w], &msgs[w], sizeof(shard_msg_t));
+    }
+    for (w = 0; w < count; w++)
+    {
+        if (ShardReadAll(shard->fds[w], &status, sizeof(status)) || status != 0)
+        {
+            failed = 1;
+        }
+    }
+    shard->broken |= failed;
+    return failed;
+}
+
+/* a segment of at least bytes, mapped by the coordinator and every worker;
+ * the name is unlinked as soon as all have mapped it */
+static int ShardReserve(mat_shard_t* shard, size_t bytes)
+{
+    shard_msg_t msgs[SHARD_MAX_WORKERS];
+    char name[SHARD_NAME_LEN];
+    void* map = MAP_FAILED;
+    int shm = -1;
+    size_t w = 0;
+
+    if (shard->broken)
+    {
+        return 1;
+    }
+    if (bytes <= shard->bytes)
+    {
+        return 0;
+    }
+    sprintf(name, "/mat_shard_%lu_%lu", (unsigned long)getpid(), shard->n_segments++);
+    shm = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (shm < 0)
+    {
+        return 1;
+    }
+    if (ftruncate(shm, (off_t)bytes) == 0)
+    {
+        map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+    }
+    close(shm);
+    if (map == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return 1;
+    }
+
+    for (w = 0; w < shard->n_workers; w++)
+    {
+        memset(&msgs[w], 0, sizeof(shard_msg_t));
+        msgs[w].op = SHARD_MAP;
+        msgs[w].args[0] = bytes;
+        strcpy(msgs[w].name, name);
+    }
+    if (ShardDispatch(shard, msgs, shard->n_workers))
+    {
+        shm_unlink(name);
+        munmap(map, bytes);
+        return 1;
+    }
+    shm_unlink(name);
+    if (shard->base)
+    {
+        munmap(shard->base, shard->bytes);
+    }
+    shard->base = (float*)map;
+    shard->bytes = bytes;
+    return 0;
+}
+
+/* c += a * b on the segment, rows [begin, end) of a and c split evenly
+ * over the workers; offsets are those of row begin */
+static int ShardGemm(mat_shard_t* shard, size_t begin, size_t end, size_t k, size_t m,
+                     size_t a, size_t lda, size_t b, size_t ldb, size_t c, size_t ldc)
+{
+    shard_msg_t msgs[SHARD_MAX_WORKERS];
+    size_t count = end - begin;
+    size_t workers = shard->n_workers < count ? shard->n_workers : count;
+    size_t w = 0;
+
+    for (w = 0; w < workers; w++)
+    {
+        size_t first = count * w / workers;
+        size_t last = count * (w + 1) / workers;
+
+        memset(&msgs[w], 0, sizeof(shard_msg_t));
+        msgs[w].op = SHARD_GEMM;
+        msgs[w].args[0] = a + first * lda;
+        msgs[w].args[1] = lda;
+        msgs[w].args[2] = b;
+        msgs[w].args[3] = ldb;
+        msgs[w].args[4] = c + first * ldc;
+        msgs[w].args[5] = ldc;
+        msgs[w].args[6] = last - first;
+        msgs[w].args[7] = k;
+        msgs[w].args[8] = m;
+    }
+    return ShardDispatch(shard, msgs, workers);
+}
+#endif
+
+mat_shard_t* MatShardCreate(size_t n_workers)
+{
+#ifdef __linux__
+    mat_shard_t* shard = NULL;
+    size_t w = 0;
+
+    if (n_workers == 0 || n_workers > SHARD_MAX_WORKERS)
+    {
+        return NULL;
+    }
+    shard = (mat_shard_t*)calloc(1, sizeof(mat_shard_t));
+    if (!shard)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&shard->lock, NULL);
+
+    for (w = 0; w < n_workers; w++)
+    {
+        int pair[2];
+        pid_t pid = 0;
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+        {
+            break;
+        }
+        pid = fork();
+        if (pid == 0)
+        {
+            size_t other = 0;
+
+            /* only its own end, so workers see the coordinator's EOF */
+            for (other = 0; other < w; other++)
+            {
+                close(shard->fds[other]);
+            }
+            close(pair[0]);
+            ShardWorker(pair[1]);
+        }
+        close(pair[1]);
+        if (pid < 0)
+        {
+            close(pair[0]);
+            break;
+        }
+        shard->pids[w] = pid;
+        shard->fds[w] = pair[0];
+        shard->n_workers = w + 1;
+    }
+
+    if (shard->n_workers < n_workers)
+    {
+        MatShardDestroy(shard);
+        return NULL;
+    }
+    return shard;
+#else
+    (void)n_workers;
+    return NULL;
+#endif
+}
+
+void MatShardDestroy(mat_shard_t* shard)
+{
+#ifdef __linux__
+    shard_msg_t quit;
+    size_t w = 0;
+
+    if (!shard)
+    {
+        return;
+    }
+    memset(&quit, 0, sizeof(quit));
+    quit.op = SHARD_QUIT;
+    for (w = 0; w < shard->n_workers; w++)
+    {
+        ShardWriteAll(shard->fds[w], &quit, sizeof(quit));
+        close(shard->fds[w]);
+    }
+    for (w = 0; w < shard->n_workers; w++)
+    {
+        waitpid(shard->pids[w], NULL, 0);
+    }
+    if (shard->base)
+    {
+        munmap(shard->base, shard->bytes);
+    }
+    pthread_mutex_destroy(&shard->lock);
+    free(shard);
+#else
+    (void)shard;
+#endif
+}
+
+matrix_t* MatShardMult(mat_shard_t* shard, const matrix_t* mat1, const matrix_t* mat2)
+{
+#ifdef __linux__
+    size_t n = mat1->n_rows;
+    size_t k = mat1->n_cols;
+    size_t m = mat2->n_cols;
+    matrix_t* result = NULL;
+
+    if (k != mat2->n_rows)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&shard->lock);
+    if (ShardReserve(shard, (n * k + k * m + n * m + 1) * sizeof(float)) == 0)
+    {
+        float* c = shard->base + n * k + k * m;
+
+        CopyRows(mat1, shard->base);
+        CopyRows(mat2, shard->base + n * k);
+        memset(c, 0, n * m * sizeof(float));
+        if (n == 0 || ShardGemm(shard, 0, n, k, m, 0, k, n * k, m, n * k + k * m, m) == 0)
+        {
+            result = MatCreate(n, m, c);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+#else
+    (void)shard;
+    (void)mat1;
+    (void)mat2;
+    return NULL;
+#endif
+}
+
+#ifdef __linux__
+/* Unblocked LU of the panel columns [k0, k1) over rows [k0, n), swapping
+ * whole rows. Returns 1 on a zero pivot. */
+static int ShardPanel(float* a, size_t n, size_t k0, size_t k1, size_t* pivots)
+{
+    size_t i, j, c = 0;
+
+    for (j = k0; j < k1; j++)
+    {
+        size_t pivot = j;
+
+        for (i = j + 1; i < n; i++)
+        {
+            if (fabs(a[i * n + j]) > fabs(a[pivot * n + j]))
+            {
+                pivot = i;
+            }
+        }
+        if (a[pivot * n + j] == 0)
+        {
+            return 1;
+        }
+        pivots[j] = pivot;
+        if (pivot != j)
+        {
+            for (c = 0; c < n; c++)
+            {
+                float tmp = a[j * n + c];
+
+                a[j * n + c] = a[pivot * n + c];
+                a[pivot * n + c] = tmp;
+            }
+        }
+        for (i = j + 1; i < n; i++)
+        {
+            float* row = a + i * n;
+            float factor = row[j] / a[j * n + j];
+
+            row[j] = factor;
+            for (c = j + 1; c < k1; c++)
+            {
+                row[c] -= factor * a[j * n + c];
+            }
+        }
+    }
+    return 0;
+}
+#endif
+
+/* Right-looking blocked LU: the coordinator factors each panel and the
+ * block row of U, the workers split the trailing update A22 -= L21 U12
+ * by rows. GemmAccumulate only adds, so L21 is negated around it. */
+int MatShardLU(mat_shard_t* shard, const matrix_t* mat, matrix_t** lu, size_t* pivots)
+{
+#ifdef __linux__
+    size_t n = mat->n_rows;
+    size_t k0, k1, i, r, c = 0;
+    float* a = NULL;
+    int failed = 0;
+
+    *lu = NULL;
+    if (n != mat->n_cols)
+    {
+        return 1;
+    }
+    pthread_mutex_lock(&shard->lock);
+    failed = ShardReserve(shard, (n * n + 1) * sizeof(float));
+    a = shard->base;
+    if (!failed)
+    {
+        CopyRows(mat, a);
+    }
+
+    for (k0 = 0; !failed && k0 < n; k0 = k1)
+    {
+        k1 = k0 + SHARD_LU_BLOCK < n ? k0 + SHARD_LU_BLOCK : n;
+        failed = ShardPanel(a, n, k0, k1, pivots);
+        if (failed || k1 == n)
+        {
+            continue;
+        }
+
+        /* U12 = L11^-1 A12, L11 unit lower triangular */
+        for (i = k0 + 1; i < k1; i++)
+        {
+            for (r = k0; r < i; r++)
+            {
+                float l_ir = a[i * n + r];
+
+                for (c = k1; c < n; c++)
+                {
+                    a[i * n + c] -= l_ir * a[r * n + c];
+                }
+            }
+        }
+
+        for (i = k1; i < n; i++)
+        {
+            for (c = k0; c < k1; c++)
+            {
+                a[i * n + c] = -a[i * n + c];
+            }
+        }
+        failed = ShardGemm(shard, k1, n, k1 - k0, n - k1, k1 * n + k0, n, k0 * n + k1, n, k1 * n + k1, n);
+        for (i = k1; i < n; i++)
+        {
+            for (c = k0; c < k1; c++)
+            {
+                a[i * n + c] = -a[i * n + c];
+            }
+        }
+    }
+
+    if (!failed)
+    {
+        *lu = MatCreate(n, n, a);
+        failed = *lu == NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return failed;
+#else
+    (void)shard;
+    (void)mat;
+    (void)pivots;
+    *lu = NULL;
+    return 1;
+#endif
+}
+
+
+/* --------------------------- random matrices --------------------------- */
+
+/* Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as
+ * 1, 2, 3"): element i of a matrix comes from counter block i / 4 under
+ * the seed as key, so any thread can produce any tile on its own and the
+ * result depends on the seed alone. */
+
+#define PHILOX_M0 0xD2511F53UL
+#define PHILOX_M1 0xCD9E8D57UL
+#define PHILOX_W0 0x9E3779B9UL
+#define PHILOX_W1 0xBB67AE85UL
+#define PHILOX_ROUNDS 10
+#define WORD_MASK 0xffffffffUL
+
+typedef enum rand_kind_t
+{
+    RAND_UNIFORM,
+    RAND_NORMAL,
+    RAND_SPARSE
+} rand_kind_t;
+
+typedef struct rand_job_t
+{
+    rand_kind_t kind;
+    unsigned long key[2];
+    float a;          /* low, mean or density */
+    float b;          /* high or standard deviation */
+    float* data;
+    size_t n_cols;
+} rand_job_t;
+
+/* hi and lo words of a * b for 32-bit a and b; without a 64-bit long
+ * the product is put together from 16-bit halves */
+static void MulHiLo32(unsigned long a, unsigned long b, unsigned long* hi, unsigned long* lo)
+{
+#if ULONG_MAX > 0xffffffffUL
+    unsigned long product = a * b;
+
+    *lo = product & WORD_MASK;
+    *hi = product >> 16 >> 16;
+#else
+    unsigned long a0 = a & 0xffffUL, a1 = a >> 16;
+    unsigned long b0 = b & 0xffffUL, b1 = b >> 16;
+    unsigned long p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    unsigned long mid = (p00 >> 16) + (p01 & 0xffffUL) + (p10 & 0xffffUL);
+
+    *lo = (((mid & 0xffffUL) << 16) | (p00 & 0xffffUL)) & WORD_MASK;
+    *hi = (p11 + (p01 >> 16) + (p10 >> 16) + (mid >> 16)) & WORD_MASK;
+#endif
+}
+
+static void Philox(const unsigned long counter[4], const unsigned long key[2], unsigned long out[4])
+{
+    unsigned long x0 = counter[0], x1 = counter[1], x2 = counter[2], x3 = counter[3];
+    unsigned long k0 = key[0], k1 = key[1];
+    unsigned long hi0, lo0, hi1, lo1 = 0;
+    int round = 0;
+
+    for (round = 0; round < PHILOX_ROUNDS; round++)
+    {
+        MulHiLo32(PHILOX_M0, x0, &hi0, &lo0);
+        MulHiLo32(PHILOX_M1, x2, &hi1, &lo1);
+        x0 = (hi1 ^ x1 ^ k0) & WORD_MASK;
+        x1 = lo1;
+        x2 = (hi0 ^ x3 ^ k1) & WORD_MASK;
+        x3 = lo0;
+        k0 = (k0 + PHILOX_W0) & WORD_MASK;
+        k1 = (k1 + PHILOX_W1) & WORD_MASK;
+    }
+    out[0] = x0;
+    out[1] = x1;
+    out[2] = x2;
+    out[3] = x3;
+}
+
+/* the 24 high bits as a float in [0, 1), exactly */
+static double UnitFloat(unsigned long word)
+{
+    return (double)(word >> 8) * (1.0 / 16777216.0);
+}
+
+/* the largest float below value, for a finite value */
+static float FloatBelow(float value)
+{
+    unsigned int bits = FloatBits(value);
+
+    if (value > 0)
+    {
+        return BitsFloat(bits - 1);
+    }
+    return value < 0 ? BitsFloat(bits + 1) : BitsFloat(0x80000001U);
+}
+
+/* the four values of counter block index; sparse elements use two words
+ * each, so their block covers only two elements */
+static void RandBlock(const rand_job_t* job, size_t index, float values[4])
+{
+    unsigned long counter[4];
+    unsigned long words[4];
+    size_t w = 0;
+
+    counter[0] = (unsigned long)index & WORD_MASK;
+    counter[1] = (unsigned long)(index >> 16 >> 16) & WORD_MASK;
+    counter[2] = (unsigned long)job->kind;
+    counter[3] = 0;
+    Philox(counter, job->key, words);
+
+    if (job->kind == RAND_UNIFORM)
+    {
+        /* rounding to float can reach high itself, e.g. 2 for [1, 2) */
+        float top = job->b > job->a ? FloatBelow(job->b) : job->a;
+
+        for (w = 0; w < 4; w++)
+        {
+            /* b - a in float overflows for ranges wider than FLT_MAX */
+            float value = (float)((double)job->a + ((double)job->b - (double)job->a) * UnitFloat(words[w]));
+
+            values[w] = value > top ? top : value;
+        }
+    }
+    else if (job->kind == RAND_NORMAL)
+    {
+        /* Box-Muller, a cosine and a sine from each pair of words */
+        for (w = 0; w < 4; w += 2)
+        {
+            double radius = sqrt(-2.0 * log(1.0 - UnitFloat(words[w])));
+            double angle = 6.283185307179586 * UnitFloat(words[w + 1]);
+
+            values[w] = (float)(job->a + job->b * radius * cos(angle));
+            values[w + 1] = (float)(job->a + job->b * radius * sin(angle));
+        }
+    }
+    else
+    {
+        for (w = 0; w < 2; w++)
+        {
+            int keep = UnitFloat(words[2 * w]) < job->a;
+
+            values[w] = keep ? (float)(2.0 * UnitFloat(words[2 * w + 1]) - 1.0) : 0.0F;
+        }
+    }
+}
+
+static void RandRange(void* arg, size_t begin, size_t end, size_t worker)
+{
+    rand_job_t* job = (rand_job_t*)arg;
+    size_t per_block = job->kind == RAND_SPARSE ? 2 : 4;
+    size_t first = begin * job->n_cols;
+    size_t last = end * job->n_cols;
+    size_t i = first;
+    float values[4];
+
+    (void)worker;
+    while (i < last)
+    {
+        size_t block = i / per_block;
+        size_t offset = i % per_block;
+
+        RandBlock(job, block, values);
+        for (; offset < per_block && i < last; offset++, i++)
+        {
+            job->data[i] = values[offset];
+        }
+    }
+}
+
+static matrix_t* RandMatrix(size_t n_rows, size_t n_cols, rand_kind_t kind, float a, float b, unsigned long seed)
+{
+    matrix_t* result = MatCreate(n_rows, n_cols, NULL);
+    rand_job_t job;
+
+    if (!result)
+    {
+        return NULL;
+    }
+    job.kind = kind;
+    job.key[0] = seed & WORD_MASK;
+    job.key[1] = (seed >> 16 >> 16) & WORD_MASK;
+    job.a = a;
+    job.b = b;
+    job.data = result->data;
+    job.n_cols = n_cols;
+    ParallelFor(n_rows, RowsPerWorker(n_cols * 8), RandRange, &job);
+    return result;
+}
+
+matrix_t* MatRandUniform(size_t n_rows, size_t n_cols, float low, float high, unsigned long seed)
+{
+    return RandMatrix(n_rows, n_cols, RAND_UNIFORM, low, high, seed);
+}
+
+matrix_t* MatRandNormal(size_t n_rows, size_t n_cols, float mean, float stddev, unsigned long seed)
+{
+    return RandMatrix(n_rows, n_cols, RAND_NORMAL, mean, stddev, seed);
+}
+
+matrix_t* MatRandSparse(size_t n_rows, size_t n_cols, float density, unsigned long seed)
+{
+    if (density < 0 || density > 1)
+    {
+        return NULL;
+    }
+    return RandMatrix(n_rows, n_cols, RAND_SPARSE, density, 0, seed);
+}
+
+
+/* -------------------------- low-rank matrices -------------------------- */
+
+#define LOWRANK_BLOCK 16     /* probes per round of the range finder */
+#define LOWRANK_SEED 0x5EEDUL
+#define LOWRANK_DROP 1e-6    /* probes left with less of ||A|| add nothing */
+
+/* A ~ U V^T, V kept transposed so both products walk rows */
+struct mat_lowrank_t
+{
+    matrix_t* u;    /* n_rows x rank */
+    matrix_t* v_t;  /* rank x n_cols */
+    float* scratch; /* rank entries for MatLowRankMatvec */
+    float error;    /* relative Frobenius error, -1 if not measured */
+};
+
+static mat_lowrank_t* LowRankFrom(matrix_t* u, matrix_t* v_t, float error)
+{
+    mat_lowrank_t* lr = (mat_lowrank_t*)malloc(sizeof(mat_lowrank_t));
+    float* scratch = (lr && u) ? (float*)malloc(u->n_cols * sizeof(float) + 1) : NULL;
+
+    if (!lr || !u || !v_t || !scratch)
+    {
+        free(lr);
+        free(scratch);
+        MatDestroy(u);
+        MatDestroy(v_t);
+        return NULL;
+    }
+    lr->u = u;
+    lr->v_t = v_t;
+    lr->scratch = scratch;
+    lr->error = error;
+    return lr;
+}
+
+/* Q^T of the range finder grows by one block of probes: A times random
+ * Gaussian vectors, orthonormalized against the rows already in q.
+ * Returns the number of rows added, 0 on failure or if none is new. */
+static size_t LowRankProbe(const matrix_t* mat, float* q, size_t rank, size_t size, double norm)
+{
+    matrix_t* omega = MatRandNormal(mat->n_cols, size, 0, 1, LOWRANK_SEED + rank);
+    matrix_t* y = omega ? MatMult(mat, omega) : NULL;
+    matrix_t* y_t = y ? MatTranspose(y) : NULL;
+    size_t n = mat->n_rows;
+    size_t added, r = 0;
+
+    for (added = 0; y_t && r < size; r++)
+    {
+        float* v = q + (rank + added) * n;
+
+        memcpy(v, y_t->data + r * n, n * sizeof(float));
+        if (Orthonormalize(q, rank + added, v, n) > LOWRANK_DROP * norm)
+        {
+            ++added;
+        }
+    }
+    MatDestroy(omega);
+    MatDestroy(y);
+    MatDestroy(y_t);
+    return added;
+}
+
+/* Adaptive randomized range finder (Halko, Martinsson and Tropp). The
+ * residual A - Q Q^T A is kept and updated after every block, and its
+ * norm decides the rank. ||A||^2 - ||Q^T A||^2 would be cheaper but
+ * cancels to float noise long before the error gets small. */
+mat_lowrank_t* MatLowRank(const matrix_t* mat, float tol, size_t max_rank)
+{
+    size_t n = mat->n_rows;
+    size_t m = mat->n_cols;
+    size_t limit = n < m ? n : m;
+    double total = 0;
+    double remaining = 0;
+    float* q = NULL;
+    float* b = NULL;
+    float* residual = NULL;
+    float* q_t = NULL;    /* -Q^T of the newest block, n * added */
+    size_t rank = 0;
+    size_t i, r = 0;
+    int failed = 0;
+    matrix_t* q_mat = NULL;
+    matrix_t* u = NULL;
+
+    if (tol < 0)
+    {
+        return NULL;
+    }
+    if (max_rank == 0 || max_rank > limit)
+    {
+        max_rank = limit;
+    }
+    residual = (float*)malloc(n * m * sizeof(float) + 1);
+    q_t = (float*)malloc(n * LOWRANK_BLOCK * sizeof(float) + 1);
+    if (!residual || !q_t)
+    {
+        free(residual);
+        free(q_t);
+        return NULL;
+    }
+    CopyRows(mat, residual);
+    total = SumProductsExact(residual, residual, n * m);
+    remaining = total;
+
+    while (!failed && rank < max_rank && remaining > (double)tol * tol * total)
+    {
+        size_t size = max_rank - rank < LOWRANK_BLOCK ? max_rank - rank : LOWRANK_BLOCK;
+        float* grown_q = (float*)realloc(q, (rank + size) * n * sizeof(float) + 1);
+        float* grown_b = grown_q ? (float*)realloc(b, (rank + size) * m * sizeof(float) + 1) : NULL;
+        matrix_t* block = NULL;
+        matrix_t* block_b = NULL;
+        size_t added = 0;
+
+        q = grown_q ? grown_q : q;
+        b = grown_b ? grown_b : b;
+        added = grown_b ? LowRankProbe(mat, q, rank, size, sqrt(total)) : 0;
+        if (added == 0)
+        {
+            failed = !grown_b;
+            break;
+        }
+
+        /* the new rows of B = Q^T A */
+        block = MatWrap(added, n, q + rank * n);
+        block_b = block ? MatMult(block, mat) : NULL;
+        if (!block_b)
+        {
+            failed = 1;
+        }
+        else
+        {
+            CopyRows(block_b, b + rank * m);
+            for (i = 0; i < n; i++)
+            {
+                for (r = 0; r < added; r++)
+                {
+                    q_t[i * added + r] = -q[(rank + r) * n + i];
+                }
+            }
+            GemmAccumulate(n, added, m, q_t, added, b + rank * m, m, residual, m);
+            remaining = SumProductsExact(residual, residual, n * m);
+            rank += added;
+        }
+        MatDestroy(block);
+        MatDestroy(block_b);
+    }
+
+    if (!failed)
+    {
+        q_mat = MatCreate(rank, n, q);
+        u = q_mat ? MatTranspose(q_mat) : NULL;
+    }
+    free(q);
+    free(q_t);
+    free(residual);
+    MatDestroy(q_mat);
+    if (failed || !u)
+    {
+        free(b);
+        MatDestroy(u);
+        return NULL;
+    }
+    {
+        matrix_t* v_t = MatCreate(rank, m, b);
+
+        free(b);
+        return LowRankFrom(u, v_t, total > 0 ? (float)sqrt(remaining / total) : 0.0F);
+    }
+}
+
+void MatLowRankDestroy(mat_lowrank_t* lr)
+{
+    if (!lr)
+    {
+        return;
+    }
+    MatDestroy(lr->u);
+    MatDestroy(lr->v_t);
+    free(lr->scratch);
+    free(lr);
+}
+
+void MatLowRankShape(const mat_lowrank_t* lr, size_t dims[3])
+{
+    dims[0] = lr->u->n_rows;
+    dims[1] = lr->v_t->n_cols;
+    dims[2] = lr->u->n_cols;
+}
+
+float MatLowRankError(const mat_lowrank_t* lr)
+{
+    return lr->error;
+}
+
+matrix_t* MatLowRankToDense(const mat_lowrank_t* lr)
+{
+    return MatMult(lr->u, lr->v_t);
+}
+
+void MatLowRankMatvec(const float* x, float* y, void* ctx)
+{
+    mat_lowrank_t* lr = (mat_lowrank_t*)ctx;
+    size_t rank = lr->u->n_cols;
+    size_t n_cols = lr->v_t->n_cols;
+    size_t i = 0;
+
+    for (i = 0; i < rank; i++)
+    {
+        lr->scratch[i] = DotF(lr->v_t->data + i * n_cols, x, n_cols);
+    }
+    for (i = 0; i < lr->u->n_rows; i++)
+    {
+        y[i] = DotF(lr->u->data + i * rank, lr->scratch, rank);
+    }
+}
+
+matrix_t* MatLowRankMult(const mat_lowrank_t* lr, const matrix_t* mat)
+{
+    matrix_t* inner = MatMult(lr->v_t, mat);
+    matrix_t* result = inner ? MatMult(lr->u, inner) : NULL;
+
+    MatDestroy(inner);
+    return result;
+}
+
+/* (U1 V1^T)(U2 V2^T) = (U1 (V1^T U2)) V2^T */
+mat_lowrank_t* MatLowRankProduct(const mat_lowrank_t* lr1, const mat_lowrank_t* lr2)
+{
+    matrix_t* inner = MatMult(lr1->v_t, lr2->u);
+    matrix_t* u = inner ? MatMult(lr1->u, inner) : NULL;
+
+    MatDestroy(inner);
+    return u ? LowRankFrom(u, MatClone(lr2->v_t), -1) : NULL;
+}
+
+/* U1 V1^T + U2 V2^T = [U1 U2] [V1 V2]^T */
+mat_lowrank_t* MatLowRankAdd(const mat_lowrank_t* lr1, const mat_lowrank_t* lr2)
+{
+    const matrix_t* us[2];
+    const matrix_t* v_ts[2];
+
+    if (lr1->u->n_rows != lr2->u->n_rows || lr1->v_t->n_cols != lr2->v_t->n_cols)
+    {
+        return NULL;
+    }
+    us[0] = lr1->u;
+    us[1] = lr2->u;
+    v_ts[0] = lr1->v_t;
+    v_ts[1] = lr2->v_t;
+    return LowRankFrom(MatBlock(us, 1, 2), MatBlock(v_ts, 2, 1), -1);
+}
+
+
+/* ------------------------------ comparison ----------------------------- */
+
+#define COMPARE_BLOCK 256
+#define COMPARE_NAN 0xffffffffU   /* ULP key of a pair holding a NaN */
+
+/* Errors are folded as unsigned keys ordered like the errors: the bits of
+ * a non-negative float for MAT_CMP_ABS and MAT_CMP_REL, where NaN lands
+ * above infinity, and the distance itself for MAT_CMP_ULP. A block is then
+ * one integer max that vectorizes without -ffast-math, and NaN cannot hide
+ * from the tolerance test. */
+typedef struct
+{
+    mat_cmp_mode_t mode;
+    unsigned int tol_key;
+    int scan_all;
+    size_t first;   /* storage index of the first mismatch */
+    unsigned int worst_key;
+    mat_cmp_report_t report;
+} compare_state_t;
+
+/* order-preserving map of float bits onto unsigned ints, +0 and -0 alike.
+ * The key functions below stay free of branches so CompareKeys vectorizes. */
+static unsigned int UlpKey(float value)
+{
+    unsigned int bits = FloatBits(value);
+    unsigned int negative = 0U - (bits >> 31);
+
+    return ((0x80000000U - (bits & 0x7fffffffU)) & negative) | ((bits | 0x80000000U) & ~negative);
+}
+
+/* Equal elements give key 0 in the ABS and REL modes without going
+ * through a - b, which is NaN for equal infinities; the mask also
+ * covers a == b == 0, where the relative error divides by zero. */
+static unsigned int AbsKey(float a, float b)
+{
+    return FloatBits(a - b) & 0x7fffffffU & CondMask(a != b);
+}
+
+static unsigned int RelKey(float a, float b)
+{
+    unsigned int abs_a = FloatBits(a) & 0x7fffffffU;
+    unsigned int abs_b = FloatBits(b) & 0x7fffffffU;
+    unsigned int larger = abs_a > abs_b ? abs_a : abs_b;
+
+    return FloatBits((a - b) / BitsFloat(larger)) & 0x7fffffffU & CondMask(a != b);
+}
+
+static unsigned int UlpDistance(float a, float b)
+{
+    unsigned int key_a = UlpKey(a);
+    unsigned int key_b = UlpKey(b);
+    unsigned int abs_a = FloatBits(a) & 0x7fffffffU;
+    unsigned int abs_b = FloatBits(b) & 0x7fffffffU;
+    unsigned int nan = (abs_a > abs_b ? abs_a : abs_b) > 0x7f800000U;
+    unsigned int high = key_a > key_b ? key_a : key_b;
+    unsigned int low = key_a > key_b ? key_b : key_a;
+
+    return (high - low) | (0U - nan);
+}
+
+static unsigned int TolKey(float tol, mat_cmp_mode_t mode)
+{
+    if (!(tol > 0))
+    {
+        return 0;
+    }
+    if (mode == MAT_CMP_ULP)
+    {
+        return tol < 4294967295.0 ? (unsigned int)tol : COMPARE_NAN - 1;
+    }
+    return FloatBits(tol);
+}
+
+static double KeyError(unsigned int key, mat_cmp_mode_t mode)
+{
+    if (mode == MAT_CMP_ULP)
+    {
+        return key == COMPARE_NAN ? HUGE_VAL : (double)key;
+    }
+    return key > 0x7f800000U ? HUGE_VAL : (double)BitsFloat(key);
+}
+
+#define COMPARE_KEYS(key_fn)                                    \
+    for (i = 0; i < COMPARE_BLOCK; i++)                         \
+    {                                                           \
+        keys[i] = key_fn(a[i], b[i]);                           \
+    }
+
+/* the keys of COMPARE_BLOCK pairs; the fixed trip count lets the loops
+ * vectorize at -O2 */
+static void CompareKeys(const float* a, const float* b, mat_cmp_mode_t mode, unsigned int* keys)
+{
+    size_t i = 0;
+
+    switch (mode)
+    {
+    case MAT_CMP_REL:
+        COMPARE_KEYS(RelKey)
+        break;
+    case MAT_CMP_ULP:
+        COMPARE_KEYS(UlpDistance)
+        break;
+    default:
+        COMPARE_KEYS(AbsKey)
+        break;
+    }
+}
+
+/* compares n pairs stored from index offset on; returns 1 once the scan
+ * can stop */
+static int CompareRun(compare_state_t* state, const float* a, const float* b, size_t n, size_t offset)
+{
+    unsigned int keys[COMPARE_BLOCK];
+    float tail_a[COMPARE_BLOCK];
+    float tail_b[COMPARE_BLOCK];
+    size_t start, i = 0;
+
+    for (start = 0; start < n; start += COMPARE_BLOCK)
+    {
+        size_t len = n - start < COMPARE_BLOCK ? n - start : COMPARE_BLOCK;
+        unsigned int worst = 0;
+
+        if (len == COMPARE_BLOCK)
+        {
+            CompareKeys(a + start, b + start, state->mode, keys);
+        }
+        else
+        {
+            /* zero padding compares equal in every mode */
+            memset(tail_a, 0, sizeof(tail_a));
+            memset(tail_b, 0, sizeof(tail_b));
+            memcpy(tail_a, a + start, len * sizeof(float));
+            memcpy(tail_b, b + start, len * sizeof(float));
+            CompareKeys(tail_a, tail_b, state->mode, keys);
+        }
+        for (i = 0; i < COMPARE_BLOCK; i++)
+        {
+            worst = keys[i] > worst ? keys[i] : worst;
+        }
+        state->worst_key = worst > state->worst_key ? worst : state->worst_key;
+        if (worst <= state->tol_key)
+        {
+            continue;
+        }
+
+        /* rare: find the offenders */
+        for (i = 0; i < len; i++)
+        {
+            if (keys[i] <= state->tol_key)
+            {
+                continue;
+            }
+            if (state->report.mismatches++ == 0)
+            {
+                state->first = offset + start + i;
+            }
+            if (!state->scan_all)
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int MatCompareEx(const matrix_t* mat1, const matrix_t* mat2, mat_cmp_mode_t mode, float tol,
+                 int scan_all, mat_cmp_report_t* report)
+{
+    compare_state_t state;
+    matrix_t storage = StorageView(mat1);
+    size_t i, j = 0;
+
+    memset(&state, 0, sizeof(state));
+    state.mode = mode;
+    state.tol_key = TolKey(tol, mode);
+    state.scan_all = scan_all;
+
+    if (mat1->n_rows != mat2->n_rows || mat1->n_cols != mat2->n_cols)
+    {
+        if (report)
+        {
+            *report = state.report;
+        }
+        return 0;
+    }
+
+    if (mat1->layout == mat2->layout)
+    {
+        CompareRun(&state, mat1->data, mat2->data, mat1->n_rows * mat1->n_cols, 0);
+    }
+    else
+    {
+        /* walk mat1's storage, gathering the matching elements of mat2 */
+        float gathered[COMPARE_BLOCK];
+        int stop = 0;
+
+        for (i = 0; !stop && i < storage.n_rows; i++)
+        {
+            for (j = 0; !stop && j < storage.n_cols; j += COMPARE_BLOCK)
+            {
+                size_t len = storage.n_cols - j < COMPARE_BLOCK ? storage.n_cols - j : COMPARE_BLOCK;
+                size_t k = 0;
+
+                for (k = 0; k < len; k++)
+                {
+                    gathered[k] = mat2->data[(j + k) * storage.n_rows + i];
+                }
+                stop = CompareRun(&state, mat1->data + i * storage.n_cols + j, gathered, len,
+                                  i * storage.n_cols + j);
+            }
+        }
+    }
+
+    state.report.max_error = KeyError(state.worst_key, mode);
+    if (state.report.mismatches > 0)
+    {
+        size_t line = state.first / storage.n_cols;
+        size_t pos = state.first % storage.n_cols;
+
+        state.report.row = mat1->layout == MAT_COL_MAJOR ? pos : line;
+        state.report.col = mat1->layout == MAT_COL_MAJOR ? line : pos;
+    }
+    if (report)
+    {
+        *report = state.report;
+    }
+    return state.report.mismatches == 0;
 }
@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
 #include "mat.h"
 
 typedef enum {
@@ -22,6 +25,31 @@ TestResult TestMatSubmatrix();
 TestResult TestMatDet();
 TestResult TestMatInvert();
 TestResult TestMatNorm();
+TestResult TestMatQuantize();
+TestResult TestMatWrapClone();
+TestResult TestMatDiskMult();
+TestResult TestMatReduce();
+TestResult TestMatApply();
+TestResult TestMatLeastSquares();
+TestResult TestMatEigs();
+TestResult TestMatInverseUpdate();
+TestResult TestMatCGSolve();
+TestResult TestMatNumaPolicy();
+TestResult TestMatTextIO();
+TestResult TestMatKron();
+TestResult TestMatConv2D();
+TestResult TestMatMultChain();
+TestResult TestMatCache();
+TestResult TestMatLayout();
+TestResult TestMatBand();
+TestResult TestMatTyped();
+TestResult TestMatProfile();
+TestResult TestMatTune();
+TestResult TestMatShard();
+TestResult TestMatReproducible();
+TestResult TestMatRand();
+TestResult TestMatLowRank();
+TestResult TestMatCompareEx();
 
 /* Helper function to check matrix shape without passing a dim array*/
 int CheckMatrixShape(const matrix_t* mat, size_t expected_rows, size_t expected_cols) 
@@ -107,6 +135,131 @@ int main() {
         printf("ERROR IN TestMatNorm\n");
         all_passed = FAIL;
     }
+    if (TestMatQuantize() == FAIL) 
+    {
+        printf("ERROR IN TestMatQuantize\n");
+        all_passed = FAIL;
+    }
+    if (TestMatWrapClone() == FAIL) 
+    {
+        printf("ERROR IN TestMatWrapClone\n");
+        all_passed = FAIL;
+    }
+    if (TestMatDiskMult() == FAIL) 
+    {
+        printf("ERROR IN TestMatDiskMult\n");
+        all_passed = FAIL;
+    }
+    if (TestMatReduce() == FAIL) 
+    {
+        printf("ERROR IN TestMatReduce\n");
+        all_passed = FAIL;
+    }
+    if (TestMatApply() == FAIL) 
+    {
+        printf("ERROR IN TestMatApply\n");
+        all_passed = FAIL;
+    }
+    if (TestMatLeastSquares() == FAIL) 
+    {
+        printf("ERROR IN TestMatLeastSquares\n");
+        all_passed = FAIL;
+    }
+    if (TestMatEigs() == FAIL) 
+    {
+        printf("ERROR IN TestMatEigs\n");
+        all_passed = FAIL;
+    }
+    if (TestMatInverseUpdate() == FAIL) 
+    {
+        printf("ERROR IN TestMatInverseUpdate\n");
+        all_passed = FAIL;
+    }
+    if (TestMatCGSolve() == FAIL) 
+    {
+        printf("ERROR IN TestMatCGSolve\n");
+        all_passed = FAIL;
+    }
+    if (TestMatNumaPolicy() == FAIL) 
+    {
+        printf("ERROR IN TestMatNumaPolicy\n");
+        all_passed = FAIL;
+    }
+    if (TestMatTextIO() == FAIL) 
+    {
+        printf("ERROR IN TestMatTextIO\n");
+        all_passed = FAIL;
+    }
+    if (TestMatKron() == FAIL) 
+    {
+        printf("ERROR IN TestMatKron\n");
+        all_passed = FAIL;
+    }
+    if (TestMatConv2D() == FAIL) 
+    {
+        printf("ERROR IN TestMatConv2D\n");
+        all_passed = FAIL;
+    }
+    if (TestMatMultChain() == FAIL) 
+    {
+        printf("ERROR IN TestMatMultChain\n");
+        all_passed = FAIL;
+    }
+    if (TestMatCache() == FAIL) 
+    {
+        printf("ERROR IN TestMatCache\n");
+        all_passed = FAIL;
+    }
+    if (TestMatLayout() == FAIL) 
+    {
+        printf("ERROR IN TestMatLayout\n");
+        all_passed = FAIL;
+    }
+    if (TestMatBand() == FAIL) 
+    {
+        printf("ERROR IN TestMatBand\n");
+        all_passed = FAIL;
+    }
+    if (TestMatTyped() == FAIL) 
+    {
+        printf("ERROR IN TestMatTyped\n");
+        all_passed = FAIL;
+    }
+    if (TestMatProfile() == FAIL) 
+    {
+        printf("ERROR IN TestMatProfile\n");
+        all_passed = FAIL;
+    }
+    if (TestMatTune() == FAIL) 
+    {
+        printf("ERROR IN TestMatTune\n");
+        all_passed = FAIL;
+    }
+    if (TestMatShard() == FAIL) 
+    {
+        printf("ERROR IN TestMatShard\n");
+        all_passed = FAIL;
+    }
+    if (TestMatReproducible() == FAIL) 
+    {
+        printf("ERROR IN TestMatReproducible\n");
+        all_passed = FAIL;
+    }
+    if (TestMatRand() == FAIL) 
+    {
+        printf("ERROR IN TestMatRand\n");
+        all_passed = FAIL;
+    }
+    if (TestMatLowRank() == FAIL) 
+    {
+        printf("ERROR IN TestMatLowRank\n");
+        all_passed = FAIL;
+    }
+    if (TestMatCompareEx() == FAIL) 
+    {
+        printf("ERROR IN TestMatCompareEx\n");
+        all_passed = FAIL;
+    }
 
     if (all_passed) 
     {
@@ -652,3 +805,1461 @@ TestResult TestMatNorm()
     MatDestroy(mat);
     return SUCCESS;
 }
+
+TestResult TestMatQuantize() 
+{
+    float data[6] = {1, -2, 0.5, 4, 5, -6};
+    float other[6] = {1, 0, 2, -1, 0.25, 3};
+    float x[3] = {1, 2, 3};
+    float y[2] = {0, 0};
+    mat_storage_t storages[3] = {MAT_STORE_FP16, MAT_STORE_BF16, MAT_STORE_INT8};
+    size_t s, i, j = 0;
+
+    matrix_t* mat = MatCreate(2, 3, data);
+    matrix_t* rhs = MatCreate(3, 2, other);
+    matrix_t* expected = MatMult(rhs, mat);
+
+    for (s = 0; s < 3; s++)
+    {
+        mat_quant_t* qmat = MatQuantize(mat, storages[s]);
+        matrix_t* back = MatDequantize(qmat);
+        matrix_t* product = MatQuantMult(rhs, qmat);
+        /* int8 rounds each element to 1/127 of its row's largest value */
+        float tolerance = storages[s] == MAT_STORE_INT8 ? 0.05F : TOLERANCE;
+        int ok = (back && product);
+
+        for (i = 0; ok && i < 2; i++)
+        {
+            for (j = 0; j < 3; j++)
+            {
+                if (fabs(MatGetElem(back, i, j) - data[i * 3 + j]) > tolerance ||
+                    fabs(MatGetElem(product, j, i) - MatGetElem(expected, j, i)) > tolerance * 10)
+                {
+                    ok = 0;
+                }
+            }
+        }
+
+        if (ok && MatQuantMatvec(qmat, x, y) == 0)
+        {
+            for (i = 0; i < 2; i++)
+            {
+                float sum = 0;
+                for (j = 0; j < 3; j++)
+                {
+                    sum += data[i * 3 + j] * x[j];
+                }
+                if (fabs(sum - y[i]) > tolerance * 10)
+                {
+                    ok = 0;
+                }
+            }
+        }
+        else
+        {
+            ok = 0;
+        }
+
+        MatQuantDestroy(qmat);
+        MatDestroy(back);
+        MatDestroy(product);
+        if (!ok)
+        {
+            MatDestroy(mat);
+            MatDestroy(rhs);
+            MatDestroy(expected);
+            return FAIL;
+        }
+    }
+
+    MatDestroy(mat);
+    MatDestroy(rhs);
+    MatDestroy(expected);
+    return SUCCESS;
+}
+
+static void CountingFree(float* data, void* ctx)
+{
+    ++*(int*)ctx;
+    free(data);
+}
+
+TestResult TestMatWrapClone() 
+{
+    float data[4] = {1, 2, 3, 4};
+    float* owned = (float*)malloc(4 * sizeof(float));
+    int frees = 0;
+    matrix_t* wrapped = MatWrap(2, 2, data);
+    matrix_t* adopted = NULL;
+    matrix_t* clone = NULL;
+    float* writable = NULL;
+
+    if (!wrapped || MatConstData(wrapped) != data || MatGetElem(wrapped, 1, 0) != 3)
+    {
+        MatDestroy(wrapped);
+        free(owned);
+        return FAIL;
+    }
+    MatDestroy(wrapped);
+
+    memcpy(owned, data, sizeof(data));
+    adopted = MatAdopt(2, 2, owned, CountingFree, &frees);
+    clone = MatClone(adopted);
+
+    /* the clone shares until written, then only the writer changes */
+    if (MatConstData(clone) != owned)
+    {
+        MatDestroy(clone);
+        MatDestroy(adopted);
+        return FAIL;
+    }
+    writable = MatData(clone);
+    writable[0] = 10;
+    if (writable == owned || MatGetElem(adopted, 0, 0) != 1 || MatGetElem(clone, 0, 0) != 10)
+    {
+        MatDestroy(clone);
+        MatDestroy(adopted);
+        return FAIL;
+    }
+
+    MatDestroy(clone);
+    if (frees != 0 || MatData(adopted) != owned)
+    {
+        MatDestroy(adopted);
+        return FAIL;
+    }
+    MatDestroy(adopted);
+
+    return frees == 1 ? SUCCESS : FAIL;
+}
+
+TestResult TestMatDiskMult() 
+{
+    const char* paths[3] = {"mat_test_a.bin", "mat_test_b.bin", "mat_test_c.bin"};
+    float data1[15] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, -1, -2, -3, -4, -5};
+    float data2[12] = {1, 0, 2, -1, 3, 1, 0.5, 2, -2, 4, 1, 1};
+    matrix_t* mat1 = MatCreate(5, 3, data1);
+    matrix_t* mat2 = MatCreate(3, 4, data2);
+    matrix_t* expected = MatMult(mat1, mat2);
+    matrix_t* result = NULL;
+    mat_disk_t* a = MatDiskCreate(paths[0], 5, 3);
+    mat_disk_t* b = MatDiskCreate(paths[1], 3, 4);
+    mat_disk_t* c = NULL;
+    TestResult status = FAIL;
+
+    /* a budget of 5 floats forces 1x1 tiles and every prefetch path */
+    if (a && b && MatDiskWrite(a, 0, 0, mat1) == 0 && MatDiskWrite(b, 0, 0, mat2) == 0)
+    {
+        c = MatDiskMult(a, b, paths[2], 5 * sizeof(float));
+        result = c ? MatDiskRead(c, 0, 0, 5, 4) : NULL;
+        if (result && MatCompare(result, expected))
+        {
+            MatDiskClose(c);
+            MatDestroy(result);
+            c = MatDiskMult(a, b, paths[2], 1 << 20);
+            result = c ? MatDiskRead(c, 0, 0, 5, 4) : NULL;
+            status = (result && MatCompare(result, expected)) ? SUCCESS : FAIL;
+        }
+    }
+
+    MatDiskClose(a);
+    MatDiskClose(b);
+    MatDiskClose(c);
+    remove(paths[0]);
+    remove(paths[1]);
+    remove(paths[2]);
+    MatDestroy(mat1);
+    MatDestroy(mat2);
+    MatDestroy(expected);
+    MatDestroy(result);
+    return status;
+}
+
+TestResult TestMatReduce() 
+{
+    float data[6] = {1, 5, -3, 4, -2, 6};
+    float expected_rows[4][2] = {{3, 8}, {-3, -2}, {5, 6}, {1, 8.0F / 3}};
+    float expected_cols[4][3] = {{5, 3, 3}, {1, -2, -3}, {4, 5, 6}, {2.5, 1.5, 1.5}};
+    size_t arg_rows[2] = {0, 0};
+    size_t arg_cols[3] = {0, 0, 0};
+    mat_reduce_t op = MAT_REDUCE_SUM;
+    size_t i = 0;
+    matrix_t* mat = MatCreate(2, 3, data);
+    TestResult status = SUCCESS;
+
+    for (op = MAT_REDUCE_SUM; op <= MAT_REDUCE_MEAN; op++)
+    {
+        matrix_t* rows = MatRowReduce(mat, op);
+        matrix_t* cols = MatColReduce(mat, op);
+
+        if (!rows || !cols || !CheckMatrixShape(rows, 2, 1) || !CheckMatrixShape(cols, 1, 3))
+        {
+            status = FAIL;
+        }
+        for (i = 0; status == SUCCESS && i < 3; i++)
+        {
+            if ((i < 2 && fabs(MatGetElem(rows, i, 0) - expected_rows[op][i]) > TOLERANCE) ||
+                fabs(MatGetElem(cols, 0, i) - expected_cols[op][i]) > TOLERANCE)
+            {
+                status = FAIL;
+            }
+        }
+        MatDestroy(rows);
+        MatDestroy(cols);
+    }
+
+    if (MatRowArgReduce(mat, MAT_REDUCE_MAX, arg_rows) != 0 || arg_rows[0] != 1 || arg_rows[1] != 2 ||
+        MatColArgReduce(mat, MAT_REDUCE_MIN, arg_cols) != 0 || arg_cols[0] != 0 || arg_cols[1] != 1 ||
+        arg_cols[2] != 0 || MatRowArgReduce(mat, MAT_REDUCE_SUM, arg_rows) == 0)
+    {
+        status = FAIL;
+    }
+
+    MatDestroy(mat);
+    return status;
+}
+
+static void NegateRow(const float* in, float* out, size_t count, void* ctx)
+{
+    size_t j = 0;
+
+    for (j = 0; j < count; j++)
+    {
+        out[j] = -in[j] * *(float*)ctx;
+    }
+}
+
+TestResult TestMatApply() 
+{
+    float data[6] = {-2.5, -0.1, 0.001, 0.5, 3, 20};
+    float scale = 2;
+    mat_func_t fn = MAT_FN_EXP;
+    size_t i = 0;
+    matrix_t* mat = MatCreate(2, 3, data);
+    matrix_t* result = NULL;
+    TestResult status = SUCCESS;
+
+    for (fn = MAT_FN_EXP; fn <= MAT_FN_ABS; fn++)
+    {
+        result = MatApply(mat, fn);
+        for (i = 0; result && i < 6; i++)
+        {
+            double x = data[i];
+            double expected[6];
+
+            expected[MAT_FN_EXP] = exp(x);
+            expected[MAT_FN_LOG] = x > 0 ? log(x) : 0;
+            expected[MAT_FN_TANH] = tanh(x);
+            expected[MAT_FN_SIGMOID] = 1 / (1 + exp(-x));
+            expected[MAT_FN_RELU] = x > 0 ? x : 0;
+            expected[MAT_FN_ABS] = fabs(x);
+
+            if ((fn != MAT_FN_LOG || x > 0) &&
+                fabs(MatGetElem(result, i / 3, i % 3) - expected[fn]) > 1e-6 * (1 + fabs(expected[fn])))
+            {
+                status = FAIL;
+            }
+        }
+        if (!result || (fn == MAT_FN_LOG && MatGetElem(result, 0, 0) == MatGetElem(result, 0, 0)))
+        {
+            status = FAIL; /* log of a negative must be NaN */
+        }
+        MatDestroy(result);
+    }
+
+    result = MatClamp(mat, -1, 1);
+    if (!result || MatGetElem(result, 0, 0) != -1 || MatGetElem(result, 0, 1) != data[1] ||
+        MatGetElem(result, 1, 2) != 1)
+    {
+        status = FAIL;
+    }
+    MatDestroy(result);
+
+    result = MatApplyRows(mat, NegateRow, &scale);
+    if (!result || MatGetElem(result, 1, 1) != -6)
+    {
+        status = FAIL;
+    }
+    MatDestroy(result);
+
+    MatDestroy(mat);
+    return status;
+}
+
+TestResult TestMatLeastSquares() 
+{
+    float data_a[10] = {1, 1, 1, 2, 1, 3, 1, 4, 1, 5};
+    float data_b[5] = {2.1, 3.9, 6.2, 7.8, 10.1};
+    float expected[2] = {0.05, 1.99}; /* intercept and slope of the best fit line */
+    matrix_t* a = MatCreate(5, 2, data_a);
+    matrix_t* b = MatCreate(5, 1, data_b);
+    matrix_t* x = MatLeastSquares(a, b);
+    mat_qr_t* qr = MatQR(a);
+    matrix_t* q = qr ? MatQRGetQ(qr) : NULL;
+    matrix_t* r = qr ? MatQRGetR(qr) : NULL;
+    matrix_t* qr_product = (q && r) ? MatMult(q, r) : NULL;
+    TestResult status = SUCCESS;
+
+    if (!x || !CheckMatrixShape(x, 2, 1) ||
+        fabs(MatGetElem(x, 0, 0) - expected[0]) > TOLERANCE ||
+        fabs(MatGetElem(x, 1, 0) - expected[1]) > TOLERANCE)
+    {
+        status = FAIL;
+    }
+    if (!qr_product || !CheckMatrixShape(q, 5, 2) || !CheckMatrixShape(r, 2, 2) ||
+        !MatCompare(qr_product, a) || MatGetElem(r, 1, 0) != 0)
+    {
+        status = FAIL;
+    }
+
+    MatDestroy(a);
+    MatDestroy(b);
+    MatDestroy(x);
+    MatDestroy(q);
+    MatDestroy(r);
+    MatDestroy(qr_product);
+    MatQRDestroy(qr);
+    return status;
+}
+
+TestResult TestMatEigs() 
+{
+    float data[9] = {2, 1, 0, 1, 2, 0, 0, 0, 5}; /* eigenvalues 5, 3, 1 */
+    float rect[6] = {3, 0, 0, -2, 0, 0};         /* singular values 3, 2 */
+    float values[2] = {0, 0};
+    float sv[2] = {0, 0};
+    matrix_t* mat = MatCreate(3, 3, data);
+    matrix_t* rmat = MatCreate(3, 2, rect);
+    matrix_t* vectors = NULL;
+    matrix_t* u = NULL;
+    matrix_t* v = NULL;
+    TestResult status = SUCCESS;
+
+    if (MatEigsLanczos(MatDenseMatvec, mat, 3, 2, values, &vectors) != 0 ||
+        fabs(values[0] - 5) > TOLERANCE || fabs(values[1] - 3) > TOLERANCE ||
+        fabs(fabs(MatGetElem(vectors, 2, 0)) - 1) > TOLERANCE)
+    {
+        status = FAIL;
+    }
+    MatDestroy(vectors);
+    vectors = NULL;
+
+    if (MatEigsPower(MatDenseMatvec, mat, 3, 2, values, &vectors) != 0 ||
+        fabs(values[0] - 5) > TOLERANCE || fabs(values[1] - 3) > TOLERANCE ||
+        fabs(fabs(MatGetElem(vectors, 0, 1)) - sqrt(0.5)) > TOLERANCE)
+    {
+        status = FAIL;
+    }
+
+    if (MatRandSVD(MatDenseMatvec, MatDenseMatvecT, rmat, 3, 2, 2, sv, &u, &v) != 0 ||
+        fabs(sv[0] - 3) > TOLERANCE || fabs(sv[1] - 2) > TOLERANCE ||
+        !CheckMatrixShape(u, 3, 2) || !CheckMatrixShape(v, 2, 2) ||
+        fabs(fabs(MatGetElem(v, 0, 0)) - 1) > TOLERANCE)
+    {
+        status = FAIL;
+    }
+
+    MatDestroy(mat);
+    MatDestroy(rmat);
+    MatDestroy(vectors);
+    MatDestroy(u);
+    MatDestroy(v);
+    return status;
+}
+
+TestResult TestMatInverseUpdate() 
+{
+    float data[9] = {4, 7, 2, -3, 6, 1, 2, 5, -1};
+    float new_row[3] = {1, 2, 3};
+    float new_col[3] = {0, 1, -2};
+    float u_data[6] = {1, 0, 0, 1, 2, -1};
+    float v_data[6] = {0, 1, 1, 0, 0.5, 0.5};
+    matrix_t* mat = MatCreate(3, 3, data);
+    matrix_t* u = MatCreate(3, 2, u_data);
+    matrix_t* v = MatCreate(3, 2, v_data);
+    matrix_t* vt = MatTranspose(v);
+    matrix_t* uvt = MatMult(u, vt);
+    matrix_t* updated = NULL;
+    matrix_t* expected = NULL;
+    matrix_t* actual = NULL;
+    mat_inverse_t* inv = MatInverseCreate(mat);
+    /* I + V with V = [[-1, 1], [1, -1]] is its own inverse, while the
+     * capacitance I + V^T has a zero leading pivot, and so has the
+     * refresh that inverts I + V from scratch */
+    float swap_v[4] = {-1, 1, 1, -1};
+    float minus_i[4] = {-1, 0, 0, -1};
+    matrix_t* eye = MatI(2);
+    matrix_t* swap = MatCreate(2, 2, swap_v);
+    matrix_t* minus = MatCreate(2, 2, minus_i);
+    mat_inverse_t* perm = eye ? MatInverseCreate(eye) : NULL;
+    size_t i = 0;
+    TestResult status = SUCCESS;
+
+    /* apply the same row, column and rank-2 changes to a plain copy */
+    for (i = 0; i < 3; i++)
+    {
+        data[1 * 3 + i] = new_row[i];
+    }
+    for (i = 0; i < 3; i++)
+    {
+        data[i * 3 + 2] = new_col[i];
+    }
+    MatDestroy(mat);
+    mat = MatCreate(3, 3, data);
+    updated = MatAdd(mat, uvt);
+    expected = MatInvert(updated);
+
+    if (!inv || MatInverseUpdateRow(inv, 1, new_row) != 0 || MatInverseUpdateCol(inv, 2, new_col) != 0 ||
+        MatInverseUpdateRankK(inv, u, v) != 0)
+    {
+        status = FAIL;
+    }
+    actual = inv ? MatInverseGet(inv) : NULL;
+    if (status == SUCCESS &&
+        (!actual || !MatCompare(actual, expected) || fabs(MatInverseDet(inv) - MatDet(updated)) > TOLERANCE * 10))
+    {
+        status = FAIL;
+    }
+
+    /* I + V, recomputed from scratch too; adding -I after it gives the
+     * singular V, which is rejected and leaves the handle as it was */
+    MatDestroy(actual);
+    actual = NULL;
+    if (!perm || MatInverseUpdateRankK(perm, eye, swap) != 0 || MatInverseRefresh(perm) != 0 ||
+        !(actual = MatInverseGet(perm)) ||
+        MatGetElem(actual, 0, 0) != 0 || MatGetElem(actual, 0, 1) != 1 ||
+        MatGetElem(actual, 1, 0) != 1 || MatGetElem(actual, 1, 1) != 0 || MatInverseDet(perm) != -1 ||
+        MatInverseUpdateRankK(perm, eye, minus) == 0 || MatInverseDet(perm) != -1)
+    {
+        status = FAIL;
+    }
+
+    MatInverseDestroy(inv);
+    MatInverseDestroy(perm);
+    MatDestroy(eye);
+    MatDestroy(swap);
+    MatDestroy(minus);
+    MatDestroy(mat);
+    MatDestroy(u);
+    MatDestroy(v);
+    MatDestroy(vt);
+    MatDestroy(uvt);
+    MatDestroy(updated);
+    MatDestroy(expected);
+    MatDestroy(actual);
+    return status;
+}
+
+TestResult TestMatCGSolve() 
+{
+    /* 1D Laplacian, tridiagonal SPD */
+    float data[16] = {2, -1, 0, 0, -1, 2, -1, 0, 0, -1, 2, -1, 0, 0, -1, 2};
+    float b[4] = {1, 0, 0, 1};
+    float expected[4] = {1, 1, 1, 1};
+    float x[4] = {0, 0, 0, 0};
+    matrix_t* mat = MatCreate(4, 4, data);
+    mat_precond_t* jacobi = MatPrecondJacobi(mat);
+    mat_precond_t* ic = MatPrecondIC(mat);
+    /* the same lower triangle as CSR */
+    size_t row_ptr[5] = {0, 1, 3, 5, 7};
+    size_t cols[7] = {0, 0, 1, 1, 2, 2, 3};
+    float vals[7] = {2, -1, 2, -1, 2, -1, 2};
+    mat_precond_t* ic_sparse = MatPrecondICSparse(4, row_ptr, cols, vals);
+    mat_precond_t* pres[4];
+    mat_cg_t* cg = MatCGCreate(4);
+    size_t iters = 0;
+    size_t p, i = 0;
+    TestResult status = SUCCESS;
+
+    pres[0] = NULL;
+    pres[1] = jacobi;
+    pres[2] = ic;
+    pres[3] = ic_sparse;
+    for (p = 0; p < 4; p++)
+    {
+        memset(x, 0, sizeof(x));
+        if (MatCGSolve(cg, MatDenseMatvec, mat, pres[p] ? MatPrecondApply : NULL, pres[p],
+                       b, x, 1e-6F, 100, &iters) != 0)
+        {
+            status = FAIL;
+        }
+        for (i = 0; i < 4; i++)
+        {
+            if (fabs(x[i] - expected[i]) > TOLERANCE)
+            {
+                status = FAIL;
+            }
+        }
+    }
+
+    /* IC(0) of a tridiagonal matrix is its exact Cholesky factor */
+    if (iters != 1)
+    {
+        status = FAIL;
+    }
+
+    MatCGDestroy(cg);
+    MatPrecondDestroy(jacobi);
+    MatPrecondDestroy(ic);
+    MatPrecondDestroy(ic_sparse);
+    MatDestroy(mat);
+    return status;
+}
+
+TestResult TestMatNumaPolicy() 
+{
+    size_t n = 600; /* 1.4 MB, above the NUMA threshold */
+    float* data = (float*)malloc(n * n * sizeof(float));
+    mat_numa_policy_t policies[2] = {MAT_NUMA_INTERLEAVE, MAT_NUMA_FIRST_TOUCH};
+    size_t p, i = 0;
+    TestResult status = MatNumaNodes() >= 1 ? SUCCESS : FAIL;
+
+    for (i = 0; i < n * n; i++)
+    {
+        data[i] = (float)(i % 7);
+    }
+
+    for (p = 0; p < 2; p++)
+    {
+        matrix_t* mat = NULL;
+        matrix_t* zeros = NULL;
+        matrix_t* id = NULL;
+        matrix_t* product = NULL;
+
+        MatSetNumaPolicy(policies[p]);
+        mat = MatCreate(n, n, data);
+        zeros = MatCreate(n, n, NULL);
+        id = MatI(n);
+        product = (mat && id) ? MatMult(mat, id) : NULL;
+        MatSetNumaPolicy(MAT_NUMA_DEFAULT);
+
+        if (!product || !zeros || !MatCompare(product, mat) || MatGetElem(mat, n - 1, n - 1) != data[n * n - 1] ||
+            MatNorm(zeros) != 0)
+        {
+            status = FAIL;
+        }
+        MatDestroy(mat);
+        MatDestroy(zeros);
+        MatDestroy(id);
+        MatDestroy(product);
+    }
+
+    free(data);
+    return status;
+}
+
+TestResult TestMatTextIO() 
+{
+    const char* paths[2] = {"mat_test.csv", "mat_test.mtx"};
+    float data[6] = {0.1F, -2.5F, 3e-20F, 1234567.0F, 0, 1.0F / 3};
+    float expected_mm[9] = {5, 0, 2, 0, 0, 0, 2, 0, 0};
+    const char* bad_mm[5] = {"-2 2 1\n1 1 1\n", "2.5 2 1\n1 1 1\n", "2 2 1\n1.5 1 1\n",
+                             "99999999999999999999999 2 1\n1 1 1\n", "2 2 3\n1 1 1\n2 2 1\n"};
+    size_t i = 0;
+    matrix_t* mat = MatCreate(2, 3, data);
+    matrix_t* csv = NULL;
+    matrix_t* mm = NULL;
+    FILE* file = NULL;
+    TestResult status = FAIL;
+
+    /* shortest formatting must still read back bit for bit */
+    if (MatWriteCSV(mat, paths[0]) == 0 && (csv = MatReadCSV(paths[0])) &&
+        CheckMatrixShape(csv, 2, 3) && memcmp(MatConstData(csv), data, sizeof(data)) == 0 &&
+        MatWriteMatrixMarket(mat, paths[1]) == 0 && (mm = MatReadMatrixMarket(paths[1])) &&
+        CheckMatrixShape(mm, 2, 3) && memcmp(MatConstData(mm), data, sizeof(data)) == 0)
+    {
+        file = fopen(paths[1], "w");
+        if (file)
+        {
+            fprintf(file, "%%%%MatrixMarket matrix coordinate real symmetric\n%% comment\n3 3 2\n1 1 5\n3 1 2\n");
+            fclose(file);
+            MatDestroy(mm);
+            mm = MatReadMatrixMarket(paths[1]);
+            status = (mm && CheckMatrixShape(mm, 3, 3) &&
+                      memcmp(MatConstData(mm), expected_mm, sizeof(expected_mm)) == 0) ? SUCCESS : FAIL;
+        }
+    }
+
+    /* signs, fractions, overflow and a wrong entry count are all errors */
+    for (i = 0; i < 5 && status == SUCCESS; i++)
+    {
+        file = fopen(paths[1], "w");
+        if (!file)
+        {
+            status = FAIL;
+            break;
+        }
+        fprintf(file, "%%%%MatrixMarket matrix coordinate real general\n%s", bad_mm[i]);
+        fclose(file);
+        MatDestroy(mm);
+        mm = MatReadMatrixMarket(paths[1]);
+        status = mm ? FAIL : SUCCESS;
+    }
+
+    remove(paths[0]);
+    remove(paths[1]);
+    MatDestroy(mat);
+    MatDestroy(csv);
+    MatDestroy(mm);
+    return status;
+}
+
+TestResult TestMatKron() 
+{
+    float data_a[6] = {1, 2, 3, 4, 5, 6};
+    float data_b[4] = {0, 1, -1, 2};
+    float x[6] = {1, 2, 3, 4, 5, 6};
+    float expected_kron[24] = {0, 1, 0, 2, 0, 3,
+                               -1, 2, -2, 4, -3, 6,
+                               0, 4, 0, 5, 0, 6,
+                               -4, 8, -5, 10, -6, 12};
+    float expected_block[30] = {1, 2, 3, 0, 1,
+                                4, 5, 6, -1, 2,
+                                0, 0, 0, 0, 1,
+                                0, 0, 0, -1, 2,
+                                1, 2, 3, 0, 0,
+                                4, 5, 6, 0, 0};
+    matrix_t* a = MatCreate(2, 3, data_a);
+    matrix_t* b = MatCreate(2, 2, data_b);
+    const matrix_t* blocks[6];
+    matrix_t* kron = MatKron(a, b);
+    matrix_t* expected = MatCreate(4, 6, expected_kron);
+    matrix_t* block = NULL;
+    matrix_t* block_expected = MatCreate(6, 5, expected_block);
+    mat_kron_t* op = MatKronCreate(a, b);
+    float y[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    TestResult status = SUCCESS;
+
+    blocks[0] = a;
+    blocks[1] = b;
+    blocks[2] = NULL;
+    blocks[3] = b;
+    blocks[4] = a;
+    blocks[5] = NULL;
+    block = MatBlock(blocks, 3, 2);
+    if (!kron || !block || !op || !MatCompare(kron, expected) || !MatCompare(block, block_expected))
+    {
+        status = FAIL;
+    }
+
+    /* the implicit operator against the materialized product */
+    if (status == SUCCESS)
+    {
+        MatKronMatvec(x, y, op);
+        for (i = 0; i < 4; i++)
+        {
+            float want = 0;
+            size_t j = 0;
+
+            for (j = 0; j < 6; j++)
+            {
+                want += expected_kron[i * 6 + j] * x[j];
+            }
+            if (y[i] != want)
+            {
+                status = FAIL;
+            }
+        }
+    }
+
+    MatKronDestroy(op);
+    MatDestroy(a);
+    MatDestroy(b);
+    MatDestroy(kron);
+    MatDestroy(expected);
+    MatDestroy(block);
+    MatDestroy(block_expected);
+    return status;
+}
+
+TestResult TestMatConv2D() 
+{
+    float image_data[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    float box_data[9] = {1, 1, 1, 1, 1, 1, 1, 1, 1};
+    float edge_data[4] = {1, 0, 0, -1};
+    /* 3x3 box filter, padding 1, stride 1: the Winograd path */
+    float expected_box[16] = {14, 24, 30, 22, 33, 54, 63, 45, 57, 90, 99, 69, 46, 72, 78, 54};
+    /* 2x2 filter, stride 2: im2col, both filters in one product */
+    float expected_strided[8] = {-5, -5, -5, -5, 14, 22, 46, 54};
+    matrix_t* image = MatCreate(4, 4, image_data);
+    matrix_t* box = MatCreate(3, 3, box_data);
+    matrix_t* edge = MatCreate(2, 2, edge_data);
+    matrix_t* ones = MatCreate(2, 2, box_data);
+    const matrix_t* pair[2];
+    matrix_t* expected1 = MatCreate(4, 4, expected_box);
+    matrix_t* expected2 = MatCreate(4, 2, expected_strided);
+    matrix_t* result1 = MatConv2D(image, (const matrix_t* const*)&box, 1, 1, 1);
+    matrix_t* result2 = NULL;
+    TestResult status = SUCCESS;
+
+    pair[0] = edge;
+    pair[1] = ones;
+    result2 = MatConv2D(image, pair, 2, 2, 0);
+    if (!result1 || !result2 || !MatCompare(result1, expected1) || !MatCompare(result2, expected2) ||
+        MatConv2D(image, pair, 2, 0, 0) != NULL)
+    {
+        status = FAIL;
+    }
+
+    MatDestroy(image);
+    MatDestroy(box);
+    MatDestroy(edge);
+    MatDestroy(ones);
+    MatDestroy(expected1);
+    MatDestroy(expected2);
+    MatDestroy(result1);
+    MatDestroy(result2);
+    return status;
+}
+
+TestResult TestMatMultChain() 
+{
+    float data1[6] = {1, 2, 3, 4, 5, 6};
+    float data2[3] = {1, -1, 2};
+    float data3[4] = {2, 0, 1, 3};
+    float data4[8] = {1, 0, -1, 2, 0, 3, 1, 1};
+    matrix_t* mats[4];
+    const matrix_t* mismatched[2];
+    matrix_t* step = NULL;
+    matrix_t* expected = NULL;
+    matrix_t* result = NULL;
+    size_t i = 0;
+    TestResult status = FAIL;
+
+    /* 2x3 * 3x1 * 1x4 * 4x2: the planner and left to right must agree */
+    mats[0] = MatCreate(2, 3, data1);
+    mats[1] = MatCreate(3, 1, data2);
+    mats[2] = MatCreate(1, 4, data3);
+    mats[3] = MatCreate(4, 2, data4);
+    expected = MatClone(mats[0]);
+    for (i = 1; i < 4; i++)
+    {
+        step = MatMult(expected, mats[i]);
+        MatDestroy(expected);
+        expected = step;
+    }
+    mismatched[0] = mats[0];
+    mismatched[1] = mats[2];
+    result = MatMultChain((const matrix_t* const*)mats, 4);
+    if (result && MatCompare(result, expected) && MatMultChain(mismatched, 2) == NULL)
+    {
+        status = SUCCESS;
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        MatDestroy(mats[i]);
+    }
+    MatDestroy(expected);
+    MatDestroy(result);
+    return status;
+}
+
+TestResult TestMatCache() 
+{
+    float data1[4] = {4, 7, 2, 6};
+    float data2[4] = {1, 2, 3, 4};
+    matrix_t* mat1 = MatCreate(2, 2, data1);
+    matrix_t* mat2 = MatCreate(2, 2, data2);
+    matrix_t* same = MatCreate(2, 2, data1);
+    matrix_t* expected = MatInvert(mat1);
+    matrix_t* first = NULL;
+    matrix_t* second = NULL;
+    mat_cache_stats_t stats;
+    TestResult status = SUCCESS;
+
+    MatCacheEnable(1 << 20);
+    first = MatInvert(mat1);
+    second = MatInvert(same); /* equal contents, different matrix: a hit */
+    if (!first || !second || !MatCompare(first, expected) || !MatCompare(second, expected) ||
+        fabs(MatDet(mat1) - 10) > TOLERANCE || fabs(MatDet(mat1) - 10) > TOLERANCE ||
+        fabs(MatDet(mat2) + 2) > TOLERANCE)
+    {
+        status = FAIL;
+    }
+    MatCacheStats(&stats);
+    if (stats.hits != 2 || stats.misses != 3 || stats.entries != 3)
+    {
+        status = FAIL;
+    }
+
+    /* a cap below one entry keeps nothing */
+    MatCacheEnable(1);
+    MatCacheStats(&stats);
+    if (stats.entries != 0 || stats.bytes != 0 || stats.evictions != 3)
+    {
+        status = FAIL;
+    }
+    MatCacheDisable();
+
+    MatDestroy(mat1);
+    MatDestroy(mat2);
+    MatDestroy(same);
+    MatDestroy(expected);
+    MatDestroy(first);
+    MatDestroy(second);
+    return status;
+}
+
+TestResult TestMatLayout() 
+{
+    /* the same 2x3 and 3x2 matrices stored column by column */
+    float rows1[6] = {1, 2, 3, 4, 5, 6};
+    float cols1[6] = {1, 4, 2, 5, 3, 6};
+    float rows2[6] = {1, -1, 0, 2, 3, 1};
+    float cols2[6] = {1, 0, 3, -1, 2, 1};
+    matrix_t* mat1 = MatCreate(2, 3, rows1);
+    matrix_t* mat2 = MatCreate(3, 2, rows2);
+    matrix_t* col1 = MatWrap(2, 3, cols1);
+    matrix_t* col2 = MatWrap(3, 2, cols2);
+    matrix_t* expected = MatMult(mat1, mat2);
+    matrix_t* mixed = NULL;
+    matrix_t* both = NULL;
+    matrix_t* converted = NULL;
+    TestResult status = SUCCESS;
+
+    MatSetLayout(col1, MAT_COL_MAJOR);
+    MatSetLayout(col2, MAT_COL_MAJOR);
+    mixed = MatMult(col1, mat2);
+    both = MatMult(col1, col2);
+    converted = MatConvertLayout(mat1, MAT_COL_MAJOR);
+    if (MatGetElem(col1, 0, 2) != 3 || !MatCompare(col1, mat1) || !MatCompare(col2, mat2) ||
+        !mixed || !both || !MatCompare(mixed, expected) || !MatCompare(both, expected) ||
+        MatGetLayout(both) != MAT_COL_MAJOR || !converted ||
+        memcmp(MatConstData(converted), cols1, sizeof(cols1)) != 0)
+    {
+        status = FAIL;
+    }
+
+    MatDestroy(mat1);
+    MatDestroy(mat2);
+    MatDestroy(col1);
+    MatDestroy(col2);
+    MatDestroy(expected);
+    MatDestroy(mixed);
+    MatDestroy(both);
+    MatDestroy(converted);
+    return status;
+}
+
+TestResult TestMatBand() 
+{
+    /* -x[i-1] + 2x[i] - x[i+1] = b[i], the 1-D Poisson stencil */
+    float lower[4] = {-1, -1, -1, -1};
+    float diag[5] = {2, 2, 2, 2, 2};
+    float upper[4] = {-1, -1, -1, -1};
+    float expected[5] = {1, 2, 3, 2, 1};
+    float b[5] = {0, 0, 0, 0, 0};
+    float x[5] = {0, 0, 0, 0, 0};
+    float y[5] = {0, 0, 0, 0, 0};
+    /* a zero leading diagonal entry forces a row swap */
+    float swap_data[9] = {0, 1, 0, 2, 1, 3, 0, 4, 1};
+    float swap_b[3] = {1, 6, 5};
+    float swap_x[3] = {0, 0, 0};
+    matrix_t* swap_mat = MatCreate(3, 3, swap_data);
+    mat_band_t* band = MatBandCreate(5, 1, 1);
+    mat_band_t* swap_band = MatBandFromDense(swap_mat, 1, 1);
+    size_t i = 0;
+    TestResult status = SUCCESS;
+
+    for (i = 0; band && i < 5; i++)
+    {
+        MatBandSet(band, i, i, 2);
+        if (i > 0)
+        {
+            MatBandSet(band, i, i - 1, -1);
+            MatBandSet(band, i - 1, i, -1);
+        }
+    }
+    if (!band || !swap_band || MatBandSet(band, 0, 2, 1) != 1 || MatBandGet(band, 4, 0) != 0)
+    {
+        status = FAIL;
+    }
+    else
+    {
+        MatBandMatvec(expected, b, band);
+        if (MatTridiagSolve(5, lower, diag, upper, b, x) || MatBandSolve(band, b, y) ||
+            MatBandSolve(swap_band, swap_b, swap_x))
+        {
+            status = FAIL;
+        }
+        for (i = 0; i < 5; i++)
+        {
+            if (fabs(x[i] - expected[i]) > TOLERANCE || fabs(y[i] - expected[i]) > TOLERANCE)
+            {
+                status = FAIL;
+            }
+        }
+        for (i = 0; i < 3; i++)
+        {
+            if (fabs(swap_x[i] - 1) > TOLERANCE)
+            {
+                status = FAIL;
+            }
+        }
+    }
+
+    MatBandDestroy(band);
+    MatBandDestroy(swap_band);
+    MatDestroy(swap_mat);
+    return status;
+}
+
+TestResult TestMatTyped() 
+{
+    double d_data[4] = {4, 3, 6, 3};
+    double d_inv_data[4] = {-0.5, 0.5, 1, -0.666667};
+    int i_data[6] = {1, 2, 3, 4, 5, 6};
+    int i_t_data[6] = {1, 4, 2, 5, 3, 6};
+    int i_prod_data[4] = {14, 32, 32, 77};
+    mat_complex_t z_data[4] = {{1, 1}, {0, 2}, {3, 0}, {1, -1}};
+    matrix_d_t* d_mat = MatDCreate(2, 2, d_data);
+    matrix_d_t* d_expected = MatDCreate(2, 2, d_inv_data);
+    matrix_d_t* d_inv = d_mat ? MatDInvert(d_mat) : NULL;
+    matrix_i32_t* i_mat = MatI32Create(2, 3, i_data);
+    matrix_i32_t* i_t = i_mat ? MatI32Transpose(i_mat) : NULL;
+    matrix_i32_t* i_t_expected = MatI32Create(3, 2, i_t_data);
+    matrix_i32_t* i_prod = i_mat && i_t ? MatI32Mult(i_mat, i_t) : NULL;
+    matrix_i32_t* i_prod_expected = MatI32Create(2, 2, i_prod_data);
+    matrix_z_t* z_mat = MatZCreate(2, 2, z_data);
+    matrix_z_t* z_inv = z_mat ? MatZInvert(z_mat) : NULL;
+    matrix_z_t* z_prod = z_mat && z_inv ? MatZMult(z_mat, z_inv) : NULL;
+    matrix_z_t* z_identity = MatZI(2);
+    mat_complex_t z_det = {0, 0};
+    /* INT_MAX + 1 wraps to INT_MIN, and out-of-range floats saturate */
+    int i_wrap_data[1] = {INT_MAX};
+    float f_wide_data[3] = {3e9F, -3e9F, 0};
+    matrix_i32_t* i_wrap = MatI32Create(1, 1, i_wrap_data);
+    matrix_i32_t* i_one = MatI32I(1);
+    matrix_i32_t* i_sum = i_wrap && i_one ? MatI32Add(i_wrap, i_one) : NULL;
+    matrix_t* f_wide = NULL;
+    matrix_i32_t* i_wide = NULL;
+    TestResult status = SUCCESS;
+
+    f_wide_data[2] = (float)sqrt(-1.0);
+    f_wide = MatCreate(1, 3, f_wide_data);
+    i_wide = f_wide ? MatI32FromFloat(f_wide) : NULL;
+    if (!i_sum || MatI32GetElem(i_sum, 0, 0) != INT_MIN || !i_wide || MatI32GetElem(i_wide, 0, 0) != INT_MAX ||
+        MatI32GetElem(i_wide, 0, 1) != INT_MIN || MatI32GetElem(i_wide, 0, 2) != 0)
+    {
+        status = FAIL;
+    }
+
+    if (!d_inv || !d_expected || !i_t || !i_t_expected || !i_prod || !i_prod_expected ||
+        !z_prod || !z_identity)
+    {
+        status = FAIL;
+    }
+    else
+    {
+        /* (1+i)(1-i) - 2i * 3 = 2 - 6i */
+        z_det = MatZDet(z_mat);
+        if (!MatDCompare(d_inv, d_expected) || fabs(MatDDet(d_mat) + 6) > TOLERANCE ||
+            !MatI32Compare(i_t, i_t_expected) || !MatI32Compare(i_prod, i_prod_expected) ||
+            MatI32Trace(i_prod) != 91 || !MatZCompare(z_prod, z_identity) ||
+            fabs(z_det.re - 2) > TOLERANCE || fabs(z_det.im + 6) > TOLERANCE)
+        {
+            status = FAIL;
+        }
+    }
+
+    MatDDestroy(d_mat);
+    MatDDestroy(d_expected);
+    MatDDestroy(d_inv);
+    MatI32Destroy(i_mat);
+    MatI32Destroy(i_t);
+    MatI32Destroy(i_t_expected);
+    MatI32Destroy(i_prod);
+    MatI32Destroy(i_prod_expected);
+    MatI32Destroy(i_wrap);
+    MatI32Destroy(i_one);
+    MatI32Destroy(i_sum);
+    MatI32Destroy(i_wide);
+    MatDestroy(f_wide);
+    MatZDestroy(z_mat);
+    MatZDestroy(z_inv);
+    MatZDestroy(z_prod);
+    MatZDestroy(z_identity);
+    return status;
+}
+
+TestResult TestMatProfile() 
+{
+    const char* path = "mat_test_profile.txt";
+    float data[4] = {1, 2, 3, 4};
+    matrix_t* mat = MatCreate(2, 2, data);
+    matrix_t* product = NULL;
+    char line[512];
+    FILE* report = NULL;
+    int found = 0;
+    TestResult status = SUCCESS;
+
+    MatProfileReset();
+    MatProfileEnable();
+    product = mat ? MatMult(mat, mat) : NULL;
+    MatProfileDisable();
+    /* not recorded once disabled */
+    MatDestroy(mat ? MatAdd(mat, mat) : NULL);
+
+    if (!product || MatProfileReport(path))
+    {
+        status = FAIL;
+    }
+    else if ((report = fopen(path, "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), report))
+        {
+            if (strncmp(line, "MatMult ", 8) == 0 && strstr(line, " 2-3 "))
+            {
+                ++found;
+            }
+            if (strncmp(line, "MatAdd ", 7) == 0)
+            {
+                status = FAIL;
+            }
+        }
+        fclose(report);
+    }
+    if (found != 1)
+    {
+        status = FAIL;
+    }
+
+    MatProfileReset();
+    remove(path);
+    MatDestroy(mat);
+    MatDestroy(product);
+    return status;
+}
+
+TestResult TestMatTune() 
+{
+    const char* path = "mat_test_tune.txt";
+    mat_tune_t saved, tune;
+    mat_tune_t bad = {0, 256, 3};
+    matrix_t* a = MatCreate(37, 53, NULL);
+    matrix_t* b = MatCreate(53, 29, NULL);
+    matrix_t* reference = NULL;
+    matrix_t* product = NULL;
+    FILE* file = NULL;
+    size_t i = 0;
+    TestResult status = SUCCESS;
+
+    MatGetTune(&saved);
+    for (i = 0; a && b && i < 53 * 29; i++)
+    {
+        if (i < 37 * 53)
+        {
+            MatData(a)[i] = (float)(i % 11) - 5;
+        }
+        MatData(b)[i] = (float)(i % 7) * 0.5F;
+    }
+    reference = a && b ? MatMult(a, b) : NULL;
+
+    /* odd shapes leave remainders for every unroll and panel, and the
+     * blocking must not change a single bit of the product */
+    tune.block_inner = 8;
+    tune.block_cols = 16;
+    tune.unroll_rows = 4;
+    if (!reference || MatSetTune(&bad) != 1 || MatSetTune(&tune) ||
+        (product = MatMult(a, b)) == NULL ||
+        memcmp(MatConstData(product), MatConstData(reference), 37 * 29 * sizeof(float)))
+    {
+        status = FAIL;
+    }
+
+    /* the profile written by autotuning loads back on this CPU */
+    if (MatAutotune(path) || MatSetTune(&saved) || MatLoadTuneProfile(path))
+    {
+        status = FAIL;
+    }
+    /* a profile from another CPU is refused */
+    if ((file = fopen(path, "w")) != NULL)
+    {
+        fprintf(file, "cpu=some other cpu\nblock_inner=64\nblock_cols=128\nunroll_rows=2\n");
+        fclose(file);
+    }
+    if (!file || MatLoadTuneProfile(path) != 1)
+    {
+        status = FAIL;
+    }
+
+    MatSetTune(&saved);
+    remove(path);
+    MatDestroy(a);
+    MatDestroy(b);
+    MatDestroy(reference);
+    MatDestroy(product);
+    return status;
+}
+
+TestResult TestMatShard() 
+{
+    float a_data[6] = {1, 2, 3, 4, 5, 6};
+    float b_data[6] = {1, 0, -1, 2, 3, 1};
+    /* a zero leading pivot forces a row swap */
+    float lu_data[9] = {0, 1, 2, 2, 1, 1, 4, 3, 7};
+    float expected_lu[9] = {4, 3, 7, 0, 1, 2, 0.5F, -0.5F, -1.5F};
+    size_t expected_pivots[3] = {2, 2, 2};
+    size_t pivots[3] = {0, 0, 0};
+    mat_shard_t* shard = MatShardCreate(2);
+    matrix_t* a = MatCreate(2, 3, a_data);
+    matrix_t* b = MatCreate(3, 2, b_data);
+    matrix_t* mat = MatCreate(3, 3, lu_data);
+    matrix_t* reference = a && b ? MatMult(a, b) : NULL;
+    matrix_t* product = NULL;
+    matrix_t* lu = NULL;
+    matrix_t* expected = MatCreate(3, 3, expected_lu);
+    size_t i = 0;
+    TestResult status = SUCCESS;
+
+    if (!shard || !reference || !expected || (product = MatShardMult(shard, a, b)) == NULL ||
+        !MatCompare(product, reference) || MatShardLU(shard, mat, &lu, pivots) || !MatCompare(lu, expected))
+    {
+        status = FAIL;
+    }
+    for (i = 0; i < 3; i++)
+    {
+        if (pivots[i] != expected_pivots[i])
+        {
+            status = FAIL;
+        }
+    }
+
+    MatShardDestroy(shard);
+    MatDestroy(a);
+    MatDestroy(b);
+    MatDestroy(mat);
+    MatDestroy(reference);
+    MatDestroy(product);
+    MatDestroy(lu);
+    MatDestroy(expected);
+    return status;
+}
+
+TestResult TestMatReproducible() 
+{
+    float x_data[3] = {1, 2, 3};
+    float y_data[3] = {4, -5, 6};
+    matrix_t* x = MatCreate(3, 1, x_data);
+    matrix_t* y = MatCreate(3, 1, y_data);
+    matrix_t* mat = MatCreate(600, 300, NULL);
+    matrix_t* sums[2] = {NULL, NULL};
+    float norms[2] = {0, 0};
+    float dots[2] = {0, 0};
+    size_t threads[2] = {1, 4};
+    size_t i = 0;
+    TestResult status = SUCCESS;
+
+    if (!x || !y || !mat || fabs(MatDot(x, y) - 12) > TOLERANCE)
+    {
+        status = FAIL;
+    }
+    for (i = 0; mat && i < 600 * 300; i++)
+    {
+        MatData(mat)[i] = (float)((i * 7919) % 1000) / 7 - 60;
+    }
+
+    /* one thread and four must agree to the last bit */
+    MatSetReproducible(1);
+    for (i = 0; mat && i < 2; i++)
+    {
+        MatSetNumThreads(threads[i]);
+        norms[i] = MatNorm(mat);
+        dots[i] = MatDot(mat, mat);
+        sums[i] = MatColReduce(mat, MAT_REDUCE_SUM);
+    }
+    MatSetNumThreads(0);
+    MatSetReproducible(0);
+
+    if (!sums[0] || !sums[1] || memcmp(&norms[0], &norms[1], sizeof(float)) ||
+        memcmp(&dots[0], &dots[1], sizeof(float)) ||
+        memcmp(MatConstData(sums[0]), MatConstData(sums[1]), 300 * sizeof(float)) || MatGetReproducible())
+    {
+        status = FAIL;
+    }
+
+    MatDestroy(x);
+    MatDestroy(y);
+    MatDestroy(mat);
+    MatDestroy(sums[0]);
+    MatDestroy(sums[1]);
+    return status;
+}
+
+TestResult TestMatRand() 
+{
+    matrix_t* uniform[2] = {NULL, NULL};
+    matrix_t* normal = MatRandNormal(300, 301, 0, 1, 5);
+    matrix_t* sparse = MatRandSparse(300, 301, 0.2F, 5);
+    size_t threads[2] = {1, 3};
+    size_t i, nonzero = 0;
+    double sum = 0;
+    TestResult status = SUCCESS;
+
+    /* the same elements whatever the thread count */
+    for (i = 0; i < 2; i++)
+    {
+        MatSetNumThreads(threads[i]);
+        uniform[i] = MatRandUniform(300, 301, -1, 1, 5);
+    }
+    MatSetNumThreads(0);
+    if (!uniform[0] || !uniform[1] || !normal || !sparse ||
+        memcmp(MatConstData(uniform[0]), MatConstData(uniform[1]), 300 * 301 * sizeof(float)) ||
+        MatRandSparse(2, 2, 1.5F, 5) != NULL)
+    {
+        status = FAIL;
+    }
+
+    for (i = 0; status == SUCCESS && i < 300 * 301; i++)
+    {
+        if (MatConstData(uniform[0])[i] < -1 || MatConstData(uniform[0])[i] >= 1)
+        {
+            status = FAIL;
+        }
+        sum += MatConstData(normal)[i];
+        nonzero += MatConstData(sparse)[i] != 0;
+    }
+    /* loose bounds, many standard deviations wide */
+    if (fabs(sum / (300 * 301)) > 0.02 || nonzero < 17000 || nonzero > 19000)
+    {
+        status = FAIL;
+    }
+
+    /* rounding to float must not reach high: the floats in [2^24, 2^24 + 2)
+     * are 2^24 only, where a plain rounding gives 2^24 + 2 half the time */
+    MatDestroy(uniform[1]);
+    uniform[1] = MatRandUniform(300, 301, 16777216.0F, 16777218.0F, 5);
+    if (!uniform[1])
+    {
+        status = FAIL;
+    }
+    for (i = 0; uniform[1] && i < 300 * 301; i++)
+    {
+        if (MatConstData(uniform[1])[i] != 16777216.0F)
+        {
+            status = FAIL;
+        }
+    }
+
+    /* a range wider than FLT_MAX still spreads over it */
+    MatDestroy(uniform[1]);
+    uniform[1] = MatRandUniform(300, 301, -FLT_MAX, FLT_MAX, 5);
+    sum = 0;
+    for (i = 0; uniform[1] && i < 300 * 301; i++)
+    {
+        sum += MatConstData(uniform[1])[i] / FLT_MAX;
+        if (MatConstData(uniform[1])[i] == FLT_MAX)
+        {
+            status = FAIL;
+        }
+    }
+    if (!uniform[1] || fabs(sum / (300 * 301)) > 0.02 || MatConstData(uniform[1])[0] == MatConstData(uniform[1])[1])
+    {
+        status = FAIL;
+    }
+
+    /* Philox4x32-10 of a zero counter and key starts with 0x6627e8d5 */
+    MatDestroy(uniform[0]);
+    uniform[0] = MatRandUniform(1, 1, 0, 1, 0);
+    if (!uniform[0] || MatConstData(uniform[0])[0] != (float)(0x6627e8 / 16777216.0))
+    {
+        status = FAIL;
+    }
+
+    MatDestroy(uniform[0]);
+    MatDestroy(uniform[1]);
+    MatDestroy(normal);
+    MatDestroy(sparse);
+    return status;
+}
+
+/* ||a - b|| / ||b|| for row-major matrices of the same shape */
+static double RelativeDiff(const matrix_t* a, const matrix_t* b)
+{
+    size_t dims[2];
+    size_t i = 0;
+    double diff = 0;
+    double norm = 0;
+
+    MatShape(b, dims);
+    for (i = 0; i < dims[0] * dims[1]; i++)
+    {
+        double d = MatConstData(a)[i] - MatConstData(b)[i];
+
+        diff += d * d;
+        norm += (double)MatConstData(b)[i] * MatConstData(b)[i];
+    }
+    return sqrt(diff / norm);
+}
+
+TestResult TestMatLowRank() 
+{
+    matrix_t* x = MatRandNormal(120, 5, 0, 1, 1);
+    matrix_t* y = MatRandNormal(5, 80, 0, 1, 2);
+    matrix_t* a = (x && y) ? MatMult(x, y) : NULL;
+    matrix_t* noise = MatRandNormal(60, 60, 0, 1, 3);
+    matrix_t* b = MatRandNormal(80, 7, 0, 1, 4);
+    mat_lowrank_t* lr = a ? MatLowRank(a, 1e-3F, 0) : NULL;
+    mat_lowrank_t* sum = lr ? MatLowRankAdd(lr, lr) : NULL;
+    mat_lowrank_t* rough = noise ? MatLowRank(noise, 0.5F, 0) : NULL;
+    matrix_t* dense = lr ? MatLowRankToDense(lr) : NULL;
+    matrix_t* doubled = sum ? MatLowRankToDense(sum) : NULL;
+    matrix_t* twice = a ? MatAdd(a, a) : NULL;
+    matrix_t* ab = (a && b) ? MatMult(a, b) : NULL;
+    matrix_t* lr_b = (lr && b) ? MatLowRankMult(lr, b) : NULL;
+    matrix_t* rough_dense = rough ? MatLowRankToDense(rough) : NULL;
+    matrix_t* graded_x = MatRandNormal(120, 80, 0, 1, 5);
+    matrix_t* graded_y = MatRandNormal(80, 80, 0, 1, 6);
+    matrix_t* graded = NULL;
+    matrix_t* fine_dense = NULL;
+    mat_lowrank_t* fine = NULL;
+    float ax[120];
+    float lr_x[200];
+    size_t dims[3];
+    size_t i = 0;
+    TestResult status = SUCCESS;
+
+    if (!dense || !doubled || !twice || !ab || !lr_b || !rough_dense)
+    {
+        status = FAIL;
+    }
+    else
+    {
+        /* an exactly rank-5 matrix is found at rank 5 */
+        MatLowRankShape(lr, dims);
+        if (dims[0] != 120 || dims[1] != 80 || dims[2] != 5 || MatLowRankError(lr) > 1e-3F ||
+            RelativeDiff(dense, a) > 1e-4 || RelativeDiff(doubled, twice) > 1e-4 ||
+            RelativeDiff(lr_b, ab) > 1e-4)
+        {
+            status = FAIL;
+        }
+
+        /* matvec against the first column of b */
+        for (i = 0; i < 80; i++)
+        {
+            lr_x[i] = MatConstData(b)[i * 7];
+        }
+        MatLowRankMatvec(lr_x, lr_x + 80, lr);
+        MatDenseMatvec(lr_x, ax, a);
+        for (i = 0; i < 120; i++)
+        {
+            status = fabs(ax[i] - lr_x[80 + i]) > 1e-3 * (1 + fabs(ax[i])) ? FAIL : status;
+        }
+
+        /* noise has no low rank: the tolerance decides and is met */
+        MatLowRankShape(rough, dims);
+        if (dims[2] == 0 || dims[2] >= 60 || MatLowRankError(rough) > 0.5F ||
+            fabs(RelativeDiff(rough_dense, noise) - MatLowRankError(rough)) > 1e-3)
+        {
+            status = FAIL;
+        }
+    }
+
+    /* singular values falling by 10^(1/4): a tol well below the float
+     * noise of ||A||^2 - ||Q^T A||^2 is still met and measured */
+    for (i = 0; graded_x && i < 120 * 80; i++)
+    {
+        MatData(graded_x)[i] *= (float)pow(10, -(double)(i % 80) / 4);
+    }
+    graded = (graded_x && graded_y) ? MatMult(graded_x, graded_y) : NULL;
+    fine = graded ? MatLowRank(graded, 1e-4F, 0) : NULL;
+    fine_dense = fine ? MatLowRankToDense(fine) : NULL;
+    if (!fine_dense || MatLowRankError(fine) > 1e-4F || RelativeDiff(fine_dense, graded) > 1e-4 ||
+        fabs(RelativeDiff(fine_dense, graded) - MatLowRankError(fine)) > 1e-5)
+    {
+        status = FAIL;
+    }
+
+    MatDestroy(x);
+    MatDestroy(y);
+    MatDestroy(a);
+    MatDestroy(noise);
+    MatDestroy(b);
+    MatDestroy(dense);
+    MatDestroy(doubled);
+    MatDestroy(twice);
+    MatDestroy(ab);
+    MatDestroy(lr_b);
+    MatDestroy(rough_dense);
+    MatDestroy(graded_x);
+    MatDestroy(graded_y);
+    MatDestroy(graded);
+    MatDestroy(fine_dense);
+    MatLowRankDestroy(fine);
+    MatLowRankDestroy(lr);
+    MatLowRankDestroy(sum);
+    MatLowRankDestroy(rough);
+    return status;
+}
+
+TestResult TestMatCompareEx() 
+{
+    matrix_t* a = MatRandUniform(50, 40, -1, 1, 7);
+    matrix_t* b = MatRandUniform(50, 40, -1, 1, 7);
+    matrix_t* b_cols = NULL;
+    float* data = b ? MatData(b) : NULL;
+    mat_cmp_report_t report;
+    TestResult status = SUCCESS;
+
+    if (!a || !data)
+    {
+        MatDestroy(a);
+        MatDestroy(b);
+        return FAIL;
+    }
+
+    /* one ULP apart everywhere: equal within 1 ULP, not within 0 */
+    data[0] = 1.0F;
+    MatData(a)[0] = 1.0F + FLT_EPSILON;
+    if (!MatCompareEx(a, b, MAT_CMP_ULP, 1, 1, &report) || report.max_error != 1 ||
+        MatCompareEx(a, b, MAT_CMP_ULP, 0, 1, &report) || report.mismatches != 1 ||
+        !MatCompare(a, b))
+    {
+        status = FAIL;
+    }
+    MatData(a)[0] = 1.0F;
+
+    /* equal infinities are equal in every mode, opposite ones are not */
+    data[1] = MatData(a)[1] = (float)HUGE_VAL;
+    data[2] = MatData(a)[2] = (float)-HUGE_VAL;
+    if (!MatCompare(a, b) || !MatCompareEx(a, b, MAT_CMP_REL, 0, 1, &report) ||
+        !MatCompareEx(a, b, MAT_CMP_ULP, 0, 1, &report) || report.max_error != 0)
+    {
+        status = FAIL;
+    }
+    data[2] = (float)HUGE_VAL;
+    if (MatCompareEx(a, b, MAT_CMP_ABS, 1e-3F, 1, &report) || report.mismatches != 1 ||
+        MatCompareEx(a, b, MAT_CMP_REL, 1e-3F, 1, &report) || report.mismatches != 1)
+    {
+        status = FAIL;
+    }
+    data[1] = MatData(a)[1] = data[2] = MatData(a)[2] = 0.5F;
+
+    data[7 * 40 + 13] += 0.01F;
+    data[20 * 40 + 3] = (float)sqrt(-1.0);
+    b_cols = MatConvertLayout(b, MAT_COL_MAJOR);
+
+    /* early exit reports the first mismatch only, in either layout */
+    if (MatCompare(a, b) || MatCompareEx(a, b, MAT_CMP_ABS, 1e-3F, 0, &report) ||
+        report.mismatches != 1 || report.row != 7 || report.col != 13 ||
+        !b_cols || MatCompareEx(a, b_cols, MAT_CMP_ABS, 1e-3F, 0, &report) ||
+        report.row != 7 || report.col != 13)
+    {
+        status = FAIL;
+    }
+
+    /* a full scan counts both and the NaN dominates the error */
+    if (MatCompareEx(a, b, MAT_CMP_REL, 1e-3F, 1, &report) || report.mismatches != 2 ||
+        report.max_error != HUGE_VAL ||
+        MatCompareEx(b_cols, a, MAT_CMP_REL, 1e-3F, 1, &report) || report.mismatches != 2)
+    {
+        status = FAIL;
+    }
+
+    MatDestroy(a);
+    MatDestroy(b);
+    MatDestroy(b_cols);
+    return status;
+}